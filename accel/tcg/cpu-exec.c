@@ -176,6 +176,8 @@ static inline tcg_target_ulong cpu_tb_exec(CPUState *cpu, TranslationBlock *itb)
     // When the TCG interpretor is disabled this actually jumps to generated native code.
     // Don't even try to debug it... 
     ret = tcg_qemu_tb_exec(env, tb_ptr);
+    /* Hand out the accesses to watched memory made by the block.  */
+    plugin_mem_watch_flush();
     if( is_rapid_analysis_active() ){
         rapid_analysis_increment_analysis(cpu, itb);
     }
@@ -543,8 +543,9 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 {
-    if (tlb_entry->addr_write == (vaddr | TLB_NOTDIRTY)) {
-        tlb_entry->addr_write = vaddr;
+    /* A watched page keeps taking the slow path once it is dirty.  */
+    if ((tlb_entry->addr_write & ~TLB_WATCH) == (vaddr | TLB_NOTDIRTY)) {
+        tlb_entry->addr_write = vaddr | (tlb_entry->addr_write & TLB_WATCH);
     }
 }
 
@@ -616,6 +617,7 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     hwaddr iotlb, xlat, sz, paddr_page;
     target_ulong vaddr_page;
     int asidx = cpu_asidx_from_attrs(cpu, attrs);
+    int watch;
 
     assert_cpu_is_self(cpu);
 
@@ -727,6 +729,15 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
         }
     }
 
+    /* Send data accesses to pages watched by a plugin down the slow path.  */
+    watch = plugin_mem_watch_page(vaddr_page, iotlb & TARGET_PAGE_MASK);
+    if ((watch & PLUGIN_WATCH_READ) && tn.addr_read != -1) {
+        tn.addr_read |= TLB_WATCH;
+    }
+    if ((watch & PLUGIN_WATCH_WRITE) && tn.addr_write != -1) {
+        tn.addr_write |= TLB_WATCH;
+    }
+
     /* Pairs with flag setting in tlb_reset_dirty_range */
     copy_tlb_helper(te, &tn, true);
     /* atomic_mb_set(&te->addr_write, write_address); */
@@ -814,7 +825,7 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
 
         index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
         tlb_addr = env->tlb_table[mmu_idx][index].addr_read;
-        if (!(tlb_addr & ~(TARGET_PAGE_MASK | TLB_RECHECK))) {
+        if (!(tlb_addr & ~(TARGET_PAGE_MASK | TLB_RECHECK | TLB_WATCH))) {
             /* RAM access */
             uintptr_t haddr = addr + env->tlb_table[mmu_idx][index].addend;
 
@@ -885,7 +896,7 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
 
         index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
         tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
-        if (!(tlb_addr & ~(TARGET_PAGE_MASK | TLB_RECHECK))) {
+        if (!(tlb_addr & ~(TARGET_PAGE_MASK | TLB_RECHECK | TLB_WATCH))) {
             /* RAM access */
             uintptr_t haddr = addr + env->tlb_table[mmu_idx][index].addend;
 
@@ -1158,6 +1169,26 @@ static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
 # define TGT_LE(X)  (X)
 #endif
 
+/* Record an access to a page watched by a plugin.  The physical address
+ * is the memory region offset the memory callbacks already report.
+ */
+static inline void tlb_watch_access(CPUArchState *env, size_t mmu_idx,
+                                    size_t index, target_ulong tlb_addr,
+                                    target_ulong addr, uint64_t val,
+                                    int size, bool is_write)
+{
+    target_ulong mr_offset = (env->iotlb[mmu_idx][index].addr &
+                              TARGET_PAGE_MASK) + addr;
+    void *host = NULL;
+
+    if (!(tlb_addr & (TLB_MMIO | TLB_RECHECK))) {
+        host = (void *)((uintptr_t)addr +
+                        env->tlb_table[mmu_idx][index].addend);
+    }
+    plugin_mem_watch_record(ENV_GET_CPU(env), addr, mr_offset, val, host,
+                            size, is_write);
+}
+
 #define MMUSUFFIX _mmu
 
 #define DATA_SIZE 1
@@ -120,6 +120,9 @@ WORD_TYPE helper_le_ld_name(CPUArchState *env, target_ulong addr,
     unsigned a_bits = get_alignment_bits(get_memop(oi));
     uintptr_t haddr;
     DATA_TYPE res;
+#ifndef SOFTMMU_CODE_ACCESS
+    bool watched = false;
+#endif
 
     if (addr & ((1 << a_bits) - 1)) {
         cpu_unaligned_access(ENV_GET_CPU(env), addr, READ_ACCESS_TYPE,
@@ -135,6 +138,14 @@ WORD_TYPE helper_le_ld_name(CPUArchState *env, target_ulong addr,
         tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     }
 
+#ifndef SOFTMMU_CODE_ACCESS
+    /* A watched page is otherwise accessed as usual.  */
+    if (unlikely(tlb_addr & TLB_WATCH)) {
+        tlb_addr &= ~TLB_WATCH;
+        watched = true;
+    }
+#endif
+
     /* Handle an IO access.  */
     if (unlikely(tlb_addr & ~TARGET_PAGE_MASK)) {
         if ((addr & (DATA_SIZE - 1)) != 0) {
@@ -157,6 +168,10 @@ WORD_TYPE helper_le_ld_name(CPUArchState *env, target_ulong addr,
         DATA_TYPE res1, res2;
         unsigned shift;
     do_unaligned_access:
+#ifndef SOFTMMU_CODE_ACCESS
+        /* Each half records itself.  */
+        watched = false;
+#endif
         addr1 = addr & ~(DATA_SIZE - 1);
         addr2 = addr1 + DATA_SIZE;
         res1 = helper_le_ld_name(env, addr1, oi, retaddr);
@@ -175,6 +190,12 @@ WORD_TYPE helper_le_ld_name(CPUArchState *env, target_ulong addr,
     res = glue(glue(ld, LSUFFIX), _le_p)((uint8_t *)haddr);
 #endif
 end_read:
+#ifndef SOFTMMU_CODE_ACCESS
+    if (unlikely(watched)) {
+        tlb_watch_access(env, mmu_idx, index, tlb_addr, addr, res,
+                         DATA_SIZE, false);
+    }
+#endif
     if(is_memread_instrumentation_enabled()){
         // Perform the translation to memory region offset.
         target_ulong mr_offset = (env->iotlb[mmu_idx][index].addr & TARGET_PAGE_MASK) + addr;
@@ -196,6 +217,9 @@ WORD_TYPE helper_be_ld_name(CPUArchState *env, target_ulong addr,
     unsigned a_bits = get_alignment_bits(get_memop(oi));
     uintptr_t haddr;
     DATA_TYPE res;
+#ifndef SOFTMMU_CODE_ACCESS
+    bool watched = false;
+#endif
 
     if (addr & ((1 << a_bits) - 1)) {
         cpu_unaligned_access(ENV_GET_CPU(env), addr, READ_ACCESS_TYPE,
@@ -211,6 +235,14 @@ WORD_TYPE helper_be_ld_name(CPUArchState *env, target_ulong addr,
         tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     }
 
+#ifndef SOFTMMU_CODE_ACCESS
+    /* A watched page is otherwise accessed as usual.  */
+    if (unlikely(tlb_addr & TLB_WATCH)) {
+        tlb_addr &= ~TLB_WATCH;
+        watched = true;
+    }
+#endif
+
     /* Handle an IO access.  */
     if (unlikely(tlb_addr & ~TARGET_PAGE_MASK)) {
         if ((addr & (DATA_SIZE - 1)) != 0) {
@@ -233,6 +265,10 @@ WORD_TYPE helper_be_ld_name(CPUArchState *env, target_ulong addr,
         DATA_TYPE res1, res2;
         unsigned shift;
     do_unaligned_access:
+#ifndef SOFTMMU_CODE_ACCESS
+        /* Each half records itself.  */
+        watched = false;
+#endif
         addr1 = addr & ~(DATA_SIZE - 1);
         addr2 = addr1 + DATA_SIZE;
         res1 = helper_be_ld_name(env, addr1, oi, retaddr);
@@ -248,6 +284,12 @@ WORD_TYPE helper_be_ld_name(CPUArchState *env, target_ulong addr,
     res = glue(glue(ld, LSUFFIX), _be_p)((uint8_t *)haddr);
 
 end_read:
+#ifndef SOFTMMU_CODE_ACCESS
+    if (unlikely(watched)) {
+        tlb_watch_access(env, mmu_idx, index, tlb_addr, addr, res,
+                         DATA_SIZE, false);
+    }
+#endif
     if(is_memread_instrumentation_enabled()){
         // Perform the translation to memory region offset.
         target_ulong mr_offset = (env->iotlb[mmu_idx][index].addr & TARGET_PAGE_MASK) + addr;
@@ -346,6 +388,7 @@ void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
     target_ulong tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     unsigned a_bits = get_alignment_bits(get_memop(oi));
     uintptr_t haddr;
+    bool watched = false;
     
     if (addr & ((1 << a_bits) - 1)) {
         cpu_unaligned_access(cpu, addr, MMU_DATA_STORE,
@@ -361,12 +404,23 @@ void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
         tlb_addr = env->tlb_table[mmu_idx][index].addr_write & ~TLB_INVALID_MASK;
     }
 
+    /* A watched page is otherwise accessed as usual.  */
+    if (unlikely(tlb_addr & TLB_WATCH)) {
+        tlb_addr &= ~TLB_WATCH;
+        watched = true;
+    }
+
     /* Handle an IO access.  */
     if (unlikely(tlb_addr & ~TARGET_PAGE_MASK)) {
         if ((addr & (DATA_SIZE - 1)) != 0) {
             goto do_unaligned_access;
         }
 
+        if (unlikely(watched)) {
+            tlb_watch_access(env, mmu_idx, index, tlb_addr, addr, val,
+                             DATA_SIZE, true);
+        }
+
         /* ??? Note that the io helpers always read data in the target
            byte ordering.  We should push the LE/BE request down into io.  */
         val = TGT_LE(val);
@@ -422,6 +476,11 @@ void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
         return;
     }
 
+    if (unlikely(watched)) {
+        tlb_watch_access(env, mmu_idx, index, tlb_addr, addr, val,
+                         DATA_SIZE, true);
+    }
+
     haddr = addr + env->tlb_table[mmu_idx][index].addend;
 #if DATA_SIZE == 1
     glue(glue(st, SUFFIX), _p)((uint8_t *)haddr, val);
@@ -440,6 +499,7 @@ void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
     target_ulong tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     unsigned a_bits = get_alignment_bits(get_memop(oi));
     uintptr_t haddr;
+    bool watched = false;
 
     if (addr & ((1 << a_bits) - 1)) {
         cpu_unaligned_access(ENV_GET_CPU(env), addr, MMU_DATA_STORE,
@@ -455,12 +515,23 @@ void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
         tlb_addr = env->tlb_table[mmu_idx][index].addr_write & ~TLB_INVALID_MASK;
     }
 
+    /* A watched page is otherwise accessed as usual.  */
+    if (unlikely(tlb_addr & TLB_WATCH)) {
+        tlb_addr &= ~TLB_WATCH;
+        watched = true;
+    }
+
     /* Handle an IO access.  */
     if (unlikely(tlb_addr & ~TARGET_PAGE_MASK)) {
         if ((addr & (DATA_SIZE - 1)) != 0) {
             goto do_unaligned_access;
         }
 
+        if (unlikely(watched)) {
+            tlb_watch_access(env, mmu_idx, index, tlb_addr, addr, val,
+                             DATA_SIZE, true);
+        }
+
         /* ??? Note that the io helpers always read data in the target
            byte ordering.  We should push the LE/BE request down into io.  */
         val = TGT_BE(val);
@@ -507,6 +578,11 @@ void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
         return;
     }
 
+    if (unlikely(watched)) {
+        tlb_watch_access(env, mmu_idx, index, tlb_addr, addr, val,
+                         DATA_SIZE, true);
+    }
+
     haddr = addr + env->tlb_table[mmu_idx][index].addend;
     glue(glue(st, SUFFIX), _be_p)((uint8_t *)haddr, val);
 }
@@ -25,6 +25,7 @@
 #include "qapi/qobject-input-visitor.h"
 #include "qapi/qapi-visit-block-core.h"
 #include "qemu/option.h"
+#include "qemu/error-report.h"
 #include "block/block_int.h"
 #include "sysemu/block-backend.h"
 #include "cromulence/inlines.h"
@@ -55,6 +56,10 @@ static QemuOptsList ibf_runtime_opts = {
     },
 };   
 
+// Deltas further apart than this from a complete dump are taken
+// to be a loop in the file.
+#define IBF_MAX_DUMP_CHAIN (65536)
+
 typedef struct IBFTransactionPacket {
     uint8_t *data;
     uint64_t size;
@@ -242,33 +247,113 @@ ibf_co_create_opts(const char *filename, QemuOpts *opts, Error **errp)
 }
 
 
+// A dump and the hash it is stored under
+typedef struct IBFDumpLink {
+    uint8_t *data;
+    uint64_t size;
+    SHA1_HASH_TYPE hash;
+} IBFDumpLink;
+
+static void ibf_if_probe(void *opaque, FILE *fp, size_t read_size_hint, SHA1_HASH_TYPE *hash)
+{
+    // We only want to know whether the hash is there.
+}
+
+static bool ibf_load_dump(IndexedFile *idxf, IBFDumpLink *link)
+{
+    IndexedFileClass *idxf_class = INDEXED_FILE_GET_CLASS(idxf);
+    IBFTransactionPacket tp;
+    IFVisitor visitor;
+
+    // We want to create a visitor with
+    // empty data.
+    tp.data = NULL;
+    tp.size = 0;
+    tp.hash = &link->hash;
+    create_file_visitor(&visitor, &tp);
+
+    // Attempt to load a hash and make sure that the data is loaded
+    if (idxf_class->load_from_hash(idxf, &visitor, link->hash) && tp.data)
+    {
+        link->data = tp.data;
+        link->size = tp.size;
+        return true;
+    }
+
+    g_free(tp.data);
+    return false;
+}
+
+// Returns the header of a delta dump, NULL if the dump is complete.
+static BdrvDumpHeader *ibf_dump_delta_header(IBFDumpLink *link)
+{
+    BdrvDumpHeader *header = (BdrvDumpHeader *) link->data;
+
+    if (link->size >= sizeof(*header) &&
+        header->magic == BDRV_DUMP_MAGIC &&
+        (header->flags & BDRV_DUMP_FLAG_DELTA))
+    {
+        return header;
+    }
+    return NULL;
+}
+
 static int ibf_dump_state(BlockDriverState *bs, BlockDriverState *target_bs, SHA1_HASH_TYPE hash)
 {
+    int ret = 0;
+
     if (target_bs->drv->bdrv_receive_dump)
     {
         BDRVIBFState *ibfs = bs->opaque;
         IndexedFile *idxf = ibfs->idx_file;
-        IndexedFileClass *idxf_class = INDEXED_FILE_GET_CLASS(idxf);
-        IBFTransactionPacket tp;
-        IFVisitor visitor;
-    
-        // We want to create a visitor with
-        // empty data.
-        tp.data = NULL;
-        tp.size = 0;
-        tp.hash = (SHA1_HASH_TYPE *)&hash;
-        create_file_visitor(&visitor, &tp);
-    
-        // Attempt to load a hash and make sure that the data is loaded
-        if (idxf_class->load_from_hash(idxf, &visitor, hash) && tp.data)
+        GArray *chain = g_array_new(false, true, sizeof(IBFDumpLink));
+        BdrvDumpHeader *header = NULL;
+        IBFDumpLink link;
+        bool complete = false;
+        int i;
+
+        // Deltas only carry what changed since their base. Walk back
+        // to a complete dump and hand the target everything from there.
+        memset(&link, 0, sizeof(link));
+        memcpy(link.hash, hash, sizeof(SHA1_HASH_TYPE));
+        while (chain->len <= IBF_MAX_DUMP_CHAIN && ibf_load_dump(idxf, &link))
         {
-            // pass the data along to the target drive
-            target_bs->drv->bdrv_receive_dump(target_bs, tp.data, tp.size, hash);
+            g_array_append_val(chain, link);
+
+            header = ibf_dump_delta_header(&link);
+            if (!header)
+            {
+                complete = true;
+                break;
+            }
+
+            memset(&link, 0, sizeof(link));
+            memcpy(link.hash, header->base_hash, sizeof(SHA1_HASH_TYPE));
         }
-        // TODO free buffer
-        
+
+        if (complete)
+        {
+            for (i = chain->len - 1; i >= 0 && ret >= 0; i--)
+            {
+                IBFDumpLink *next = &g_array_index(chain, IBFDumpLink, i);
+
+                // pass the data along to the target drive
+                ret = target_bs->drv->bdrv_receive_dump(target_bs, next->data, next->size, next->hash);
+            }
+        }
+        else if (chain->len)
+        {
+            error_report("ibf: The base of a delta block dump is missing");
+            ret = -ENOENT;
+        }
+
+        for (i = 0; i < chain->len; i++)
+        {
+            g_free(g_array_index(chain, IBFDumpLink, i).data);
+        }
+        g_array_free(chain, true);
     }
-    return 0;
+    return ret;
 }
 
 static int ibf_receive_dump(BlockDriverState *bs, uint8_t *data, size_t data_len, SHA1_HASH_TYPE hash)
@@ -285,6 +370,15 @@ static int ibf_receive_dump(BlockDriverState *bs, uint8_t *data, size_t data_len
     tp.size = data_len;
     tp.hash = (SHA1_HASH_TYPE *)&hash;
     create_file_visitor(&visitor, &tp);
+
+    // Loads always find the first dump stored under a hash, so
+    // storing another one would only take up space.
+    visitor.if_read = ibf_if_probe;
+    if (idxf_class->load_from_hash(idxf, &visitor, hash))
+    {
+        return 0;
+    }
+    visitor.if_read = ibf_if_read;
     
     // We will tell the file to write now
     idxf_class->write_data(idxf, &visitor, NULL, NULL);
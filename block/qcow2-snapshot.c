@@ -29,11 +29,20 @@
 #include "qemu/bswap.h"
 #include "qemu/error-report.h"
 #include "qemu/cutils.h"
+#include "block/dirty-bitmap.h"
+#include "migration/rsave-hash.h"
 
 //#define DUMP_DEBUG
 
+// Where the data of a dumped cluster comes from
+enum {
+    QCOW2_DUMP_SOURCE_DATA = 0, // The data is carried in the entry
+    QCOW2_DUMP_SOURCE_BASE = 1, // Unchanged since the base dump
+    QCOW2_DUMP_SOURCE_DUP  = 2, // Same data as the cluster at source_offset
+};
 
 typedef struct QCow2Dump {
+    BdrvDumpHeader header;
     uint64_t l1_table_size;
     uint64_t *l1_table;
     uint64_t num_entries;
@@ -54,6 +63,8 @@ typedef struct QCow2DumpSliceEntry {
     uint64_t slice_index;
     uint64_t data_offset;
     uint64_t data_size;
+    uint64_t source;
+    uint64_t source_offset;
     void *data;
     QLIST_ENTRY(QCow2DumpSliceEntry) next;
 } QCow2DumpSliceEntry;
@@ -90,6 +101,8 @@ static int serialize_slice_entry(QCow2DumpSliceEntry *entry, uint8_t **buffer, u
                          sizeof(entry->slice_index) + 
                          sizeof(entry->data_offset) + 
                          sizeof(entry->data_size) +
+                         sizeof(entry->source) +
+                         sizeof(entry->source_offset) +
                          entry->data_size;
 
     *buffer = g_realloc(*buffer, *size +  data_size);
@@ -111,6 +124,12 @@ static int serialize_slice_entry(QCow2DumpSliceEntry *entry, uint8_t **buffer, u
         memcpy(write_buff, &entry->data_size, sizeof(entry->data_size));
         write_buff += sizeof(entry->data_size);
 
+        memcpy(write_buff, &entry->source, sizeof(entry->source));
+        write_buff += sizeof(entry->source);
+
+        memcpy(write_buff, &entry->source_offset, sizeof(entry->source_offset));
+        write_buff += sizeof(entry->source_offset);
+
         memcpy(write_buff, entry->data, entry->data_size);
         write_buff += entry->data_size;
         
@@ -166,7 +185,8 @@ static int serialize_dump(QCow2Dump *dump, uint8_t **buffer, uint64_t *size)
     int ret = -EFBIG;
     uint8_t *write_buff;
     uint64_t l1_bytes = sizeof(uint64_t) * dump->l1_table_size;
-    uint32_t data_size = sizeof(dump->l1_table_size) +
+    uint32_t data_size = sizeof(dump->header) +
+                         sizeof(dump->l1_table_size) +
                          l1_bytes +
                          sizeof(dump->num_entries);
 
@@ -187,6 +207,9 @@ static int serialize_dump(QCow2Dump *dump, uint8_t **buffer, uint64_t *size)
         write_buff = *buffer;
         *size += data_size;
 
+        memcpy(write_buff, &dump->header, sizeof(dump->header));
+        write_buff += sizeof(dump->header);
+
         memcpy(write_buff, &dump->l1_table_size, sizeof(dump->l1_table_size));
         write_buff += sizeof(dump->l1_table_size); 
 
@@ -209,7 +232,7 @@ static int serialize_dump(QCow2Dump *dump, uint8_t **buffer, uint64_t *size)
     return ret;
 }
 
-static int deserialize_slice_entry(QCow2DumpSliceEntry *entry, uint8_t *buffer, uint64_t *size)
+static int deserialize_slice_entry(QCow2DumpSliceEntry *entry, uint8_t *buffer, uint64_t *size, bool has_source)
 {
     int ret = -EFBIG;
     uint8_t *read_buff = buffer;
@@ -218,6 +241,13 @@ static int deserialize_slice_entry(QCow2DumpSliceEntry *entry, uint8_t *buffer,
                                  sizeof(entry->data_offset) +
                                  sizeof(entry->data_size);
  
+    // Dumps from before the dump header always carry their data
+    if (has_source)
+    {
+        initial_read_size += sizeof(entry->source) + sizeof(entry->source_offset);
+    }
+    entry->source = QCOW2_DUMP_SOURCE_DATA;
+    entry->source_offset = 0;
 
     if (*size >= initial_read_size)
     {
@@ -234,19 +264,31 @@ static int deserialize_slice_entry(QCow2DumpSliceEntry *entry, uint8_t *buffer,
 
         memcpy(&entry->data_size, read_buff, sizeof(entry->data_size));
         read_buff += sizeof(entry->data_size);
+
+        if (has_source)
+        {
+            memcpy(&entry->source, read_buff, sizeof(entry->source));
+            read_buff += sizeof(entry->source);
+
+            memcpy(&entry->source_offset, read_buff, sizeof(entry->source_offset));
+            read_buff += sizeof(entry->source_offset);
+        }
     }
 
     if (*size >= entry->data_size)
     {
-        entry->data = g_new(uint8_t, entry->data_size);
-        memcpy(entry->data, read_buff, entry->data_size);
+        if (entry->data_size)
+        {
+            entry->data = g_new(uint8_t, entry->data_size);
+            memcpy(entry->data, read_buff, entry->data_size);
+        }
         *size -= entry->data_size;
         ret = 0;
     }
     return ret;
 }
 
-static int deserialize_dump_record(QCow2DumpRecord *record, uint8_t *buffer, uint64_t *size)
+static int deserialize_dump_record(QCow2DumpRecord *record, uint8_t *buffer, uint64_t *size, bool has_source)
 {
     int i, ret = -EFBIG;
     uint8_t *read_buff = buffer;
@@ -283,7 +325,7 @@ static int deserialize_dump_record(QCow2DumpRecord *record, uint8_t *buffer, uin
             entry = g_new0(QCow2DumpSliceEntry, 1);
 
             uint64_t delta_size = *size;
-            ret = deserialize_slice_entry(entry, read_buff, size);
+            ret = deserialize_slice_entry(entry, read_buff, size, has_source);
             if (ret != 0)
             {
                 break;
@@ -309,6 +351,25 @@ static int deserialize_dump(QCow2Dump *dump, uint8_t *buffer, uint64_t size)
     uint64_t ents, size_remaining = size;
     uint32_t l1_size_size = sizeof(dump->l1_table_size);
     uint32_t initial_read_size = sizeof(dump->num_entries);
+    bool has_header = false;
+
+    // Older dumps start right at the L1 table
+    memset(&dump->header, 0, sizeof(dump->header));
+    if (size_remaining >= sizeof(dump->header))
+    {
+        memcpy(&dump->header, read_buff, sizeof(dump->header));
+        has_header = (dump->header.magic == BDRV_DUMP_MAGIC);
+    }
+
+    if (has_header)
+    {
+        read_buff += sizeof(dump->header);
+        size_remaining -= sizeof(dump->header);
+    }
+    else
+    {
+        memset(&dump->header, 0, sizeof(dump->header));
+    }
 
     if (size_remaining >= l1_size_size)
     {
@@ -346,7 +407,7 @@ static int deserialize_dump(QCow2Dump *dump, uint8_t *buffer, uint64_t size)
             records = g_new0(QCow2DumpRecord, 1);
 
             uint64_t delta_size = size_remaining;
-            ret = deserialize_dump_record(records, read_buff, &size_remaining);
+            ret = deserialize_dump_record(records, read_buff, &size_remaining, has_header);
             if (ret != 0)
             {
                 break;
@@ -375,6 +436,11 @@ static void pretty_print_slice_entry(QCow2DumpSliceEntry *slice)
     printf("\t\tSlice Index: %lu\n", slice->slice_index);
     printf("\t\tData Offset: %lx\n", slice->data_offset);
     printf("\t\tData Size: %lx\n", slice->data_size);
+    printf("\t\tSource: %lu (%lx)\n", slice->source, slice->source_offset);
+    if (!slice->data)
+    {
+        return;
+    }
     printf("\t\tData:");
     for (x = 0; x < 32; ++x)
     {
@@ -751,6 +817,102 @@ static int find_snapshot_by_id_or_name(BlockDriverState *bs,
     return find_snapshot_by_id_and_name(bs, NULL, id_or_name);
 }
 
+static guint dump_content_hash_func(gconstpointer key)
+{
+    // The key is already a content hash so any part of it will do.
+    return *(const guint *)key;
+}
+
+static gboolean dump_content_hash_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, sizeof(SHA1_HASH_TYPE));
+}
+
+// Looks for an earlier cluster in the dump with the same data. Returns
+// the entry that carries that data, or NULL after remembering this one.
+static QCow2DumpSliceEntry *dump_find_duplicate(GHashTable *content, QCow2DumpSliceEntry *entry)
+{
+    SHA1_HASH_TYPE hash;
+    QCow2DumpSliceEntry *match;
+    struct iovec iov = { .iov_base = entry->data, .iov_len = entry->data_size };
+
+    if (rsave_hash_iov(&iov, 1, &hash) < 0)
+    {
+        return NULL;
+    }
+
+    match = g_hash_table_lookup(content, hash);
+    if (!match)
+    {
+        g_hash_table_insert(content, g_memdup(hash, sizeof(SHA1_HASH_TYPE)), entry);
+    }
+    else if (match->data_size == entry->data_size &&
+             !memcmp(match->data, entry->data, entry->data_size))
+    {
+        return match;
+    }
+    return NULL;
+}
+
+// Returns the bitmap a dump can be taken against, or NULL when there
+// is no base dump and every cluster has to be carried.
+static BdrvDirtyBitmap *dump_base_bitmap(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+
+    if (!s->dump_has_base)
+    {
+        return NULL;
+    }
+
+    bitmap = bdrv_find_dirty_bitmap(bs, QCOW2_DUMP_BITMAP);
+    if (!bitmap || !bdrv_dirty_bitmap_enabled(bitmap))
+    {
+        return NULL;
+    }
+    return bitmap;
+}
+
+static bool dump_cluster_is_dirty(BlockDriverState *bs, BdrvDirtyBitmap *bitmap, uint64_t guest_offset)
+{
+    bool dirty = true;
+
+    bdrv_dirty_bitmap_lock(bitmap);
+    if (guest_offset < bdrv_dirty_bitmap_size(bitmap))
+    {
+        dirty = bdrv_get_dirty_locked(bs, bitmap, guest_offset);
+    }
+    bdrv_dirty_bitmap_unlock(bitmap);
+
+    return dirty;
+}
+
+// Makes the dump with the given hash the base of later dumps and
+// starts tracking writes from here.
+static void dump_reset_base(BlockDriverState *bs, SHA1_HASH_TYPE hash)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap = bdrv_find_dirty_bitmap(bs, QCOW2_DUMP_BITMAP);
+
+    if (!bitmap)
+    {
+        bitmap = bdrv_create_dirty_bitmap(bs, s->cluster_size, QCOW2_DUMP_BITMAP, NULL);
+    }
+    else if (bdrv_dirty_bitmap_enabled(bitmap) && !bdrv_dirty_bitmap_readonly(bitmap))
+    {
+        bdrv_clear_dirty_bitmap(bitmap, NULL);
+    }
+    else
+    {
+        // Someone else has been at the bitmap, we can't trust it.
+        bitmap = NULL;
+    }
+
+    s->dump_has_base = (bitmap != NULL);
+    memcpy(s->dump_base_hash, hash, sizeof(SHA1_HASH_TYPE));
+}
+
 int qcow2_dump_state(BlockDriverState *bs, BlockDriverState *target_bs, SHA1_HASH_TYPE hash)
 {
     QCow2Dump dump;
@@ -759,6 +921,17 @@ int qcow2_dump_state(BlockDriverState *bs, BlockDriverState *target_bs, SHA1_HAS
     uint8_t *storage_buffer = NULL; //, *cluster_buffer = NULL;
     uint64_t *l2_slice = NULL;
     uint64_t offset;
+    BdrvDirtyBitmap *base_bitmap = dump_base_bitmap(bs);
+    GHashTable *content = NULL;
+
+    // The blocks for this hash are the ones that were last received,
+    // the target already has them. The hash only covers the VM state,
+    // a job that wrote to the disk and came back to it still dumps.
+    if (base_bitmap && !memcmp(s->dump_base_hash, hash, sizeof(SHA1_HASH_TYPE)) &&
+        bdrv_get_dirty_count(base_bitmap) == 0)
+    {
+        return 0;
+    }
 
     // Does the target support this?
     if (target_bs->drv->bdrv_receive_dump)
@@ -768,6 +941,18 @@ int qcow2_dump_state(BlockDriverState *bs, BlockDriverState *target_bs, SHA1_HAS
         // Initialize the record
         dump.num_entries = 0;
         QLIST_INIT(&dump.dump_entries);
+
+        // Clusters that were not written since the base dump was
+        // received are only referenced. The others are deduplicated
+        // by their content.
+        memset(&dump.header, 0, sizeof(dump.header));
+        dump.header.magic = BDRV_DUMP_MAGIC;
+        if (base_bitmap)
+        {
+            dump.header.flags |= BDRV_DUMP_FLAG_DELTA;
+            memcpy(dump.header.base_hash, s->dump_base_hash, sizeof(SHA1_HASH_TYPE));
+        }
+        content = g_hash_table_new_full(dump_content_hash_func, dump_content_hash_equal, g_free, NULL);
         
         // We will load the L1 table from file
         dump.l1_table_size = s->l1_size;
@@ -840,13 +1025,25 @@ int qcow2_dump_state(BlockDriverState *bs, BlockDriverState *target_bs, SHA1_HAS
                         if (offset > 0)
                         {
                            // Initialize slice data
-                            QCow2DumpSliceEntry *slice_data; 
+                            QCow2DumpSliceEntry *slice_data, *duplicate; 
+                            uint64_t guest_offset = ((uint64_t) i * s->l2_size +
+                                                     slice * s->l2_slice_size + j) << s->cluster_bits;
 
                             // Initialize data
                             slice_data = g_new0(QCow2DumpSliceEntry, 1);
                             slice_data->entry_index = j;
                             slice_data->data_offset = entry;
                             slice_data->slice_index = offset;
+
+                            // The base dump already has this one
+                            if (base_bitmap && !dump_cluster_is_dirty(bs, base_bitmap, guest_offset))
+                            {
+                                slice_data->source = QCOW2_DUMP_SOURCE_BASE;
+                                add_slice_entry(record, slice_data);
+                                continue;
+                            }
+
+                            slice_data->source = QCOW2_DUMP_SOURCE_DATA;
                             slice_data->data = g_new0(uint8_t, s->cluster_size);
                             slice_data->data_size = s->cluster_size;
 
@@ -859,6 +1056,17 @@ int qcow2_dump_state(BlockDriverState *bs, BlockDriverState *target_bs, SHA1_HAS
                                 goto failed;
                             }
 
+                            // Only keep the first copy of any data
+                            duplicate = dump_find_duplicate(content, slice_data);
+                            if (duplicate)
+                            {
+                                g_free(slice_data->data);
+                                slice_data->data = NULL;
+                                slice_data->data_size = 0;
+                                slice_data->source = QCOW2_DUMP_SOURCE_DUP;
+                                slice_data->source_offset = duplicate->slice_index;
+                            }
+
                             // Add the slice data to the record for this segment
                             add_slice_entry(record, slice_data);
                         } 
@@ -905,6 +1113,7 @@ int qcow2_dump_state(BlockDriverState *bs, BlockDriverState *target_bs, SHA1_HAS
 failed:
     if(l2_slice) qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
     if(storage_buffer) g_free(storage_buffer);
+    if(content) g_hash_table_destroy(content);
     free_dump_memory(&dump);
     return -1;
 }
@@ -1039,12 +1248,27 @@ int qcow2_receive_dump(BlockDriverState *bs, uint8_t *data, size_t data_len, SHA
     //uint64_t *new_l1_table;
 
     QCow2Dump dump;
+    GHashTable *carried = NULL;
     deserialize_dump(&dump, data, data_len);
 
 #ifdef DUMP_DEBUG
     pretty_print_dump(&dump);
 #endif 
 
+    // A delta only holds up on top of the dump it was taken against.
+    // The sender is expected to have given us that one first.
+    if (dump.header.flags & BDRV_DUMP_FLAG_DELTA)
+    {
+        if (!s->dump_has_base ||
+            memcmp(s->dump_base_hash, dump.header.base_hash, sizeof(SHA1_HASH_TYPE)))
+        {
+            error_report("qcow2: The base of a delta block dump was not loaded");
+            ret = -EINVAL;
+            goto load_fail;
+        }
+    }
+    s->dump_has_base = false;
+
     // TODO loop through each value in each L2 slice and zero them
 
     // Calculate the size of the incoming L1 tables in bytes
@@ -1105,9 +1329,25 @@ int qcow2_receive_dump(BlockDriverState *bs, uint8_t *data, size_t data_len, SHA
         goto load_fail;
     }
 
-    // Loop through each record
+    // Duplicated clusters point at the host offset of the entry
+    // carrying their data, which may come later in the dump.
+    carried = g_hash_table_new(g_int64_hash, g_int64_equal);
+
     QCow2DumpRecord *rec;
     QLIST_FOREACH(rec, &dump.dump_entries, next)
+    {
+        QCow2DumpSliceEntry *slice;
+        QLIST_FOREACH(slice, &rec->slice_entries, next)
+        {
+            if (slice->source == QCOW2_DUMP_SOURCE_DATA)
+            {
+                g_hash_table_insert(carried, &slice->slice_index, slice);
+            }
+        }
+    }
+
+    // Loop through each record
+    QLIST_FOREACH(rec, &dump.dump_entries, next)
     {
         uint64_t *l2_slice = NULL;
         uint64_t l2_offset = s->l1_table[rec->l1_index] & L1E_OFFSET_MASK;
@@ -1126,11 +1366,30 @@ int qcow2_receive_dump(BlockDriverState *bs, uint8_t *data, size_t data_len, SHA
         QCow2DumpSliceEntry *slice;
         QLIST_FOREACH(slice, &rec->slice_entries, next)
         {
+            QCow2DumpSliceEntry *source = slice;
+
             // Make sure that the offset is in the lice
             l2_slice[slice->entry_index] = cpu_to_be64(slice->data_offset);
 
+            // Clusters from the base are already on the drive
+            if (slice->source == QCOW2_DUMP_SOURCE_BASE)
+            {
+                continue;
+            }
+
+            if (slice->source == QCOW2_DUMP_SOURCE_DUP)
+            {
+                source = g_hash_table_lookup(carried, &slice->source_offset);
+                if (!source)
+                {
+                    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+                    ret = -EINVAL;
+                    goto load_fail;
+                }
+            }
+
             // Make sure that the data makes its way to the haed drive
-            ret = bdrv_pwrite(bs->file, slice->slice_index, slice->data, slice->data_size);
+            ret = bdrv_pwrite(bs->file, slice->slice_index, source->data, source->data_size);
             if (ret < 0)
             {
                 goto load_fail;            
@@ -1140,7 +1399,12 @@ int qcow2_receive_dump(BlockDriverState *bs, uint8_t *data, size_t data_len, SHA
         // Let QCOW know that we are done with this slice
         qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
     }
+
+    // Later dumps only need what is written from here on
+    dump_reset_base(bs, hash);
+
 load_fail:
+    if (carried) g_hash_table_destroy(carried);
     free_dump_memory(&dump);
     return ret;
 }
@@ -1163,6 +1427,9 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     }
     sn = &s->snapshots[snapshot_index];
 
+    // The drive no longer holds what the last block dump left on it
+    s->dump_has_base = false;
+
     ret = qcow2_validate_table(bs, sn->l1_table_offset, sn->l1_size,
                                sizeof(uint64_t), QCOW_MAX_L1_SIZE,
                                "Snapshot L1 table", &local_err);
@@ -41,6 +41,9 @@
 #define QCOW_MAX_CRYPT_CLUSTERS 32
 #define QCOW_MAX_SNAPSHOTS 65536
 
+// Name of the dirty bitmap that block dumps are taken against
+#define QCOW2_DUMP_BITMAP "rsave-dump"
+
 /* 8 MB refcount table is enough for 2 PB images at 64k cluster size
  * (128 GB for 512 byte clusters, 2 EB for 2 MB clusters) */
 #define QCOW_MAX_REFTABLE_SIZE 0x800000
@@ -330,6 +333,12 @@ typedef struct BDRVQcow2State {
 
     CoQueue compress_wait_queue;
     int nb_compress_threads;
+
+    // The dump last received by the drive. Clusters written since then
+    // are tracked in the QCOW2_DUMP_BITMAP dirty bitmap, so later dumps
+    // only need to carry those.
+    bool dump_has_base;
+    SHA1_HASH_TYPE dump_base_hash;
 } BDRVQcow2State;
 
 typedef struct Qcow2COWRegion {
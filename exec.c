@@ -2237,6 +2237,7 @@ static void ram_block_add(RAMBlock *new_block, Error **errp, bool shared)
     new_block->rsave_flags = 0;
     new_block->rsave_l1_hashes = NULL;
     new_block->rsave_l2_hashes = NULL;
+    new_block->rsave_pristine = NULL;
 
     /* Keep the list sorted from biggest to smallest block.  Unlike QTAILQ,
      * QLIST (which has an RCU-friendly variant) does not have insertion at
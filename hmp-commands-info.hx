@@ -878,6 +878,22 @@ STEXI
 @findex info memory_size_summary
 Display the amount of initially allocated and present hotpluggable (if
 enabled) memory in bytes.
+ETEXI
+
+    {
+        .name       = "rapid-analysis",
+        .args_type  = "reset:-r",
+        .params     = "[-r]",
+        .help       = "show rapid analysis performance counters (-r: reset them afterwards)",
+        .cmd        = hmp_info_rapid_analysis,
+    },
+
+STEXI
+@item info rapid-analysis
+@findex info rapid-analysis
+Show the time spent in each phase of rapid analysis jobs, the reference and
+node cache hit counts and the bytes moved. With @option{-r} the counters are
+cleared after they are shown.
 ETEXI
 
 #if defined(TARGET_I386)
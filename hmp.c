@@ -3268,6 +3268,50 @@ void hmp_info_vm_generation_id(Monitor *mon, const QDict *qdict)
     qapi_free_GuidInfo(info);
 }
 
+void hmp_info_rapid_analysis(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+    bool reset = qdict_get_try_bool(qdict, "reset", false);
+    RapidAnalysisStats *stats = qmp_query_rapid_analysis_stats(true, reset, &err);
+    RapidAnalysisPhaseStatsList *phase;
+
+    if (err) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+
+    monitor_printf(mon, "jobs: %" PRIu64 " (%" PRIu64 " merged)\n",
+                   stats->jobs, stats->merged_jobs);
+    monitor_printf(mon, "%-14s %10s %14s %14s %14s\n",
+                   "phase", "count", "total (us)", "mean (us)", "max (us)");
+    for (phase = stats->phases; phase; phase = phase->next) {
+        RapidAnalysisPhaseStats *p = phase->value;
+
+        monitor_printf(mon, "%-14s %10" PRIu64 " %14" PRIu64 " %14" PRIu64
+                       " %14" PRIu64 "\n",
+                       RapidAnalysisPhase_str(p->phase), p->count,
+                       p->total_ns / 1000,
+                       p->count ? p->total_ns / p->count / 1000 : 0,
+                       p->max_ns / 1000);
+    }
+
+    monitor_printf(mon, "reference cache: %" PRIu64 " hits, %" PRIu64
+                   " misses\n", stats->ref_cache_hits, stats->ref_cache_misses);
+    if (stats->has_node_cache) {
+        monitor_printf(mon, "node cache: %" PRIu64 " hits, %" PRIu64
+                       " misses, %" PRIu64 " evictions, %" PRIu64
+                       " entries, %" PRIu64 " bytes\n",
+                       stats->node_cache->hits, stats->node_cache->misses,
+                       stats->node_cache->evictions,
+                       stats->node_cache->entries, stats->node_cache->size);
+    }
+    monitor_printf(mon, "bytes restored: %" PRIu64 ", written: %" PRIu64
+                   ", sent: %" PRIu64 "\n", stats->bytes_restored,
+                   stats->bytes_written, stats->bytes_sent);
+
+    qapi_free_RapidAnalysisStats(stats);
+}
+
 void hmp_info_memory_size_summary(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
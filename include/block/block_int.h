@@ -62,6 +62,18 @@
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
+// Block dumps may start with this header. A delta dump only holds what
+// changed since the dump named by base_hash, so the base has to be
+// received by the target first. Dumps without the header are complete.
+#define BDRV_DUMP_MAGIC             (0x504d55445644524bull)
+#define BDRV_DUMP_FLAG_DELTA        (1 << 0)
+
+typedef struct BdrvDumpHeader {
+    uint64_t magic;
+    uint64_t flags;
+    SHA1_HASH_TYPE base_hash;
+} BdrvDumpHeader;
+
 enum BdrvTrackedRequestType {
     BDRV_TRACKED_READ,
     BDRV_TRACKED_WRITE,
@@ -334,12 +334,15 @@ CPUArchState *cpu_copy(CPUArchState *env);
 #define TLB_MMIO            (1 << (TARGET_PAGE_BITS - 3))
 /* Set if TLB entry must have MMU lookup repeated for every access */
 #define TLB_RECHECK         (1 << (TARGET_PAGE_BITS - 4))
+/* Set if a plugin watches accesses to the page.  Only used for data
+   accesses, the page is otherwise handled as its other flags say.  */
+#define TLB_WATCH           (1 << (TARGET_PAGE_BITS - 5))
 
 /* Use this mask to check interception with an alignment mask
  * in a TCG backend.
  */
 #define TLB_FLAGS_MASK  (TLB_INVALID_MASK | TLB_NOTDIRTY | TLB_MMIO \
-                         | TLB_RECHECK)
+                         | TLB_RECHECK | TLB_WATCH)
 
 /**
  * tlb_hit_page: return true if page aligned @addr is a hit against the
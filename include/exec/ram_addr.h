@@ -63,6 +63,8 @@ struct RAMBlock {
     uint8_t *rsave_flags;
     SHA1_HASH_TYPE *rsave_l1_hashes;
     SHA1_HASH_TYPE *rsave_l2_hashes;
+    // Copy of the base state's RAM for forkserver mode
+    uint8_t *rsave_pristine;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
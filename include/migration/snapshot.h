@@ -26,6 +26,6 @@ int load_snapshot_rsave(const char *filename, SHA1_HASH_TYPE *hash, Error **errp
 void increment_snapshot_rsave(CPUState *cpu, RSaveTree *rst, TranslationBlock *tb);
 bool load_work(CPUState *cpu, RSaveTree *rst);
 void close_work(RSaveTree *rst, CPUState *cpu, SHA1_HASH_TYPE job_hash, bool send_results);
-CommsMessage *build_rsave_report(RSaveTree *rst, SHA1_HASH_TYPE job_hash, JOB_REPORT_TYPE report_mask, CommsQueue *queue);
+CommsResultsItem *build_rsave_report(RSaveTree *rst, SHA1_HASH_TYPE job_hash, JOB_REPORT_TYPE report_mask, CommsQueue *queue);
 
 #endif
@@ -21,6 +21,8 @@
 
 #include "qemu/osdep.h"
 #include "qemu-common.h"
+#include "qemu/thread.h"
+#include "sysemu/sysemu.h"
 #include "qapi/error.h"
 #include "qom/object.h"
 #include "qapi/qmp/qlist.h"
@@ -38,6 +40,9 @@
     OBJECT_GET_CLASS(OSHandlerClass, obj, TYPE_OSHANDLER)
 
 typedef struct OSPidPool OSPidPool;
+typedef struct OSActiveKey OSActiveKey;
+
+typedef bool (*OSProcessMatch)(const Process *p, const void *data);
 
 typedef struct {
     Object obj;
@@ -50,6 +55,20 @@ typedef struct {
     QList *breakpoints;
     QString *process_header;
     int singlestep_enabled;
+
+    // Process table cache. It is walked from guest memory again on a
+    // lookup miss, or when the process found no longer exists. Process
+    // details are as of the last walk.
+    QemuMutex proc_cache_lock;
+    ProcessList *proc_cache;
+    GHashTable *proc_cache_by_key;
+    bool proc_cache_valid;
+
+    // Active process key of each vCPU, kept until it writes its page
+    // table root or the guest is resumed.
+    OSActiveKey *active_keys;
+    uint32_t active_generation;
+    VMChangeStateEntry *vmstate_change;
 } OSHandler;
 
 typedef struct {
@@ -87,12 +106,25 @@ typedef struct {
     ProcessInfo* (*get_processinfo_by_ospid)(OSHandler* ctxt, OSPid pid);
     bool         (*is_active_by_processinfo)(OSHandler* ctxt, CPUState* cpu, ProcessInfo *pi);
 
+    uint64_t (*active_process_key)(OSHandler* ctxt, CPUState* cpu);
+    uint64_t (*process_key)(OSHandler* ctxt, const ProcessInfo *pi);
+    // Whether a process from the cache is still the one in the guest.
+    // Should be cheaper than a walk of the process list.
+    bool (*process_exists)(OSHandler* ctxt, const Process *p);
+
 } OSHandlerClass;
 
 OSHandler *oshandler_init(CPUState *cpu, const char *hint);
 bool is_oshandler_active(void);
 OSHandler *oshandler_get_instance(void);
 
+uint64_t oshandler_get_active_key(OSHandler *ctxt, CPUState *cpu);
+ProcessInfo *oshandler_cached_processinfo_by_key(OSHandler *ctxt, uint64_t key);
+ProcessInfo *oshandler_cached_processinfo(OSHandler *ctxt, OSProcessMatch match, const void *data);
+Process *oshandler_cached_process(OSHandler *ctxt, OSProcessMatch match, const void *data);
+void oshandler_invalidate_cache(OSHandler *ctxt);
+void oshandler_notify_pagetable_change(CPUState *cpu);
+
 void object_property_add_uint64_ptr2(Object *obj, const char *name,
                                     uint64_t *v, Error **errp);
 
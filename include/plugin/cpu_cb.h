@@ -19,8 +19,35 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qom/cpu.h"
+#include "plugin/plugin-object.h"
+
+// What a translated block needs to be instrumented with.
+#define PLUGIN_EXEC_INSN  (1 << 0)
+#define PLUGIN_EXEC_BLOCK (1 << 1)
+#define PLUGIN_EXEC_COUNT (1 << 2)
+
+void notify_exec_instruction(CPUState *cs, uint64_t vaddr, void *code);
+void notify_exec_block(CPUState *cs, PluginExecBlock *block);
+
+// Translation time support for the execution callbacks
+int plugin_exec_block_mode(uint64_t begin, uint64_t end);
+bool plugin_exec_insn_wanted(uint64_t vaddr);
+void *plugin_exec_code_pointer(CPUState *cs, uint64_t vaddr);
+PluginExecBlock *plugin_exec_block_new(struct TranslationBlock *tb, uint64_t vaddr);
+void plugin_exec_block_add_insn(CPUState *cs, PluginExecBlock *block, uint64_t vaddr, uint32_t size);
+void plugin_exec_block_end(PluginExecBlock *block);
+void plugin_exec_block_invalidate(struct TranslationBlock *tb);
+void plugin_exec_blocks_flush(void);
+void plugin_exec_filter_changed(void);
+
+// Memory watches, see PluginMemAccess
+bool plugin_mem_watch_add(PluginObject *po, uint64_t begin, uint64_t end, uint32_t flags);
+void plugin_mem_watch_remove(PluginObject *po);
+int plugin_mem_watch_page(uint64_t vaddr, uint64_t paddr);
+void plugin_mem_watch_record(CPUState *cs, uint64_t vaddr, uint64_t paddr,
+                             uint64_t value, void *addr, int size, bool is_write);
+void plugin_mem_watch_flush(void);
 
-void notify_exec_instruction(CPUState *cs, uint64_t vaddr);
 void notify_read_memory(CPUState *cs, uint64_t paddr, uint8_t *value, int size);
 void notify_write_memory(CPUState *cs, uint64_t paddr, const uint8_t *value, int size);
 void notify_breakpoint_hit(CPUState *cs, OSBreakpoint* bp);
@@ -31,5 +58,6 @@ void notify_interrupt(int mask);
 bool is_memread_instrumentation_enabled(void);
 bool is_memwrite_instrumentation_enabled(void);
 bool is_exec_instrumentation_enabled(void);
+bool is_block_instrumentation_enabled(void);
 bool is_syscall_instrumentation_enabled(void);
 bool is_interrupt_instrumentation_enabled(void);
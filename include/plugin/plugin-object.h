@@ -25,6 +25,7 @@
 #include "racomms/interface.h"
 #include "racomms/racomms-types.h"
 #include "qapi/qapi-types-run-state.h"
+#include "oshandler/ostypes.h"
 
 // ****************************************************** //
 // **********       Plugin Class Setup        ********** //
@@ -41,6 +42,70 @@
 typedef struct PluginObject PluginObject;
 typedef struct PluginObjectClass PluginObjectClass;
 typedef struct PluginCallbacks PluginCallbacks;
+typedef struct PluginExecInsn PluginExecInsn;
+typedef struct PluginExecBlock PluginExecBlock;
+typedef struct PluginExecFilter PluginExecFilter;
+typedef struct PluginMemAccess PluginMemAccess;
+
+struct PluginExecInsn {
+    // The address of the instruction
+    uint64_t vaddr;
+    // The instruction in host memory (NULL if it is not in RAM)
+    void *addr;
+    // The size of the instruction
+    uint32_t size;
+};
+
+/**
+ * A translated block of guest code. Blocks are built when code is
+ * translated and stay valid until the code is invalidated or the
+ * translation cache is flushed, see on_invalidate_block.
+ */
+struct PluginExecBlock {
+    // The address of the first instruction
+    uint64_t vaddr;
+    // Times the block started executing, only kept for on_translate_block
+    uint64_t exec_count;
+    uint32_t num_insns;
+    PluginExecInsn *insns;
+};
+
+/**
+ * Limits the execution callbacks of a plugin. Blocks that lie entirely
+ * outside the range of every interested plugin are translated without
+ * any instrumentation, and instructions outside it without a call. The
+ * process is checked when the callback would run.
+ */
+struct PluginExecFilter {
+    // An empty range (begin == end) covers all addresses
+    uint64_t range_begin;
+    uint64_t range_end;
+    // NULL_PID for any process
+    OSPid process;
+};
+
+// Kinds of memory watches, see qemu_watch_memory_range
+#define PLUGIN_WATCH_READ     (1 << 0)
+#define PLUGIN_WATCH_WRITE    (1 << 1)
+#define PLUGIN_WATCH_VIRTUAL  (1 << 2)
+
+/**
+ * An access to a watched range of memory. Accesses are collected as the
+ * vCPU runs and handed to the plugin in batches when it leaves a block.
+ */
+struct PluginMemAccess {
+    // The virtual address of the access
+    uint64_t vaddr;
+    // The physical address, as passed to on_memory_read/on_memory_write
+    uint64_t paddr;
+    // The value read or written (host endianess)
+    uint64_t value;
+    // Address in host memory (NULL for IO)
+    void *addr;
+    int cpu_id;
+    uint8_t size;
+    bool is_write;
+};
 
 struct PluginCallbacks {
     /**
@@ -82,6 +147,17 @@ struct PluginCallbacks {
      * @param size Size of write access
      */    
     void (*on_memory_write)(void *opaque, uint64_t paddr, const uint8_t *value, void *addr, int size);
+
+    /**
+     * Alerts the plugin to accesses of the memory it watches. Once a plugin
+     * watches memory, its on_memory_read and on_memory_write callbacks only
+     * see watched accesses, and only if this callback is not set.
+     *
+     * @param opaque "This" pointer to the state
+     * @param accesses The accesses in the order they happened
+     * @param count Number of accesses
+     */
+    void (*on_memory_access)(void *opaque, const PluginMemAccess *accesses, uint32_t count);
     
     /**
      * This callback is executed when the RA system has started. Add an
@@ -165,6 +241,35 @@ struct PluginCallbacks {
      */
     void (*on_execute_instruction)(void *opaque, uint64_t vaddr, void *addr);
 
+    /**
+     * This callback is executed when a translated block starts executing.
+     * It is called once per block instead of once per instruction.
+     * 
+     * @param plugin "This" pointer to plugin state
+     * @param block The block and its instructions
+     */
+    void (*on_execute_block)(void *opaque, PluginExecBlock *block);
+
+    /**
+     * This callback is executed when a block of code has been translated.
+     * The block's exec_count is then counted in the generated code, so a
+     * plugin that only needs counts does not get a call per execution.
+     * 
+     * @param plugin "This" pointer to plugin state
+     * @param block The block and its instructions
+     */
+    void (*on_translate_block)(void *opaque, PluginExecBlock *block);
+
+    /**
+     * This callback is executed when a translated block goes away, after
+     * the last time it executed. The block's exec_count is final and the
+     * block must not be used once the callback returns.
+     * 
+     * @param plugin "This" pointer to plugin state
+     * @param block The block and its instructions
+     */
+    void (*on_invalidate_block)(void *opaque, PluginExecBlock *block);
+
     /**
      * This callback is executed when a packet is received from an external interface.
      * 
@@ -194,6 +299,9 @@ struct PluginCallbacks {
 struct PluginObject {
     Object obj;
     PluginCallbacks cb;
+    PluginExecFilter exec_filter;
+    // Number of memory ranges the plugin watches
+    uint32_t num_mem_watches;
     const char *args;
 };
 
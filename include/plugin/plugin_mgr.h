@@ -54,5 +54,6 @@ typedef struct PluginOptions {
 void plugin_init_globals(void);
 void plugin_init_plugins(void);
 bool plugin_create_plugin(const char *optstr);
+void plugin_update_memory_instrumentation(void);
 
 #endif
\ No newline at end of file
@@ -440,6 +440,9 @@ struct CPUState {
 
     int hvf_fd;
     Object *rapid_analysis;
+    /* Edge coverage state, updated by the generated code */
+    uint32_t coverage_prev_loc;
+    uint8_t coverage_active;
     OSBreakpoint *active_bp;
 
     bool register_control_initialized;
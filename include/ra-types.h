@@ -41,6 +41,10 @@ typedef struct MemoryDescriptor {
     uint64_t offset; 
     uint32_t size; 
     uint8_t *value;
+    // One of the MEMORY_ENCODING_* values and the bytes of memory the
+    // value stands for. Encoded descriptors own their value.
+    uint8_t encoding;
+    uint32_t length;
     QLIST_ENTRY(MemoryDescriptor) next;
 } MemoryDescriptor;
 
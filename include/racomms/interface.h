@@ -30,31 +30,68 @@ typedef struct WorkEntryItem{
 
 typedef struct CommsWorkItem{
     CommsMessage *msg;
+    // When the work went on its queue
+    int64_t queued;
     QLIST_HEAD(,WorkEntryItem) entry_list;
     QTAILQ_ENTRY(CommsWorkItem) next;
 } CommsWorkItem;
 
+// A memory entry sent straight from where it lives instead of being
+// copied into the message. It goes out at offset `at` of the message.
+typedef struct CommsResultsRef{
+    size_t at;
+    CommsResponseJobReportMemoryEntry entry;
+    const uint8_t *value;
+} CommsResultsRef;
+
 typedef struct CommsResultsItem{
     CommsMessage *msg;
+    // Referenced entries and their size on the wire. msg->size only
+    // counts them once the results are pushed.
+    GArray *refs;
+    size_t ref_size;
+    bool pinned;
+    // When the results went on their queue
+    int64_t pushed;
     QTAILQ_ENTRY(CommsResultsItem) next;
 } CommsResultsItem;
 
 typedef struct CommsQueue CommsQueue;
 
+// Produces a long response a result at a time as the socket takes
+// them, rather than all of it up front. Returns NULL when done.
+typedef CommsResultsItem *(*CommsResultsSource)(void *opaque);
+
 void queue_push_work(CommsQueue *q, CommsWorkItem *work);
 CommsWorkItem *queue_pop_work(CommsQueue *q);
 bool queue_has_work(CommsQueue *q);
+uint8_t queue_get_id(CommsQueue *q);
 void queue_push_results(CommsQueue *q, CommsResultsItem *results);
 CommsResultsItem *queue_pop_results(CommsQueue *q);
+void queue_push_results_source(CommsQueue *q, CommsResultsSource produce, void *opaque, GDestroyNotify destroy);
 
 bool racomms_queue_add_job(CommsQueue *q, CommsMessage *msg);
+// Checks the job add entries from buffer to the end of msg, adding them
+// to work_item when one is given.
+bool racomms_parse_job_entries(CommsMessage *msg, const char *buffer,
+                               CommsWorkItem *work_item, Error **errp);
 void racomms_free_work(CommsWorkItem *work);
 
+CommsResultsItem *racomms_create_results(CommsMessage *msg);
+void racomms_free_results(CommsResultsItem *results);
+// Referenced memory has to stay put until it is sent, call this
+// before changing guest memory that went out in a report.
+void racomms_wait_results_sent(void);
+
 void racomms_queue_start(uint8_t id, int ctrlfd, Error **errp);
 void racomms_queue_stop(void);
 
 CommsQueue *get_comms_queue(uint8_t queue_num);
 
+// Work from every started queue, served round robin.
+bool racomms_has_any_work(void);
+CommsWorkItem *racomms_pop_any_work(CommsQueue **from);
+
 CommsMessage *racomms_create_config_request_msg(uint8_t queue);
 void racomms_msg_config_request_put_ReportMask(CommsMessage *msg, JOB_REPORT_TYPE req_flags);
 void racomms_msg_config_request_put_SessionTimeout(CommsMessage *msg, uint64_t timeout);
@@ -68,29 +105,45 @@ CommsMessage *racomms_msg_job_add_put_RegisterSetup(CommsMessage *msg, uint8_t i
 CommsMessage *racomms_msg_job_add_put_MemorySetup(CommsMessage *msg, uint64_t offset, uint32_t size, const uint8_t *value, MEMORY_FLAGS flags);
 CommsMessage *racomms_msg_job_add_put_StreamSetup(CommsMessage *msg, uint32_t fileno, uint32_t size, uint8_t *value);
 CommsMessage *racomms_msg_job_add_put_TimeoutSetup(CommsMessage *msg, uint64_t timeout);
+CommsMessage *racomms_msg_job_add_put_ReportMaskSetup(CommsMessage *msg, JOB_REPORT_TYPE report_mask);
+void          racomms_msg_job_add_put_Template(CommsMessage *msg, uint16_t template_id);
+
+CommsMessage *racomms_create_job_template_msg(uint8_t queue, uint16_t template_id, SHA1_HASH_TYPE base_hash);
+CommsMessage *racomms_create_job_batch_msg(uint8_t queue);
+CommsMessage *racomms_msg_job_batch_put_Job(CommsMessage *msg, const CommsMessage *job);
 
 CommsMessage *racomms_create_job_status_msg(uint8_t queue, int32_t job_id);
 
 CommsMessage *racomms_create_job_report_request_msg(uint8_t queue, int32_t job_id, SHA1_HASH_TYPE hash, JOB_REPORT_TYPE req_flags);
 CommsMessage *racomms_create_job_report_response_msg(uint8_t queue, int32_t job_id, SHA1_HASH_TYPE job_hash);
 void          racomms_msg_job_report_put_InstructionCount(CommsMessage *msg, uint64_t icount);
+void          racomms_msg_job_report_put_Flags(CommsMessage *msg, JOB_RESULT_TYPE flags);
 CommsMessage *racomms_msg_job_report_put_ProcessorEntry(CommsMessage *msg, uint8_t cpu_id, NAME_TYPE cpu_name);
 CommsMessage *racomms_msg_job_report_put_RegisterEntry(CommsMessage *msg, uint8_t id, NAME_TYPE name, uint8_t size, uint8_t *value);
 CommsMessage *racomms_msg_job_report_put_MemoryEntry(CommsMessage *msg, uint64_t offset, uint32_t size, uint8_t *value, JOB_REPORT_TYPE mem_type);
+CommsMessage *racomms_msg_job_report_put_EncodedMemoryEntry(CommsMessage *msg, uint64_t offset, uint32_t length, MEMORY_ENCODING_TYPE encoding, uint32_t size, uint8_t *value, JOB_REPORT_TYPE mem_type);
+bool          racomms_results_put_MemoryEntryRef(CommsResultsItem *results, uint64_t offset, uint32_t size, const uint8_t *value, JOB_REPORT_TYPE mem_type);
 CommsMessage *racomms_msg_job_report_put_Exception(CommsMessage *msg, uint64_t exception_mask);
 CommsMessage *racomms_msg_job_report_put_Error(CommsMessage *msg, uint32_t error_id, uint64_t error_loc, const char *error_text);
+CommsMessage *racomms_msg_job_report_put_CoverageEntry(CommsMessage *msg, const uint8_t *map, uint8_t map_bits);
+CommsMessage *racomms_msg_job_report_put_StatsEntry(CommsMessage *msg, const uint64_t *values, uint8_t num_phases, uint8_t num_counters);
 
 CommsMessage *racomms_create_purge_queue_msg(uint8_t queue, PURGE_ACTION_TYPE action);
 
 CommsMessage *racomms_create_quit_msg(QUIT_ACTION_TYPE how);
 
 CommsMessage *racomms_create_rapid_save_tree_request_msg(uint8_t queue, int32_t job_id);
+void          racomms_msg_rapid_save_tree_request_put_Flags(CommsMessage *msg, RST_FLAG_TYPE flags);
+CommsMessage *racomms_create_rapid_save_tree_state_request_msg(uint8_t queue, SHA1_HASH_TYPE hash);
 CommsMessage *racomms_create_rapid_save_tree_response_msg(uint8_t queue, int32_t job_id);
 CommsMessage *racomms_msg_rapid_save_tree_put_InstructionEntry(CommsMessage *msg, const char *insn_label);
 CommsMessage *racomms_msg_rapid_save_tree_put_NodeHeader(CommsMessage *msg, int64_t timestamp,
-    uint64_t instruction_number, uint64_t cpu_exception_index, int32_t job_id);
+    uint64_t instruction_number, uint64_t cpu_exception_index, int32_t job_id,
+    SHA1_HASH_TYPE hash, uint64_t state_size);
 CommsMessage *racomms_msg_rapid_save_tree_put_NodeIndex(CommsMessage *msg, const char *index_label,
     uint32_t instance_id, uint32_t section_id, uint64_t offset);
 CommsMessage *racomms_msg_rapid_save_tree_put_NodeState(CommsMessage *msg, uint32_t size);
+CommsMessage *racomms_create_rapid_save_tree_state_response_msg(uint8_t queue, int32_t job_id, SHA1_HASH_TYPE hash,
+    uint64_t state_size, uint64_t offset, uint32_t size);
 
 #endif
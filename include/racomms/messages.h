@@ -37,8 +37,8 @@ typedef struct{
 
 typedef struct{
     uint8_t queue;
+    uint8_t reserved1;
     JOB_REPORT_TYPE report_mask;
-    uint16_t reserved1;
     uint32_t reserved2;
     CONFIG_VALID_SETTINGS valid_settings;
     uint64_t timeout;
@@ -46,8 +46,8 @@ typedef struct{
 
 typedef struct{
     uint8_t queue;
+    uint8_t reserved1;
     JOB_REPORT_TYPE report_mask;
-    uint16_t reserved1;
     uint32_t reserved2;
     uint64_t timeout;
 } CommsResponseConfigMsg;
@@ -56,7 +56,7 @@ typedef struct{
 
 typedef struct{
     uint8_t queue;
-    uint8_t reserved1;
+    JOB_RESULT_TYPE flags;
     uint16_t reserved2;
     int32_t job_id;
     uint32_t num_insns;
@@ -65,7 +65,6 @@ typedef struct{
 
 typedef struct{
     JOB_REPORT_TYPE entry_type;
-    uint8_t reserved1;
     uint16_t reserved2;
     uint32_t reserved3;
     uint32_t reserved4;
@@ -77,7 +76,6 @@ typedef struct{
     JOB_REPORT_TYPE entry_type;
     uint8_t id;
     uint8_t size;
-    uint8_t reserved1;
     uint32_t reserved2;
     NAME_TYPE name;
     uint8_t value[1];
@@ -85,19 +83,17 @@ typedef struct{
 
 typedef struct{
     JOB_REPORT_TYPE entry_type;
-    uint8_t reserved1;
     uint16_t reserved2;
     uint32_t size;
     uint64_t offset;
-    uint32_t reserved3;
+    uint32_t length;
     uint16_t reserved4;
-    uint8_t reserved5;
+    MEMORY_ENCODING_TYPE encoding;
     uint8_t value[1];
 } CommsResponseJobReportMemoryEntry;
 
 typedef struct{
     JOB_REPORT_TYPE entry_type;
-    uint8_t reserved1;
     uint16_t reserved2;
     uint32_t reserved3;
     uint64_t exception_mask;
@@ -105,23 +101,60 @@ typedef struct{
 
 typedef struct{
     JOB_REPORT_TYPE entry_type;
-    uint8_t reserved1;
     uint16_t reserved2;
     uint32_t error_id;
     ERROR_TEXT error_text;
     uint64_t error_loc;
 } CommsResponseJobReportErrorEntry;
 
+typedef struct{
+    JOB_REPORT_TYPE entry_type;
+    uint8_t map_bits;
+    uint8_t reserved1;
+    uint32_t num_edges;
+    // Only the edges that were hit, each is (index << 8) | hit count.
+    uint32_t edges[1];
+} CommsResponseJobReportCoverageEntry;
+
+typedef struct{
+    JOB_REPORT_TYPE entry_type;
+    uint8_t num_phases;
+    uint8_t num_counters;
+    uint32_t num_values;
+    // num_phases pairs of a sample count and total nanoseconds, then
+    // num_counters counters. See JOB_STATS_* for the order.
+    uint64_t values[1];
+} CommsResponseJobReportStatsEntry;
+
 ///////////////////////////////
 
 typedef struct{
     uint8_t queue;
     JOB_FLAG_TYPE flags;
-    uint16_t reserved1;
+    uint16_t template_id; // Only with JOB_FLAG_TEMPLATE
     int32_t job_id;
     SHA1_HASH_TYPE base_hash;
 } CommsRequestJobAddMsg;
 
+// Followed by job add entries. Jobs flagged JOB_FLAG_TEMPLATE start from
+// the template's base hash and entries, their own entries win.
+typedef struct{
+    uint8_t queue;
+    uint8_t reserved1;
+    uint16_t template_id;
+    uint32_t reserved2;
+    SHA1_HASH_TYPE base_hash;
+} CommsRequestJobTemplateMsg;
+
+// Followed by num_jobs job add or job template messages, each with its
+// own CommsMessage header.
+typedef struct{
+    uint8_t queue;
+    uint8_t reserved1;
+    uint16_t reserved2;
+    uint32_t num_jobs;
+} CommsRequestJobBatchMsg;
+
 typedef struct{
     JOB_ADD_TYPE entry_type;
     uint8_t reserved1;
@@ -185,6 +218,13 @@ typedef struct{
     uint64_t timeout;
 } CommsRequestJobAddTimeoutSetup;
 
+typedef struct{
+    JOB_ADD_TYPE entry_type;
+    uint8_t reserved1;
+    JOB_REPORT_TYPE report_mask;
+    uint32_t reserved2;
+} CommsRequestJobAddReportMaskSetup;
+
 ///////////////////////////////
 
 typedef struct{
@@ -196,8 +236,8 @@ typedef struct{
 
 typedef struct{
     uint8_t queue;
+    uint8_t reserved1;
     JOB_REPORT_TYPE report_mask;
-    uint16_t reserved1;
     int32_t job_id;
     SHA1_HASH_TYPE job_hash;
 } CommsRequestJobReportMsg;
@@ -212,11 +252,19 @@ typedef struct{
 
 typedef struct{
     uint8_t queue;
-    uint8_t reserved1;
+    RST_FLAG_TYPE flags;
     uint16_t reserved2;
     int32_t job_id;
 } CommsRequestRapidSaveTreeMsg;
 
+typedef struct{
+    uint8_t queue;
+    uint8_t reserved1;
+    uint16_t reserved2;
+    uint32_t reserved3;
+    SHA1_HASH_TYPE hash;
+} CommsRequestRapidSaveTreeStateMsg;
+
 ///////////////////////////////
 
 typedef struct{
@@ -232,6 +280,8 @@ typedef struct{
     uint64_t num_nodes;
 } CommsResponseRapidSaveTreeInstructionEntry;
 
+// Node states are no longer sent inline, state_offset is left at zero
+// and state_size says how much MSG_RESPONSE_RST_STATE brings for hash.
 typedef struct{
     uint32_t index_offset;
     uint32_t state_offset;
@@ -240,6 +290,9 @@ typedef struct{
     int64_t  timestamp;
     uint64_t instruction_number;
     uint64_t cpu_exception_index;
+    SHA1_HASH_TYPE hash;
+    uint32_t reserved1;
+    uint64_t state_size;
 } CommsResponseRapidSaveTreeNodeHeader;
 
 typedef struct{
@@ -256,4 +309,16 @@ typedef struct{
     uint8_t  state[1];
 } CommsResponseRapidSaveTreeNodeState;
 
+// One piece of a node state, size bytes of it from offset on follow.
+typedef struct{
+    uint8_t  queue;
+    uint8_t  reserved1;
+    uint16_t reserved2;
+    int32_t  job_id;
+    SHA1_HASH_TYPE hash;
+    uint32_t size;
+    uint64_t state_size;
+    uint64_t offset;
+} CommsResponseRapidSaveTreeStateMsg;
+
 #endif
@@ -46,10 +46,14 @@ typedef uint8_t MESSAGE_TYPE;
 #define MSG_REQUEST_JOB_PURGE  (MSG_RESERVED+4)
 #define MSG_REQUEST_JOB_REPORT (MSG_RESERVED+5)
 #define MSG_REQUEST_QUIT       (MSG_RESERVED+6)
+#define MSG_REQUEST_JOB_BATCH    (MSG_RESERVED+7)
+#define MSG_REQUEST_JOB_TEMPLATE (MSG_RESERVED+8)
+#define MSG_REQUEST_RST_STATE    (MSG_RESERVED+9)
 
 #define MSG_RESPONSE_CONFIG    (MSG_RESERVED+10)
 #define MSG_RESPONSE_REPORT    (MSG_RESERVED+11)
 #define MSG_RESPONSE_RST       (MSG_RESERVED+12)
+#define MSG_RESPONSE_RST_STATE (MSG_RESERVED+13)
 
 typedef uint8_t JOB_ADD_TYPE;
 
@@ -61,14 +65,29 @@ typedef uint8_t JOB_ADD_TYPE;
 #define JOB_ADD_EXIT_EXCEPTION  (JOB_ADD_RESERVED+5)
 #define JOB_ADD_TIMEOUT         (JOB_ADD_RESERVED+6)
 #define JOB_ADD_STREAM          (JOB_ADD_RESERVED+7)
+#define JOB_ADD_REPORT_MASK     (JOB_ADD_RESERVED+8)
 
 typedef uint8_t JOB_FLAG_TYPE;
 
 #define JOB_FLAG_CONTINUE       (1<<0)
 #define JOB_FLAG_FORCE_SAVE     (1<<1)
 #define JOB_FLAG_NO_EXECUTE     (1<<2)
+#define JOB_FLAG_TEMPLATE       (1<<3)
+#define JOB_FLAG_MERGE          (1<<4)
 
-typedef uint8_t JOB_REPORT_TYPE;
+// Set in a job report when the job stopped on a state that was already
+// known, the report's hash is that state.
+typedef uint8_t JOB_RESULT_TYPE;
+
+#define JOB_RESULT_MERGED       (1<<0)
+
+// Node states follow the tree in MSG_RESPONSE_RST_STATE messages
+// unless the request asks for the tree alone.
+typedef uint8_t RST_FLAG_TYPE;
+
+#define RST_FLAG_NO_STATES      (1<<0)
+
+typedef uint16_t JOB_REPORT_TYPE;
 
 #define JOB_REPORT_PROCESSOR           (1<<0)
 #define JOB_REPORT_REGISTER            (1<<1)
@@ -78,6 +97,26 @@ typedef uint8_t JOB_REPORT_TYPE;
 #define JOB_REPORT_ALL_VIRTUAL_MEMORY  (1<<5)
 #define JOB_REPORT_ERROR               (1<<6)
 #define JOB_REPORT_EXCEPTION           (1<<7)
+#define JOB_REPORT_COVERAGE            (1<<8)
+#define JOB_REPORT_ENCODED_MEMORY      (1<<9)
+#define JOB_REPORT_STATS               (1<<10)
+
+// Values of a JOB_REPORT_STATS entry. These are the totals of the
+// instance so far, not of the one job. First comes a sample count and a
+// total in nanoseconds for each phase: queue wait, load, block restore,
+// execute, capture, hash, write, report and send. The counters follow.
+#define JOB_STATS_NUM_PHASES           (9)
+
+#define JOB_STATS_JOBS                 (0)
+#define JOB_STATS_MERGED_JOBS          (1)
+#define JOB_STATS_REF_CACHE_HITS       (2)
+#define JOB_STATS_REF_CACHE_MISSES     (3)
+#define JOB_STATS_BYTES_RESTORED       (4)
+#define JOB_STATS_BYTES_WRITTEN        (5)
+#define JOB_STATS_BYTES_SENT           (6)
+#define JOB_STATS_NUM_COUNTERS         (7)
+
+#define JOB_STATS_NUM_VALUES           (JOB_STATS_NUM_PHASES * 2 + JOB_STATS_NUM_COUNTERS)
 
 typedef uint64_t CONFIG_VALID_SETTINGS;
 
@@ -94,6 +133,15 @@ typedef uint8_t MEMORY_FLAGS;
 #define MEMORY_VIRTUAL  (1)
 #define MEMORY_PHYSICAL (2)
 
+// How the value of a memory report entry stands for its length bytes
+// of memory. Entries other than raw are only sent when the report asks
+// for JOB_REPORT_ENCODED_MEMORY.
+typedef uint8_t MEMORY_ENCODING_TYPE;
+
+#define MEMORY_ENCODING_RAW    (0) // value is the memory itself
+#define MEMORY_ENCODING_FILL   (1) // every byte is value[0]
+#define MEMORY_ENCODING_XBZRLE (2) // XBZRLE diff of one page against the base
+
 typedef uint8_t QUIT_ACTION_TYPE;
 
 #define QUIT_RESERVED     (70)
@@ -17,28 +17,296 @@
  */
 
 #include "qemu-memory-channel.h"
+#include "rsave-hash.h"
 #include "qapi/qmp/qpointer.h"
 #include "qemu/error-report.h"
+#include "qemu/thread.h"
 #include "cromulence/debug.h"
 
+#include <sys/mman.h>
+#include <zlib.h>
+
 #define MAX_IOV_SIZE      (262144)
 #define MAX_IOVS_IN_CHUNK (40)
 
+// Sections that fit in the zlib window are compressed against the first
+// copy of the same section, which is usually most of what a device's
+// state still looks like further down a trace.
+#define MAX_DICT_SIZE     (32768)
+
+// Kept for as long as a block is compressed against it.
+typedef struct MemoryChannelDict {
+    char *name;
+    unsigned int refs;
+    uint8_t *data;
+    size_t size;
+} MemoryChannelDict;
+
+// A stretch of a packed channel, shared by every channel holding the
+// same bytes.
+struct MemoryChannelBlock {
+    SHA1_HASH_TYPE hash;
+    unsigned int refs;
+    size_t size;
+    size_t packed_size;
+    bool compressed;
+    MemoryChannelDict *dict;
+    uint8_t *data;
+};
+
+// The lock covers the pool and the packed blocks. Channels are finalized
+// wherever their last reference goes, not only on the vCPU.
 typedef struct MemoryChannelGlobalState{
+    QemuMutex lock;
     QList *pool_allocations;
     size_t pool_limit;
     size_t pool_size;
     size_t pool_used;
+    GHashTable *blocks;
+    GHashTable *dicts;
+    size_t packed_used;
+    z_stream deflate_stream;
+    z_stream inflate_stream;
+    uint8_t *compare_buf;
 } MemoryChannelGlobalState;
 
 static MemoryChannelGlobalState *global_mc = NULL;
 
+// ************************************************************* //
+// **********              Packed Blocks              ********** //
+// ************************************************************* //
+
+static guint block_hash_func(gconstpointer key)
+{
+    // The key is already a content hash so any part of it will do.
+    return *(const guint *)key;
+}
+
+static gboolean block_hash_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, sizeof(SHA1_HASH_TYPE));
+}
+
+static void free_dict(gpointer data)
+{
+    MemoryChannelDict *dict = data;
+
+    global_mc->packed_used -= dict->size;
+    g_free(dict->name);
+    g_free(dict->data);
+    g_free(dict);
+}
+
+static void release_dict(MemoryChannelDict *dict)
+{
+    if (dict->refs && --dict->refs) {
+        return;
+    }
+
+    // The next copy of the section becomes its dictionary.
+    g_hash_table_remove(global_mc->dicts, dict->name);
+}
+
+static MemoryChannelDict *get_section_dict(const char *name, const uint8_t *buf, size_t size)
+{
+    MemoryChannelDict *dict;
+
+    if (!name || size > MAX_DICT_SIZE) {
+        return NULL;
+    }
+
+    dict = g_hash_table_lookup(global_mc->dicts, name);
+    if (!dict) {
+        // The first copy of a section becomes its dictionary while
+        // blocks compressed against it are around.
+        dict = g_new0(MemoryChannelDict, 1);
+        dict->name = g_strdup(name);
+        dict->data = g_memdup(buf, size);
+        dict->size = size;
+        g_hash_table_insert(global_mc->dicts, dict->name, dict);
+        global_mc->packed_used += size;
+    }
+
+    return dict;
+}
+
+static bool deflate_block(MemoryChannelBlock *block, const uint8_t *buf)
+{
+    z_stream *stream = &global_mc->deflate_stream;
+
+    if (deflateReset(stream) != Z_OK) {
+        return false;
+    }
+
+    if (block->dict && deflateSetDictionary(stream, block->dict->data, block->dict->size) != Z_OK) {
+        return false;
+    }
+
+    // Only keep the compressed copy if it is smaller.
+    stream->next_in = (uint8_t *)buf;
+    stream->avail_in = block->size;
+    stream->next_out = block->data;
+    stream->avail_out = block->size;
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+        return false;
+    }
+
+    block->packed_size = block->size - stream->avail_out;
+    return true;
+}
+
+static bool unpack_block(z_stream *stream, const MemoryChannelBlock *block, uint8_t *buf)
+{
+    int ret;
+
+    if (!block->compressed) {
+        memcpy(buf, block->data, block->size);
+        return true;
+    }
+
+    if (inflateReset(stream) != Z_OK) {
+        return false;
+    }
+
+    stream->next_in = block->data;
+    stream->avail_in = block->packed_size;
+    stream->next_out = buf;
+    stream->avail_out = block->size;
+
+    ret = inflate(stream, Z_FINISH);
+    if (ret == Z_NEED_DICT && block->dict) {
+        if (inflateSetDictionary(stream, block->dict->data, block->dict->size) != Z_OK) {
+            return false;
+        }
+        ret = inflate(stream, Z_FINISH);
+    }
+
+    return ret == Z_STREAM_END && stream->avail_out == 0;
+}
+
+// The hash only finds a candidate, the bytes decide. Under the fast
+// hash two sections colliding would otherwise swap one for the other.
+static bool block_matches(const MemoryChannelBlock *block, const uint8_t *buf, size_t size)
+{
+    if (block->size != size) {
+        return false;
+    }
+
+    if (!block->compressed) {
+        return !memcmp(block->data, buf, size);
+    }
+
+    return unpack_block(&global_mc->inflate_stream, block, global_mc->compare_buf) &&
+           !memcmp(global_mc->compare_buf, buf, size);
+}
+
+static MemoryChannelBlock *pack_block(const uint8_t *buf, size_t size, MemoryChannelDict *dict)
+{
+    MemoryChannelBlock *block;
+    SHA1_HASH_TYPE hash;
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = size };
+    bool shared;
+
+    // Identical stretches are stored once, whichever channel they came from.
+    rsave_hash_iov(&iov, 1, &hash);
+    block = g_hash_table_lookup(global_mc->blocks, hash);
+    if (block && block_matches(block, buf, size)) {
+        block->refs++;
+        return block;
+    }
+    shared = !block;
+
+    block = g_new0(MemoryChannelBlock, 1);
+    memcpy(block->hash, hash, sizeof(SHA1_HASH_TYPE));
+    block->refs = 1;
+    block->size = size;
+    block->dict = dict;
+    block->data = g_malloc(size);
+
+    block->compressed = deflate_block(block, buf);
+    if (block->compressed) {
+        block->data = g_realloc(block->data, block->packed_size);
+    } else {
+        memcpy(block->data, buf, size);
+        block->packed_size = size;
+        block->dict = NULL;
+    }
+
+    if (block->dict) {
+        block->dict->refs++;
+    }
+
+    global_mc->packed_used += block->packed_size;
+
+    // A block whose hash is taken by different bytes is simply not shared.
+    if (shared) {
+        g_hash_table_insert(global_mc->blocks, block->hash, block);
+    }
+
+    return block;
+}
+
+static void release_block(MemoryChannelBlock *block)
+{
+    if (--block->refs) {
+        return;
+    }
+
+    if (g_hash_table_lookup(global_mc->blocks, block->hash) == block) {
+        g_hash_table_remove(global_mc->blocks, block->hash);
+    }
+
+    if (block->dict) {
+        release_dict(block->dict);
+    }
+
+    global_mc->packed_used -= block->packed_size;
+    g_free(block->data);
+    g_free(block);
+}
+
+static void write_packed_to_file(MemoryChannel *mc, FILE *fd)
+{
+    z_stream stream = { 0 };
+    uint8_t *buf;
+
+    if (inflateInit(&stream) != Z_OK) {
+        error_report("%s: failed to set up decompression @ line %d\n", __func__, __LINE__);
+        return;
+    }
+
+    buf = g_malloc(MAX_IOV_SIZE);
+    for (size_t i = 0; i < mc->num_blocks; i++)
+    {
+        MemoryChannelBlock *block = mc->blocks[i];
+
+        if (!block->compressed) {
+            fwrite(block->data, sizeof(uint8_t), block->size, fd);
+        } else if (unpack_block(&stream, block, buf)) {
+            fwrite(buf, sizeof(uint8_t), block->size, fd);
+        } else {
+            error_report("%s: failed to unpack block @ line %d\n", __func__, __LINE__);
+            break;
+        }
+    }
+
+    g_free(buf);
+    inflateEnd(&stream);
+}
+
 // ************************************************************* //
 // **********       Memory Channel Class Setup        ********** //
 // ************************************************************* //
 
 static void qemu_memory_channel_write_to_file(MemoryChannel *mc, FILE *fd)
 {
+    // Packed channels are written straight from their blocks. This also
+    // runs on the vmstate writer thread, so it must not touch the pool.
+    if (mc->blocks) {
+        write_packed_to_file(mc, fd);
+        return;
+    }
+
     // Loop over the nodes and dump data to the file
     for (size_t i = 0; i < mc->main_iovs; ++i)
     {
@@ -72,6 +340,7 @@ static void add_iovs(MemoryChannel *mc, size_t new_iovs)
 
     // Split our iov allocations in chunks
     // This will speed up allocation and improve cache efficiency
+    qemu_mutex_lock(&global_mc->lock);
     for(int chunk = 0; chunk < num_chunks; chunk++)
     {
         QPointer *iov_qptr = NULL;
@@ -97,6 +366,20 @@ static void add_iovs(MemoryChannel *mc, size_t new_iovs)
             error_report("%s: failed to allocate iov @ line %d\n", __func__, __LINE__);
         }
     }
+    qemu_mutex_unlock(&global_mc->lock);
+}
+
+static void return_allocations(MemoryChannel *mc)
+{
+    QObject *qptr;
+
+    // Hand our raw allocations back to the free pool.
+    qemu_mutex_lock(&global_mc->lock);
+    while ((qptr = qlist_pop(mc->used_allocations))) {
+        qlist_append_obj(global_mc->pool_allocations, qptr);
+        global_mc->pool_used -= MAX_IOVS_IN_CHUNK * MAX_IOV_SIZE;
+    }
+    qemu_mutex_unlock(&global_mc->lock);
 }
 
 static size_t add_meta_memory(MemoryChannel *mc, size_t added_size)
@@ -168,8 +451,206 @@ static size_t set_main_memory(MemoryChannel *mc, size_t new_size)
     return new_num_iovs;
 }
 
+// Hands the iovs of a packed channel back to the pool, main_size is kept.
+static void drop_unpacked(MemoryChannel *mc)
+{
+    return_allocations(mc);
+    qemu_iovec_reset(&mc->iov_list);
+    mc->main_iovs = 0;
+    mc->meta_size = 0;
+    mc->meta_iovs = 0;
+    mc->iov_pos = 0;
+}
+
+// Copies out of the packed blocks without unpacking the channel into
+// the pool. Nearby reads land in the same block, so the last one
+// inflated is kept.
+static ssize_t read_packed(MemoryChannel *mc, uint8_t *buf, int64_t pos, size_t size)
+{
+    z_stream stream = { 0 };
+    bool stream_ready = false;
+    size_t lo = 0, hi = mc->num_blocks;
+    size_t total = 0;
+
+    // Find the block holding pos.
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (mc->block_starts[mid] <= pos) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    qemu_mutex_lock(&mc->block_lock);
+    for (size_t i = lo; i < mc->num_blocks && total < size; i++)
+    {
+        MemoryChannelBlock *block = mc->blocks[i];
+        size_t skip = pos + total - mc->block_starts[i];
+        size_t len = MIN(block->size - skip, size - total);
+
+        if (!block->compressed) {
+            memcpy(&buf[total], &block->data[skip], len);
+        } else {
+            if (mc->block_buf_index != i) {
+                if (!stream_ready) {
+                    if (inflateInit(&stream) != Z_OK) {
+                        error_report("%s: failed to set up decompression @ line %d\n", __func__, __LINE__);
+                        break;
+                    }
+                    stream_ready = true;
+                }
+                if (!mc->block_buf) {
+                    mc->block_buf = g_malloc(MAX_IOV_SIZE);
+                }
+                if (!unpack_block(&stream, block, mc->block_buf)) {
+                    error_report("%s: failed to unpack block @ line %d\n", __func__, __LINE__);
+                    mc->block_buf_index = SIZE_MAX;
+                    break;
+                }
+                mc->block_buf_index = i;
+            }
+            memcpy(&buf[total], &mc->block_buf[skip], len);
+        }
+
+        total += len;
+    }
+    qemu_mutex_unlock(&mc->block_lock);
+
+    if (stream_ready) {
+        inflateEnd(&stream);
+    }
+
+    return total ? total : -EIO;
+}
+
+static bool unpack_channel(MemoryChannel *mc)
+{
+    z_stream stream = { 0 };
+    uint8_t *buf;
+    size_t offset = 0;
+    bool ok = true;
+
+    // Nothing to do unless the state only lives in blocks.
+    if (!mc->blocks || mc->main_iovs) {
+        return true;
+    }
+
+    if (inflateInit(&stream) != Z_OK) {
+        error_report("%s: failed to set up decompression @ line %d\n", __func__, __LINE__);
+        return false;
+    }
+
+    // Bring the iovs back from the pool on the usual MAX_IOV_SIZE grid.
+    set_main_memory(mc, mc->main_size);
+    while (offset < mc->main_size)
+    {
+        size_t iov_len = MIN(mc->main_size - offset, MAX_IOV_SIZE);
+        mc->iov_list.iov[mc->main_iovs++].iov_len = iov_len;
+        offset += iov_len;
+    }
+
+    // The blocks stay with the channel, they are what gets written out.
+    buf = g_malloc(MAX_IOV_SIZE);
+    offset = 0;
+    for (size_t i = 0; i < mc->num_blocks; i++)
+    {
+        if (!unpack_block(&stream, mc->blocks[i], buf)) {
+            error_report("%s: failed to unpack block @ line %d\n", __func__, __LINE__);
+            ok = false;
+            break;
+        }
+        iov_from_buf(mc->iov_list.iov, mc->main_iovs, offset, buf, mc->blocks[i]->size);
+        offset += mc->blocks[i]->size;
+    }
+
+    g_free(buf);
+    inflateEnd(&stream);
+    return ok;
+}
+
+static int compare_section_offset(const void *a, const void *b)
+{
+    const MemoryChannelSection *sa = a;
+    const MemoryChannelSection *sb = b;
+
+    return (sa->offset > sb->offset) - (sa->offset < sb->offset);
+}
+
+static void qemu_memory_channel_pack(MemoryChannel *mc, const MemoryChannelSection *sections, size_t num_sections)
+{
+    MemoryChannelSection *bounds;
+    GPtrArray *blocks;
+    uint8_t *buf;
+    size_t num_bounds = 0;
+
+    // Mapped channels never used the pool, packed ones are done already.
+    if (mc->mapped_base || mc->blocks || !mc->main_size) {
+        return;
+    }
+
+    // The stream header ahead of the first section is packed as an
+    // unnamed section of its own.
+    bounds = g_new(MemoryChannelSection, num_sections + 1);
+    bounds[num_bounds].name = NULL;
+    bounds[num_bounds++].offset = 0;
+    for (size_t i = 0; i < num_sections; i++)
+    {
+        if (sections[i].offset < mc->main_size) {
+            bounds[num_bounds++] = sections[i];
+        }
+    }
+    qsort(bounds, num_bounds, sizeof(MemoryChannelSection), compare_section_offset);
+
+    blocks = g_ptr_array_new();
+    buf = g_malloc(MAX_IOV_SIZE);
+    qemu_mutex_lock(&global_mc->lock);
+    for (size_t i = 0; i < num_bounds; i++)
+    {
+        size_t end = (i + 1 < num_bounds) ? bounds[i + 1].offset : mc->main_size;
+        size_t pos = bounds[i].offset;
+
+        // Long sections (RAM) are packed an iov's worth at a time.
+        while (pos < end)
+        {
+            size_t len = MIN(end - pos, MAX_IOV_SIZE);
+            MemoryChannelDict *dict;
+
+            iov_to_buf(mc->iov_list.iov, mc->main_iovs, pos, buf, len);
+            dict = get_section_dict(bounds[i].name, buf, len);
+            g_ptr_array_add(blocks, pack_block(buf, len, dict));
+
+            // Nothing was compressed against a new dictionary.
+            if (dict && !dict->refs) {
+                release_dict(dict);
+            }
+            pos += len;
+        }
+    }
+    qemu_mutex_unlock(&global_mc->lock);
+    g_free(buf);
+    g_free(bounds);
+
+    mc->num_blocks = blocks->len;
+    mc->blocks = (MemoryChannelBlock **) g_ptr_array_free(blocks, false);
+    mc->block_starts = g_new(size_t, mc->num_blocks);
+    for (size_t i = 0, start = 0; i < mc->num_blocks; i++) {
+        mc->block_starts[i] = start;
+        start += mc->blocks[i]->size;
+    }
+
+    // The blocks hold the state now, the iovs go back to the pool until
+    // someone reads the state again.
+    drop_unpacked(mc);
+}
+
 static void qemu_memory_channel_read_from_file(MemoryChannel *mc, FILE *file, size_t image_size)
 {
+    if (mc->mapped_base || mc->blocks) {
+        error_report("%s: cannot read into a mapped channel @ line %d\n", __func__, __LINE__);
+        return;
+    }
+
     // Allocate enough iovs to handle our image_size
     set_main_memory(mc, image_size);
 
@@ -207,6 +688,56 @@ static void qemu_memory_channel_read_from_file(MemoryChannel *mc, FILE *file, si
     } while(mc->main_size < image_size);
 }
 
+static bool qemu_memory_channel_map_from_file(MemoryChannel *mc, FILE *file, size_t image_size)
+{
+    long file_pos;
+    size_t map_offset;
+    uint8_t *image_base;
+
+    // Only a fresh channel can become a view onto the file.
+    if (mc->mapped_base || mc->blocks || mc->iov_list.niov || !image_size) {
+        return false;
+    }
+
+    // Anything still buffered by stdio has to reach the file before it is mapped.
+    fflush(file);
+    file_pos = ftell(file);
+    if (file_pos < 0) {
+        return false;
+    }
+
+    // The mapping has to start on a page boundary.
+    map_offset = file_pos & (qemu_real_host_page_size - 1);
+    mc->mapped_len = map_offset + image_size;
+    mc->mapped_base = mmap(NULL, mc->mapped_len, PROT_READ, MAP_SHARED, fileno(file), file_pos - map_offset);
+    if (mc->mapped_base == MAP_FAILED) {
+        mc->mapped_base = NULL;
+        mc->mapped_len = 0;
+        return false;
+    }
+    image_base = (uint8_t *)mc->mapped_base + map_offset;
+
+    // Lay the iovs over the mapping on the same MAX_IOV_SIZE grid that
+    // get_buffer expects. None of this comes from the pool.
+    mc->meta_size = 0;
+    mc->meta_iovs = 0;
+    mc->main_iovs = 0;
+    mc->main_size = 0;
+    mc->iov_pos = 0;
+    while (mc->main_size < image_size)
+    {
+        size_t iov_len = MIN(image_size - mc->main_size, MAX_IOV_SIZE);
+        qemu_iovec_add(&mc->iov_list, &image_base[mc->main_size], iov_len);
+        mc->main_size += iov_len;
+        mc->main_iovs++;
+    }
+
+    // Leave the file where a read would have.
+    fseek(file, file_pos + image_size, SEEK_SET);
+
+    return true;
+}
+
 static void qemu_memory_channel_remove_meta(MemoryChannel *mc)
 {
     mc->meta_size = 0;
@@ -215,6 +746,11 @@ static void qemu_memory_channel_remove_meta(MemoryChannel *mc)
 
 static void qemu_memory_channel_add_meta(MemoryChannel *mc, void *buf, size_t size)
 {
+    // Meta data goes after the main iovs, so they have to be there.
+    if (!unpack_channel(mc)) {
+        return;
+    }
+
     // Allocate enough iovs to handle our meta data size
     size_t size_in_iov = add_meta_memory(mc, size);
 
@@ -236,6 +772,7 @@ static void qemu_memory_channel_add_meta(MemoryChannel *mc, void *buf, size_t si
 
 static size_t qemu_memory_channel_get_stream(MemoryChannel *mc, QEMUIOVector **qiov)
 {
+    unpack_channel(mc);
     *qiov = &mc->iov_list;
     return (mc->main_iovs + mc->meta_iovs);
 }
@@ -245,6 +782,29 @@ static size_t qemu_memory_channel_get_size(MemoryChannel *mc)
     return mc->main_size;
 }
 
+// The pool memory the channel holds, with an even share of the packed
+// blocks it has in common with other channels and the block it keeps
+// inflated for reading. Mapped states live in the page cache and don't
+// count.
+static size_t qemu_memory_channel_get_footprint(MemoryChannel *mc)
+{
+    size_t footprint = qlist_size(mc->used_allocations) * MAX_IOVS_IN_CHUNK * MAX_IOV_SIZE;
+
+    qemu_mutex_lock(&global_mc->lock);
+    for (size_t i = 0; i < mc->num_blocks; i++) {
+        footprint += mc->blocks[i]->packed_size / mc->blocks[i]->refs;
+    }
+    qemu_mutex_unlock(&global_mc->lock);
+
+    qemu_mutex_lock(&mc->block_lock);
+    if (mc->block_buf) {
+        footprint += MAX_IOV_SIZE;
+    }
+    qemu_mutex_unlock(&mc->block_lock);
+
+    return footprint;
+}
+
 // ************************************************************* //
 // **********             I/O Operations              ********** //
 // ************************************************************* //
@@ -267,6 +827,15 @@ static ssize_t qemu_memory_channel_get_buffer(void *opaque,
     MemoryChannel *mc = MEMORY_CHANNEL(opaque);
     size_t total_copied = 0;
 
+    // Packed channels are read from their blocks, unless the whole
+    // stream was asked for and they were unpacked already.
+    if (mc->blocks && !mc->main_iovs) {
+        if (pos < 0 || pos >= mc->main_size) {
+            return 0;
+        }
+        return read_packed(mc, buf, pos, MIN(size, mc->main_size - pos));
+    }
+
     // Find the respective iov and offset for this pos
     size_t offset = qemu_memory_channel_find_offset(mc, pos);
 
@@ -286,6 +855,24 @@ static ssize_t qemu_memory_channel_get_buffer(void *opaque,
     return total_copied;
 }
 
+// Copies part of the state for readers other than the one loading it.
+// This neither moves iov_pos nor unpacks into the pool. Channels are
+// packed before they go into the tree and keep their blocks from then
+// on, so whichever form is read here stays put while it is read.
+static ssize_t qemu_memory_channel_read_state(MemoryChannel *mc, uint8_t *buf, int64_t pos, size_t size)
+{
+    if (pos < 0 || pos >= mc->main_size) {
+        return 0;
+    }
+    size = MIN(size, mc->main_size - pos);
+
+    if (!mc->blocks) {
+        return iov_to_buf(mc->iov_list.iov, mc->main_iovs, pos, buf, size);
+    }
+
+    return read_packed(mc, buf, pos, size);
+}
+
 static ssize_t qemu_memory_channel_writev_buffer(void *opaque,
                                             struct iovec *iov,
                                             int iovcnt,
@@ -293,6 +880,18 @@ static ssize_t qemu_memory_channel_writev_buffer(void *opaque,
 {
     MemoryChannel *mc = MEMORY_CHANNEL(opaque);
 
+    // Mapped channels are a read-only view of the vmstate file.
+    if (mc->mapped_base) {
+        error_report("%s: cannot write to a mapped channel @ line %d\n", __func__, __LINE__);
+        return -EROFS;
+    }
+
+    // Packed blocks may be shared with other channels.
+    if (mc->blocks) {
+        error_report("%s: cannot write to a packed channel @ line %d\n", __func__, __LINE__);
+        return -EROFS;
+    }
+
     // This needs to be a direct copy instead...
 
     // Meta data is not preserved
@@ -363,6 +962,19 @@ static int qemu_memory_channel_close(void *opaque)
     // don't read, close, write.
     mc->iov_pos = 0;
 
+    // A packed channel is only unpacked for the reader, the blocks
+    // still hold the state. Keeping both would count it twice.
+    if (mc->blocks) {
+        if (mc->main_iovs) {
+            drop_unpacked(mc);
+        }
+        qemu_mutex_lock(&mc->block_lock);
+        g_free(mc->block_buf);
+        mc->block_buf = NULL;
+        mc->block_buf_index = SIZE_MAX;
+        qemu_mutex_unlock(&mc->block_lock);
+    }
+
     return 0;
 }
 
@@ -399,31 +1011,56 @@ static void memory_channel_initfn(Object *obj)
     mc->meta_iovs = 0;
     // The total size of meta data in the iov_list
     mc->meta_size = 0;
+    // The file mapping backing the main iovs, if any
+    mc->mapped_base = NULL;
+    mc->mapped_len = 0;
+    // The shared blocks holding a packed channel, if any
+    mc->blocks = NULL;
+    mc->num_blocks = 0;
+    mc->block_starts = NULL;
+    qemu_mutex_init(&mc->block_lock);
+    mc->block_buf = NULL;
+    mc->block_buf_index = SIZE_MAX;
 }
 
 static void memory_channel_finalize(Object *obj)
 {
-    QListEntry *e;
-
     // Capture the MC object
     MemoryChannel *mc = MEMORY_CHANNEL(obj);
 
-    // Inc the refcount for the qpointers and assign to the free pool.
-    QLIST_FOREACH_ENTRY(mc->used_allocations, e){
-        QPointer *qptr = qobject_to(QPointer, qlist_entry_obj(e));
-        qobject_ref(qptr);
-        qlist_append(global_mc->pool_allocations, qptr);
-        global_mc->pool_used -= MAX_IOVS_IN_CHUNK * MAX_IOV_SIZE;
+    // Assign our allocations back to the free pool.
+    return_allocations(mc);
+
+    // Drop our share of the packed blocks.
+    qemu_mutex_lock(&global_mc->lock);
+    for (size_t i = 0; i < mc->num_blocks; i++) {
+        release_block(mc->blocks[i]);
     }
+    qemu_mutex_unlock(&global_mc->lock);
+    g_free(mc->blocks);
+    mc->blocks = NULL;
+    mc->num_blocks = 0;
+    g_free(mc->block_starts);
+    mc->block_starts = NULL;
+    g_free(mc->block_buf);
+    mc->block_buf = NULL;
+    qemu_mutex_destroy(&mc->block_lock);
 
     // Dec the refcount because we're not using the pool anymore.
     qobject_unref(global_mc->pool_allocations);
 
-    // This will free all the entries but not the qpointers...
+    // The allocations are back in the pool, this only frees the list.
     qobject_unref(mc->used_allocations);
 
     qemu_iovec_destroy(&mc->iov_list);
 
+    // Drop the view of the file
+    if (mc->mapped_base) {
+        munmap(mc->mapped_base, mc->mapped_len);
+        mc->mapped_base = NULL;
+        mc->mapped_len = 0;
+    }
+
     // reset everything
     mc->meta_iovs = 0;
     mc->meta_size = 0;
@@ -438,11 +1075,15 @@ static void memory_channel_class_init(ObjectClass *klass,
     MemoryChannelClass *mc_klass = MEMORY_CHANNEL_CLASS(klass);
     mc_klass->write_to_file = qemu_memory_channel_write_to_file;
     mc_klass->read_from_file = qemu_memory_channel_read_from_file;
+    mc_klass->map_from_file = qemu_memory_channel_map_from_file;
+    mc_klass->pack = qemu_memory_channel_pack;
     mc_klass->remove_meta = qemu_memory_channel_remove_meta;
     mc_klass->add_meta = qemu_memory_channel_add_meta;
     mc_klass->get_stream = qemu_memory_channel_get_stream;
     mc_klass->get_buffer = qemu_memory_channel_get_buffer;
+    mc_klass->read_state = qemu_memory_channel_read_state;
     mc_klass->get_size = qemu_memory_channel_get_size;
+    mc_klass->get_footprint = qemu_memory_channel_get_footprint;
     mc_klass->writev_buffer = qemu_memory_channel_writev_buffer;
     mc_klass->close = qemu_memory_channel_close;
 }
@@ -484,10 +1125,21 @@ void memory_channel_alloc_pool(size_t pool_size, size_t pool_limit)
 {
     if( !global_mc ) {
         global_mc = g_new0(MemoryChannelGlobalState, 1);
+        qemu_mutex_init(&global_mc->lock);
         global_mc->pool_allocations = qlist_new();
         global_mc->pool_limit = pool_limit;
         global_mc->pool_size = 0;
         global_mc->pool_used = 0;
+        global_mc->blocks = g_hash_table_new(block_hash_func, block_hash_equal);
+        global_mc->dicts = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_dict);
+        global_mc->packed_used = 0;
+        if (deflateInit(&global_mc->deflate_stream, Z_BEST_SPEED) != Z_OK) {
+            error_report("%s: failed to set up compression @ line %d\n", __func__, __LINE__);
+        }
+        if (inflateInit(&global_mc->inflate_stream) != Z_OK) {
+            error_report("%s: failed to set up decompression @ line %d\n", __func__, __LINE__);
+        }
+        global_mc->compare_buf = g_malloc(MAX_IOV_SIZE);
 
         allocate_chunks(pool_size);
     }
@@ -497,6 +1149,12 @@ void memory_channel_free_pool(void)
 {
     if( global_mc ){
         qobject_unref(global_mc->pool_allocations);
+        g_hash_table_destroy(global_mc->blocks);
+        g_hash_table_destroy(global_mc->dicts);
+        deflateEnd(&global_mc->deflate_stream);
+        inflateEnd(&global_mc->inflate_stream);
+        g_free(global_mc->compare_buf);
+        qemu_mutex_destroy(&global_mc->lock);
         g_free(global_mc);
         global_mc = NULL;
     }
@@ -504,10 +1162,12 @@ void memory_channel_free_pool(void)
 
 bool memory_channel_test_and_set_pool_limit(void)
 {
-    if( global_mc->pool_limit != 0 && global_mc->pool_used > global_mc->pool_limit )
-    {
-        return true;
-    }
+    bool over;
+
+    // Packed blocks count against the limit as well.
+    qemu_mutex_lock(&global_mc->lock);
+    over = global_mc->pool_limit != 0 && global_mc->pool_used + global_mc->packed_used > global_mc->pool_limit;
+    qemu_mutex_unlock(&global_mc->lock);
 
-    return false;
+    return over;
 }
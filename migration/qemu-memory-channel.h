@@ -30,6 +30,7 @@
 #include "qom/object.h"
 #include "qemu-file.h"
 #include "qemu/iov.h"
+#include "qemu/thread.h"
 #include "qapi/qmp/qlist.h"
 
 // ************************************************************* //
@@ -47,6 +48,13 @@
 
 typedef struct MemoryChannel MemoryChannel;
 typedef struct MemoryChannelClass MemoryChannelClass;
+typedef struct MemoryChannelBlock MemoryChannelBlock;
+
+// Where a named section (a device's state) starts in the channel.
+typedef struct MemoryChannelSection {
+    const char *name;
+    size_t offset;
+} MemoryChannelSection;
 
 struct MemoryChannel {
     Object obj;
@@ -57,17 +65,31 @@ struct MemoryChannel {
     size_t meta_size;
     size_t meta_iovs;
     int64_t iov_pos;
+    void *mapped_base;
+    size_t mapped_len;
+    MemoryChannelBlock **blocks;
+    size_t num_blocks;
+    size_t *block_starts;
+    // Packed channels are read a block at a time, the last block
+    // inflated is kept until the channel is closed.
+    QemuMutex block_lock;
+    uint8_t *block_buf;
+    size_t block_buf_index;
 };
 
 struct MemoryChannelClass {
     ObjectClass parent;
     void (*write_to_file)(MemoryChannel *mc, FILE *fp);
     void (*read_from_file)(MemoryChannel *mc, FILE *fp, size_t image_size);
+    bool (*map_from_file)(MemoryChannel *mc, FILE *fp, size_t image_size);
+    void (*pack)(MemoryChannel *mc, const MemoryChannelSection *sections, size_t num_sections);
     void (*remove_meta)(MemoryChannel *mc);
     void (*add_meta)(MemoryChannel *mc, void *buf, size_t size);
     size_t (*get_stream)(MemoryChannel *mc, QEMUIOVector **qiov);
     size_t (*get_size)(MemoryChannel *mc);
+    size_t (*get_footprint)(MemoryChannel *mc);
     ssize_t (*get_buffer)(void *opaque, uint8_t *buf, int64_t pos, size_t size);
+    ssize_t (*read_state)(MemoryChannel *mc, uint8_t *buf, int64_t pos, size_t size);
     ssize_t (*writev_buffer)(void *opaque, struct iovec *iov, int iovcnt, int64_t pos);
     int (*close)(void *opaque);
 };
@@ -0,0 +1,153 @@
+/*
+ * Rapid Analysis QEMU System Emulator
+ *
+ * Copyright (c) 2020 Cromulence LLC
+ *
+ * Distribution Statement A
+ *
+ * Approved for Public Release, Distribution Unlimited
+ *
+ * Authors:
+ *  Joseph Walker
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The creation of this code was funded by the US Government.
+ */
+
+#include "ra-stats.h"
+#include "qemu/stats64.h"
+#include "qemu/host-utils.h"
+
+// The report entry lists the phases in the order of the QAPI enum.
+QEMU_BUILD_BUG_ON(RAPID_ANALYSIS_PHASE__MAX != JOB_STATS_NUM_PHASES);
+
+typedef struct RapidAnalysisPhaseCounters {
+    Stat64 count;
+    Stat64 total_ns;
+    Stat64 max_ns;
+    Stat64 buckets[RA_STATS_BUCKETS];
+} RapidAnalysisPhaseCounters;
+
+static RapidAnalysisPhaseCounters ra_phases[RAPID_ANALYSIS_PHASE__MAX];
+static Stat64 ra_counters[JOB_STATS_NUM_COUNTERS];
+
+static unsigned int ra_stats_bucket(int64_t ns)
+{
+    uint64_t us = ns / 1000;
+
+    if (us < 2) {
+        return 0;
+    }
+    return MIN(63 - clz64(us), RA_STATS_BUCKETS - 1);
+}
+
+void ra_stats_add_time(RapidAnalysisPhase phase, int64_t ns)
+{
+    RapidAnalysisPhaseCounters *p = &ra_phases[phase];
+
+    // The host clock may step back.
+    if (ns < 0) {
+        ns = 0;
+    }
+
+    stat64_add(&p->count, 1);
+    stat64_add(&p->total_ns, ns);
+    stat64_max(&p->max_ns, ns);
+    stat64_add(&p->buckets[ra_stats_bucket(ns)], 1);
+}
+
+void ra_stats_end(RapidAnalysisPhase phase, int64_t begin)
+{
+    ra_stats_add_time(phase, get_clock() - begin);
+}
+
+void ra_stats_count(unsigned int counter, uint64_t value)
+{
+    stat64_add(&ra_counters[counter], value);
+}
+
+void ra_stats_reset(void)
+{
+    // Samples taken while this runs may be split across the reset.
+    for (int i = 0; i < RAPID_ANALYSIS_PHASE__MAX; i++) {
+        RapidAnalysisPhaseCounters *p = &ra_phases[i];
+
+        stat64_init(&p->count, 0);
+        stat64_init(&p->total_ns, 0);
+        stat64_init(&p->max_ns, 0);
+        for (int b = 0; b < RA_STATS_BUCKETS; b++) {
+            stat64_init(&p->buckets[b], 0);
+        }
+    }
+
+    for (int i = 0; i < JOB_STATS_NUM_COUNTERS; i++) {
+        stat64_init(&ra_counters[i], 0);
+    }
+}
+
+static RapidAnalysisPhaseStats *ra_stats_query_phase(RapidAnalysisPhase phase)
+{
+    RapidAnalysisPhaseCounters *p = &ra_phases[phase];
+    RapidAnalysisPhaseStats *stats = g_new0(RapidAnalysisPhaseStats, 1);
+    uint64List **tail = &stats->histogram;
+    int used = 0;
+
+    stats->phase = phase;
+    stats->count = stat64_get(&p->count);
+    stats->total_ns = stat64_get(&p->total_ns);
+    stats->max_ns = stat64_get(&p->max_ns);
+
+    for (int b = 0; b < RA_STATS_BUCKETS; b++) {
+        if (stat64_get(&p->buckets[b])) {
+            used = b + 1;
+        }
+    }
+
+    for (int b = 0; b < used; b++) {
+        uint64List *entry = g_new0(uint64List, 1);
+
+        entry->value = stat64_get(&p->buckets[b]);
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return stats;
+}
+
+RapidAnalysisStats *ra_stats_query(void)
+{
+    RapidAnalysisStats *stats = g_new0(RapidAnalysisStats, 1);
+    RapidAnalysisPhaseStatsList **tail = &stats->phases;
+
+    stats->jobs = stat64_get(&ra_counters[JOB_STATS_JOBS]);
+    stats->merged_jobs = stat64_get(&ra_counters[JOB_STATS_MERGED_JOBS]);
+    stats->ref_cache_hits = stat64_get(&ra_counters[JOB_STATS_REF_CACHE_HITS]);
+    stats->ref_cache_misses = stat64_get(&ra_counters[JOB_STATS_REF_CACHE_MISSES]);
+    stats->bytes_restored = stat64_get(&ra_counters[JOB_STATS_BYTES_RESTORED]);
+    stats->bytes_written = stat64_get(&ra_counters[JOB_STATS_BYTES_WRITTEN]);
+    stats->bytes_sent = stat64_get(&ra_counters[JOB_STATS_BYTES_SENT]);
+
+    for (int i = 0; i < RAPID_ANALYSIS_PHASE__MAX; i++) {
+        RapidAnalysisPhaseStatsList *entry = g_new0(RapidAnalysisPhaseStatsList, 1);
+
+        entry->value = ra_stats_query_phase(i);
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return stats;
+}
+
+void ra_stats_snapshot(uint64_t values[JOB_STATS_NUM_VALUES])
+{
+    for (int i = 0; i < RAPID_ANALYSIS_PHASE__MAX; i++) {
+        values[i * 2] = stat64_get(&ra_phases[i].count);
+        values[i * 2 + 1] = stat64_get(&ra_phases[i].total_ns);
+    }
+
+    for (int i = 0; i < JOB_STATS_NUM_COUNTERS; i++) {
+        values[JOB_STATS_NUM_PHASES * 2 + i] = stat64_get(&ra_counters[i]);
+    }
+}
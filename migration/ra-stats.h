@@ -0,0 +1,51 @@
+/*
+ * Rapid Analysis QEMU System Emulator
+ *
+ * Copyright (c) 2020 Cromulence LLC
+ *
+ * Distribution Statement A
+ *
+ * Approved for Public Release, Distribution Unlimited
+ *
+ * Authors:
+ *  Joseph Walker
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The creation of this code was funded by the US Government.
+ */
+
+#ifndef RA_STATS_H
+#define RA_STATS_H
+
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "racomms/racomms-types.h"
+#include "qapi/qapi-types-migration.h"
+
+// Histogram buckets are powers of two of microseconds, the last one
+// takes everything from about 8 seconds up.
+#define RA_STATS_BUCKETS (24)
+
+// Phase times and counters are Stat64s, so they can be bumped from the
+// vCPU, the main loop and the vmstate writer without taking a lock of
+// our own. Counters are the JOB_STATS_* values from racomms-types.h.
+static inline int64_t ra_stats_begin(void)
+{
+    return get_clock();
+}
+
+// Adds the time since begin, as returned by ra_stats_begin, to the phase.
+void ra_stats_end(RapidAnalysisPhase phase, int64_t begin);
+void ra_stats_add_time(RapidAnalysisPhase phase, int64_t ns);
+void ra_stats_count(unsigned int counter, uint64_t value);
+
+void ra_stats_reset(void);
+// Fills everything but the node cache, which the vmstate file keeps.
+RapidAnalysisStats *ra_stats_query(void);
+// Sample counts and totals of each phase followed by the counters, in
+// the order of a JOB_REPORT_STATS entry.
+void ra_stats_snapshot(uint64_t values[JOB_STATS_NUM_VALUES]);
+
+#endif
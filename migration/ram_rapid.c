@@ -30,12 +30,14 @@
 #include "qemu-file.h"
 #include "postcopy-ram.h"
 #include "migration/page_cache.h"
+#include "xbzrle.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
 #include "qapi/qapi-events-migration.h"
 #include "qapi/qmp/qerror.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
+#include "exec/exec-all.h"
 #include "exec/target_page.h"
 #include "qemu/rcu_queue.h"
 #include "migration/colo.h"
@@ -329,9 +331,11 @@ void ram_rapid_blocks_cleanup(void)
         g_free(block->rsave_flags);
         g_free(block->rsave_l2_hashes);
         g_free(block->rsave_l1_hashes);
+        g_free(block->rsave_pristine);
         block->rsave_flags = NULL;
         block->rsave_l2_hashes = NULL;
         block->rsave_l1_hashes = NULL;
+        block->rsave_pristine = NULL;
     }
 }
 
@@ -438,149 +442,465 @@ static bool ram_check_section_footer(QEMUFile *f, uint32_t section_id)
     return true;
 }
 
-static void ram_get_reference_page_bytes(
-    RSaveTree *rst,
-    RAMState *rs,
-    RAMBlock *rb,
-    ram_addr_t offset,
-    SHA1_HASH_TYPE ref_hash,
-    uint8_t *host_buf)
+// Reads primitives straight out of a node's memory channel, packed
+// channels stay packed.
+typedef struct RAMRapidStreamCursor {
+    MemoryChannel *mc;
+    MemoryChannelClass *mcc;
+    size_t size;
+    size_t pos;
+} RAMRapidStreamCursor;
+
+static bool ram_cursor_get(RAMRapidStreamCursor *c, void *buf, size_t len)
 {
-    RAMRapidLoadCache *entry;
-    RAMBlock *block;
+    if (c->pos + len > c->size) {
+        return false;
+    }
+    if (len && c->mcc->read_state(c->mc, buf, c->pos, len) != len) {
+        return false;
+    }
+    c->pos += len;
+    return true;
+}
+
+static bool ram_cursor_skip(RAMRapidStreamCursor *c, size_t len)
+{
+    if (c->pos + len > c->size) {
+        return false;
+    }
+    c->pos += len;
+    return true;
+}
+
+static bool ram_cursor_get_byte(RAMRapidStreamCursor *c, uint8_t *v)
+{
+    return ram_cursor_get(c, v, sizeof(uint8_t));
+}
+
+static bool ram_cursor_get_be32(RAMRapidStreamCursor *c, uint32_t *v)
+{
+    uint8_t buf[sizeof(uint32_t)];
+    if (!ram_cursor_get(c, buf, sizeof(buf))) {
+        return false;
+    }
+    *v = ldl_be_p(buf);
+    return true;
+}
+
+static bool ram_cursor_get_be64(RAMRapidStreamCursor *c, uint64_t *v)
+{
+    uint8_t buf[sizeof(uint64_t)];
+    if (!ram_cursor_get(c, buf, sizeof(buf))) {
+        return false;
+    }
+    *v = ldq_be_p(buf);
+    return true;
+}
+
+static bool ram_cursor_get_idstr(RAMRapidStreamCursor *c, char *idstr)
+{
+    uint8_t len;
+    if (!ram_cursor_get_byte(c, &len) || !ram_cursor_get(c, idstr, len)) {
+        return false;
+    }
+    idstr[len] = 0;
+    return true;
+}
+
+static bool ram_cursor_check_footer(RAMRapidStreamCursor *c, uint32_t section_id)
+{
+    uint8_t flags;
+    uint32_t end_sid;
+
+    if (!migrate_get_current()->send_section_footer) {
+        return true;
+    }
+
+    return ram_cursor_get_byte(c, &flags) && flags == QEMU_VM_SECTION_FOOTER &&
+           ram_cursor_get_be32(c, &end_sid) && end_sid == section_id;
+}
+
+static int ram_compare_indexed_page(const void *a, const void *b)
+{
+    const RSaveTreeNodePage *pa = a;
+    const RSaveTreeNodePage *pb = b;
+    return (pa->addr > pb->addr) - (pa->addr < pb->addr);
+}
+
+/**
+ * ram_build_reference_page_index: walk the RAM sections of a node once and
+ * remember where every page it carries lives in the stream.
+ *
+ * Only full and zero pages are indexed since those are the only records
+ * that another state can reference. If the stream can't be understood the
+ * index is left empty and lookups fall back to scanning.
+ *
+ * @node: the node to index
+ */
+static void ram_build_reference_page_index(RSaveTreeNode *node)
+{
+    RAMRapidStreamCursor c;
     VMStateIndexEntry *se;
-    uint8_t *peek_buf;
+    MemoryChannelClass *mcc;
+    RAMBlock *block = NULL;
+    GArray *pages;
     char idstr[UCHAR_MAX+1];
-    int flags;
-    QEMUFile *f = NULL;
-    RSaveTreeNode *node = NULL;
-    RSaveTreeClass *rcc = RSAVE_TREE_GET_CLASS(rst);
+    uint64_t ram_offset = -1;
+    uint64_t total_ram_bytes;
+    uint64_t addr;
+    uint32_t section_id;
+    uint32_t sid;
+    uint32_t version;
+    uint8_t section_type;
+    uint8_t ch;
+    bool ok = false;
 
-    if( rcc->search_ram_cache(rst, offset + rb->offset, ref_hash, host_buf) ){
+    node->page_index_built = true;
+
+    QLIST_FOREACH(se, &node->device_list, next) {
+        if( !strcmp(se->idstr, "ram") ) {
+            ram_offset = se->offset;
+            break;
+        }
+    }
+
+    if( ram_offset == -1 || !node->vm_state ){
         return;
     }
 
-    // Look for this node in our cache of previously loaded states.
-    QSIMPLEQ_FOREACH(entry, &rs->load_cache, next) {
-        if(!memcmp(entry->node->hash, ref_hash, sizeof(SHA1_HASH_TYPE))){
-            f = entry->in;
-            node = entry->node;
-            break;
+    mcc = MEMORY_CHANNEL_GET_CLASS(node->vm_state);
+    c.mc = node->vm_state;
+    c.mcc = mcc;
+    c.size = mcc->get_size(node->vm_state);
+    c.pos = ram_offset;
+
+    pages = g_array_new(false, false, sizeof(RSaveTreeNodePage));
+
+    // The setup section describes the RAM layout and holds no pages.
+    if (!ram_cursor_get_byte(&c, &section_type) || section_type != QEMU_VM_SECTION_START ||
+        !ram_cursor_get_be32(&c, &section_id) ||
+        !ram_cursor_get_idstr(&c, idstr) || strcmp(idstr, "ram") ||
+        !ram_cursor_get_be32(&c, &version) ||
+        !ram_cursor_get_be32(&c, &version) ||
+        !ram_cursor_get_be64(&c, &total_ram_bytes) ||
+        (total_ram_bytes & ~TARGET_PAGE_MASK) != RAM_SAVE_FLAG_MEM_SIZE) {
+        goto out;
+    }
+
+    total_ram_bytes &= TARGET_PAGE_MASK;
+    while (total_ram_bytes) {
+        uint64_t length;
+        if (!ram_cursor_get_idstr(&c, idstr) || !ram_cursor_get_be64(&c, &length) ||
+            length > total_ram_bytes) {
+            goto out;
         }
+        total_ram_bytes -= length;
     }
 
-    // Did we find the node for this hash in our cache?
-    if( node == NULL) {
-        // We didn't find it so load it from scratch.
-        VMStateFileClass *vmstate_file_class = VMSTATE_FILE_GET_CLASS(rst->vm_state_file);
+    if (!ram_cursor_get_be64(&c, &addr) || addr != RAM_SAVE_FLAG_EOS ||
+        !ram_cursor_check_footer(&c, section_id)) {
+        goto out;
+    }
 
-        vmstate_file_class->load_from_hash(rst->vm_state_file, &node, ref_hash);
+    // Then every iteration of RAM that follows.
+    while (ram_cursor_get_byte(&c, &section_type) &&
+           (section_type == QEMU_VM_SECTION_PART || section_type == QEMU_VM_SECTION_END) &&
+           ram_cursor_get_be32(&c, &sid) && sid == section_id)
+    {
+        int flags = 0;
 
-        uint64_t ram_offset = -1;
+        while (!(flags & RAM_SAVE_FLAG_EOS)) {
+            RSaveTreeNodePage page;
 
-        QLIST_FOREACH(se, &node->device_list, next) {
-            if( !strcmp(se->idstr, "ram") ) {
-                ram_offset = se->offset;
-                break;
+            if (!ram_cursor_get_be64(&c, &addr)) {
+                goto out;
+            }
+            flags = addr & ~TARGET_PAGE_MASK;
+            addr &= TARGET_PAGE_MASK;
+
+            if ((flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
+                        RAM_SAVE_FLAG_DELTA_PAGE | RAM_SAVE_FLAG_DELTA_BANK)) &&
+                !(flags & RAM_SAVE_FLAG_CONTINUE)) {
+                if (!ram_cursor_get_idstr(&c, idstr)) {
+                    goto out;
+                }
+                block = qemu_ram_block_by_name(idstr);
+            }
+
+            switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
+                case RAM_SAVE_FLAG_MEM_SIZE:
+                    if (!ram_cursor_get_byte(&c, &ch) || !ram_cursor_skip(&c, ch + sizeof(uint64_t))) {
+                        goto out;
+                    }
+                    break;
+
+                case RAM_SAVE_FLAG_DELTA_PAGE:
+                case RAM_SAVE_FLAG_DELTA_BANK:
+                    if (!ram_cursor_skip(&c, sizeof(SHA1_HASH_TYPE))) {
+                        goto out;
+                    }
+                    break;
+
+                case RAM_SAVE_FLAG_ZERO:
+                    if (!block || !ram_cursor_get_byte(&c, &ch)) {
+                        goto out;
+                    }
+                    page.addr = block->offset + addr;
+                    page.offset = ch;
+                    page.zero = true;
+                    g_array_append_val(pages, page);
+                    break;
+
+                case RAM_SAVE_FLAG_PAGE:
+                    if (!block) {
+                        goto out;
+                    }
+                    page.addr = block->offset + addr;
+                    page.offset = c.pos;
+                    page.zero = false;
+                    if (!ram_cursor_skip(&c, TARGET_PAGE_SIZE)) {
+                        goto out;
+                    }
+                    g_array_append_val(pages, page);
+                    break;
+
+                case RAM_SAVE_FLAG_EOS:
+                    break;
+
+                default:
+                    goto out;
             }
         }
 
-        if( ram_offset == -1 ){
-            // error
-            printf("Error @ line %d\n",__LINE__);
-            return;
+        if (!ram_cursor_check_footer(&c, section_id)) {
+            goto out;
         }
 
-        // Prepare the file container with the VM state and load procedure.
-        f = qemu_fopen_ops(node->vm_state, &memory_channel_input_ops);
+        if (section_type == QEMU_VM_SECTION_END) {
+            break;
+        }
+    }
 
-        qemu_peek_buffer(f, &peek_buf, ram_offset, 0);
-        qemu_file_skip(f, ram_offset);
+    ok = true;
 
-        uint32_t section_id;
-        uint8_t section_type;
-        if(!ram_check_section_header(f, &section_type, &section_id, se->idstr)){
-            // ram mismatch
-            printf("Error @ line %d\n",__LINE__);
-            return;
+out:
+    if (ok && pages->len) {
+        g_array_sort(pages, ram_compare_indexed_page);
+        node->num_indexed_pages = pages->len;
+        node->page_index = (RSaveTreeNodePage *)g_array_free(pages, false);
+    } else {
+        g_array_free(pages, true);
+    }
+}
+
+static bool ram_read_indexed_page(RSaveTreeNode *node, ram_addr_t addr, uint8_t *host_buf)
+{
+    RSaveTreeNodePage key = { .addr = addr };
+    const RSaveTreeNodePage *page;
+    MemoryChannelClass *mcc;
+
+    if (!node->page_index) {
+        return false;
+    }
+
+    page = bsearch(&key, node->page_index, node->num_indexed_pages,
+                   sizeof(RSaveTreeNodePage), ram_compare_indexed_page);
+    if (!page) {
+        return false;
+    }
+
+    if (page->zero) {
+        memset(host_buf, page->offset, TARGET_PAGE_SIZE);
+        return true;
+    }
+
+    mcc = MEMORY_CHANNEL_GET_CLASS(node->vm_state);
+    return mcc->read_state(node->vm_state, host_buf, page->offset, TARGET_PAGE_SIZE) == TARGET_PAGE_SIZE;
+}
+
+static bool ram_open_reference_stream(RAMRapidLoadCache *entry)
+{
+    RAMBlock *block;
+    VMStateIndexEntry *se;
+    char idstr[UCHAR_MAX+1];
+    int flags;
+    QEMUFile *f = NULL;
+    RSaveTreeNode *node = entry->node;
+    uint64_t ram_offset = -1;
+
+    QLIST_FOREACH(se, &node->device_list, next) {
+        if( !strcmp(se->idstr, "ram") ) {
+            ram_offset = se->offset;
+            break;
         }
+    }
 
-        if(!(section_type & (QEMU_VM_SECTION_FULL | QEMU_VM_SECTION_START))) {
-            // ram mismatch
+    if( ram_offset == -1 ){
+        // error
+        printf("Error @ line %d\n",__LINE__);
+        return false;
+    }
+
+    // Prepare the file container with the VM state and load procedure.
+    f = qemu_fopen_ops(node->vm_state, &memory_channel_input_ops);
+    qemu_update_position(f, ram_offset);
+
+    uint32_t section_id;
+    uint8_t section_type;
+    if(!ram_check_section_header(f, &section_type, &section_id, se->idstr)){
+        // ram mismatch
+        printf("Error @ line %d\n",__LINE__);
+        goto fail;
+    }
+
+    if(!(section_type & (QEMU_VM_SECTION_FULL | QEMU_VM_SECTION_START))) {
+        // ram mismatch
+        printf("Error @ line %d\n",__LINE__);
+        goto fail;
+    }
+
+    uint64_t ram_size = qemu_get_be64(f);
+    flags = ram_size & ~TARGET_PAGE_MASK;
+    ram_size &= TARGET_PAGE_MASK;
+    if( flags != RAM_SAVE_FLAG_MEM_SIZE ){
+        // ram mismatch
+        printf("Error @ line %d\n",__LINE__);
+        goto fail;
+    }
+
+    // check the ram configuration
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        uint8_t len = qemu_get_byte(f);
+
+        qemu_get_buffer(f, (uint8_t *)idstr, len);
+        if(memcmp(idstr, block->idstr, len) != 0){
+            // error, encountered unexpected section
             printf("Error @ line %d\n",__LINE__);
-            return;
+            goto fail;
         }
 
-        uint64_t ram_size = qemu_get_be64(f);
-        flags = ram_size & ~TARGET_PAGE_MASK;
-        ram_size &= TARGET_PAGE_MASK;
-        if( flags != RAM_SAVE_FLAG_MEM_SIZE ){
-            // ram mismatch
+        uint64_t used_length = qemu_get_be64(f);
+        if( block->used_length != used_length ){
+            // ram mismatch, ram should not be resizable
             printf("Error @ line %d\n",__LINE__);
-            return;
+            goto fail;
         }
 
-        // check the ram configuration
-        RAMBLOCK_FOREACH_MIGRATABLE(block) {
-            uint8_t len = qemu_get_byte(f);
-
-            qemu_get_buffer(f, (uint8_t *)idstr, len);
-            if(memcmp(idstr, block->idstr, len) != 0){
-                // error, encountered unexpected section
+        if (migrate_postcopy_ram() && block->page_size != qemu_host_page_size) {
+            uint64_t page_size = qemu_get_be64(f);
+            if( block->page_size != page_size ){
+                // ram mismatch
                 printf("Error @ line %d\n",__LINE__);
-                return;
+                goto fail;
             }
+        }
+    }
 
-            uint64_t used_length = qemu_get_be64(f);
-            if( block->used_length != used_length ){
-                // ram mismatch, ram should not be resizable
-                printf("Error @ line %d\n",__LINE__);
-                return;
-            }
+    flags = qemu_get_be64(f);
+    if( flags != RAM_SAVE_FLAG_EOS){
+        // ram mismatch
+        printf("Error @ line %d\n",__LINE__);
+        goto fail;
+    }
 
-            if (migrate_postcopy_ram() && block->page_size != qemu_host_page_size) {
-                uint64_t page_size = qemu_get_be64(f);
-                if( block->page_size != page_size ){
-                    // ram mismatch
-                    printf("Error @ line %d\n",__LINE__);
-                    return;
-                }
-            }
-        }
+    if(!ram_check_section_footer(f, section_id)){
+        // ram mismatch
+        printf("Error @ line %d\n",__LINE__);
+        goto fail;
+    }
 
-        flags = qemu_get_be64(f);
-        if( flags != RAM_SAVE_FLAG_EOS){
-            // ram mismatch
-            printf("Error @ line %d\n",__LINE__);
-            return;
-        }
+    if(!ram_check_section_header(f, &section_type, &section_id, NULL)){
+        // ram mismatch
+        printf("Error @ line %d\n",__LINE__);
+        goto fail;
+    }
 
-        if(!ram_check_section_footer(f, section_id)){
-            // ram mismatch
-            printf("Error @ line %d\n",__LINE__);
-            return;
+    if(!(section_type & QEMU_VM_SECTION_PART)){
+        // ram mismatch
+        printf("Error @ line %d\n",__LINE__);
+        goto fail;
+    }
+
+    entry->in = f;
+    entry->section_id = section_id;
+    entry->section_type = section_type;
+    return true;
+
+fail:
+    qemu_fclose(f);
+    return false;
+}
+
+static void ram_get_reference_page_bytes(
+    RSaveTree *rst,
+    RAMState *rs,
+    RAMBlock *rb,
+    ram_addr_t offset,
+    SHA1_HASH_TYPE ref_hash,
+    uint8_t *host_buf)
+{
+    RAMRapidLoadCache *entry;
+    uint8_t *peek_buf;
+    char idstr[UCHAR_MAX+1];
+    int flags;
+    QEMUFile *f = NULL;
+    RSaveTreeNode *node = NULL;
+    RSaveTreeClass *rcc = RSAVE_TREE_GET_CLASS(rst);
+    VMStateFileClass *vmstate_file_class = VMSTATE_FILE_GET_CLASS(rst->vm_state_file);
+
+    if( rcc->search_ram_cache(rst, offset + rb->offset, ref_hash, host_buf) ){
+        return;
+    }
+
+    // Look for this node in our cache of previously loaded states.
+    QSIMPLEQ_FOREACH(entry, &rs->load_cache, next) {
+        if(!memcmp(entry->node->hash, ref_hash, sizeof(SHA1_HASH_TYPE))){
+            node = entry->node;
+            break;
         }
+    }
 
-        if(!ram_check_section_header(f, &section_type, &section_id, NULL)){
-            // ram mismatch
-            printf("Error @ line %d\n",__LINE__);
+    // Did we find the node for this hash in our cache?
+    if( node == NULL) {
+        // States indexed before, in this run or an earlier one, have
+        // their pages read straight from the file.
+        if( vmstate_file_class->read_page(rst->vm_state_file, ref_hash, offset + rb->offset,
+                                          host_buf, TARGET_PAGE_SIZE) ){
+            rcc->update_ram_cache(rst, offset + rb->offset, ref_hash, host_buf);
             return;
         }
 
-        if(!(section_type & QEMU_VM_SECTION_PART)){
-            // ram mismatch
+        // We didn't find it so load it from scratch.
+        if (!vmstate_file_class->load_from_hash(rst->vm_state_file, &node, ref_hash)) {
+            // error
             printf("Error @ line %d\n",__LINE__);
             return;
         }
 
         entry = g_new0(RAMRapidLoadCache,1);
-        entry->in = f;
+        entry->in = NULL;
         entry->node = node;
-        entry->section_id = section_id;
-        entry->section_type = section_type;
         QSIMPLEQ_INSERT_TAIL(&rs->load_cache, entry, next);
     }
 
+    // Most lookups are answered by the page index of the node, which
+    // is kept with the vmstate file for the runs after this one.
+    if( !node->page_index_built ){
+        ram_build_reference_page_index(node);
+        vmstate_file_class->add_page_index(rst->vm_state_file, node);
+    }
+
+    if( ram_read_indexed_page(node, offset + rb->offset, host_buf) ){
+        rcc->update_ram_cache(rst, offset + rb->offset, ref_hash, host_buf);
+        return;
+    }
+
+    // Otherwise walk the stream to find the page.
+    if( !entry->in && !ram_open_reference_stream(entry) ){
+        return;
+    }
+    f = entry->in;
+
     bool found_page = false;
     do{
         uint8_t len;
@@ -589,6 +909,12 @@ static void ram_get_reference_page_bytes(
         flags = addr & ~TARGET_PAGE_MASK;
         addr &= TARGET_PAGE_MASK;
 
+        if (qemu_file_get_error(f)) {
+            // ran off the end of the stream
+            printf("Error @ line %d\n",__LINE__);
+            return;
+        }
+
         if ((flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                     RAM_SAVE_FLAG_DELTA_PAGE | RAM_SAVE_FLAG_DELTA_BANK)) &&
             !(flags & RAM_SAVE_FLAG_CONTINUE)) {
@@ -694,20 +1020,120 @@ void ram_rapid_get_ram_blocks(MemoryList *mem_list)
     rcu_read_lock();
     RAMBLOCK_FOREACH(block)
     { 
-        MemoryDescriptor *desc = g_new(MemoryDescriptor, 1);
+        MemoryDescriptor *desc = g_new0(MemoryDescriptor, 1);
 
         desc->offset = block->offset;
         desc->size = block->used_length;
         desc->value = block->host;
+        desc->length = desc->size;
 
         QLIST_INSERT_HEAD(mem_list, desc, next);
     }
     rcu_read_unlock();
 }
 
-void ram_rapid_get_ram_blocks_deltas(MemoryList *mem_list)
+/**
+ * ram_base_page: find what a page held when the active state was loaded
+ *
+ * Only the pristine copy and the reference cache are consulted, going to
+ * the vmstate file would cost more than sending the page.
+ *
+ * Returns a pointer to the base bytes or NULL if they aren't at hand
+ *
+ * @rst: the rapid analysis tree that owns the reference cache
+ * @block: block that contains the page
+ * @addr: offset of the page inside the block
+ * @buf: scratch page the reference cache copies into
+ */
+static const uint8_t *ram_base_page(RSaveTree *rst, RAMBlock *block,
+                                    ram_addr_t addr, uint8_t *buf)
+{
+    RSaveTreeClass *rcc = RSAVE_TREE_GET_CLASS(rst);
+    SHA1_HASH_TYPE zero_hash;
+    const unsigned long page = addr >> TARGET_PAGE_BITS;
+
+    if (rst->forkserver && block->rsave_pristine) {
+        return block->rsave_pristine + addr;
+    }
+
+    // A page without a reference was never loaded.
+    memset(zero_hash, 0, sizeof(SHA1_HASH_TYPE));
+    if (!memcmp(block->rsave_l2_hashes[page], zero_hash, sizeof(SHA1_HASH_TYPE))) {
+        return NULL;
+    }
+
+    if (rcc->search_ram_cache(rst, block->offset + addr, block->rsave_l2_hashes[page], buf)) {
+        return buf;
+    }
+    return NULL;
+}
+
+/**
+ * ram_append_delta: add a page to the delta list, growing the last range
+ * when the page continues it with the same encoding
+ *
+ * Returns the descriptor the page ended up in
+ */
+static MemoryDescriptor *ram_append_delta(MemoryList *mem_list, MemoryDescriptor *last,
+                                          uint64_t offset, uint8_t encoding,
+                                          uint8_t *value, uint32_t size)
+{
+    MemoryDescriptor *desc;
+
+    if (last && last->encoding == encoding &&
+        last->offset + last->length == offset &&
+        last->length <= UINT32_MAX - TARGET_PAGE_SIZE)
+    {
+        if (encoding == MEMORY_ENCODING_RAW) {
+            last->size += TARGET_PAGE_SIZE;
+            last->length += TARGET_PAGE_SIZE;
+            return last;
+        }
+        if (encoding == MEMORY_ENCODING_FILL && last->value[0] == value[0]) {
+            last->length += TARGET_PAGE_SIZE;
+            g_free(value);
+            return last;
+        }
+    }
+
+    desc = g_new0(MemoryDescriptor, 1);
+    desc->offset = offset;
+    desc->length = TARGET_PAGE_SIZE;
+    desc->encoding = encoding;
+    desc->value = value;
+    desc->size = size;
+
+    // Keep the list in address order.
+    if (last) {
+        QLIST_INSERT_AFTER(last, desc, next);
+    } else {
+        QLIST_INSERT_HEAD(mem_list, desc, next);
+    }
+    return desc;
+}
+
+/**
+ * ram_rapid_get_ram_blocks_deltas: list the pages changed since the active
+ * state was loaded
+ *
+ * Adjacent dirty pages come back as one range and pages that were written
+ * back to their loaded contents are left out. With encode set, pages that
+ * repeat a single byte become MEMORY_ENCODING_FILL ranges and pages with a
+ * base at hand are sent as an XBZRLE diff against it when that is smaller.
+ * Encoded descriptors own their value, raw ones point into guest RAM.
+ *
+ * @rst: the rapid analysis tree that owns the reference cache
+ * @mem_list: list the descriptors are added to
+ * @encode: whether encoded descriptors may be returned
+ */
+void ram_rapid_get_ram_blocks_deltas(RSaveTree *rst, MemoryList *mem_list, bool encode)
 {
     RAMBlock *block;
+    MemoryDescriptor *last = NULL;
+    uint8_t *base_buf = g_malloc(TARGET_PAGE_SIZE);
+    uint8_t *encoded_buf = g_malloc(TARGET_PAGE_SIZE);
+    // A diff has to save at least a quarter of the page to be worth it.
+    const int encoded_limit = TARGET_PAGE_SIZE - TARGET_PAGE_SIZE / 4;
 
     rcu_read_lock();
     RAMBLOCK_FOREACH(block)
@@ -725,19 +1151,41 @@ void ram_rapid_get_ram_blocks_deltas(MemoryList *mem_list)
                 uint64_t last_page = MIN(page + RSAVE_LAYER1_BANK_SIZE, block->max_pages);
                 for(;page < last_page; page++) 
                 {
+                    ram_addr_t addr = (ram_addr_t)page << TARGET_PAGE_BITS;
+                    uint8_t *host = &block->host[addr];
+                    const uint8_t *base;
+
                     // Test the segment to see if its dirty
-                    if(block->rsave_flags[page] & RSAVE_LAYER2_DIRTY) 
+                    if(!(block->rsave_flags[page] & RSAVE_LAYER2_DIRTY)) 
                     {
-                        // Create a memory descriptor 
-                        MemoryDescriptor *desc = g_new(MemoryDescriptor, 1);
+                        continue;
+                    }
 
-                        // Calculate offset into actual ram
-                        desc->offset = block->offset + (page * TARGET_PAGE_SIZE);
-                        desc->size = TARGET_PAGE_SIZE;
-                        desc->value = &block->host[page * TARGET_PAGE_SIZE];
+                    // Written, but back to what it was loaded with.
+                    base = ram_base_page(rst, block, addr, base_buf);
+                    if (base && !memcmp(host, base, TARGET_PAGE_SIZE)) {
+                        continue;
+                    }
 
-                        QLIST_INSERT_HEAD(mem_list, desc, next);
+                    if (encode && !memcmp(host, host + 1, TARGET_PAGE_SIZE - 1)) {
+                        last = ram_append_delta(mem_list, last, block->offset + addr,
+                                                MEMORY_ENCODING_FILL, g_memdup(host, 1), 1);
+                        continue;
                     }
+
+                    if (encode && base) {
+                        int len = xbzrle_encode_buffer((uint8_t *)base, host, TARGET_PAGE_SIZE,
+                                                       encoded_buf, encoded_limit);
+                        if (len > 0) {
+                            last = ram_append_delta(mem_list, last, block->offset + addr,
+                                                    MEMORY_ENCODING_XBZRLE,
+                                                    g_memdup(encoded_buf, len), len);
+                            continue;
+                        }
+                    }
+
+                    last = ram_append_delta(mem_list, last, block->offset + addr,
+                                            MEMORY_ENCODING_RAW, host, TARGET_PAGE_SIZE);
                 }
             }
             else
@@ -748,6 +1196,9 @@ void ram_rapid_get_ram_blocks_deltas(MemoryList *mem_list)
         }
     }
     rcu_read_unlock();
+
+    g_free(encoded_buf);
+    g_free(base_buf);
 }
 
 void ram_rapid_set_ram_block(CPUState *cpu, uint64_t offset, uint32_t size, uint8_t *data, bool is_physical)
@@ -2015,7 +2466,9 @@ static int ram_load_cleanup(void *opaque)
     if(!QSIMPLEQ_EMPTY(&rs->load_cache)) {
         QSIMPLEQ_FOREACH_SAFE(entry, &rs->load_cache, next, next_entry) {
             QSIMPLEQ_REMOVE_HEAD(&rs->load_cache, next);
-            qemu_fclose(entry->in);
+            if (entry->in) {
+                qemu_fclose(entry->in);
+            }
             object_unref(OBJECT(entry->node));
             g_free(entry);
         }
@@ -2024,6 +2477,166 @@ static int ram_load_cleanup(void *opaque)
     return 0;
 }
 
+typedef int (*RAMRapidRestorePage)(RAMBlock *block, ram_addr_t addr, void *host, void *opaque);
+
+/**
+ * ram_restore_dirty_pages: hand every page dirtied since the active state
+ * was loaded to @restore, then mark it clean again.
+ *
+ * Translations of the restored pages are dropped since the guest may have
+ * run code out of them while they were dirty.
+ *
+ * Returns the number of pages restored or the first error from @restore
+ */
+static int ram_restore_dirty_pages(RAMRapidRestorePage restore, void *opaque)
+{
+    RAMBlock *block;
+    int pages = 0;
+    int ret;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_MIGRATABLE(block)
+    {
+        unsigned long page = 0;
+
+        if (!block->rsave_flags) {
+            continue;
+        }
+
+        while (page < block->max_pages)
+        {
+            // Skip whole banks that were never written to.
+            if (!(block->rsave_flags[page >> RSAVE_LAYER1_BANK_BITS] & RSAVE_LAYER1_DIRTY))
+            {
+                page += RSAVE_LAYER1_BANK_SIZE;
+                continue;
+            }
+
+            uint64_t bank_page = page;
+            uint64_t last_page = MIN(page + RSAVE_LAYER1_BANK_SIZE, block->max_pages);
+            for (; page < last_page; page++)
+            {
+                ram_addr_t addr = page << TARGET_PAGE_BITS;
+                void *host;
+
+                if (!(block->rsave_flags[page] & RSAVE_LAYER2_DIRTY)) {
+                    continue;
+                }
+
+                host = host_from_ram_block_offset(block, addr);
+                if (!host) {
+                    continue;
+                }
+
+                ret = restore(block, addr, host, opaque);
+                if (ret < 0) {
+                    pages = ret;
+                    goto out;
+                }
+
+                if (tcg_enabled()) {
+                    tb_invalidate_phys_range(block->offset + addr, block->offset + addr + TARGET_PAGE_SIZE);
+                }
+                ram_clean_l2_page(block, addr);
+                pages++;
+            }
+
+            // The whole bank is back to its loaded contents.
+            ram_clean_l1_page(block, bank_page << TARGET_PAGE_BITS);
+        }
+    }
+
+out:
+    rcu_read_unlock();
+
+    return pages;
+}
+
+static int ram_restore_reference_page(RAMBlock *block, ram_addr_t addr, void *host, void *opaque)
+{
+    RSaveTree *rst = opaque;
+    SHA1_HASH_TYPE zero_hash;
+    const unsigned long page = addr >> TARGET_PAGE_BITS;
+
+    // A page without a reference was never loaded, we can't help it.
+    memset(zero_hash, 0, sizeof(SHA1_HASH_TYPE));
+    if (!memcmp(block->rsave_l2_hashes[page], zero_hash, sizeof(SHA1_HASH_TYPE))) {
+        return -EINVAL;
+    }
+
+    ram_get_reference_page_bytes(rst, ram_state, block, addr, block->rsave_l2_hashes[page], host);
+    return 0;
+}
+
+/**
+ * ram_rapid_restore_dirty_pages: copy the reference bytes back into every
+ * page that was dirtied since the active state was loaded.
+ *
+ * Each page remembers the hash of the state that supplied its contents
+ * so the dirty pages are the only ones that need to be refreshed.
+ *
+ * Returns the number of pages restored or negative on error
+ *
+ * @rst: the rapid analysis tree that owns the vmstate file
+ */
+int ram_rapid_restore_dirty_pages(RSaveTree *rst)
+{
+    int pages;
+
+    if (!ram_state) {
+        return -EINVAL;
+    }
+
+    ram_load_setup(NULL, &ram_state);
+    pages = ram_restore_dirty_pages(ram_restore_reference_page, rst);
+    ram_load_cleanup(&ram_state);
+
+    return pages;
+}
+
+/**
+ * ram_rapid_save_pristine: keep a copy of guest RAM as it is now so that
+ * ram_rapid_restore_pristine_pages can roll jobs back with a memcpy.
+ *
+ * This costs one copy of guest RAM. The copy is reused, not reallocated,
+ * when a different base is loaded later.
+ */
+void ram_rapid_save_pristine(void)
+{
+    RAMBlock *block;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_MIGRATABLE(block)
+    {
+        if (!block->rsave_pristine) {
+            block->rsave_pristine = g_malloc(block->max_length);
+        }
+        memcpy(block->rsave_pristine, block->host, block->used_length);
+    }
+    rcu_read_unlock();
+}
+
+static int ram_restore_pristine_page(RAMBlock *block, ram_addr_t addr, void *host, void *opaque)
+{
+    if (!block->rsave_pristine) {
+        return -EINVAL;
+    }
+
+    memcpy(host, block->rsave_pristine + addr, TARGET_PAGE_SIZE);
+    return 0;
+}
+
+/**
+ * ram_rapid_restore_pristine_pages: copy the pristine bytes back into every
+ * page that was dirtied since ram_rapid_save_pristine.
+ *
+ * Returns the number of pages restored or negative on error
+ */
+int ram_rapid_restore_pristine_pages(void)
+{
+    return ram_restore_dirty_pages(ram_restore_pristine_page, NULL);
+}
+
 static int ram_resume_prepare(MigrationState *s, void *opaque)
 {
     RAMState *rs = *(RAMState **)opaque;
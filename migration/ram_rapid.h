@@ -21,6 +21,7 @@
 
 #include "racomms/racomms-types.h"
 #include "ra-types.h"
+#include "rsave-tree.h"
 
 void ram_rapid_blocks_init(void);
 void ram_rapid_blocks_cleanup(void);
@@ -31,6 +32,9 @@ int ram_rapid_postcopy_send_discard_bitmap(MigrationState *ms);
 void ram_rapid_postcopy_chunk_hostpages_pass(MigrationState *ms, bool unsent_pass,
                                           RAMBlock *block, PostcopyDiscardState *pds);
 void ram_rapid_get_ram_blocks(MemoryList *mem_list);
-void ram_rapid_get_ram_blocks_deltas(MemoryList *mem_list);
+void ram_rapid_get_ram_blocks_deltas(RSaveTree *rst, MemoryList *mem_list, bool encode);
+int ram_rapid_restore_dirty_pages(RSaveTree *rst);
+void ram_rapid_save_pristine(void);
+int ram_rapid_restore_pristine_pages(void);
 
 #endif
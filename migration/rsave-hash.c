@@ -0,0 +1,201 @@
+/*
+ * Rapid Analysis QEMU System Emulator
+ *
+ * Copyright (c) 2020 Cromulence LLC
+ *
+ * Distribution Statement A
+ *
+ * Approved for Public Release, Distribution Unlimited
+ *
+ * Authors:
+ *  Joseph Walker
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The creation of this code was funded by the US Government.
+ */
+
+#include "rsave-hash.h"
+#include "crypto/hash.h"
+#include "qemu/bswap.h"
+
+// The fast engine is the xxHash64 stripe loop with its four lanes
+// finalized separately, so that the 160 bits we hand out are not
+// stretched from a single 64 bit result. It is not a cryptographic
+// hash; states are identified by it, not authenticated.
+#define FAST_PRIME1 (0x9E3779B185EBCA87ull)
+#define FAST_PRIME2 (0xC2B2AE3D27D4EB4Full)
+#define FAST_PRIME3 (0x165667B19E3779F9ull)
+#define FAST_PRIME4 (0x85EBCA77C2B2AE63ull)
+#define FAST_PRIME5 (0x27D4EB2F165667C5ull)
+
+#define FAST_STRIPE_SIZE (32)
+
+typedef struct RSaveFastHashState {
+    uint64_t v[4];
+    uint8_t stripe[FAST_STRIPE_SIZE];
+    size_t stripe_len;
+    uint64_t total_len;
+} RSaveFastHashState;
+
+static RSaveHashEngine hash_engine = RSAVE_HASH_ENGINE_SHA1;
+
+static inline uint64_t fast_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fast_round(uint64_t acc, uint64_t input)
+{
+    acc += input * FAST_PRIME2;
+    acc = fast_rotl(acc, 31);
+    return acc * FAST_PRIME1;
+}
+
+static inline uint64_t fast_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= fast_round(0, val);
+    return acc * FAST_PRIME1 + FAST_PRIME4;
+}
+
+static inline uint64_t fast_avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= FAST_PRIME2;
+    h ^= h >> 29;
+    h *= FAST_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline void fast_consume_stripe(RSaveFastHashState *s, const uint8_t *p)
+{
+    s->v[0] = fast_round(s->v[0], ldq_le_p(p));
+    s->v[1] = fast_round(s->v[1], ldq_le_p(p + 8));
+    s->v[2] = fast_round(s->v[2], ldq_le_p(p + 16));
+    s->v[3] = fast_round(s->v[3], ldq_le_p(p + 24));
+}
+
+static void fast_hash_init(RSaveFastHashState *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->v[0] = FAST_PRIME1 + FAST_PRIME2;
+    s->v[1] = FAST_PRIME2;
+    s->v[2] = 0;
+    s->v[3] = -FAST_PRIME1;
+}
+
+static void fast_hash_update(RSaveFastHashState *s, const uint8_t *p, size_t len)
+{
+    s->total_len += len;
+
+    // Finish off a stripe left over from the last iov.
+    if (s->stripe_len) {
+        size_t fill = MIN(len, FAST_STRIPE_SIZE - s->stripe_len);
+        memcpy(&s->stripe[s->stripe_len], p, fill);
+        s->stripe_len += fill;
+        p += fill;
+        len -= fill;
+
+        if (s->stripe_len < FAST_STRIPE_SIZE) {
+            return;
+        }
+        fast_consume_stripe(s, s->stripe);
+        s->stripe_len = 0;
+    }
+
+    while (len >= FAST_STRIPE_SIZE) {
+        fast_consume_stripe(s, p);
+        p += FAST_STRIPE_SIZE;
+        len -= FAST_STRIPE_SIZE;
+    }
+
+    memcpy(s->stripe, p, len);
+    s->stripe_len = len;
+}
+
+static void fast_hash_final(RSaveFastHashState *s, SHA1_HASH_TYPE *hash)
+{
+    uint64_t merged, out[3];
+    uint8_t *result = (uint8_t *) hash;
+
+    // The tail is zero padded, the length folded in below tells it apart.
+    if (s->stripe_len) {
+        memset(&s->stripe[s->stripe_len], 0, FAST_STRIPE_SIZE - s->stripe_len);
+        fast_consume_stripe(s, s->stripe);
+    }
+
+    merged = fast_rotl(s->v[0], 1) + fast_rotl(s->v[1], 7) +
+             fast_rotl(s->v[2], 12) + fast_rotl(s->v[3], 18);
+    for (int i = 0; i < 4; i++) {
+        merged = fast_merge_round(merged, s->v[i]);
+    }
+
+    out[0] = fast_avalanche(merged + s->total_len);
+    out[1] = fast_avalanche((s->v[0] ^ fast_rotl(s->v[2], 31)) * FAST_PRIME3 + s->total_len);
+    out[2] = fast_avalanche((s->v[1] ^ fast_rotl(s->v[3], 31)) * FAST_PRIME5 + s->total_len);
+
+    stq_le_p(result, out[0]);
+    stq_le_p(result + 8, out[1]);
+    stl_le_p(result + 16, (uint32_t) out[2]);
+}
+
+bool rsave_hash_engine_from_name(const char *name, RSaveHashEngine *engine)
+{
+    if (!strcmp(name, "sha1")) {
+        *engine = RSAVE_HASH_ENGINE_SHA1;
+    } else if (!strcmp(name, "fast")) {
+        *engine = RSAVE_HASH_ENGINE_FAST;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char *rsave_hash_engine_name(RSaveHashEngine engine)
+{
+    switch (engine) {
+    case RSAVE_HASH_ENGINE_SHA1:
+        return "sha1";
+    case RSAVE_HASH_ENGINE_FAST:
+        return "fast";
+    }
+    return "unknown";
+}
+
+void rsave_hash_set_engine(RSaveHashEngine engine)
+{
+    hash_engine = engine;
+}
+
+RSaveHashEngine rsave_hash_get_engine(void)
+{
+    return hash_engine;
+}
+
+int rsave_hash_iov(const struct iovec *iov, size_t niov, SHA1_HASH_TYPE *hash)
+{
+    RSaveFastHashState state;
+    uint8_t *result = (uint8_t *) hash;
+    size_t resultlen = sizeof(SHA1_HASH_TYPE);
+
+    switch (hash_engine) {
+        case RSAVE_HASH_ENGINE_FAST:
+            fast_hash_init(&state);
+            for (size_t i = 0; i < niov; i++) {
+                fast_hash_update(&state, iov[i].iov_base, iov[i].iov_len);
+            }
+            fast_hash_final(&state, hash);
+            return 0;
+
+        case RSAVE_HASH_ENGINE_SHA1:
+        default:
+            return qcrypto_hash_bytesv(QCRYPTO_HASH_ALG_SHA1,
+                                       iov,
+                                       niov,
+                                       &result,
+                                       &resultlen,
+                                       NULL);
+    }
+}
@@ -0,0 +1,50 @@
+/*
+ * Rapid Analysis QEMU System Emulator
+ *
+ * Copyright (c) 2020 Cromulence LLC
+ *
+ * Distribution Statement A
+ *
+ * Approved for Public Release, Distribution Unlimited
+ *
+ * Authors:
+ *  Joseph Walker
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ * 
+ * The creation of this code was funded by the US Government.
+ */
+
+#ifndef RSAVE_HASH_H
+#define RSAVE_HASH_H
+
+#include "qemu/osdep.h"
+#include "racomms/racomms-types.h"
+
+// State hashes are always SHA1_HASH_TYPE sized, whichever engine fills them.
+typedef enum RSaveHashEngine {
+    RSAVE_HASH_ENGINE_SHA1,
+    RSAVE_HASH_ENGINE_FAST,
+} RSaveHashEngine;
+
+/**
+ * Looks up an engine by the name used on the command line ("sha1" or "fast").
+ */
+bool rsave_hash_engine_from_name(const char *name, RSaveHashEngine *engine);
+const char *rsave_hash_engine_name(RSaveHashEngine engine);
+
+/**
+ * Selects the engine used for every state hash from here on.
+ * Hashes from different engines never match, so a vmstate file
+ * should stick with one engine.
+ */
+void rsave_hash_set_engine(RSaveHashEngine engine);
+RSaveHashEngine rsave_hash_get_engine(void);
+
+/**
+ * Hashes the iovs with the selected engine.
+ */
+int rsave_hash_iov(const struct iovec *iov, size_t niov, SHA1_HASH_TYPE *hash);
+
+#endif
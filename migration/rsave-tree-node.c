@@ -17,23 +17,14 @@
  */
 
 #include "rsave-tree-node.h"
+#include "rsave-tree-store.h"
 #include "migration/ram_rapid.h"
-#include "crypto/hash.h"
+#include "migration/rsave-hash.h"
 #include "qemu/timer.h"
 #include "qemu/error-report.h"
 #include "migration/rsave-tree-node.h"
-#include "qapi/qmp/qlist.h"
-#include "qapi/qmp/qpointer.h"
 #include "cromulence/inlines.h"
 
-struct RSaveTreeNodeLink {
-    Object obj;
-    RSaveTreeNodeLink *next;
-    RSaveTreeNodeLink *previous;
-    RSaveTreeNode *node;
-    SHA1_HASH_TYPE hash;
-};
-
 static void rsave_tree_node_write_tree_node(RSaveTreeNode *rstn, FILE* fp)
 {
     VMStateIndexEntry *e;
@@ -70,7 +61,7 @@ static void rsave_tree_node_write_tree_node(RSaveTreeNode *rstn, FILE* fp)
     mcc->write_to_file(rstn->vm_state, fp);
 }
 
-static void rsave_tree_node_read_tree_node(RSaveTreeNode *rstn, FILE *fp, size_t node_size)
+static void rsave_tree_node_read_tree_node(RSaveTreeNode *rstn, FILE *fp, size_t node_size, bool map_state)
 {
     // Farm out some of the work.
     size_t amount_remaining = node_size;
@@ -126,8 +117,10 @@ static void rsave_tree_node_read_tree_node(RSaveTreeNode *rstn, FILE *fp, size_t
         QLIST_INSERT_HEAD(&rstn->device_list, e, next);
     }
 
-    // Then read the vm-state
-    mcc->read_from_file(vm_state, fp, amount_remaining);
+    // Then read the vm-state, or map it straight out of the file when asked.
+    if (!map_state || !mcc->map_from_file(vm_state, fp, amount_remaining)) {
+        mcc->read_from_file(vm_state, fp, amount_remaining);
+    }
 
     // We want this to be a fresh state,
     // So, we're going to free the vm state if it exists.
@@ -144,8 +137,6 @@ static void rsave_tree_node_read_tree_node(RSaveTreeNode *rstn, FILE *fp, size_t
 static void rsave_tree_node_calculate_hash(RSaveTreeNode *rstn)
 {
     // Variables
-    uint8_t *result;
-    size_t resultlen;
     MemoryChannel *vm_state;
     MemoryChannelClass *vm_state_class;
     QEMUIOVector *qiov;
@@ -153,8 +144,6 @@ static void rsave_tree_node_calculate_hash(RSaveTreeNode *rstn)
 
     // Initialization
     vm_state = rstn->vm_state;
-    result = (uint8_t *) rstn->hash;
-    resultlen = sizeof(SHA1_HASH_TYPE);
     vm_state_class = MEMORY_CHANNEL_GET_CLASS(vm_state);
 
     // Add our own modifiers for the node metadata
@@ -173,12 +162,7 @@ static void rsave_tree_node_calculate_hash(RSaveTreeNode *rstn)
     // Get the iovs for hashing the memory channel
     size_t qiov_size = vm_state_class->get_stream(vm_state, &qiov);
 
-    qcrypto_hash_bytesv(QCRYPTO_HASH_ALG_SHA1,
-                        qiov->iov,
-                        qiov_size,
-                        &result,
-                        &resultlen,
-                        NULL);
+    rsave_hash_iov(qiov->iov, qiov_size, &rstn->hash);
 
     vm_state_class->remove_meta(vm_state);
 }
@@ -193,14 +177,23 @@ static void rsave_tree_node_initfn(Object *obj)
     rstn->num_devices = 0;
     rstn->timestamp = 0;
     rstn->job_id = -1;
-    rstn->link_list = qlist_new();
+    rstn->link_store = NULL;
+    rstn->link_head = RSAVE_TREE_STORE_NONE;
+    rstn->page_index = NULL;
+    rstn->num_indexed_pages = 0;
+    rstn->page_index_built = false;
 }
 
 static void rsave_tree_node_finalize(Object *obj)
 {
     RSaveTreeNode *rstn = RSAVE_TREE_NODE(obj);
     VMStateIndexEntry *e, *next;
-    QListEntry *qe = NULL;
+    RSaveTreeStore *store = atomic_read(&rstn->link_store);
+
+    // Detach links first, the store takes its own lock for it.
+    if (store) {
+        rsave_tree_store_detach_node(store, rstn);
+    }
 
     QLIST_FOREACH_SAFE(e, &rstn->device_list, next, next)
     {
@@ -213,16 +206,9 @@ static void rsave_tree_node_finalize(Object *obj)
         object_unref(OBJECT(rstn->vm_state));
     }
 
-    rstn->cpu_exception_index = 0;
-
-    // Detach links.
-    QLIST_FOREACH_ENTRY(rstn->link_list, qe){
-        QPointer *this_qptr = qobject_to(QPointer, qlist_entry_obj(qe));
-        RSaveTreeNodeLink* this_link = qpointer_get_pointer(this_qptr);
-        this_link->node = NULL;
-    }
+    g_free(rstn->page_index);
 
-    object_unref(OBJECT(rstn->link_list));
+    rstn->cpu_exception_index = 0;
 }
 
 static void rsave_tree_node_class_init(ObjectClass *klass, void *class_data)
@@ -257,83 +243,3 @@ RSaveTreeNode* rsave_tree_node_new(void)
     rstn = RSAVE_TREE_NODE(object_new(TYPE_RSAVE_TREE_NODE));
     return rstn; 
 }
-
-static void rsave_tree_link_initfn(Object *obj)
-{
-    RSaveTreeNodeLink *l = RSAVE_TREE_NODE_LINK(obj);
-
-    l->next = NULL;
-    l->previous = NULL;
-    l->node = NULL;
-}
-
-static void rsave_tree_link_finalize(Object *obj)
-{
-    RSaveTreeNodeLink *l = RSAVE_TREE_NODE_LINK(obj);
-
-    // Stich up the gap
-    if(l->previous) {
-        l->previous->next = l->next;
-    }
-    if(l->next){
-        l->next->previous = l->previous;
-    }
-
-    // Remove this link from the node
-    if(l->node){
-        QPointer *qptr = NULL;
-        QListEntry *qe = NULL;
-        
-        QLIST_FOREACH_ENTRY(l->node->link_list, qe){
-            QPointer *this_qptr = qobject_to(QPointer, qlist_entry_obj(qe));
-            RSaveTreeNodeLink* this_link = qpointer_get_pointer(this_qptr);
-            if(this_link == l){
-                qptr = this_qptr;
-                break;
-            }
-        }
-
-        if(qptr)
-        {
-            QTAILQ_REMOVE(&l->node->link_list->head, qe, next);
-            qobject_unref(qptr);
-            g_free(qe);
-        }
-    }
-}
-
-static const TypeInfo rsave_tree_link_info = {
-    .parent = TYPE_OBJECT,
-    .name = TYPE_RSAVE_TREE_NODE_LINK,
-    .instance_size = sizeof(RSaveTreeNodeLink),
-    .instance_init = rsave_tree_link_initfn,
-    .instance_finalize = rsave_tree_link_finalize
-};
-
-static void rsave_tree_link_register_types(void)
-{
-    type_register_static(&rsave_tree_link_info);
-}
-
-type_init(rsave_tree_link_register_types);
-
-RSaveTreeNodeLink* rsave_tree_node_link_new(RSaveTreeNodeLink *parent, RSaveTreeNode *node)
-{
-    RSaveTreeNodeLink *l = RSAVE_TREE_NODE_LINK(object_new(TYPE_RSAVE_TREE_NODE_LINK));
-    if(l) {
-        l->next = NULL;
-        l->previous = parent;
-        memcpy(l->hash, node->hash, sizeof(SHA1_HASH_TYPE));
-
-        // Add this new link to the node.
-        QPointer *lptr = qpointer_from_pointer(l, NULL);
-        qlist_append(node->link_list, lptr);
-        l->node = node;
-
-        if(parent){
-            parent->next = l;
-        }
-    }
-
-    return l;
-}
\ No newline at end of file
@@ -29,13 +29,7 @@
 typedef struct RSaveTreeNode RSaveTreeNode;
 typedef struct RSaveTreeNodeMeta RSaveTreeNodeMeta;
 typedef struct RSaveTreeNodeClass RSaveTreeNodeClass;
-typedef struct RSaveTreeNodeLink RSaveTreeNodeLink;
-
-#define TYPE_RSAVE_TREE_NODE_LINK (stringify(TYPE_##RSaveTreeNodeLink))
-#define RSAVE_TREE_NODE_LINK(obj)                                    \
-    OBJECT_CHECK(RSaveTreeNodeLink, (obj), TYPE_RSAVE_TREE_NODE_LINK)
-
-RSaveTreeNodeLink* rsave_tree_node_link_new(RSaveTreeNodeLink *parent, RSaveTreeNode *node);
+typedef struct RSaveTreeStore RSaveTreeStore;
 
 #define TYPE_RSAVE_TREE_NODE "rsave-tree-node"
 #define RSAVE_TREE_NODE(obj)                                    \
@@ -53,6 +47,13 @@ typedef struct VMStateIndexEntry{
     QLIST_ENTRY(VMStateIndexEntry) next;
 } VMStateIndexEntry;
 
+// Locates a single page of RAM within the serialized vm state.
+typedef struct RSaveTreeNodePage {
+    uint64_t addr;
+    uint64_t offset;
+    bool zero;
+} RSaveTreeNodePage;
+
 struct RSaveTreeNodeMeta {
     int64_t timestamp;
     uint64_t instruction_number;
@@ -74,13 +75,22 @@ struct RSaveTreeNode {
     SHA1_HASH_TYPE parent_hash;
     SHA1_HASH_TYPE hash;
     MemoryChannel *vm_state;
-    QList *link_list;
+
+    // Trace links to this node, cleared when it goes away.
+    RSaveTreeStore *link_store;
+    uint32_t link_head;
+
+    // Page lookup table, sorted by address and built on first use.
+    // Zero pages keep the fill byte in place of the stream offset.
+    RSaveTreeNodePage *page_index;
+    uint64_t num_indexed_pages;
+    bool page_index_built;
 };
 
 struct RSaveTreeNodeClass {
     ObjectClass parent;
     void (*write_tree_node)(RSaveTreeNode *rst, FILE *fp);
-    void (*read_tree_node)(RSaveTreeNode *rst, FILE *fp, size_t node_size);
+    void (*read_tree_node)(RSaveTreeNode *rst, FILE *fp, size_t node_size, bool map_state);
     void (*calculate_hash)(RSaveTreeNode *rst);
 };
 
@@ -0,0 +1,356 @@
+/*
+ * Rapid Analysis QEMU System Emulator
+ *
+ * Copyright (c) 2020 Cromulence LLC
+ *
+ * Distribution Statement A
+ *
+ * Approved for Public Release, Distribution Unlimited
+ *
+ * Authors:
+ *  Joseph Walker
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The creation of this code was funded by the US Government.
+ */
+
+#include "rsave-tree-store.h"
+#include "qemu/error-report.h"
+#include "qemu/atomic.h"
+
+#define RSAVE_TREE_STORE_INITIAL_SLOTS (1024)
+
+static inline uint32_t rsave_tree_store_hash(uint64_t pc, uint64_t context)
+{
+    // 64 bit finalizer from MurmurHash3, pcs are too regular to use as is.
+    uint64_t h = pc ^ (context * 0x9E3779B97F4A7C15ull);
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return (uint32_t) h;
+}
+
+static guint rsave_tree_store_hash_func(gconstpointer key)
+{
+    // The key is already a SHA1 so any part of it is a good hash.
+    return *(const guint *)key;
+}
+
+static gboolean rsave_tree_store_hash_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, sizeof(SHA1_HASH_TYPE));
+}
+
+// Hands out the next entry of a chunked array, allocating its chunk
+// when the entry is the first one in it.
+static bool rsave_tree_store_bump(void **chunks, uint32_t count, size_t entry_size)
+{
+    uint32_t chunk = count >> RSAVE_TREE_STORE_CHUNK_BITS;
+
+    if (chunk >= RSAVE_TREE_STORE_MAX_CHUNKS) {
+        return false;
+    }
+    if (!chunks[chunk]) {
+        chunks[chunk] = g_malloc(entry_size * RSAVE_TREE_STORE_CHUNK_SIZE);
+    }
+    return true;
+}
+
+static void rsave_tree_store_free_chunks(void **chunks, uint32_t count)
+{
+    uint32_t num_chunks = DIV_ROUND_UP(count, RSAVE_TREE_STORE_CHUNK_SIZE);
+
+    for (uint32_t i = 0; i < num_chunks; i++) {
+        g_free(chunks[i]);
+        chunks[i] = NULL;
+    }
+}
+
+static void rsave_tree_store_grow_slots(RSaveTreeStore *s)
+{
+    uint32_t num_slots = (s->slot_mask + 1) * 2;
+
+    g_free(s->slots);
+    s->slots = g_new(uint32_t, num_slots);
+    memset(s->slots, 0xFF, num_slots * sizeof(uint32_t));
+    s->slot_mask = num_slots - 1;
+
+    for (uint32_t k = 0; k < s->num_keys; k++) {
+        RSaveTreeStoreKey *key = rsave_tree_store_get_key(s, k);
+        uint32_t slot = rsave_tree_store_hash(key->pc, key->context) & s->slot_mask;
+
+        while (s->slots[slot] != RSAVE_TREE_STORE_NONE) {
+            slot = (slot + 1) & s->slot_mask;
+        }
+        s->slots[slot] = k;
+    }
+}
+
+static uint32_t rsave_tree_store_lookup(RSaveTreeStore *s, uint64_t pc, uint64_t context)
+{
+    uint32_t slot = rsave_tree_store_hash(pc, context) & s->slot_mask;
+    RSaveTreeStoreKey *key;
+
+    while (s->slots[slot] != RSAVE_TREE_STORE_NONE) {
+        key = rsave_tree_store_get_key(s, s->slots[slot]);
+        if (key->pc == pc && key->context == context) {
+            return s->slots[slot];
+        }
+        slot = (slot + 1) & s->slot_mask;
+    }
+
+    // Not seen yet, keep the table under three quarters full.
+    if ((s->num_keys + 1) * 4 > (s->slot_mask + 1) * 3) {
+        rsave_tree_store_grow_slots(s);
+        slot = rsave_tree_store_hash(pc, context) & s->slot_mask;
+        while (s->slots[slot] != RSAVE_TREE_STORE_NONE) {
+            slot = (slot + 1) & s->slot_mask;
+        }
+    }
+
+    if (!rsave_tree_store_bump((void **) s->keys, s->num_keys, sizeof(RSaveTreeStoreKey))) {
+        return RSAVE_TREE_STORE_NONE;
+    }
+
+    key = rsave_tree_store_get_key(s, s->num_keys);
+    key->pc = pc;
+    key->context = context;
+    key->first_link = RSAVE_TREE_STORE_NONE;
+    key->last_link = RSAVE_TREE_STORE_NONE;
+    s->slots[slot] = s->num_keys;
+
+    return s->num_keys++;
+}
+
+void rsave_tree_store_init(RSaveTreeStore *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->links = g_new0(RSaveTreeStoreLink *, RSAVE_TREE_STORE_MAX_CHUNKS);
+    s->keys = g_new0(RSaveTreeStoreKey *, RSAVE_TREE_STORE_MAX_CHUNKS);
+    s->slots = g_new(uint32_t, RSAVE_TREE_STORE_INITIAL_SLOTS);
+    memset(s->slots, 0xFF, RSAVE_TREE_STORE_INITIAL_SLOTS * sizeof(uint32_t));
+    s->slot_mask = RSAVE_TREE_STORE_INITIAL_SLOTS - 1;
+    s->first_root = RSAVE_TREE_STORE_NONE;
+    s->last_root = RSAVE_TREE_STORE_NONE;
+    s->by_hash = g_hash_table_new(rsave_tree_store_hash_func, rsave_tree_store_hash_equal);
+    qemu_mutex_init(&s->lock);
+}
+
+static void rsave_tree_store_clear_locked(RSaveTreeStore *s)
+{
+    // Nodes outlive the store when the vmstate cache holds them.
+    for (uint32_t l = 0; l < s->num_links; l++) {
+        RSaveTreeStoreLink *link = rsave_tree_store_get_link(s, l);
+        if (link->node) {
+            link->node->link_store = NULL;
+            link->node->link_head = RSAVE_TREE_STORE_NONE;
+        }
+    }
+
+    rsave_tree_store_free_chunks((void **) s->links, s->num_links);
+    rsave_tree_store_free_chunks((void **) s->keys, s->num_keys);
+    s->num_links = 0;
+    s->num_keys = 0;
+    g_hash_table_remove_all(s->by_hash);
+
+    memset(s->slots, 0xFF, (s->slot_mask + 1) * sizeof(uint32_t));
+    s->first_root = RSAVE_TREE_STORE_NONE;
+    s->last_root = RSAVE_TREE_STORE_NONE;
+}
+
+void rsave_tree_store_clear(RSaveTreeStore *s)
+{
+    qemu_mutex_lock(&s->lock);
+    rsave_tree_store_clear_locked(s);
+    qemu_mutex_unlock(&s->lock);
+}
+
+void rsave_tree_store_destroy(RSaveTreeStore *s)
+{
+    if (!s->links) {
+        return;
+    }
+
+    rsave_tree_store_clear(s);
+    qemu_mutex_destroy(&s->lock);
+    g_free(s->links);
+    g_free(s->keys);
+    g_free(s->slots);
+    g_hash_table_destroy(s->by_hash);
+    memset(s, 0, sizeof(*s));
+}
+
+uint32_t rsave_tree_store_append(RSaveTreeStore *s, uint32_t parent, RSaveTreeNode *node)
+{
+    RSaveTreeStoreLink *link;
+    uint32_t l;
+
+    qemu_mutex_lock(&s->lock);
+    l = s->num_links;
+    if (!rsave_tree_store_bump((void **) s->links, l, sizeof(RSaveTreeStoreLink))) {
+        qemu_mutex_unlock(&s->lock);
+        error_report("The rapid save tree is full, states are no longer added");
+        return RSAVE_TREE_STORE_NONE;
+    }
+
+    link = rsave_tree_store_get_link(s, l);
+    link->node = node;
+    memcpy(link->hash, node->hash, sizeof(SHA1_HASH_TYPE));
+    link->key = RSAVE_TREE_STORE_NONE;
+    link->parent = parent;
+    link->child = RSAVE_TREE_STORE_NONE;
+    link->next = RSAVE_TREE_STORE_NONE;
+    link->next_root = RSAVE_TREE_STORE_NONE;
+
+    // The node clears its links when it goes away.
+    if (node->link_store != s) {
+        node->link_store = s;
+        node->link_head = RSAVE_TREE_STORE_NONE;
+    }
+    link->next_alias = node->link_head;
+    node->link_head = l;
+
+    if (parent != RSAVE_TREE_STORE_NONE) {
+        rsave_tree_store_get_link(s, parent)->child = l;
+    }
+
+    // Links never move, so their hash can be the key.
+    if (!g_hash_table_contains(s->by_hash, link->hash)) {
+        g_hash_table_insert(s->by_hash, link->hash, GUINT_TO_POINTER(l));
+    }
+
+    s->num_links++;
+    qemu_mutex_unlock(&s->lock);
+    return l;
+}
+
+void rsave_tree_store_index(RSaveTreeStore *s, uint32_t l, uint64_t pc, uint64_t context)
+{
+    RSaveTreeStoreLink *link;
+    RSaveTreeStoreKey *key;
+    uint32_t k;
+
+    if (l == RSAVE_TREE_STORE_NONE) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->lock);
+    k = rsave_tree_store_lookup(s, pc, context);
+    if (k == RSAVE_TREE_STORE_NONE) {
+        qemu_mutex_unlock(&s->lock);
+        return;
+    }
+
+    link = rsave_tree_store_get_link(s, l);
+    link->key = k;
+
+    key = rsave_tree_store_get_key(s, k);
+    if (key->last_link == RSAVE_TREE_STORE_NONE) {
+        key->first_link = l;
+    } else {
+        rsave_tree_store_get_link(s, key->last_link)->next = l;
+    }
+    key->last_link = l;
+    qemu_mutex_unlock(&s->lock);
+}
+
+void rsave_tree_store_add_root(RSaveTreeStore *s, uint32_t l)
+{
+    if (l == RSAVE_TREE_STORE_NONE) {
+        return;
+    }
+
+    // Jobs sharing a start state share its link.
+    qemu_mutex_lock(&s->lock);
+    if (l != s->last_root &&
+        rsave_tree_store_get_link(s, l)->next_root == RSAVE_TREE_STORE_NONE) {
+        if (s->last_root == RSAVE_TREE_STORE_NONE) {
+            s->first_root = l;
+        } else {
+            rsave_tree_store_get_link(s, s->last_root)->next_root = l;
+        }
+        s->last_root = l;
+    }
+    qemu_mutex_unlock(&s->lock);
+}
+
+void rsave_tree_store_detach_node(RSaveTreeStore *s, RSaveTreeNode *node)
+{
+    uint32_t l;
+
+    qemu_mutex_lock(&s->lock);
+
+    // The store may have been cleared while the lock was waited for.
+    if (node->link_store == s) {
+        l = node->link_head;
+        while (l != RSAVE_TREE_STORE_NONE) {
+            RSaveTreeStoreLink *link = rsave_tree_store_get_link(s, l);
+            atomic_set(&link->node, NULL);
+            l = link->next_alias;
+        }
+
+        node->link_store = NULL;
+        node->link_head = RSAVE_TREE_STORE_NONE;
+    }
+
+    qemu_mutex_unlock(&s->lock);
+}
+
+uint32_t rsave_tree_store_find_hash(RSaveTreeStore *s, SHA1_HASH_TYPE hash)
+{
+    uint32_t ret = RSAVE_TREE_STORE_NONE;
+    gpointer l;
+
+    qemu_mutex_lock(&s->lock);
+    if (g_hash_table_lookup_extended(s->by_hash, hash, NULL, &l)) {
+        ret = GPOINTER_TO_UINT(l);
+    }
+    qemu_mutex_unlock(&s->lock);
+    return ret;
+}
+
+void rsave_tree_store_foreach(RSaveTreeStore *s, RSaveTreeStoreFunc func, void *opaque)
+{
+    qemu_mutex_lock(&s->lock);
+    for (uint32_t k = 0; k < s->num_keys; k++) {
+        const RSaveTreeStoreKey *key = rsave_tree_store_get_key(s, k);
+
+        for (uint32_t l = key->first_link; l != RSAVE_TREE_STORE_NONE;
+             l = rsave_tree_store_get_link(s, l)->next) {
+            if (!func(key, rsave_tree_store_get_link(s, l), opaque)) {
+                qemu_mutex_unlock(&s->lock);
+                return;
+            }
+        }
+    }
+    qemu_mutex_unlock(&s->lock);
+}
+
+RSaveTreeNode *rsave_tree_store_ref_node(RSaveTreeStoreLink *link)
+{
+    RSaveTreeNode *node = atomic_read(&link->node);
+    Object *obj;
+    uint32_t ref;
+
+    if (!node) {
+        return NULL;
+    }
+
+    // A node whose last reference was dropped is waiting on the store
+    // lock to detach, and must not be brought back.
+    obj = OBJECT(node);
+    ref = atomic_read(&obj->ref);
+    while (ref) {
+        uint32_t old = atomic_cmpxchg(&obj->ref, ref, ref + 1);
+        if (old == ref) {
+            return node;
+        }
+        ref = old;
+    }
+    return NULL;
+}
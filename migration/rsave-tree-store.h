@@ -0,0 +1,115 @@
+/*
+ * Rapid Analysis QEMU System Emulator
+ *
+ * Copyright (c) 2020 Cromulence LLC
+ *
+ * Distribution Statement A
+ *
+ * Approved for Public Release, Distribution Unlimited
+ *
+ * Authors:
+ *  Joseph Walker
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The creation of this code was funded by the US Government.
+ */
+
+#ifndef RSAVE_TREE_STORE_H
+#define RSAVE_TREE_STORE_H
+
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "rsave-tree-node.h"
+
+// Links and keys are handed out of fixed size chunks and referred to by
+// index. The chunk directories never move, so a reader holding an index
+// can follow it while the trace grows.
+#define RSAVE_TREE_STORE_CHUNK_BITS (12)
+#define RSAVE_TREE_STORE_CHUNK_SIZE (1 << RSAVE_TREE_STORE_CHUNK_BITS)
+#define RSAVE_TREE_STORE_MAX_CHUNKS (1 << 16)
+#define RSAVE_TREE_STORE_NONE (UINT32_MAX)
+
+typedef struct RSaveTreeStoreLink {
+    // Not referenced, cleared when the node goes away. The hash stays.
+    // See rsave_tree_store_ref_node.
+    RSaveTreeNode *node;
+    SHA1_HASH_TYPE hash;
+    // Key this link was indexed under, if any.
+    uint32_t key;
+    // The state before this one, and the last one taken after it.
+    uint32_t parent;
+    uint32_t child;
+    // Next link under the same key, and the next root for roots.
+    uint32_t next;
+    uint32_t next_root;
+    // Next link to the same node.
+    uint32_t next_alias;
+} RSaveTreeStoreLink;
+
+typedef struct RSaveTreeStoreKey {
+    uint64_t pc;
+    // Tells apart the same pc in different guest processes, 0 without one.
+    uint64_t context;
+    uint32_t first_link;
+    uint32_t last_link;
+} RSaveTreeStoreKey;
+
+// Every operation takes the store's lock, nodes detach themselves from
+// whichever thread drops their last reference.
+struct RSaveTreeStore {
+    QemuMutex lock;
+
+    RSaveTreeStoreLink **links;
+    uint32_t num_links;
+    RSaveTreeStoreKey **keys;
+    uint32_t num_keys;
+
+    // Open addressed pc index, each slot holds a key index.
+    uint32_t *slots;
+    uint32_t slot_mask;
+
+    uint32_t first_root;
+    uint32_t last_root;
+
+    // First link to each state hash, keyed by the hash in that link.
+    GHashTable *by_hash;
+};
+
+// Returns false to stop the walk.
+typedef bool (*RSaveTreeStoreFunc)(const RSaveTreeStoreKey *key, RSaveTreeStoreLink *link, void *opaque);
+
+void rsave_tree_store_init(RSaveTreeStore *s);
+void rsave_tree_store_destroy(RSaveTreeStore *s);
+// Drops every link and key at once. Nodes that are still around are
+// detached from the store.
+void rsave_tree_store_clear(RSaveTreeStore *s);
+
+// Adds a link to the node after parent, which may be RSAVE_TREE_STORE_NONE.
+uint32_t rsave_tree_store_append(RSaveTreeStore *s, uint32_t parent, RSaveTreeNode *node);
+void rsave_tree_store_index(RSaveTreeStore *s, uint32_t link, uint64_t pc, uint64_t context);
+void rsave_tree_store_add_root(RSaveTreeStore *s, uint32_t link);
+void rsave_tree_store_detach_node(RSaveTreeStore *s, RSaveTreeNode *node);
+// Returns the first link to a state with this hash, or RSAVE_TREE_STORE_NONE.
+uint32_t rsave_tree_store_find_hash(RSaveTreeStore *s, SHA1_HASH_TYPE hash);
+
+// Visits the keys in the order they were first seen, and the links of
+// each key in the order they were added. func runs with the store locked,
+// so it must not change the store or drop a node reference.
+void rsave_tree_store_foreach(RSaveTreeStore *s, RSaveTreeStoreFunc func, void *opaque);
+// References the link's node, from inside rsave_tree_store_foreach.
+// Returns NULL if there is none, or if it is already going away.
+RSaveTreeNode *rsave_tree_store_ref_node(RSaveTreeStoreLink *link);
+
+static inline RSaveTreeStoreLink *rsave_tree_store_get_link(RSaveTreeStore *s, uint32_t link)
+{
+    return &s->links[link >> RSAVE_TREE_STORE_CHUNK_BITS][link & (RSAVE_TREE_STORE_CHUNK_SIZE - 1)];
+}
+
+static inline RSaveTreeStoreKey *rsave_tree_store_get_key(RSaveTreeStore *s, uint32_t key)
+{
+    return &s->keys[key >> RSAVE_TREE_STORE_CHUNK_BITS][key & (RSAVE_TREE_STORE_CHUNK_SIZE - 1)];
+}
+
+#endif
@@ -40,6 +40,7 @@
 #include "qemu-memory-channel.h"
 #include "rsave-tree.h"
 #include "rsave-tree-node.h"
+#include "ra-stats.h"
 #include "qemu-file.h"
 #include "savevm.h"
 #include "postcopy-ram.h"
@@ -2551,11 +2552,31 @@ int save_snapshot(const char *name, Error **errp)
     return ret;
 }
 
+static void pack_node_state(RSaveTreeNode *node)
+{
+    MemoryChannelClass *mcc = MEMORY_CHANNEL_GET_CLASS(node->vm_state);
+    MemoryChannelSection *sections = g_new(MemoryChannelSection, node->num_devices);
+    VMStateIndexEntry *e;
+    size_t num_sections = 0;
+
+    // Each device's section is packed on its own so that it can be shared
+    // with the same section of other states.
+    QLIST_FOREACH(e, &node->device_list, next) {
+        sections[num_sections].name = e->idstr;
+        sections[num_sections].offset = e->offset;
+        num_sections++;
+    }
+
+    mcc->pack(node->vm_state, sections, num_sections);
+    g_free(sections);
+}
+
 static RSaveTreeNode* create_node_of_current_state(CPUState *cpu, RSaveTree *rst)
 {
     // Variables
     QEMUFile *f;
     int ret = -1;
+    int64_t begin;
     Error *errp = NULL;
     SaveStateEntry *se;
 
@@ -2580,7 +2601,9 @@ static RSaveTreeNode* create_node_of_current_state(CPUState *cpu, RSaveTree *rst
     }
 
     // Do vm state capture and leave the file channel open.
+    begin = ra_stats_begin();
     ret = qemu_savevm_state(f, &errp);
+    ra_stats_end(RAPID_ANALYSIS_PHASE_CAPTURE, begin);
 
     // Verify that the process was successful
     qemu_fclose(f);
@@ -2609,7 +2632,15 @@ static RSaveTreeNode* create_node_of_current_state(CPUState *cpu, RSaveTree *rst
         new_child->num_devices++;
     }
 
+    begin = ra_stats_begin();
     ncc->calculate_hash(new_child);
+    ra_stats_end(RAPID_ANALYSIS_PHASE_HASH, begin);
+
+    // Most states are not read again once they are hashed, so they can
+    // sit in the pool packed.
+    if (rst->compress_states) {
+        pack_node_state(new_child);
+    }
  
 end:
     return new_child;
@@ -2617,13 +2648,35 @@ end:
 
 static void append_memory_and_segment_message(RSaveTree *rst, 
     CommsQueue *queue, 
-    CommsMessage **msg, 
+    CommsResultsItem **results, 
     MemoryDescriptor *mem, 
     SHA1_HASH_TYPE job_hash,
     JOB_REPORT_TYPE mem_type)
 {
     size_t mem_sent = 0;
 
+    if (mem->encoding != MEMORY_ENCODING_RAW)
+    {
+        // Encoded values are small and owned by the descriptor, so they
+        // are copied in whole instead of being split or referenced.
+        if (rst->msgsz_limit && queue &&
+            ((*results)->msg->size + (*results)->ref_size + mem->size) > rst->msgsz_limit)
+        {
+            (*results)->msg->has_next_message = 1;
+            queue_push_results(queue, *results);
+            *results = racomms_create_results(racomms_create_job_report_response_msg(rst->message_queue_number, rst->job_id, job_hash));
+        }
+
+        (*results)->msg = racomms_msg_job_report_put_EncodedMemoryEntry((*results)->msg,
+                                                                        mem->offset,
+                                                                        mem->length,
+                                                                        mem->encoding,
+                                                                        mem->size,
+                                                                        mem->value,
+                                                                        mem_type);
+        return;
+    }
+
     while( mem_sent < mem->size )
     {
         size_t send_size = mem->size;
@@ -2632,34 +2685,42 @@ static void append_memory_and_segment_message(RSaveTree *rst,
         {
             send_size = MIN(mem->size - mem_sent, rst->msgsz_limit);
 
-            if (((*msg)->size + send_size) > rst->msgsz_limit)
+            if (((*results)->msg->size + (*results)->ref_size + send_size) > rst->msgsz_limit)
             {
                 // Set the incomplete message flag then 
                 // send the message.
-                (*msg)->has_next_message = 1;
-                
-                // Get the queue for message processing
-                CommsResultsItem *work_results = g_new(CommsResultsItem, 1);
-                work_results->msg = *msg;
-                queue_push_results(queue, work_results);
+                (*results)->msg->has_next_message = 1;
+                queue_push_results(queue, *results);
 
                 // If we reset our pointers, then
                 // we should be able to continue on our loop
-                *msg = racomms_create_job_report_response_msg(rst->message_queue_number, rst->job_id, job_hash);
+                *results = racomms_create_results(racomms_create_job_report_response_msg(rst->message_queue_number, rst->job_id, job_hash));
             }
         }
 
-        *msg = racomms_msg_job_report_put_MemoryEntry(*msg,
-                                                        mem->offset + mem_sent,
-                                                        send_size,
-                                                        mem->value + mem_sent,
-                                                        mem_type);
+        if (queue)
+        {
+            // Reports that go out on a queue send guest RAM in place.
+            racomms_results_put_MemoryEntryRef(*results,
+                                               mem->offset + mem_sent,
+                                               send_size,
+                                               mem->value + mem_sent,
+                                               mem_type);
+        }
+        else
+        {
+            (*results)->msg = racomms_msg_job_report_put_MemoryEntry((*results)->msg,
+                                                                     mem->offset + mem_sent,
+                                                                     send_size,
+                                                                     mem->value + mem_sent,
+                                                                     mem_type);
+        }
 
         mem_sent += send_size;
     }
 }
 
-CommsMessage *build_rsave_report(RSaveTree *rst, SHA1_HASH_TYPE job_hash, JOB_REPORT_TYPE report_mask, CommsQueue *queue)
+CommsResultsItem *build_rsave_report(RSaveTree *rst, SHA1_HASH_TYPE job_hash, JOB_REPORT_TYPE report_mask, CommsQueue *queue)
 {
     // Variables
     uint8_t ncpu;
@@ -2667,16 +2728,30 @@ CommsMessage *build_rsave_report(RSaveTree *rst, SHA1_HASH_TYPE job_hash, JOB_RE
     MemoryDescriptor *m_next = NULL;
     RegisterDescriptor *r_next = NULL;
     const CPUArchIdList *cpus = NULL; 
-    CommsMessage *result_message = NULL;
+    CommsResultsItem *results = NULL;
 
     // Are we configured to send anything?
     if(!report_mask){
         return NULL;
     }
 
-    result_message = racomms_create_job_report_response_msg(rst->message_queue_number, rst->job_id, job_hash);
+    results = racomms_create_results(racomms_create_job_report_response_msg(rst->message_queue_number, rst->job_id, job_hash));
 
-    racomms_msg_job_report_put_InstructionCount(result_message, rst->icount);
+    racomms_msg_job_report_put_InstructionCount(results->msg, rst->icount);
+
+    if (rst->job_merged) {
+        racomms_msg_job_report_put_Flags(results->msg, JOB_RESULT_MERGED);
+    }
+
+    // The instance's totals so far, the controller can tell jobs apart
+    // by the difference between reports.
+    if (report_mask & JOB_REPORT_STATS) {
+        uint64_t values[JOB_STATS_NUM_VALUES];
+
+        ra_stats_snapshot(values);
+        results->msg = racomms_msg_job_report_put_StatsEntry(results->msg, values,
+                                                             JOB_STATS_NUM_PHASES, JOB_STATS_NUM_COUNTERS);
+    }
 
     // This following section of code will collect information from all CPUs
     // moving forward, we may want this separated out so that we report on only
@@ -2694,7 +2769,7 @@ CommsMessage *build_rsave_report(RSaveTree *rst, SHA1_HASH_TYPE job_hash, JOB_RE
             // Grab general information about the CPU.
             const CPUArchId *arch = &cpus->cpus[ncpu];
             if( report_mask & JOB_REPORT_PROCESSOR ) {
-                result_message = racomms_msg_job_report_put_ProcessorEntry(result_message,
+                results->msg = racomms_msg_job_report_put_ProcessorEntry(results->msg,
                                                                     ncpu,
                                                                     (uint8_t *)arch->type);
             }
@@ -2718,7 +2793,7 @@ CommsMessage *build_rsave_report(RSaveTree *rst, SHA1_HASH_TYPE job_hash, JOB_RE
                     QLIST_FOREACH_SAFE(reg_desc, &reg_list, next, r_next)
                     {
                         // Put the data on the message
-                        result_message = racomms_msg_job_report_put_RegisterEntry(result_message,
+                        results->msg = racomms_msg_job_report_put_RegisterEntry(results->msg,
                                                                                 reg_desc->reg_id,
                                                                                 (uint8_t *)reg_desc->reg_name,
                                                                                 reg_desc->reg_size,
@@ -2742,7 +2817,7 @@ CommsMessage *build_rsave_report(RSaveTree *rst, SHA1_HASH_TYPE job_hash, JOB_RE
         QLIST_FOREACH_SAFE(mem_desc, &memory_segments, next, m_next)
         {
             // Add them to the result message
-            append_memory_and_segment_message(rst, queue, &result_message, mem_desc, job_hash, JOB_REPORT_PHYSICAL_MEMORY);
+            append_memory_and_segment_message(rst, queue, &results, mem_desc, job_hash, JOB_REPORT_PHYSICAL_MEMORY);
             QLIST_REMOVE(mem_desc, next);
             g_free(mem_desc);
         }
@@ -2752,14 +2827,17 @@ CommsMessage *build_rsave_report(RSaveTree *rst, SHA1_HASH_TYPE job_hash, JOB_RE
         MemoryList memory_segments;
 
         QLIST_INIT(&memory_segments);
-        ram_rapid_get_ram_blocks_deltas(&memory_segments);
+        ram_rapid_get_ram_blocks_deltas(rst, &memory_segments, report_mask & JOB_REPORT_ENCODED_MEMORY);
 
         // Loop through the memory segments  
         QLIST_FOREACH_SAFE(mem_desc, &memory_segments, next, m_next)
         {
             // Add them to the result message
-            append_memory_and_segment_message(rst, queue, &result_message, mem_desc, job_hash, JOB_REPORT_PHYSICAL_MEMORY);
+            append_memory_and_segment_message(rst, queue, &results, mem_desc, job_hash, JOB_REPORT_PHYSICAL_MEMORY);
             QLIST_REMOVE(mem_desc, next);
+            if (mem_desc->encoding != MEMORY_ENCODING_RAW) {
+                g_free(mem_desc->value);
+            }
             g_free(mem_desc);
         }
     }
@@ -2778,7 +2856,7 @@ CommsMessage *build_rsave_report(RSaveTree *rst, SHA1_HASH_TYPE job_hash, JOB_RE
 
     if (rapid_analysis_has_error())
     {
-        result_message = racomms_msg_job_report_put_Error(result_message,
+        results->msg = racomms_msg_job_report_put_Error(results->msg,
                                                           rapid_analysis_get_error_id(),
                                                           rapid_analysis_get_error_loc(), 
                                                           rapid_analysis_get_error_text());
@@ -2786,10 +2864,24 @@ CommsMessage *build_rsave_report(RSaveTree *rst, SHA1_HASH_TYPE job_hash, JOB_RE
 
     if (report_mask & JOB_REPORT_EXCEPTION)
     {
-        result_message = racomms_msg_job_report_put_Exception(result_message, rst->exceptions_occurred);
+        results->msg = racomms_msg_job_report_put_Exception(results->msg, rst->exceptions_occurred);
     }
 
-    return result_message;
+    if ((report_mask & JOB_REPORT_COVERAGE) && rst->coverage_map)
+    {
+        results->msg = racomms_msg_job_report_put_CoverageEntry(results->msg, rst->coverage_map, rst->coverage_bits);
+    }
+
+    return results;
+}
+
+// The job's code has stopped running, what follows is overhead.
+static void end_execution(RSaveTree *rst)
+{
+    if (rst->job_started) {
+        ra_stats_end(RAPID_ANALYSIS_PHASE_EXECUTE, rst->job_started);
+        rst->job_started = 0;
+    }
 }
 
 void close_work(RSaveTree *rst, CPUState *cpu, SHA1_HASH_TYPE job_hash, bool send_results)
@@ -2797,21 +2889,22 @@ void close_work(RSaveTree *rst, CPUState *cpu, SHA1_HASH_TYPE job_hash, bool sen
     // We will clear the alarm now that the job is finished
     clear_alarm();
 
+    end_execution(rst);
+
     // Should we send the results to the queue?
     if(send_results && rst->send_to_queue) {
         CommsQueue *queue = get_comms_queue(rst->message_queue_number);
+        int64_t begin = ra_stats_begin();
 
         // Generate the result
-        CommsMessage *result_message = build_rsave_report(rst, job_hash, rst->job_report_mask, queue);
-
-        // Put together the work results
-        CommsResultsItem *work_results = g_new(CommsResultsItem, 1);
-        
-        // Set the message field in the work result.
-        work_results->msg = result_message;
-        
+        CommsResultsItem *work_results = build_rsave_report(rst, job_hash, rst->job_report_mask, queue);
+        ra_stats_end(RAPID_ANALYSIS_PHASE_REPORT, begin);
+
         // Send the response message out
-        queue_push_results(queue, work_results);
+        if (work_results)
+        {
+            queue_push_results(queue, work_results);
+        }
     }
 
     // If we should notify plugins, then do that.
@@ -2930,15 +3023,8 @@ static void save_work(RSaveTree *rst, CPUState *cpu, SHA1_HASH_TYPE state_hash)
         // Verify that we don't have trees or traces disabled.
         if (!rst->skip_tree || !rst->skip_trace)
         {
-            INSN_LABEL key;
-            memset(key, 0, sizeof(INSN_LABEL));
-
-            // Generate a key for the node placement in the trace - we'll use the program counter
-            if( cc->get_pc ){
-                snprintf(key, sizeof(INSN_LABEL), "%lx", cc->get_pc(cpu));
-            }else{
-                snprintf(key, sizeof(INSN_LABEL), "%lx", rst->icount);
-            }
+            // The node is placed in the trace by its program counter
+            uint64_t key = cc->get_pc ? cc->get_pc(cpu) : rst->icount;
 
             rcc->insert_analysis(rst, new_child, key);
         }
@@ -2955,9 +3041,104 @@ static void save_work(RSaveTree *rst, CPUState *cpu, SHA1_HASH_TYPE state_hash)
     }
 }
 
+/**
+ * Ends a job on a state that is already known. The report points at that
+ * state, which is only written out if the vmstate file does not have it
+ * yet, such as one that was traced but never saved.
+ */
+static void merge_work(RSaveTree *rst, CPUState *cpu, RSaveTreeNode *node)
+{
+    RSaveTreeClass *rcc = RSAVE_TREE_GET_CLASS(rst);
+    VMStateFileClass *vmstate_file_class = VMSTATE_FILE_GET_CLASS(rst->vm_state_file);
+
+    vm_stop(RUN_STATE_PAUSED);
+    end_execution(rst);
+
+    if (!vmstate_file_class->has_state(rst->vm_state_file, node->hash))
+    {
+        rcc->write_node_state(rst, node, NULL);
+
+        if (!rst->skip_blocks)
+        {
+            rsave_write_block_state(rst, node->hash);
+        }
+    }
+
+    rst->job_merged = true;
+    ra_stats_count(JOB_STATS_MERGED_JOBS, 1);
+
+    // Report the session results.
+    close_work(rst, cpu, node->hash, true);
+}
+
+/**
+ * Brings the VM back to the state it was loaded from without a full reset.
+ * Only the RAM pages marked dirty since that load are copied back, from the
+ * pristine copy in forkserver mode or the reference states otherwise, after
+ * which the device sections are reloaded straight from the node's index.
+ */
+static int restore_dirty_state(RSaveTree *rst, RSaveTreeNode *node)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    VMStateIndexEntry *e;
+    SaveStateEntry *se;
+    uint8_t *peek_buf;
+    QEMUFile *f;
+    int ret;
+
+    if (rst->forkserver) {
+        ret = ram_rapid_restore_pristine_pages();
+    } else {
+        ret = ram_rapid_restore_dirty_pages(rst);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    ra_stats_count(JOB_STATS_BYTES_RESTORED, (uint64_t) ret * qemu_target_page_size());
+    ret = 0;
+
+    cpu_synchronize_all_pre_loadvm();
+
+    QLIST_FOREACH(e, &node->device_list, next) {
+        QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+            if (se->section_id == e->section_id && !strcmp(se->idstr, e->idstr)) {
+                break;
+            }
+        }
+
+        // Iterative sections (RAM) were taken care of above.
+        if (!se || se->is_ram) {
+            continue;
+        }
+
+        f = qemu_fopen_ops(node->vm_state, &memory_channel_input_ops);
+        qemu_update_position(f, e->offset);
+
+        // Sections skipped during the save still carry a stale offset.
+        if (qemu_peek_buffer(f, &peek_buf, 5, 0) != 5 ||
+            peek_buf[0] != QEMU_VM_SECTION_FULL ||
+            ldl_be_p(&peek_buf[1]) != e->section_id) {
+            qemu_fclose(f);
+            continue;
+        }
+        qemu_file_skip(f, 1);
+
+        ret = qemu_loadvm_section_start_full(f, mis);
+        qemu_fclose(f);
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    cpu_synchronize_all_post_init();
+
+    return ret;
+}
+
 static bool process_work_msg(RSaveTree *rst, CommsMessage *work_msg, Error **errp)
 { 
     int ret;
+    bool fast_restore = false;
     QEMUFile *f;
     Error *err = NULL;
     QDict *qdict = NULL;
@@ -2978,6 +3159,7 @@ static bool process_work_msg(RSaveTree *rst, CommsMessage *work_msg, Error **err
 
             // Reset all values back to their config value.
             rst_class->reset_job(rst, msg->queue, msg->job_id, msg->flags);
+            ra_stats_count(JOB_STATS_JOBS, 1);
 
             // Is this a continuation of the previous job?
             if( rst->job_flags & JOB_FLAG_CONTINUE ){
@@ -2986,6 +3168,10 @@ static bool process_work_msg(RSaveTree *rst, CommsMessage *work_msg, Error **err
 
             memcpy(rst->job_hash, msg->base_hash, sizeof(SHA1_HASH_TYPE));
 
+            // Jobs sharing the base we already have loaded only need their changes undone.
+            fast_restore = (rst->fast_restore || rst->forkserver) && rst->state_restorable &&
+                !memcmp(rst->active_hash, rst->job_hash, sizeof(SHA1_HASH_TYPE));
+
             // We will load the VM State into the target node.
             if (!vmstate_file_class->load_from_hash(rst->vm_state_file, &work_node, rst->job_hash)) {
                 error_setg(errp, "Error while loading state from hash");
@@ -3004,6 +3190,7 @@ static bool process_work_msg(RSaveTree *rst, CommsMessage *work_msg, Error **err
 
             rst->job_id = msg->job_id;
             rst->job_report_mask = msg->report_mask;
+            rst->job_merged = false;
             memcpy(rst->job_hash, msg->job_hash, sizeof(SHA1_HASH_TYPE));
 
             // If the job isn't invalid then proceed to load it.
@@ -3041,6 +3228,8 @@ static bool process_work_msg(RSaveTree *rst, CommsMessage *work_msg, Error **err
 
     if (!rst->skip_blocks)
     {
+        int64_t begin = ra_stats_begin();
+
         // Open the blocks file
         opts = qemu_opts_create(bdrv_ibf.create_opts, NULL, 0, NULL);
         qdict = qemu_opts_to_qdict_filtered(opts, NULL, bdrv_ibf.create_opts, true);
@@ -3053,24 +3242,42 @@ static bool process_work_msg(RSaveTree *rst, CommsMessage *work_msg, Error **err
 
         bdrv_unref(blocks);
         qemu_opts_del(opts);
+        ra_stats_end(RAPID_ANALYSIS_PHASE_BLOCK_RESTORE, begin);
     }
 
-    f = rst_class->load_from_node(rst, work_node);
-    if (!f) {
-        error_setg(errp, "Could not load state from node.");
-        object_unref(OBJECT(work_node));
-        return false;
+    if (fast_restore) {
+        aio_context_acquire(aio_context);
+        fast_restore = (restore_dirty_state(rst, work_node) >= 0);
+        aio_context_release(aio_context);
     }
 
-    // Flush all IO requests so they don't interfere with the new state.
-    // Then prepare the system to do a load.
-    qemu_system_reset(SHUTDOWN_CAUSE_NONE);
-    mis->from_src_file = f;
+    if (fast_restore) {
+        ret = 0;
+    } else {
+        rst->state_restorable = false;
 
-    aio_context_acquire(aio_context);
-    ret = qemu_loadvm_state(f);
-    migration_incoming_state_destroy();
-    aio_context_release(aio_context);
+        f = rst_class->load_from_node(rst, work_node);
+        if (!f) {
+            error_setg(errp, "Could not load state from node.");
+            object_unref(OBJECT(work_node));
+            return false;
+        }
+
+        // Flush all IO requests so they don't interfere with the new state.
+        // Then prepare the system to do a load.
+        qemu_system_reset(SHUTDOWN_CAUSE_NONE);
+        mis->from_src_file = f;
+
+        aio_context_acquire(aio_context);
+        ret = qemu_loadvm_state(f);
+        migration_incoming_state_destroy();
+        aio_context_release(aio_context);
+
+        rst->state_restorable = (ret >= 0);
+        if (rst->state_restorable && rst->forkserver) {
+            ram_rapid_save_pristine();
+        }
+    }
 
     bdrv_drain_all_end();
     qemu_mutex_unlock_iothread();
@@ -3097,23 +3304,33 @@ bool load_work(CPUState *cpu, RSaveTree *rst)
     WorkEntryItem *next_entry = NULL;
     Error *local_error = NULL;
     RSaveTreeClass *rst_class = RSAVE_TREE_GET_CLASS(rst);
+    int64_t begin;
 
-    CommsQueue *message_queue = get_comms_queue(rst->message_queue_number);
+    CommsQueue *message_queue = NULL;
 
-    // Check if there is work waiting in the queue
-    if (!queue_has_work(message_queue))
+    // Check if there is work waiting on any queue
+    if (!racomms_has_any_work())
     {
         // We should tell the plugin system that we
         // are idle so that plugins may potentially send work
         notify_ra_idle();
     }
 
-    // Pull work off the queue - This will block
-    work = queue_pop_work(message_queue);
+    // Pull work off the next queue in turn - This will block
+    work = racomms_pop_any_work(&message_queue);
+    ra_stats_end(RAPID_ANALYSIS_PHASE_QUEUE_WAIT, work->queued);
+
+    // Results go back out on the queue the work came in on.
+    rst->message_queue_number = queue_get_id(message_queue);
 
     CommsMessage *msg = ((CommsMessage *)work->msg);
 
     if( msg->msg_id == MSG_REQUEST_QUIT ){
+        // States may still be queued for the vmstate file
+        if( rst->vm_state_file ){
+            VMStateFileClass *vmstate_file_class = VMSTATE_FILE_GET_CLASS(rst->vm_state_file);
+            vmstate_file_class->flush(rst->vm_state_file);
+        }
         qemu_system_shutdown_request(SHUTDOWN_CAUSE_HOST_UI);
         goto load_end;
     }
@@ -3121,10 +3338,15 @@ bool load_work(CPUState *cpu, RSaveTree *rst)
     autostart = 0;
     qemu_wait_for_runstate_change(RUN_STATE_PAUSED);
 
+    // The last report may still be sending guest RAM in place.
+    racomms_wait_results_sent();
+
+    begin = ra_stats_begin();
     if( !process_work_msg(rst, msg, &local_error) ){
         error_report_err(local_error);
         goto load_end;
     }
+    ra_stats_end(RAPID_ANALYSIS_PHASE_LOAD, begin);
 
     // We need some considerations initialized in the CPU to perform work
     // and provide reports
@@ -3215,6 +3437,14 @@ bool load_work(CPUState *cpu, RSaveTree *rst)
                     rst->job_timeout = timeout_setup->timeout;
                 }   
                 break; 
+            case JOB_ADD_REPORT_MASK:
+                {
+                    // Cast the buffer and get the report this job wants
+                    CommsRequestJobAddReportMaskSetup *report_setup;
+                    report_setup = (CommsRequestJobAddReportMaskSetup *)MSG_OFFSET(work->msg, entry->offset);
+                    rst->job_report_mask = report_setup->report_mask;
+                }
+                break;
             default:
                 break;
         }
@@ -3240,6 +3470,11 @@ bool load_work(CPUState *cpu, RSaveTree *rst)
             rst_class->start_analysis(rst);
         }
 
+        // Each job gets its own coverage map.
+        if (rst->coverage_map) {
+            rst_class->reset_coverage(rst);
+        }
+
         // Proceed to execute the work
         rst->has_work = true;
         if (work)
@@ -3250,6 +3485,8 @@ bool load_work(CPUState *cpu, RSaveTree *rst)
         // Set the alarm
         set_alarm(rst->job_timeout);
 
+        rst->job_started = ra_stats_begin();
+
         if (runstate_check(RUN_STATE_INMIGRATE)) {
             autostart = 1;
         } else {
@@ -3276,15 +3513,28 @@ void increment_snapshot_rsave(CPUState *cpu, RSaveTree *rst, TranslationBlock *t
     // Start verification
     if (rst->has_work)
     {
+        // Increment the iteration
+        rcc->increment_iteration(rst, tb);
+
+        // The vCPU may have switched processes while in this block.
+        if (rst->coverage_process)
+        {
+            rcc->update_coverage(rst, cpu);
+        }
+
+        // Most blocks neither end the job nor produce a state,
+        // those go straight back to the guest without the locks.
+        if (!rcc->update_due(rst, cpu))
+        {
+            return;
+        }
+
         // Lock the tree
         rcc->lock_tree(rst);
 
         // Some functions that we may call require the IO thread to be locked
         qemu_mutex_lock_iothread();
 
-        // Increment the iteration
-        rcc->increment_iteration(rst, tb);
-
         // Check the iteration number to determine if we should stop executing
         // Also make sure there was no exception or internal errors.
         if (!rapid_analysis_has_error() &&
@@ -3300,21 +3550,21 @@ void increment_snapshot_rsave(CPUState *cpu, RSaveTree *rst, TranslationBlock *t
                 // Verify that we don't have trace collection disabled
                 if (!rst->skip_trace)
                 {
-                    INSN_LABEL key;
-
-                    // Clear the key
-                    memset(key, 0, sizeof(INSN_LABEL));
+                    // The node is placed in the tree by its program counter
+                    uint64_t key = cpu_class->get_pc ? cpu_class->get_pc(cpu) : rst->icount;
+                    bool merge;
 
                     new_child = create_node_of_current_state(cpu, rst);
 
-                    // Generate a key for the node placement in the tree - we'll use the program counter
-                    if( cpu_class->get_pc ){
-                        snprintf(key, sizeof(INSN_LABEL), "%lx", cpu_class->get_pc(cpu));
-                    }else{
-                        snprintf(key, sizeof(INSN_LABEL), "%lx", rst->icount);
-                    }
+                    merge = rcc->merge_due(rst, new_child);
 
                     rcc->insert_analysis(rst, new_child, key);
+
+                    // The rest of this job was run before from here.
+                    if (merge)
+                    {
+                        merge_work(rst, cpu, new_child);
+                    }
                 }
             }
         }
@@ -3326,6 +3576,7 @@ void increment_snapshot_rsave(CPUState *cpu, RSaveTree *rst, TranslationBlock *t
             memset(state_hash, 0, sizeof(SHA1_HASH_TYPE));
 
             vm_stop(RUN_STATE_PAUSED);
+            end_execution(rst);
 
             save_work(rst, cpu, state_hash);
 
@@ -3535,6 +3786,13 @@ int save_snapshot_rsave(const char *filename, Error **errp)
 
     // We will open a new VM State file and write to it.
     vmstate_file = vmstate_file_new(rsave_vmstate);
+    if (!vmstate_file) {
+        error_setg(errp, "Could not open %s", rsave_vmstate);
+        goto the_end;
+    }
+    if (!VMSTATE_FILE_GET_CLASS(vmstate_file)->check_hash_engine(vmstate_file, errp)) {
+        goto the_end;
+    }
 
     /**
      * We want to setup a memory channel to contain all of the
@@ -3807,9 +4065,20 @@ int load_snapshot_rsave(const char *filename, SHA1_HASH_TYPE *hash, Error **errp
 
     // We will open a new VM State file and write to it.
     vmstate_file = vmstate_file_new(rst->vmstate_file_path);
+    if (!vmstate_file) {
+        error_setg(errp, "Could not open %s", rst->vmstate_file_path);
+        return -1;
+    }
 
     // Have the VM State file, load the state into the node
     vmstate_file_class = VMSTATE_FILE_GET_CLASS(vmstate_file);
+    if (!vmstate_file_class->check_hash_engine(vmstate_file, errp)) {
+        object_unref(OBJECT(vmstate_file));
+        return -1;
+    }
+    vmstate_file_class->set_map_states(vmstate_file, rst->map_states);
+    vmstate_file_class->set_async_writes(vmstate_file, rst->async_writes);
+    vmstate_file_class->set_cache_limit(vmstate_file, rst->state_cache_limit);
     bool node_found = false;
     if(hash){
         node_found = vmstate_file_class->load_from_hash(vmstate_file, &initial_node, *hash);
@@ -3849,6 +4118,11 @@ int load_snapshot_rsave(const char *filename, SHA1_HASH_TYPE *hash, Error **errp
 
     bdrv_drain_all_end();
 
+    rst->state_restorable = (ret >= 0);
+    if (rst->state_restorable && rst->forkserver) {
+        ram_rapid_save_pristine();
+    }
+
     if(!rst->skip_tree || !rst->skip_trace) {
         rst_class->load_new_analysis(rst, initial_node);
     }
@@ -18,68 +18,483 @@
 
 #include "vmstate-file.h"
 #include "rsave-tree-node.h"
+#include "ra-stats.h"
 #include "qemu/error-report.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include "cromulence/inlines.h"
 
 #include <stdlib.h>
 #include <string.h>
 
 typedef struct VMStateNodeCache{
-    bool loaded;
     uint64_t index;
     RSaveTreeNode *node;
-    QSIMPLEQ_ENTRY(VMStateNodeCache) next;
+    // Pool memory charged to the cache for the node.
+    size_t size;
+    bool protected;
+    QTAILQ_ENTRY(VMStateNodeCache) next;
 } VMStateNodeCache;
 
+// Share of the cache limit the protected segment may take up.
+#define VMSTATE_CACHE_PROTECTED_SHARE(limit) ((limit) / 5 * 4)
+
+// The RAM page table of a saved state, as read from the pages file.
+typedef struct VMStatePageTable {
+    uint64_t state_offset;
+    uint64_t num_pages;
+    RSaveTreeNodePage *pages;
+} VMStatePageTable;
+
+// A node waiting for the writer thread
+typedef struct VMStateWrite {
+    RSaveTreeNode *node;
+    QSIMPLEQ_ENTRY(VMStateWrite) next;
+} VMStateWrite;
+
 struct VMStateFile {
     Object obj; 
     FILE *fp;
     uint64_t current_header_loc;
-    uint64_t current_index;
-    QSIMPLEQ_HEAD(node_cache, VMStateNodeCache) node_cache;
+    bool map_states;
+    RSaveHashEngine hash_engine;
+
+    // Nodes kept in memory, as a segmented LRU. Nodes start out on
+    // probation and are protected once they are asked for again, so the
+    // states jobs keep starting from outlive the ones saved once. Both
+    // lists run from least to most recently used.
+    QemuMutex cache_lock;
+    QTAILQ_HEAD(, VMStateNodeCache) cache_probation;
+    QTAILQ_HEAD(, VMStateNodeCache) cache_protected;
+    GHashTable *cache_by_hash;
+    GHashTable *cache_by_index;
+    GHashTable *cache_by_job;
+    uint64_t cache_limit;
+    uint64_t cache_size;
+    uint64_t cache_protected_size;
+    // Part of the size held by nodes in use outside the cache.
+    uint64_t cache_held_size;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_evictions;
+
+    // Segment index, records are stored by their position in the file.
+    FILE *index_fp;
+    GArray *records;
+    GHashTable *hash_index;
+    GHashTable *job_index;
+
+    // Page tables of reference states, loaded as they are asked for.
+    FILE *pages_fp;
+    GHashTable *page_tables;
+
+    // Held while the file or the index is in use, the writer thread
+    // appends nodes under it.
+    QemuMutex lock;
+
+    // Nodes queued for the writer thread and the ones it has written.
+    // Written nodes are released by the caller, not by the writer, as
+    // their memory goes back to the channel pool.
+    bool async_writes;
+    bool writer_quit;
+    QemuThread writer;
+    QemuMutex write_lock;
+    QemuCond write_cond;
+    QemuCond written_cond;
+    uint64_t writes_pending;
+    QSIMPLEQ_HEAD(, VMStateWrite) write_queue;
+    QSIMPLEQ_HEAD(, VMStateWrite) written;
 };
 
+// Nodes that were never written to the file can't be found by index.
+#define VMSTATE_INDEX_UNSAVED (UINT64_MAX)
+
+static size_t vmstate_cache_footprint(RSaveTreeNode *node)
+{
+    MemoryChannelClass *mcc;
+
+    if (!node->vm_state) {
+        return 0;
+    }
+    mcc = MEMORY_CHANNEL_GET_CLASS(node->vm_state);
+    return mcc->get_footprint(node->vm_state);
+}
+
+static void vmstate_cache_unlink(VMStateFile *file, VMStateNodeCache *entry)
+{
+    if (entry->protected) {
+        QTAILQ_REMOVE(&file->cache_protected, entry, next);
+        file->cache_protected_size -= entry->size;
+    } else {
+        QTAILQ_REMOVE(&file->cache_probation, entry, next);
+    }
+    file->cache_size -= entry->size;
+}
+
+static void vmstate_cache_link(VMStateFile *file, VMStateNodeCache *entry, bool protected)
+{
+    entry->protected = protected;
+    if (protected) {
+        QTAILQ_INSERT_TAIL(&file->cache_protected, entry, next);
+        file->cache_protected_size += entry->size;
+    } else {
+        QTAILQ_INSERT_TAIL(&file->cache_probation, entry, next);
+    }
+    file->cache_size += entry->size;
+}
+
+static void vmstate_cache_remove(VMStateFile *file, VMStateNodeCache *entry)
+{
+    vmstate_cache_unlink(file, entry);
+
+    g_hash_table_remove(file->cache_by_hash, entry->node->hash);
+    if (entry->index != VMSTATE_INDEX_UNSAVED) {
+        g_hash_table_remove(file->cache_by_index, &entry->index);
+    }
+    if (g_hash_table_lookup(file->cache_by_job, GINT_TO_POINTER(entry->node->job_id)) == entry) {
+        g_hash_table_remove(file->cache_by_job, GINT_TO_POINTER(entry->node->job_id));
+    }
+
+    object_unref(OBJECT(entry->node));
+    g_free(entry);
+}
+
+// Whether something besides the cache, a trace or a job, is using the
+// node. Dropping it would not give any memory back.
+static bool vmstate_cache_held(VMStateNodeCache *entry)
+{
+    return atomic_read(&OBJECT(entry->node)->ref) > 1;
+}
+
+static void vmstate_cache_measure_entry(VMStateFile *file, VMStateNodeCache *entry)
+{
+    entry->size = vmstate_cache_footprint(entry->node);
+    file->cache_size += entry->size;
+    if (entry->protected) {
+        file->cache_protected_size += entry->size;
+    }
+    if (vmstate_cache_held(entry)) {
+        file->cache_held_size += entry->size;
+    }
+}
+
+// Measures every node again, loading or sending a state unpacks its
+// channel and closing it packs it back.
+static void vmstate_cache_measure(VMStateFile *file)
+{
+    VMStateNodeCache *entry;
+
+    file->cache_size = 0;
+    file->cache_protected_size = 0;
+    file->cache_held_size = 0;
+    QTAILQ_FOREACH(entry, &file->cache_probation, next) {
+        vmstate_cache_measure_entry(file, entry);
+    }
+    QTAILQ_FOREACH(entry, &file->cache_protected, next) {
+        vmstate_cache_measure_entry(file, entry);
+    }
+}
+
+// Nodes in use are kept whatever the limit, so only the rest counts
+// against it.
+static bool vmstate_cache_over_limit(VMStateFile *file)
+{
+    return (file->cache_limit && file->cache_size > file->cache_held_size + file->cache_limit) ||
+           memory_channel_test_and_set_pool_limit();
+}
+
+// The least recently used entry that nothing else is holding on to.
+static VMStateNodeCache *vmstate_cache_victim(VMStateFile *file, VMStateNodeCache *keep)
+{
+    VMStateNodeCache *entry;
+
+    QTAILQ_FOREACH(entry, &file->cache_probation, next) {
+        if (entry != keep && !vmstate_cache_held(entry)) {
+            return entry;
+        }
+    }
+    QTAILQ_FOREACH(entry, &file->cache_protected, next) {
+        if (entry != keep && !vmstate_cache_held(entry)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Evicts one node at a time until we are back under the limits.
+static void vmstate_cache_evict(VMStateFile *file, VMStateNodeCache *keep)
+{
+    VMStateNodeCache *entry;
+
+    vmstate_cache_measure(file);
+    while (vmstate_cache_over_limit(file) && (entry = vmstate_cache_victim(file, keep))) {
+        vmstate_cache_remove(file, entry);
+        file->cache_evictions++;
+    }
+}
+
+// Moves a node that was asked for again to the protected segment,
+// which hands its oldest entries back to probation once it is full.
+static void vmstate_cache_touch(VMStateFile *file, VMStateNodeCache *entry)
+{
+    VMStateNodeCache *oldest;
+
+    vmstate_cache_unlink(file, entry);
+
+    // Unpacking or loading may have changed what the node holds.
+    entry->size = vmstate_cache_footprint(entry->node);
+    vmstate_cache_link(file, entry, true);
+
+    while (file->cache_limit &&
+           file->cache_protected_size > VMSTATE_CACHE_PROTECTED_SHARE(file->cache_limit) &&
+           (oldest = QTAILQ_FIRST(&file->cache_protected)) != entry) {
+        vmstate_cache_unlink(file, oldest);
+        vmstate_cache_link(file, oldest, false);
+    }
+}
+
+// Returns a referenced node from the cache, if it is there.
+static RSaveTreeNode *vmstate_cache_lookup(VMStateFile *file, GHashTable *table, gconstpointer key)
+{
+    VMStateNodeCache *entry;
+    RSaveTreeNode *node = NULL;
+
+    qemu_mutex_lock(&file->cache_lock);
+    entry = g_hash_table_lookup(table, key);
+    if (entry) {
+        vmstate_cache_touch(file, entry);
+        node = entry->node;
+        object_ref(OBJECT(node));
+        file->cache_hits++;
+    }
+    qemu_mutex_unlock(&file->cache_lock);
+
+    return node;
+}
+
+static void vmstate_cache_miss(VMStateFile *file)
+{
+    qemu_mutex_lock(&file->cache_lock);
+    file->cache_misses++;
+    qemu_mutex_unlock(&file->cache_lock);
+}
+
+// The cache takes over the caller's reference to the node.
 static void vmstate_cache_insert(VMStateFile *file, uint64_t index, RSaveTreeNode *node)
 {
     VMStateNodeCache *entry;
 
+    qemu_mutex_lock(&file->cache_lock);
+
+    // A state we already hold is only given its index.
+    entry = g_hash_table_lookup(file->cache_by_hash, node->hash);
+    if (entry) {
+        if (entry->index == VMSTATE_INDEX_UNSAVED && index != VMSTATE_INDEX_UNSAVED) {
+            entry->index = index;
+            g_hash_table_insert(file->cache_by_index, &entry->index, entry);
+        }
+        qemu_mutex_unlock(&file->cache_lock);
+        object_unref(OBJECT(node));
+        return;
+    }
+
     entry = g_new0(VMStateNodeCache,1);
-    entry->loaded = false;
     entry->node = node;
     entry->index = index;
-    QSIMPLEQ_INSERT_TAIL(&file->node_cache, entry, next);
+    entry->size = vmstate_cache_footprint(node);
+    vmstate_cache_link(file, entry, false);
+
+    g_hash_table_insert(file->cache_by_hash, node->hash, entry);
+    if (index != VMSTATE_INDEX_UNSAVED) {
+        g_hash_table_insert(file->cache_by_index, &entry->index, entry);
+    }
+    if (!g_hash_table_contains(file->cache_by_job, GINT_TO_POINTER(node->job_id))) {
+        g_hash_table_insert(file->cache_by_job, GINT_TO_POINTER(node->job_id), entry);
+    }
+
+    // Make room for it, without throwing out the node we just added.
+    vmstate_cache_evict(file, entry);
+
+    qemu_mutex_unlock(&file->cache_lock);
 }
 
-static void vmstate_cache_purge(VMStateFile *file)
+static void vmstate_cache_force_purge(VMStateFile *file)
 {
     VMStateNodeCache *entry;
-    VMStateNodeCache *next_entry;
 
-    if(!QSIMPLEQ_EMPTY(&file->node_cache)) {
-        QSIMPLEQ_FOREACH_SAFE(entry, &file->node_cache, next, next_entry) {
-            if(entry->loaded){
-                entry->loaded = false;
-            }else{
-                QSIMPLEQ_REMOVE(&file->node_cache, entry, VMStateNodeCache, next);
-                object_unref(OBJECT(entry->node));
-                g_free(entry);
-            }
-        }
+    qemu_mutex_lock(&file->cache_lock);
+    while ((entry = QTAILQ_FIRST(&file->cache_probation)) != NULL) {
+        vmstate_cache_remove(file, entry);
     }
+    while ((entry = QTAILQ_FIRST(&file->cache_protected)) != NULL) {
+        vmstate_cache_remove(file, entry);
+    }
+    qemu_mutex_unlock(&file->cache_lock);
 }
 
-static void vmstate_cache_force_purge(VMStateFile *file)
+static guint vmstate_index_hash_func(gconstpointer key)
 {
-    VMStateNodeCache *entry;
-    VMStateNodeCache *next_entry;
+    // The key is already a SHA1 so any part of it is a good hash.
+    return *(const guint *)key;
+}
+
+static gboolean vmstate_index_hash_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, sizeof(SHA1_HASH_TYPE));
+}
+
+static VMStateIndexRecord *vmstate_index_insert(VMStateFile *file, FileSegment *segment)
+{
+    VMStateIndexRecord record;
+    gpointer position;
+
+    memset(&record, 0, sizeof(record));
+    memcpy(&record.segment, segment, sizeof(FileSegment));
+    record.index = file->records->len;
+    g_array_append_val(file->records, record);
+
+    // Positions are stored off by one so that NULL means not found.
+    // Only the first occurrence is kept, the same as a scan of the file would find.
+    position = GUINT_TO_POINTER(record.index + 1);
+    if (!g_hash_table_contains(file->hash_index, segment->hash)) {
+        g_hash_table_insert(file->hash_index, g_memdup(segment->hash, sizeof(SHA1_HASH_TYPE)), position);
+    }
+    if (!g_hash_table_contains(file->job_index, GINT_TO_POINTER(segment->job_id))) {
+        g_hash_table_insert(file->job_index, GINT_TO_POINTER(segment->job_id), position);
+    }
+
+    return &g_array_index(file->records, VMStateIndexRecord, record.index);
+}
+
+static const VMStateIndexRecord *vmstate_index_lookup(VMStateFile *file, GHashTable *table, gconstpointer key)
+{
+    gpointer position = g_hash_table_lookup(table, key);
+    if (!position) {
+        return NULL;
+    }
+    return &g_array_index(file->records, VMStateIndexRecord, GPOINTER_TO_UINT(position) - 1);
+}
+
+static void vmstate_index_write_header(VMStateFile *file)
+{
+    VMStateIndexHeader header;
+
+    header.magic = VMSTATE_INDEX_MAGIC;
+    header.version = VMSTATE_INDEX_VERSION;
+    header.num_records = file->records->len;
+    header.current_header = file->current_header_loc;
+    header.hash_engine = file->hash_engine;
+
+    // Everything written so far counts, buffered or not.
+    fseek(file->fp, 0, SEEK_END);
+    header.file_size = ftell(file->fp);
+    fseek(file->fp, file->current_header_loc, SEEK_SET);
+
+    fseek(file->index_fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file->index_fp);
+    fflush(file->index_fp);
+}
+
+// Rewrites one record in place, the count in the header stays as it is.
+static void vmstate_index_write_record(VMStateFile *file, uint64_t index)
+{
+    if (!file->index_fp) {
+        return;
+    }
+
+    fseek(file->index_fp, sizeof(VMStateIndexHeader) + index * sizeof(VMStateIndexRecord), SEEK_SET);
+    fwrite(&g_array_index(file->records, VMStateIndexRecord, index), sizeof(VMStateIndexRecord), 1, file->index_fp);
+    fflush(file->index_fp);
+}
+
+static void vmstate_index_append(VMStateFile *file, FileSegment *segments, uint64_t count)
+{
+    uint64_t first = file->records->len;
+
+    for (uint64_t i = 0; i < count; i++) {
+        vmstate_index_insert(file, &segments[i]);
+    }
+
+    if (file->index_fp && count) {
+        // Write the records before the count so a partial update is never trusted.
+        fseek(file->index_fp, sizeof(VMStateIndexHeader) + first * sizeof(VMStateIndexRecord), SEEK_SET);
+        fwrite(&g_array_index(file->records, VMStateIndexRecord, first), sizeof(VMStateIndexRecord), count, file->index_fp);
+        vmstate_index_write_header(file);
+    }
+}
+
+// Opens the index and finds the header in progress. A current index
+// tells where that header is, otherwise the chain is walked and the
+// index rebuilt from it.
+static void vmstate_file_open_index(VMStateFile *file, const char *index_path)
+{
+    VMStateIndexHeader header;
+    VMStateIndexRecord record;
+    VMStateFileClass *vmstate_class = VMSTATE_FILE_GET_CLASS(file);
+    uint64_t file_size;
+    bool valid = false;
+
+    fseek(file->fp, 0, SEEK_END);
+    file_size = ftell(file->fp);
+
+    // A new file takes the engine in use. Files from before the engine
+    // was recorded, or that lost their index, were hashed with SHA1.
+    file->hash_engine = file_size > 0 ? RSAVE_HASH_ENGINE_SHA1 : rsave_hash_get_engine();
+
+    file->index_fp = fopen(index_path, "r+b");
+    if (file->index_fp)
+    {
+        bool current = fread(&header, sizeof(header), 1, file->index_fp) == 1 &&
+                       header.magic == VMSTATE_INDEX_MAGIC &&
+                       header.version == VMSTATE_INDEX_VERSION;
+
+        // Even a stale index knows what the states were hashed with.
+        if (current && file_size > 0) {
+            file->hash_engine = header.hash_engine;
+        }
+
+        // The index is only trusted when it was written along with the
+        // last change to the file, anything appended since shows in the size.
+        if (current &&
+            file_size > 0 &&
+            header.file_size == file_size &&
+            header.current_header + sizeof(VMFileHeader) <= file_size)
+        {
+            valid = true;
+            file->current_header_loc = header.current_header;
+            for (uint64_t i = 0; i < header.num_records; i++)
+            {
+                VMStateIndexRecord *r;
 
-    if(!QSIMPLEQ_EMPTY(&file->node_cache)) {
-        QSIMPLEQ_FOREACH_SAFE(entry, &file->node_cache, next, next_entry) {
-            QSIMPLEQ_REMOVE(&file->node_cache, entry, VMStateNodeCache, next);
-            object_unref(OBJECT(entry->node));
-            g_free(entry);
+                if (fread(&record, sizeof(record), 1, file->index_fp) != 1 || record.index != i) {
+                    valid = false;
+                    break;
+                }
+                r = vmstate_index_insert(file, &record.segment);
+                r->state_offset = record.state_offset;
+                r->pages_offset = record.pages_offset;
+                r->num_pages = record.num_pages;
+            }
+        }
+    }
+    else
+    {
+        file->index_fp = fopen(index_path, "w+b");
+        if (!file->index_fp) {
+            warn_report("Could not open vmstate index %s, it will be rebuilt on every start", index_path);
         }
     }
+
+    if (!valid)
+    {
+        vmstate_class->find_current_header(file);
+        vmstate_class->rebuild_index(file);
+    }
+
+    // Leave the file at the header in progress.
+    fseek(file->fp, file->current_header_loc, SEEK_SET);
 }
 
 /**
@@ -90,7 +505,6 @@ VMStateFile* vmstate_file_new(const char *file_path)
     // Variables
     FILE *fp;
     VMStateFile *ret_val;
-    VMStateFileClass *ret_class;
 
     // Allocate the new VM State File
     ret_val = VMSTATE_FILE(object_new(TYPE_VMSTATE_FILE));
@@ -120,9 +534,22 @@ VMStateFile* vmstate_file_new(const char *file_path)
         // Store the file pointer
         ret_val->fp = fp;
 
-        // Now, we set the file pointer to the header in progress
-        ret_class = VMSTATE_FILE_GET_CLASS(ret_val);
-        ret_class->find_current_header(ret_val);
+        // The page tables are only found through the index, open them first
+        char *pages_path = g_strconcat(file_path, VMSTATE_PAGES_SUFFIX, NULL);
+        ret_val->pages_fp = fopen(pages_path, "r+b");
+        if (!ret_val->pages_fp) {
+            ret_val->pages_fp = fopen(pages_path, "w+b");
+        }
+        if (!ret_val->pages_fp) {
+            warn_report("Could not open vmstate page tables %s, reference pages will be scanned for", pages_path);
+        }
+        g_free(pages_path);
+
+        // Bring up the lookup index that lives next to the file, it
+        // also sets the file pointer to the header in progress.
+        char *index_path = g_strconcat(file_path, VMSTATE_INDEX_SUFFIX, NULL);
+        vmstate_file_open_index(ret_val, index_path);
+        g_free(index_path);
     }
 
     // All done
@@ -173,7 +600,7 @@ static void vmstate_file_find_current_header(VMStateFile *file)
 {
     // Used for sizing.
     VMFileHeader header;
-    uint64_t next_header_field_loc, next_header, file_size, skipped_headers;
+    uint64_t next_header_field_loc, next_header, file_size;
 
     // First check to see the size of the file
     fseek(file->fp, 0, SEEK_END);
@@ -184,7 +611,6 @@ static void vmstate_file_find_current_header(VMStateFile *file)
     {
         // Initialize the header
         next_header = 0;
-        skipped_headers = 0;
      
         // We'll reset to the begenning ad start looking forward.
         fseek(file->fp, 0, SEEK_SET);
@@ -203,12 +629,9 @@ static void vmstate_file_find_current_header(VMStateFile *file)
 
             // Read the header location.
             fread_checked(&next_header, sizeof(next_header), file->fp);
-            skipped_headers++;
     
         } while(next_header > 0);
 
-        file->current_index = (skipped_headers - 1) * SEGMENTS_PER_HEADER;
-
         // Advance to the current header
         fseek(file->fp, file->current_header_loc, SEEK_SET);
     }
@@ -219,435 +642,673 @@ static void vmstate_file_find_current_header(VMStateFile *file)
     }
 }
 
-static void vmstate_file_save_data(VMStateFile *file, RSaveTreeNode *node, uint64_t *out_index, bool nosave)
+// Appends the node to the file and fills in its segment. The index
+// is left to the caller so that it can be updated in batches.
+static void vmstate_file_append_node(VMStateFile *file, RSaveTreeNode *node, FileSegment *segment)
 {
-    uint64_t record_index = 0;
-    
-    // Should we flush to file? If not, then we'll just cache the save.
-    if( !nosave )
+    // We'll assume that there is already at least one header.
+    uint64_t num_segments = 0;
+    uint64_t new_num_segments = 0;
+    uint64_t new_segment = 0;
+    uint64_t new_segment_end = 0;
+
+    // Clear the memory
+    memset(segment, 0, sizeof(*segment));
+
+    // We'll let the node class do some of the work
+    RSaveTreeNodeClass *rstn_class = RSAVE_TREE_NODE_GET_CLASS(node);
+
+    // Read the current number of segments in this header
+    fread_checked(&num_segments, sizeof(num_segments), file->fp);
+
+    // Determine if we need to add a new header
+    if (num_segments >= SEGMENTS_PER_HEADER)
     {
-        // We'll assume that there is already at least one header.
-        FileSegment segment;
-        uint64_t num_segments = 0;
-        uint64_t new_num_segments = 0;
-        uint64_t new_segment = 0;
-        uint64_t new_segment_end = 0;
+        // we're about to add the first segment
+        // to the new section
+        num_segments = 0;
 
-        // Clear the memory
-        memset(&segment, 0, sizeof(segment));
+        // There is already code for adding a header
+        vmstate_file_add_header(file);
+    }
 
-        // We'll let the node class do some of the work
-        RSaveTreeNodeClass *rstn_class = RSAVE_TREE_NODE_GET_CLASS(node);
+    // Determine where the new segment will go
+    fseek(file->fp, 0, SEEK_END);
+    new_segment = ftell (file->fp); 
 
-        // Read the current number of segments in this header
-        fread_checked(&num_segments, sizeof(num_segments), file->fp);
+    // Since we are here, go ahead and write data
+    rstn_class->write_tree_node(node, file->fp);
 
-        // Determine if we need to add a new header
-        if (num_segments >= SEGMENTS_PER_HEADER)
-        {
-            // we're about to add the first segment
-            // to the new section
-            num_segments = 0;
+    // Collect the endpoint for segment size calculation
+    new_segment_end = ftell(file->fp);
+
+    // Calculate the segment size
+    memcpy(segment->hash, node->hash, sizeof(SHA1_HASH_TYPE));
+    segment->job_id = node->job_id;
+    segment->segment_pointer = new_segment;
+    segment->segment_size = new_segment_end - new_segment;
+    ra_stats_count(JOB_STATS_BYTES_WRITTEN, segment->segment_size);
+
+    // Go back to the current header and update the number of segments.
+    fseek(file->fp, file->current_header_loc, SEEK_SET);
+    new_num_segments = num_segments + 1;
+    fwrite(&new_num_segments, sizeof(new_num_segments), 1, file->fp);
 
-            // There is already code for adding a header
-            vmstate_file_add_header(file);
+    // Go to the segment where we will store the data location
+    // and write it.
+    fseek(file->fp , num_segments * sizeof(FileSegment) , SEEK_CUR);
+    fwrite(segment, sizeof(*segment), 1, file->fp);
+    
+    // Set the FP back to the current file header.
+    fseek(file->fp, file->current_header_loc, SEEK_SET);
+}
+
+static void *vmstate_file_writer(void *opaque)
+{
+    VMStateFile *file = opaque;
+    QSIMPLEQ_HEAD(, VMStateWrite) batch = QSIMPLEQ_HEAD_INITIALIZER(batch);
+    GArray *segments = g_array_new(false, false, sizeof(FileSegment));
+    VMStateWrite *write;
+
+    qemu_mutex_lock(&file->write_lock);
+    while (true) {
+        while (!file->writer_quit && QSIMPLEQ_EMPTY(&file->write_queue)) {
+            qemu_cond_wait(&file->write_cond, &file->write_lock);
         }
 
-        // Determine where the new segment will go
-        fseek(file->fp, 0, SEEK_END);
-        new_segment = ftell (file->fp); 
+        // Only stop once everything queued is in the file
+        if (QSIMPLEQ_EMPTY(&file->write_queue)) {
+            break;
+        }
 
-        // Since we are here, go ahead and write data
-        rstn_class->write_tree_node(node, file->fp);
+        // Whatever has queued up goes out together
+        QSIMPLEQ_CONCAT(&batch, &file->write_queue);
+        qemu_mutex_unlock(&file->write_lock);
 
-        // Collect the endpoint for segment size calculation
-        new_segment_end = ftell(file->fp);
+        qemu_mutex_lock(&file->lock);
+        g_array_set_size(segments, 0);
+        QSIMPLEQ_FOREACH(write, &batch, next) {
+            FileSegment segment;
+            vmstate_file_append_node(file, write->node, &segment);
+            g_array_append_val(segments, segment);
+        }
 
-        // Calculate the segment size
-        memcpy(segment.hash, node->hash, sizeof(SHA1_HASH_TYPE));
-        segment.job_id = node->job_id;
-        segment.segment_pointer = new_segment;
-        segment.segment_size = new_segment_end - new_segment;
+        // One index update and one sync for the whole batch
+        vmstate_index_append(file, (FileSegment *) segments->data, segments->len);
+        fflush(file->fp);
+        if (qemu_fdatasync(fileno(file->fp)) < 0 ||
+            (file->index_fp && qemu_fdatasync(fileno(file->index_fp)) < 0)) {
+            warn_report("Could not sync the vmstate file: %s", strerror(errno));
+        }
+        qemu_mutex_unlock(&file->lock);
 
-        // Go back to the current header and update the number of segments.
-        fseek(file->fp, file->current_header_loc, SEEK_SET);
-        new_num_segments = num_segments + 1;
-        fwrite(&new_num_segments, sizeof(new_num_segments), 1, file->fp);
+        qemu_mutex_lock(&file->write_lock);
+        QSIMPLEQ_CONCAT(&file->written, &batch);
+        file->writes_pending -= segments->len;
+        qemu_cond_broadcast(&file->written_cond);
+    }
+    qemu_mutex_unlock(&file->write_lock);
 
-        // Go to the segment where we will store the data location
-        // and write it.
-        fseek(file->fp , num_segments * sizeof(FileSegment) , SEEK_CUR);
-        fwrite(&segment, sizeof(segment), 1, file->fp);
-        
-        // Set the FP back to the current file header.
-        fseek(file->fp, file->current_header_loc, SEEK_SET);
+    g_array_free(segments, true);
+    return NULL;
+}
+
+// Drops the references held for nodes the writer thread is done with.
+static void vmstate_file_release_writes(VMStateFile *file)
+{
+    QSIMPLEQ_HEAD(, VMStateWrite) written = QSIMPLEQ_HEAD_INITIALIZER(written);
+    VMStateWrite *write, *next_write;
+
+    qemu_mutex_lock(&file->write_lock);
+    QSIMPLEQ_CONCAT(&written, &file->written);
+    qemu_mutex_unlock(&file->write_lock);
+
+    QSIMPLEQ_FOREACH_SAFE(write, &written, next, next_write) {
+        object_unref(OBJECT(write->node));
+        g_free(write);
+    }
+}
+
+// Waits for every queued node to be in the file.
+static void vmstate_file_flush(VMStateFile *file)
+{
+    qemu_mutex_lock(&file->write_lock);
+    while (file->writes_pending) {
+        qemu_cond_wait(&file->written_cond, &file->write_lock);
+    }
+    qemu_mutex_unlock(&file->write_lock);
+
+    vmstate_file_release_writes(file);
+}
+
+static void vmstate_file_stop_writer(VMStateFile *file)
+{
+    qemu_mutex_lock(&file->write_lock);
+    file->writer_quit = true;
+    qemu_cond_signal(&file->write_cond);
+    qemu_mutex_unlock(&file->write_lock);
+
+    // The writer drains the queue before it exits
+    qemu_thread_join(&file->writer);
+    vmstate_file_release_writes(file);
+}
+
+static void vmstate_file_set_async_writes(VMStateFile *file, bool async_writes)
+{
+    if (async_writes == file->async_writes) {
+        return;
     }
 
-    record_index = ++file->current_index;
+    if (async_writes) {
+        file->writer_quit = false;
+        qemu_thread_create(&file->writer, "vmstate writer", vmstate_file_writer,
+                           file, QEMU_THREAD_JOINABLE);
+    } else {
+        vmstate_file_stop_writer(file);
+    }
+    file->async_writes = async_writes;
+}
+
+static void vmstate_file_save_data(VMStateFile *file, RSaveTreeNode *node, uint64_t *out_index, bool nosave)
+{
+    uint64_t record_index = VMSTATE_INDEX_UNSAVED;
+    
+    // Should we flush to file? If not, then we'll just cache the save.
+    if( !nosave )
+    {
+        // The writer can't tell us where the node ends up, so only
+        // hand it nodes nobody wants the index of.
+        if( file->async_writes && !out_index )
+        {
+            VMStateWrite *write = g_new0(VMStateWrite, 1);
+
+            object_ref(OBJECT(node));
+            write->node = node;
+
+            qemu_mutex_lock(&file->write_lock);
+            QSIMPLEQ_INSERT_TAIL(&file->write_queue, write, next);
+            file->writes_pending++;
+            qemu_cond_signal(&file->write_cond);
+            qemu_mutex_unlock(&file->write_lock);
+        }
+        else
+        {
+            FileSegment segment;
+
+            // Keep the file in the order the nodes were saved
+            vmstate_file_flush(file);
+
+            qemu_mutex_lock(&file->lock);
+            vmstate_file_append_node(file, node, &segment);
+
+            // Keep the index in step with the file.
+            vmstate_index_append(file, &segment, 1);
+            record_index = file->records->len - 1;
+            qemu_mutex_unlock(&file->lock);
+        }
+    }
 
     if( out_index != NULL ){
         *out_index = record_index;
     }
 
-    // Have we exceeded our pool limit?
-    if( memory_channel_test_and_set_pool_limit() ) {
-        // We need to recover some memory, so
-        // purge entries that haven't been recently
-        // loaded and request that the tree release
-        // some of it's nodes.
-        vmstate_cache_purge(file);
-    }
+    // Release anything the writer has finished with
+    vmstate_file_release_writes(file);
 
-    // Ref the node and add it to the state cache.
+    // Ref the node and add it to the state cache, which makes room
+    // for it if we are over our limits.
     object_ref(OBJECT(node));
     vmstate_cache_insert(file, record_index, node);
 }
 
+// Returns a referenced node for the record, read from the file unless
+// the cache already has the state.
+static RSaveTreeNode *vmstate_file_read_record(VMStateFile *file, const VMStateIndexRecord *record)
+{
+    RSaveTreeNode *node;
+    RSaveTreeNodeClass *rstn_class;
+
+    node = vmstate_cache_lookup(file, file->cache_by_hash, record->segment.hash);
+    if( node ) {
+        return node;
+    }
+    vmstate_cache_miss(file);
+
+    // Create the receiving node for this record's state
+    node = rsave_tree_node_new();
+    rstn_class = RSAVE_TREE_NODE_GET_CLASS(node);
+
+    // We have a segment pointer that we can seek to.
+    fseek(file->fp, record->segment.segment_pointer, SEEK_SET);
+
+    // Farm out the tree node loading
+    rstn_class->read_tree_node(node, file->fp, record->segment.segment_size, file->map_states);
+
+    // Add the hash to the node
+    memcpy(node->hash, record->segment.hash, sizeof(SHA1_HASH_TYPE));
+
+    // Set the FP back to the current file header.
+    fseek(file->fp, file->current_header_loc, SEEK_SET);
+
+    // One reference for the caller, the first one goes to the cache.
+    object_ref(OBJECT(node));
+    vmstate_cache_insert(file, record->index, node);
+
+    return node;
+}
+
 static bool vmstate_file_load_from_index(VMStateFile *file, RSaveTreeNode **new_node, uint64_t index)
 {
-    // Variables
-    FileSegment segment;
-    VMFileHeader header;
-    uint64_t num_segments;
-    bool header_missing, record_missing;
-    uint64_t current_header, header_number, record_number, record_loc, next_header;
-    VMStateNodeCache *entry;
-    RSaveTreeNode *node = NULL;
-    bool result_found = false;
+    RSaveTreeNode *node;
 
     // Look for this node in our cache of previously loaded states.
-    QSIMPLEQ_FOREACH(entry, &file->node_cache, next) {
-        if( entry->index == index ) {
-            entry->loaded = true;
-            node = entry->node;
-            result_found = true;
-            break;
+    node = vmstate_cache_lookup(file, file->cache_by_index, &index);
+
+    if( !node ) {
+        vmstate_file_flush(file);
+
+        qemu_mutex_lock(&file->lock);
+        if( index < file->records->len ) {
+            node = vmstate_file_read_record(file, &g_array_index(file->records, VMStateIndexRecord, index));
         }
+        qemu_mutex_unlock(&file->lock);
     }
 
-    if( !result_found )
-    {
-        // Initialize Variabes
-        record_loc = 0;
-        record_missing = true;
-        header_missing = false;
-        header_number = index / SEGMENTS_PER_HEADER;
-        record_number = index % SEGMENTS_PER_HEADER;
-
-        // We will start at the begenning
-        fseek(file->fp, 0, SEEK_SET);
+    if( node ){
+        // It is already referenced for the caller
+        *new_node = node;
+    }
 
-        // Begin to look for header containing the record
-        for (current_header = 0; current_header < header_number && !header_missing; ++current_header)
-        {
-            // Calculate the location for the next header
-            uint64_t next_header_field = (current_header) +
-                                        (sizeof(header.num_segments)) +
-                                        (sizeof(header.segments));
-            fseek(file->fp, next_header_field, SEEK_SET);
+    // All done
+    return node != NULL;
+}
 
-            // Read the header location and go there.
-            fread_checked(&next_header, sizeof(next_header), file->fp);
+static bool vmstate_file_load_from_hash(VMStateFile *file, RSaveTreeNode **new_node, SHA1_HASH_TYPE hash)
+{
+    const VMStateIndexRecord *record;
+    RSaveTreeNode *node;
 
-            if (next_header)
-            {
-                // We found the header, now we go there
-                fseek(file->fp, next_header, SEEK_SET);
-            }
-            else
-            {
-                // we did not find the header
-                header_missing = true;
-            }
-        }
+    // Look for this node in our cache of previously loaded states.
+    node = vmstate_cache_lookup(file, file->cache_by_hash, hash);
 
-        // Unless the header was missing, we should now be on the right header
-        if (!header_missing)
-        {
-            // First we read the number of elements in the header
-            fread_checked(&num_segments, sizeof(num_segments), file->fp);
+    if( !node ) {
+        // The state may still be on its way to the file
+        vmstate_file_flush(file);
 
-            // Verify that the record number exists
-            if (record_number < num_segments)
-            {
-                // First calculate the distance to the header
-                uint64_t record_offset = (record_number * sizeof(FileSegment));
-
-                // We have calculated the jump, now make it.
-                fseek(file->fp, record_offset, SEEK_CUR);
-                
-                // Read the segment data
-                fread_checked(&segment.hash, sizeof(segment.hash), file->fp);
-                fread_checked(&segment.job_id, sizeof(segment.job_id), file->fp);
-                fread_checked(&segment.segment_pointer, sizeof(segment.segment_pointer), file->fp);
-                fread_checked(&segment.segment_size, sizeof(segment.segment_size), file->fp);
-
-                // Populate the file offset the to record
-                record_loc = segment.segment_pointer;
-
-                // Verify that the record_loc is populated
-                // and go to that location
-                if (record_loc)
-                {
-                    record_missing = false;
-                    fseek(file->fp, record_loc, SEEK_SET);
-                }
-            }
+        qemu_mutex_lock(&file->lock);
+        record = vmstate_index_lookup(file, file->hash_index, hash);
+        if( record ) {
+            node = vmstate_file_read_record(file, record);
         }
+        qemu_mutex_unlock(&file->lock);
+    }
 
-        // If we found our record and we successfully made it
-        // to the loc, then we can start to load data
-        if (!record_missing && record_loc == ftell(file->fp))
-        {
-            // Create a node to write to the file
-            // We don't care about linkage of the node to others as
-            // This is being used soley for writing a consistent structure.
-            node = rsave_tree_node_new();
-            RSaveTreeNodeClass *rstn_class = RSAVE_TREE_NODE_GET_CLASS(node);
-
-            // Farm out the tree node loading
-            rstn_class->read_tree_node(node, file->fp, segment.segment_size);
-
-            // Add the hash to the node
-            memcpy(node->hash, segment.hash, sizeof(SHA1_HASH_TYPE));
-
-            // Have we exceeded our pool limit?
-            if( memory_channel_test_and_set_pool_limit() ) {
-                // We need to recover some memory, note that
-                // copies of the nodes may still be in the
-                // rapid analysis tree.
-                vmstate_cache_purge(file);
-            }
+    if( node ){
+        // It is already referenced for the caller
+        *new_node = node;
+    }
 
-            // The first reference will always be held by cache to keep the node persistent.
-            vmstate_cache_insert(file, index, node);
+    // All done
+    return node != NULL;
+}
 
-            // This should have been a success
-            result_found = true;
-        }
+static bool vmstate_file_load_from_job(VMStateFile *file, RSaveTreeNode **new_node, int32_t job_id)
+{
+    const VMStateIndexRecord *record;
+    RSaveTreeNode *node;
 
-        // Set the FP back to the current file header.
-        fseek(file->fp, file->current_header_loc, SEEK_SET);
+    // Look for this node in our cache of previously loaded states.
+    node = vmstate_cache_lookup(file, file->cache_by_job, GINT_TO_POINTER(job_id));
+
+    if( !node ) {
+        vmstate_file_flush(file);
+
+        qemu_mutex_lock(&file->lock);
+        record = vmstate_index_lookup(file, file->job_index, GINT_TO_POINTER(job_id));
+        if( record ) {
+            node = vmstate_file_read_record(file, record);
+        }
+        qemu_mutex_unlock(&file->lock);
     }
 
-    if(result_found){
-        // Ref it and return it
-        object_ref(OBJECT(node));
+    if( node ){
+        // It is already referenced for the caller
         *new_node = node;
     }
 
     // All done
-    return result_found;
+    return node != NULL;
 }
 
-static bool vmstate_file_load_from_hash(VMStateFile *file, RSaveTreeNode **new_node, SHA1_HASH_TYPE hash)
+// The node fields in front of the device table, as write_tree_node lays them out.
+#define VMSTATE_NODE_FIXED_SIZE  (sizeof(uint64_t) * 2 + sizeof(int32_t) + sizeof(SHA1_HASH_TYPE) + \
+                                  sizeof(int64_t) + sizeof(uint32_t))
+#define VMSTATE_NODE_DEVICE_SIZE (sizeof(uint32_t) * 2 + sizeof(((VMStateIndexEntry *)0)->idstr) + sizeof(uint64_t))
+
+static bool vmstate_file_read_node_info(int fd, const FileSegment *segment, RSaveTreeNode *node, uint64_t *offset, uint64_t *size)
+{
+    uint8_t fixed[VMSTATE_NODE_FIXED_SIZE];
+    uint8_t *devices, *p = fixed;
+    uint64_t table_size;
+
+    if( segment->segment_size < sizeof(fixed) ||
+        pread(fd, fixed, sizeof(fixed), segment->segment_pointer) != sizeof(fixed) ) {
+        return false;
+    }
+
+    memcpy(&node->instruction_number, p, sizeof(uint64_t));
+    p += sizeof(uint64_t);
+    memcpy(&node->cpu_exception_index, p, sizeof(uint64_t));
+    p += sizeof(uint64_t);
+    memcpy(&node->job_id, p, sizeof(int32_t));
+    p += sizeof(int32_t);
+    memcpy(node->parent_hash, p, sizeof(SHA1_HASH_TYPE));
+    p += sizeof(SHA1_HASH_TYPE);
+    memcpy(&node->timestamp, p, sizeof(int64_t));
+    p += sizeof(int64_t);
+    memcpy(&node->num_devices, p, sizeof(uint32_t));
+
+    table_size = (uint64_t)node->num_devices * VMSTATE_NODE_DEVICE_SIZE;
+    if( segment->segment_size < sizeof(fixed) + table_size ) {
+        return false;
+    }
+
+    devices = g_malloc(table_size);
+    if( pread(fd, devices, table_size, segment->segment_pointer + sizeof(fixed)) != table_size ) {
+        g_free(devices);
+        return false;
+    }
+
+    // Walked backwards so the list comes out in file order.
+    for( uint32_t i = node->num_devices; i > 0; i-- ) {
+        VMStateIndexEntry *e = g_new0(VMStateIndexEntry, 1);
+
+        p = &devices[(i - 1) * VMSTATE_NODE_DEVICE_SIZE];
+        memcpy(&e->section_id, p, sizeof(uint32_t));
+        p += sizeof(uint32_t);
+        memcpy(&e->instance_id, p, sizeof(uint32_t));
+        p += sizeof(uint32_t);
+        memcpy(e->idstr, p, sizeof(e->idstr));
+        e->idstr[sizeof(e->idstr) - 1] = 0;
+        p += sizeof(e->idstr);
+        memcpy(&e->offset, p, sizeof(uint64_t));
+
+        QLIST_INSERT_HEAD(&node->device_list, e, next);
+    }
+    g_free(devices);
+
+    *offset = segment->segment_pointer + sizeof(fixed) + table_size;
+    *size = segment->segment_size - sizeof(fixed) - table_size;
+    return true;
+}
+
+// Finds where a saved state sits in the file so it can be read from
+// there without loading the node. The node handed back has its details
+// and indices but no vm_state. Only the file lock is taken and the node
+// cache is left alone, so this can be used off the vCPU thread. It goes
+// by the index alone, states still queued for the writer aren't found.
+static bool vmstate_file_locate_state(VMStateFile *file, RSaveTreeNode **new_node, SHA1_HASH_TYPE hash,
+                                      uint64_t *offset, uint64_t *size)
 {
+    const VMStateIndexRecord *record;
     FileSegment segment;
-    uint64_t segment_counter, header_pointer, current_segment, record_index;
-    VMStateNodeCache *entry;
-    bool result_found = false;
-    RSaveTreeNode *node = NULL;
+    RSaveTreeNode *node;
 
-    // Look for this node in our cache of previously loaded states.
-    QSIMPLEQ_FOREACH(entry, &file->node_cache, next) {
-        if(!memcmp(entry->node->hash, hash, sizeof(SHA1_HASH_TYPE))) {
-            entry->loaded = true;
-            node = entry->node;
-            result_found = true;
-            break;
-        }
+    qemu_mutex_lock(&file->lock);
+    record = vmstate_index_lookup(file, file->hash_index, hash);
+    if( record ) {
+        segment = record->segment;
+
+        // The reads go around stdio, it can't be holding on to any of the segment.
+        fflush(file->fp);
     }
+    qemu_mutex_unlock(&file->lock);
 
-    if( !result_found )
-    {
-        // Start at the first header
-        record_index = 0;
-        header_pointer = 0;
+    if( !record ) {
+        return false;
+    }
 
-        do
+    // Segments are never rewritten, so they can be read without the lock.
+    node = rsave_tree_node_new();
+    if( !vmstate_file_read_node_info(fileno(file->fp), &segment, node, offset, size) ) {
+        error_report("%s: failed to read node from the vmstate file @ line %d", __func__, __LINE__);
+        object_unref(OBJECT(node));
+        return false;
+    }
+    memcpy(node->hash, segment.hash, sizeof(SHA1_HASH_TYPE));
+
+    *new_node = node;
+    return true;
+}
+
+// Tells whether a state is saved or held in the cache, without loading
+// it. States still queued for the writer are in the cache already, so
+// there is no need to wait for them.
+static bool vmstate_file_has_state(VMStateFile *file, SHA1_HASH_TYPE hash)
+{
+    bool found;
+
+    qemu_mutex_lock(&file->cache_lock);
+    found = g_hash_table_contains(file->cache_by_hash, hash);
+    qemu_mutex_unlock(&file->cache_lock);
+
+    if( !found ) {
+        qemu_mutex_lock(&file->lock);
+        found = vmstate_index_lookup(file, file->hash_index, hash) != NULL;
+        qemu_mutex_unlock(&file->lock);
+    }
+
+    return found;
+}
+
+static ssize_t vmstate_file_read_state(VMStateFile *file, uint8_t *buf, uint64_t offset, size_t size)
+{
+    return pread(fileno(file->fp), buf, size, offset);
+}
+
+static int vmstate_compare_page(const void *a, const void *b)
+{
+    const RSaveTreeNodePage *pa = a;
+    const RSaveTreeNodePage *pb = b;
+    return (pa->addr > pb->addr) - (pa->addr < pb->addr);
+}
+
+static void vmstate_free_page_table(gpointer data)
+{
+    VMStatePageTable *table = data;
+
+    g_free(table->pages);
+    g_free(table);
+}
+
+// Appends the page index of a node that is in the file to the pages
+// file. The offsets in it are from the start of the node's state, which
+// is where read_tree_node leaves off.
+static void vmstate_file_add_page_index(VMStateFile *file, RSaveTreeNode *node)
+{
+    VMStateIndexRecord *record;
+    uint64_t state_offset;
+    long pages_offset;
+
+    if (!node->page_index || !file->pages_fp) {
+        return;
+    }
+
+    qemu_mutex_lock(&file->lock);
+    record = (VMStateIndexRecord *) vmstate_index_lookup(file, file->hash_index, node->hash);
+    if (record && !record->num_pages) {
+        state_offset = record->segment.segment_pointer + VMSTATE_NODE_FIXED_SIZE +
+                       (uint64_t)node->num_devices * VMSTATE_NODE_DEVICE_SIZE;
+
+        fseek(file->pages_fp, 0, SEEK_END);
+        pages_offset = ftell(file->pages_fp);
+        if (state_offset < record->segment.segment_pointer + record->segment.segment_size &&
+            pages_offset >= 0 &&
+            fwrite(node->page_index, sizeof(RSaveTreeNodePage), node->num_indexed_pages,
+                   file->pages_fp) == node->num_indexed_pages &&
+            fflush(file->pages_fp) == 0)
         {
-            // We will start at the beginning of the header
-            fseek(file->fp, header_pointer, SEEK_SET);
-        
-            // Read the number of segments in the header
-            fread_checked(&segment_counter, sizeof(segment_counter), file->fp);
+            // The table goes out before the record that points at it.
+            record->state_offset = state_offset;
+            record->pages_offset = pages_offset;
+            record->num_pages = node->num_indexed_pages;
+            vmstate_index_write_record(file, record->index);
+        }
+    }
+    qemu_mutex_unlock(&file->lock);
+}
 
-            // Check through the header and compare hashes 
-            for (current_segment = 0; current_segment < segment_counter && !result_found; ++current_segment)
-            {
-                // Load the data segment info
-                fread_checked(&segment.hash, sizeof(segment.hash), file->fp);
-                fread_checked(&segment.job_id, sizeof(segment.job_id), file->fp);
-                fread_checked(&segment.segment_pointer, sizeof(segment.segment_pointer), file->fp);
-                fread_checked(&segment.segment_size, sizeof(segment.segment_size), file->fp);
-
-                // Check if we found the right hash
-                if ( !memcmp(segment.hash, hash, sizeof(SHA1_HASH_TYPE)) )
-                {
-                    // Create the receiving node for this hash's state
-                    node = rsave_tree_node_new();
-                    RSaveTreeNodeClass *rstn_class = RSAVE_TREE_NODE_GET_CLASS(node);
-
-                    // We now have a segment pointer that we can seek to.
-                    fseek(file->fp, segment.segment_pointer, SEEK_SET);
-
-                    // Farm out the tree node loading
-                    rstn_class->read_tree_node(node, file->fp, segment.segment_size);
-
-                    // Add the hash to the node
-                    memcpy(node->hash, segment.hash, sizeof(SHA1_HASH_TYPE));
-
-                    // We found what we were seeking.
-                    record_index += current_segment;
-                    result_found = true;
-                }
-            }
-    
-            // Did we exit the loop because we found our result or searched the entire header?
-            if (!result_found && current_segment >= SEGMENTS_PER_HEADER)
-            {
-                // We did not find the hash in this header, load the next header pointer 
-                fread_checked(&header_pointer, sizeof(header_pointer), file->fp);
-                record_index += SEGMENTS_PER_HEADER;
-            }
-            else
-            {
-                // We either found what we were looking for, or we exausted our search
-                header_pointer = 0;
-            }
+// Returns the page table of a state, reading it in the first time.
+// Called with the file lock held.
+static VMStatePageTable *vmstate_file_get_page_table(VMStateFile *file, SHA1_HASH_TYPE hash)
+{
+    const VMStateIndexRecord *record;
+    VMStatePageTable *table;
+    size_t table_size;
 
-        } while(header_pointer > 0 && !result_found);
+    table = g_hash_table_lookup(file->page_tables, hash);
+    if (table || !file->pages_fp) {
+        return table;
+    }
 
-        // Set the FP back to the current file header.
-        fseek(file->fp, file->current_header_loc, SEEK_SET);
+    record = vmstate_index_lookup(file, file->hash_index, hash);
+    if (!record || !record->num_pages) {
+        return NULL;
+    }
 
-        if( result_found ) {
-            // Have we exceeded our pool limit?
-            if( memory_channel_test_and_set_pool_limit() ) {
-                // We need to recover some memory, note that
-                // copies of the nodes may still be in the
-                // rapid analysis tree.
-                vmstate_cache_purge(file);
-            }
+    table_size = record->num_pages * sizeof(RSaveTreeNodePage);
+    table = g_new0(VMStatePageTable, 1);
+    table->state_offset = record->state_offset;
+    table->num_pages = record->num_pages;
+    table->pages = g_malloc(table_size);
+    if (pread(fileno(file->pages_fp), table->pages, table_size, record->pages_offset) != table_size) {
+        vmstate_free_page_table(table);
+        return NULL;
+    }
+
+    // The pages are read around stdio, it can't be holding on to any of them.
+    fflush(file->fp);
+
+    g_hash_table_insert(file->page_tables, g_memdup(hash, sizeof(SHA1_HASH_TYPE)), table);
+    return table;
+}
 
-            // The first reference will always be held by cache to keep the node persistent.
-            vmstate_cache_insert(file, record_index, node);
+// Reads one RAM page of a saved state through its page table, without
+// loading the state. False if the state has no table or not this page.
+static bool vmstate_file_read_page(VMStateFile *file, SHA1_HASH_TYPE hash, uint64_t addr, uint8_t *buf, size_t size)
+{
+    RSaveTreeNodePage key = { .addr = addr };
+    const RSaveTreeNodePage *found = NULL;
+    RSaveTreeNodePage page;
+    VMStatePageTable *table;
+    uint64_t state_offset = 0;
+
+    qemu_mutex_lock(&file->lock);
+    table = vmstate_file_get_page_table(file, hash);
+    if (table) {
+        found = bsearch(&key, table->pages, table->num_pages, sizeof(RSaveTreeNodePage), vmstate_compare_page);
+        if (found) {
+            page = *found;
+            state_offset = table->state_offset;
         }
     }
+    qemu_mutex_unlock(&file->lock);
 
-    if( result_found ){
-        // Ref it and return it
-        object_ref(OBJECT(node));
-        *new_node = node;
+    if (!found) {
+        return false;
     }
 
-    // All done
-    return result_found;
+    // Zero pages keep their fill byte in the offset.
+    if (page.zero) {
+        memset(buf, page.offset, size);
+        return true;
+    }
+
+    // Segments are never rewritten, so they can be read without the lock.
+    return pread(fileno(file->fp), buf, size, state_offset + page.offset) == size;
 }
 
-static bool vmstate_file_load_from_job(VMStateFile *file, RSaveTreeNode **new_node, int32_t job_id)
+static void vmstate_file_rebuild_index(VMStateFile *file)
 {
     FileSegment segment;
-    uint64_t segment_counter, header_pointer, current_segment, record_index;
-    VMStateNodeCache *entry;
-    bool result_found = false;
-    RSaveTreeNode *node = NULL;
+    uint64_t segment_counter, header_pointer, current_segment;
 
-    // Look for this node in our cache of previously loaded states.
-    QSIMPLEQ_FOREACH(entry, &file->node_cache, next) {
-        if(entry->node->job_id == job_id) {
-            entry->loaded = true;
-            node = entry->node;
-            result_found = true;
-            break;
-        }
+    vmstate_file_flush(file);
+    qemu_mutex_lock(&file->lock);
+
+    g_array_set_size(file->records, 0);
+    g_hash_table_remove_all(file->hash_index);
+    g_hash_table_remove_all(file->job_index);
+
+    // The page tables were only reachable through the old records.
+    g_hash_table_remove_all(file->page_tables);
+    if (file->pages_fp && ftruncate(fileno(file->pages_fp), 0) < 0) {
+        warn_report("Could not truncate vmstate page tables");
     }
 
-    if( !result_found )
+    header_pointer = 0;
+    do
     {
-        // Start at the first header
-        record_index = 0;
-        header_pointer = 0;
+        // We will start at the beginning of the header
+        fseek(file->fp, header_pointer, SEEK_SET);
+    
+        // Read the number of segments in the header
+        fread_checked(&segment_counter, sizeof(segment_counter), file->fp);
 
-        do
+        for (current_segment = 0; current_segment < segment_counter; ++current_segment)
         {
-            // We will start at the beginning of the header
-            fseek(file->fp, header_pointer, SEEK_SET);
-        
-            // Read the number of segments in the header
-            fread_checked(&segment_counter, sizeof(segment_counter), file->fp);
-
-            // Check through the header and compare hashes 
-            for (current_segment = 0; current_segment < segment_counter && !result_found; ++current_segment)
-            {
-                // Load the data segment info
-                fread_checked(&segment.hash, sizeof(segment.hash), file->fp);
-                fread_checked(&segment.job_id, sizeof(segment.job_id), file->fp);
-                fread_checked(&segment.segment_pointer, sizeof(segment.segment_pointer), file->fp);
-                fread_checked(&segment.segment_size, sizeof(segment.segment_size), file->fp);
-
-                // Check if we found the right hash
-                if ( segment.job_id == job_id )
-                {
-                    // Create the receiving node for this hash's state
-                    node = rsave_tree_node_new();
-                    RSaveTreeNodeClass *rstn_class = RSAVE_TREE_NODE_GET_CLASS(node);
-
-                    // We now have a segment pointer that we can seek to.
-                    fseek(file->fp, segment.segment_pointer, SEEK_SET);
-
-                    // Farm out the tree node loading
-                    rstn_class->read_tree_node(node, file->fp, segment.segment_size);
-
-                    // Add the hash to the node
-                    memcpy(node->hash, segment.hash, sizeof(SHA1_HASH_TYPE));
-
-                    // We found what we were seeking.
-                    record_index += current_segment;
-                    result_found = true;
-                }
-            }
-    
-            // Did we exit the loop because we found our result or searched the entire header?
-            if (!result_found && current_segment >= SEGMENTS_PER_HEADER)
-            {
-                // We did not find the hash in this header, load the next header pointer 
-                fread_checked(&header_pointer, sizeof(header_pointer), file->fp);
-                record_index += SEGMENTS_PER_HEADER;
-            }
-            else
-            {
-                // We either found what we were looking for, or we exausted our search
-                header_pointer = 0;
-            }
+            // Load the data segment info
+            memset(&segment, 0, sizeof(segment));
+            fread_checked(&segment.hash, sizeof(segment.hash), file->fp);
+            fread_checked(&segment.job_id, sizeof(segment.job_id), file->fp);
+            fread_checked(&segment.segment_pointer, sizeof(segment.segment_pointer), file->fp);
+            fread_checked(&segment.segment_size, sizeof(segment.segment_size), file->fp);
 
-        } while(header_pointer > 0 && !result_found);
+            vmstate_index_insert(file, &segment);
+        }
 
-        // Set the FP back to the current file header.
-        fseek(file->fp, file->current_header_loc, SEEK_SET);
+        // Load the next header pointer 
+        fseek(file->fp, header_pointer + sizeof(segment_counter) + SEGMENTS_PER_HEADER * sizeof(FileSegment), SEEK_SET);
+        fread_checked(&header_pointer, sizeof(header_pointer), file->fp);
+    } while(header_pointer > 0);
 
-        if( result_found ) {
-            // Have we exceeded our pool limit?
-            if( memory_channel_test_and_set_pool_limit() ) {
-                // We need to recover some memory, note that
-                // copies of the nodes may still be in the
-                // rapid analysis tree.
-                vmstate_cache_purge(file);
-            }
+    // Set the FP back to the current file header.
+    fseek(file->fp, file->current_header_loc, SEEK_SET);
 
-            // The first reference will always be held by cache to keep the node persistent.
-            vmstate_cache_insert(file, record_index, node);
+    // Write the whole index back out.
+    if (file->index_fp)
+    {
+        if (ftruncate(fileno(file->index_fp), 0) < 0) {
+            warn_report("Could not truncate vmstate index");
         }
+        fseek(file->index_fp, sizeof(VMStateIndexHeader), SEEK_SET);
+        fwrite(file->records->data, sizeof(VMStateIndexRecord), file->records->len, file->index_fp);
+        vmstate_index_write_header(file);
     }
 
-    if( result_found ){
-        // Ref it and return it
-        object_ref(OBJECT(node));
-        *new_node = node;
+    qemu_mutex_unlock(&file->lock);
+}
+
+static RSaveHashEngine vmstate_file_get_hash_engine(VMStateFile *file)
+{
+    return file->hash_engine;
+}
+
+static bool vmstate_file_check_hash_engine(VMStateFile *file, Error **errp)
+{
+    if (file->hash_engine != rsave_hash_get_engine()) {
+        error_setg(errp, "The vmstate file holds %s state hashes, but hashalg=%s is in use",
+                   rsave_hash_engine_name(file->hash_engine),
+                   rsave_hash_engine_name(rsave_hash_get_engine()));
+        return false;
     }
+    return true;
+}
 
-    // All done
-    return result_found;
+static void vmstate_file_set_map_states(VMStateFile *file, bool map_states)
+{
+    // Only affects states loaded from here on.
+    file->map_states = map_states;
 }
 
 static void hash_to_string(SHA1_HASH_TYPE hash, char *str)
@@ -675,6 +1336,9 @@ static void vmstate_file_query_image_info(VMStateFile *file, ImageInfoList **lis
     uint64_t job_eindex;
     int64_t timestamp;
 
+    vmstate_file_flush(file);
+    qemu_mutex_lock(&file->lock);
+
     header_pointer = 0;
     do
     {
@@ -741,6 +1405,42 @@ static void vmstate_file_query_image_info(VMStateFile *file, ImageInfoList **lis
 
     // Set the FP back to the current file header.
     fseek(file->fp, file->current_header_loc, SEEK_SET);
+
+    qemu_mutex_unlock(&file->lock);
+}
+
+static void vmstate_file_set_cache_limit(VMStateFile *file, uint64_t limit)
+{
+    qemu_mutex_lock(&file->cache_lock);
+    file->cache_limit = limit;
+    vmstate_cache_evict(file, NULL);
+    qemu_mutex_unlock(&file->cache_lock);
+}
+
+static RapidAnalysisCacheInfo *vmstate_file_query_cache(VMStateFile *file)
+{
+    RapidAnalysisCacheInfo *info = g_new0(RapidAnalysisCacheInfo, 1);
+    VMStateNodeCache *entry;
+
+    qemu_mutex_lock(&file->cache_lock);
+    vmstate_cache_measure(file);
+    info->hits = file->cache_hits;
+    info->misses = file->cache_misses;
+    info->evictions = file->cache_evictions;
+    info->limit = file->cache_limit;
+    info->size = file->cache_size;
+    info->protected_size = file->cache_protected_size;
+    info->held_size = file->cache_held_size;
+    QTAILQ_FOREACH(entry, &file->cache_probation, next) {
+        info->entries++;
+    }
+    QTAILQ_FOREACH(entry, &file->cache_protected, next) {
+        info->entries++;
+        info->protected_entries++;
+    }
+    qemu_mutex_unlock(&file->cache_lock);
+
+    return info;
 }
 
 static void vmstate_file_initfn(Object *obj)
@@ -749,20 +1449,80 @@ static void vmstate_file_initfn(Object *obj)
 
     file->fp = NULL;
     file->current_header_loc = 0;
-    file->current_index = 0;
-    QSIMPLEQ_INIT(&file->node_cache);
+    file->map_states = false;
+    file->hash_engine = RSAVE_HASH_ENGINE_SHA1;
+
+    qemu_mutex_init(&file->cache_lock);
+    QTAILQ_INIT(&file->cache_probation);
+    QTAILQ_INIT(&file->cache_protected);
+    file->cache_by_hash = g_hash_table_new(vmstate_index_hash_func, vmstate_index_hash_equal);
+    file->cache_by_index = g_hash_table_new(g_int64_hash, g_int64_equal);
+    file->cache_by_job = g_hash_table_new(g_direct_hash, g_direct_equal);
+    file->cache_limit = 0;
+    file->cache_size = 0;
+    file->cache_held_size = 0;
+    file->cache_protected_size = 0;
+    file->cache_hits = 0;
+    file->cache_misses = 0;
+    file->cache_evictions = 0;
+
+    file->index_fp = NULL;
+    file->records = g_array_new(false, false, sizeof(VMStateIndexRecord));
+    file->hash_index = g_hash_table_new_full(vmstate_index_hash_func, vmstate_index_hash_equal, g_free, NULL);
+    file->job_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    file->pages_fp = NULL;
+    file->page_tables = g_hash_table_new_full(vmstate_index_hash_func, vmstate_index_hash_equal,
+                                              g_free, vmstate_free_page_table);
+
+    qemu_mutex_init(&file->lock);
+    file->async_writes = false;
+    file->writer_quit = false;
+    file->writes_pending = 0;
+    qemu_mutex_init(&file->write_lock);
+    qemu_cond_init(&file->write_cond);
+    qemu_cond_init(&file->written_cond);
+    QSIMPLEQ_INIT(&file->write_queue);
+    QSIMPLEQ_INIT(&file->written);
 }
 
 static void vmstate_file_finalize(Object *obj)
 {
     VMStateFile *file = VMSTATE_FILE(obj);
 
+    // Anything still queued has to make it to the file first
+    if (file->async_writes) {
+        vmstate_file_stop_writer(file);
+        file->async_writes = false;
+    }
+    qemu_cond_destroy(&file->write_cond);
+    qemu_cond_destroy(&file->written_cond);
+    qemu_mutex_destroy(&file->write_lock);
+    qemu_mutex_destroy(&file->lock);
+
     fclose(file->fp);
     file->fp = NULL;
     file->current_header_loc = 0;
-    file->current_index = 0;
+
+    if (file->index_fp) {
+        fclose(file->index_fp);
+        file->index_fp = NULL;
+    }
+    g_hash_table_destroy(file->hash_index);
+    g_hash_table_destroy(file->job_index);
+    g_array_free(file->records, true);
+
+    if (file->pages_fp) {
+        fclose(file->pages_fp);
+        file->pages_fp = NULL;
+    }
+    g_hash_table_destroy(file->page_tables);
 
     vmstate_cache_force_purge(file);
+    g_hash_table_destroy(file->cache_by_hash);
+    g_hash_table_destroy(file->cache_by_index);
+    g_hash_table_destroy(file->cache_by_job);
+    qemu_mutex_destroy(&file->cache_lock);
 }
 
 static void vmstate_file_class_init(ObjectClass *klass, void *class_data)
@@ -773,8 +1533,21 @@ static void vmstate_file_class_init(ObjectClass *klass, void *class_data)
     vmstate_class->load_from_index = vmstate_file_load_from_index;
     vmstate_class->load_from_hash = vmstate_file_load_from_hash;
     vmstate_class->load_from_job = vmstate_file_load_from_job;
+    vmstate_class->locate_state = vmstate_file_locate_state;
+    vmstate_class->has_state = vmstate_file_has_state;
+    vmstate_class->read_state = vmstate_file_read_state;
+    vmstate_class->add_page_index = vmstate_file_add_page_index;
+    vmstate_class->read_page = vmstate_file_read_page;
     vmstate_class->find_current_header = vmstate_file_find_current_header;
     vmstate_class->query_image_info = vmstate_file_query_image_info;
+    vmstate_class->rebuild_index = vmstate_file_rebuild_index;
+    vmstate_class->set_map_states = vmstate_file_set_map_states;
+    vmstate_class->set_async_writes = vmstate_file_set_async_writes;
+    vmstate_class->flush = vmstate_file_flush;
+    vmstate_class->set_cache_limit = vmstate_file_set_cache_limit;
+    vmstate_class->query_cache = vmstate_file_query_cache;
+    vmstate_class->get_hash_engine = vmstate_file_get_hash_engine;
+    vmstate_class->check_hash_engine = vmstate_file_check_hash_engine;
 }
 
 /**
@@ -23,11 +23,21 @@
 #include "qemu-common.h"
 #include "qemu-memory-channel.h"
 #include "block/qapi.h"
+#include "qapi/qapi-types-migration.h"
 #include "racomms/racomms-types.h"
 #include "migration/rsave-tree-node.h"
+#include "migration/rsave-hash.h"
 
 #define SEGMENTS_PER_HEADER (1000)
 
+// The lookup index is kept next to the vmstate file as <file>.idx
+#define VMSTATE_INDEX_SUFFIX  ".idx"
+#define VMSTATE_INDEX_MAGIC   (0x5844494d56534152ull)
+#define VMSTATE_INDEX_VERSION (4)
+
+// RAM page tables of reference states are kept in <file>.pages
+#define VMSTATE_PAGES_SUFFIX  ".pages"
+
 #define TYPE_VMSTATE_FILE "vmstate-file"
 #define VMSTATE_FILE(obj)                                            \
     OBJECT_CHECK(VMStateFile, (obj), TYPE_VMSTATE_FILE)
@@ -40,6 +50,8 @@ typedef struct FileSegment       FileSegment;
 typedef struct VMFileHeader      VMFileHeader;
 typedef struct VMStateFile       VMStateFile;
 typedef struct VMStateFileClass  VMStateFileClass;
+typedef struct VMStateIndexHeader VMStateIndexHeader;
+typedef struct VMStateIndexRecord VMStateIndexRecord;
 typedef struct RSaveTreeNode     RSaveTreeNode;
 
 struct FileSegment {
@@ -55,6 +67,31 @@ struct VMFileHeader {
     uint64_t next_header;
 };
 
+// The index file is a header followed by one record per segment
+// in the order the segments appear in the vmstate file. The header
+// also has the size of the vmstate file and where its last header is
+// as of the last update, so opening a file doesn't walk the chain.
+// The hash engine is the one every state hash in the file came from,
+// it is carried over when the rest of the index is rebuilt.
+struct VMStateIndexHeader {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t num_records;
+    uint64_t file_size;
+    uint64_t current_header;
+    uint64_t hash_engine;
+};
+
+struct VMStateIndexRecord {
+    FileSegment segment;
+    uint64_t index;
+    // Where the state starts in the vmstate file and where its RAM page
+    // table sits in the pages file. No pages until a table is built.
+    uint64_t state_offset;
+    uint64_t pages_offset;
+    uint64_t num_pages;
+};
+
 struct VMStateFileClass {
     ObjectClass parent;
     void (*add_header)(VMStateFile *file);
@@ -62,8 +99,26 @@ struct VMStateFileClass {
     bool (*load_from_index)(VMStateFile *file, RSaveTreeNode **node, uint64_t index);
     bool (*load_from_hash)(VMStateFile *file, RSaveTreeNode **node, SHA1_HASH_TYPE hash);
     bool (*load_from_job)(VMStateFile *file, RSaveTreeNode **node, int32_t job_id);
+    bool (*locate_state)(VMStateFile *file, RSaveTreeNode **node, SHA1_HASH_TYPE hash, uint64_t *offset, uint64_t *size);
+    bool (*has_state)(VMStateFile *file, SHA1_HASH_TYPE hash);
+    ssize_t (*read_state)(VMStateFile *file, uint8_t *buf, uint64_t offset, size_t size);
+    // Keeps the RAM page index of a saved node with the file, so later
+    // runs can read its pages without loading the node.
+    void (*add_page_index)(VMStateFile *file, RSaveTreeNode *node);
+    bool (*read_page)(VMStateFile *file, SHA1_HASH_TYPE hash, uint64_t addr, uint8_t *buf, size_t size);
     void (*find_current_header)(VMStateFile *file);
     void (*query_image_info)(VMStateFile *file, ImageInfoList **list);
+    void (*rebuild_index)(VMStateFile *file);
+    void (*set_map_states)(VMStateFile *file, bool map_states);
+    void (*set_async_writes)(VMStateFile *file, bool async_writes);
+    void (*flush)(VMStateFile *file);
+    // Bytes of states to keep in memory, zero leaves it to the channel pool limit.
+    void (*set_cache_limit)(VMStateFile *file, uint64_t limit);
+    RapidAnalysisCacheInfo* (*query_cache)(VMStateFile *file);
+    // States hashed by another engine never match ours, so a file
+    // is only used with the engine its states were hashed with.
+    RSaveHashEngine (*get_hash_engine)(VMStateFile *file);
+    bool (*check_hash_engine)(VMStateFile *file, Error **errp);
 };
 
 VMStateFile* vmstate_file_new(const char *file_path);
@@ -23,6 +23,9 @@
 #include "qom/object_interfaces.h"
 #include "qapi/qmp/qpointer.h"
 #include "qapi/qapi-commands-oshandler.h"
+#include "qapi/qapi-visit-oshandler.h"
+#include "qapi/clone-visitor.h"
+#include "qemu/atomic.h"
 #include "exec/gdbstub.h"
 #include "monitor/monitor.h"
 
@@ -34,6 +37,11 @@ OSHandler* os_handler = NULL;
 #define OSPID_TO_POOL(pb, p) ((OSPidPool *)((((void*)p) - sizeof(OSPidPool)) + ((uintptr_t)pb)))
 #define POOL_OFFSET(p, o)    ((OSPidPool *)(((void*)p) + (o)))
 
+typedef struct OSActiveKey {
+   uint64_t key;
+   uint32_t generation;
+} OSActiveKey;
+
 typedef struct OSPidPool{
    uint64_t free_pid;
    uint64_t next_pid;
@@ -671,6 +679,178 @@ static void oshandler_remove_breakpoints(OSHandler* ctxt, OSBreakpointType bp_ty
 }
 
 
+static void proc_cache_drop(OSHandler* ctxt)
+{
+   g_hash_table_remove_all(ctxt->proc_cache_by_key);
+   qapi_free_ProcessList(ctxt->proc_cache);
+   ctxt->proc_cache = NULL;
+   ctxt->proc_cache_valid = false;
+}
+
+static void proc_cache_build(OSHandler* ctxt)
+{
+   OSHandlerClass *os_cc = OSHANDLER_GET_CLASS(ctxt);
+
+   proc_cache_drop(ctxt);
+
+   ctxt->proc_cache = os_cc->get_process_list(ctxt);
+   ctxt->proc_cache_valid = true;
+
+   // Threads share a page table, the first task listed for it wins.
+   for (ProcessList *cur = ctxt->proc_cache; cur; cur = cur->next) {
+      uint64_t key = os_cc->process_key(ctxt, cur->value->info);
+      if( !g_hash_table_contains(ctxt->proc_cache_by_key, &key) ) {
+         g_hash_table_insert(ctxt->proc_cache_by_key,
+                             g_memdup(&key, sizeof(key)), cur->value);
+      }
+   }
+}
+
+// Returns true when the cache was built.
+static bool proc_cache_refresh(OSHandler* ctxt)
+{
+   if( !ctxt->proc_cache_valid ) {
+      proc_cache_build(ctxt);
+      return true;
+   }
+   return false;
+}
+
+// A hit is only used if the guest still has the process. Otherwise, as on
+// a miss, the task list is walked again, which finds processes created
+// since the last walk and drops those that exited.
+static bool proc_cache_usable(OSHandler* ctxt, const Process *p)
+{
+   OSHandlerClass *os_cc = OSHANDLER_GET_CLASS(ctxt);
+   return p && os_cc->process_exists(ctxt, p);
+}
+
+static const Process *proc_cache_find(OSHandler* ctxt, OSProcessMatch match, const void *data)
+{
+   for (ProcessList *cur = ctxt->proc_cache; cur; cur = cur->next) {
+      if( match(cur->value, data) ) {
+         return cur->value;
+      }
+   }
+   return NULL;
+}
+
+static const Process *proc_cache_lookup(OSHandler* ctxt, OSProcessMatch match, const void *data)
+{
+   bool built = proc_cache_refresh(ctxt);
+   const Process *p = proc_cache_find(ctxt, match, data);
+
+   if( !built && !proc_cache_usable(ctxt, p) ) {
+      proc_cache_build(ctxt);
+      p = proc_cache_find(ctxt, match, data);
+   }
+   return p;
+}
+
+ProcessInfo *oshandler_cached_processinfo_by_key(OSHandler *ctxt, uint64_t key)
+{
+   ProcessInfo *pi = NULL;
+   const Process *p;
+   bool built;
+
+   qemu_mutex_lock(&ctxt->proc_cache_lock);
+   built = proc_cache_refresh(ctxt);
+   p = g_hash_table_lookup(ctxt->proc_cache_by_key, &key);
+   if( !built && !proc_cache_usable(ctxt, p) ) {
+      proc_cache_build(ctxt);
+      p = g_hash_table_lookup(ctxt->proc_cache_by_key, &key);
+   }
+   if( p ) {
+      pi = g_memdup(p->info, sizeof(ProcessInfo));
+   }
+   qemu_mutex_unlock(&ctxt->proc_cache_lock);
+
+   return pi;
+}
+
+ProcessInfo *oshandler_cached_processinfo(OSHandler *ctxt, OSProcessMatch match, const void *data)
+{
+   ProcessInfo *pi = NULL;
+   const Process *p;
+
+   qemu_mutex_lock(&ctxt->proc_cache_lock);
+   p = proc_cache_lookup(ctxt, match, data);
+   if( p ) {
+      pi = g_memdup(p->info, sizeof(ProcessInfo));
+   }
+   qemu_mutex_unlock(&ctxt->proc_cache_lock);
+
+   return pi;
+}
+
+Process *oshandler_cached_process(OSHandler *ctxt, OSProcessMatch match, const void *data)
+{
+   Process *result = NULL;
+   const Process *p;
+
+   qemu_mutex_lock(&ctxt->proc_cache_lock);
+   p = proc_cache_lookup(ctxt, match, data);
+   if( p ) {
+      result = QAPI_CLONE(Process, (Process *) p);
+   }
+   qemu_mutex_unlock(&ctxt->proc_cache_lock);
+
+   return result;
+}
+
+void oshandler_invalidate_cache(OSHandler *ctxt)
+{
+   qemu_mutex_lock(&ctxt->proc_cache_lock);
+   proc_cache_drop(ctxt);
+   qemu_mutex_unlock(&ctxt->proc_cache_lock);
+
+   // Every vCPU reads its page table root again.
+   atomic_inc(&ctxt->active_generation);
+}
+
+uint64_t oshandler_get_active_key(OSHandler *ctxt, CPUState *cpu)
+{
+   OSHandlerClass *os_cc = OSHANDLER_GET_CLASS(ctxt);
+   OSActiveKey *active;
+   uint32_t generation;
+
+   // Only TCG tells us about page table switches.
+   if( !tcg_enabled() || !ctxt->active_keys || (unsigned) cpu->cpu_index >= max_cpus ) {
+      return os_cc->active_process_key(ctxt, cpu);
+   }
+
+   active = &ctxt->active_keys[cpu->cpu_index];
+   generation = atomic_read(&ctxt->active_generation);
+   if( atomic_read(&active->generation) != generation ) {
+      active->key = os_cc->active_process_key(ctxt, cpu);
+      atomic_set(&active->generation, generation);
+   }
+
+   return active->key;
+}
+
+void oshandler_notify_pagetable_change(CPUState *cpu)
+{
+   if( !os_handler || !os_handler->active_keys || (unsigned) cpu->cpu_index >= max_cpus ) {
+      return;
+   }
+
+   // Generation zero is never current, the key is read again on next use.
+   atomic_set(&os_handler->active_keys[cpu->cpu_index].generation, 0);
+}
+
+static void oshandler_vm_state_change(void *opaque, int running, RunState state)
+{
+   OSHandler *ctxt = OSHANDLER(opaque);
+
+   // Loading a state sets the page table roots without a switch being
+   // reported. The process table is kept, its entries are checked
+   // against the guest as they are used.
+   if( running ) {
+      atomic_inc(&ctxt->active_generation);
+   }
+}
+
 static void oshandler_initfn(Object* obj)
 {
    OSHandler* ctxt = OSHANDLER(obj);
@@ -680,6 +860,14 @@ static void oshandler_initfn(Object* obj)
    ctxt->process_header = qstring_new();
     ctxt->singlestep_enabled = 0;
    ctxt->arch = NULL;
+
+   qemu_mutex_init(&ctxt->proc_cache_lock);
+   ctxt->proc_cache = NULL;
+   ctxt->proc_cache_by_key = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+   ctxt->proc_cache_valid = false;
+   ctxt->active_keys = NULL;
+   ctxt->active_generation = 1;
+   ctxt->vmstate_change = NULL;
 }
 
 static void oshandler_finalize(Object* obj)
@@ -692,6 +880,29 @@ static void oshandler_finalize(Object* obj)
       object_unref(OBJECT(ctxt->arch));
       ctxt->arch = NULL;
    }
+
+   if( ctxt->vmstate_change ) {
+      qemu_del_vm_change_state_handler(ctxt->vmstate_change);
+   }
+   g_free(ctxt->active_keys);
+   proc_cache_drop(ctxt);
+   g_hash_table_destroy(ctxt->proc_cache_by_key);
+   qemu_mutex_destroy(&ctxt->proc_cache_lock);
+}
+
+static uint64_t oshandler_active_process_key(OSHandler* ctxt, CPUState* cpu)
+{
+   return OSARCH_GET_CLASS(ctxt->arch)->get_active_pagetable(ctxt->arch, cpu);
+}
+
+static uint64_t oshandler_process_key(OSHandler* ctxt, const ProcessInfo *pi)
+{
+   return pi->cr3;
+}
+
+static bool oshandler_process_exists(OSHandler* ctxt, const Process *p)
+{
+   return true;
 }
 
 static bool oshandler_is_active_process(OSHandler* ctxt, CPUState* cpu, ProcessInfo *pi)
@@ -743,6 +954,9 @@ static void oshandler_class_init(ObjectClass *klass, void* class_data)
    oshandler_class->release_ospid = oshandler_release_ospid;
    oshandler_class->get_processinfo_by_ospid = oshandler_get_processinfo_by_ospid;
    oshandler_class->is_active_process = oshandler_is_active_process;
+   oshandler_class->active_process_key = oshandler_active_process_key;
+   oshandler_class->process_key = oshandler_process_key;
+   oshandler_class->process_exists = oshandler_process_exists;
 }
 
 static void property_get_uint64_ptr(Object *obj, Visitor *v, const char *name,
@@ -804,6 +1018,9 @@ OSHandler *oshandler_init(CPUState *cpu, const char *hint)
 
       if( os_handler ){
          os_handler->arch = cpu_arch;
+         os_handler->active_keys = g_new0(OSActiveKey, max_cpus);
+         os_handler->vmstate_change =
+            qemu_add_vm_change_state_handler(oshandler_vm_state_change, os_handler);
       }
    }
 
@@ -38,6 +38,7 @@ static void plugin_object_initfn(Object *obj)
     p->cb.get_ra_report_type = NULL;
     p->cb.on_memory_read = NULL;
     p->cb.on_memory_write = NULL;
+    p->cb.on_memory_access = NULL;
     p->cb.on_ra_start = NULL;
     p->cb.on_ra_stop = NULL;
     p->cb.on_ra_idle = NULL;
@@ -47,9 +48,16 @@ static void plugin_object_initfn(Object *obj)
     p->cb.on_command = NULL;
     p->cb.on_breakpoint_hit = NULL;
     p->cb.on_execute_instruction = NULL;
+    p->cb.on_execute_block = NULL;
+    p->cb.on_translate_block = NULL;
+    p->cb.on_invalidate_block = NULL;
     p->cb.on_packet_recv = NULL;
     p->cb.on_packet_send = NULL;
     p->cb.on_vm_shutdown = NULL;
+    p->exec_filter.range_begin = 0;
+    p->exec_filter.range_end = 0;
+    p->exec_filter.process = NULL_PID;
+    p->num_mem_watches = 0;
 }
 
 static void plugin_object_finalize(Object *obj)
@@ -25,10 +25,13 @@
 #include "plugin/plugin_mgr.h"
 #include "migration/snapshot.h"
 #include "cpu.h"
+#include "exec/exec-all.h"
 #include "exec/ram_addr.h"
 #include "oshandler/oshandler.h"
 #include "qapi/qmp/qpointer.h"
 #include "sysemu/hw_accel.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
 
 
 void notify_ra_start(CommsWorkItem* work)
@@ -71,23 +74,16 @@ void notify_ra_stop(CPUState *cpu, SHA1_HASH_TYPE job_hash)
                 request = p->instance->cb.get_ra_report_type(p->instance);
             }
 
-            // request a report
-            CommsMessage *result_message = build_rsave_report(rst, job_hash, request, NULL);
+            // request a report, without a queue the memory is copied in
+            work_results = build_rsave_report(rst, job_hash, request, NULL);
 
-            if (result_message)
+            if (work_results)
             {
-                // Put together the work results
-                work_results = g_new(CommsResultsItem, 1);
-
-                // Set the message field in the work result.
-                work_results->msg = result_message;   
-
                 // Call the plugin callback
                 p->instance->cb.on_ra_stop(p->instance, work_results);
 
                 // Free the pointers (not RST though)
-                if (result_message) g_free(result_message);
-                if (work_results) g_free(work_results);                    
+                racomms_free_results(work_results);
             }             
         }
     }    
@@ -108,30 +104,282 @@ void notify_ra_idle(void)
     }
 }
 
-void notify_exec_instruction(CPUState *cs, uint64_t vaddr)
+// The block handed to plugins for each translated block, by the TB it was
+// built for. Entries go when the TB is invalidated or the translation cache
+// is flushed, once no vCPU can still be running the TB's code.
+typedef struct PluginExecBlockEntry {
+    struct rcu_head rcu;
+    PluginExecBlock block;
+} PluginExecBlockEntry;
+
+static GHashTable *exec_blocks = NULL;
+static QemuMutex exec_blocks_lock;
+
+static void __attribute__((constructor)) plugin_exec_blocks_init(void)
 {
-    // Perform the translation from vaddr to paddr.
-    hwaddr paddr = cpu_get_phys_page_debug(cs, vaddr);
-    if (paddr == -1) {
-        printf("notify_exec_instruction: No virtual translation for code address %lX!\n", vaddr);
-        return;
+    qemu_mutex_init(&exec_blocks_lock);
+}
+
+static bool plugin_exec_in_range(PluginObject *po, uint64_t begin, uint64_t end)
+{
+    const PluginExecFilter *filter = &po->exec_filter;
+
+    return filter->range_begin == filter->range_end ||
+           (begin < filter->range_end && end > filter->range_begin);
+}
+
+static uint64_t plugin_exec_block_extent(PluginExecBlock *block)
+{
+    PluginExecInsn *last;
+
+    if (!block->num_insns) {
+        return block->vaddr + 1;
+    }
+
+    last = &block->insns[block->num_insns - 1];
+    return last->vaddr + last->size;
+}
+
+static bool plugin_exec_in_process(PluginObject *po, CPUState *cs)
+{
+    OSHandler *os_handler;
+    OSHandlerClass *os_cc;
+
+    if (po->exec_filter.process == NULL_PID || !is_oshandler_active()) {
+        return true;
+    }
+
+    os_handler = oshandler_get_instance();
+    os_cc = OSHANDLER_GET_CLASS(os_handler);
+    return os_cc->is_active_process(os_handler, cs,
+        os_cc->get_processinfo_by_ospid(os_handler, po->exec_filter.process));
+}
+
+// Called from the RCU thread, with the BQL held
+static void plugin_exec_block_free(PluginExecBlockEntry *entry)
+{
+    PluginExecBlock *block = &entry->block;
+
+    // The count is final now that nothing runs the block.
+    PluginInstanceList *p = NULL;
+    QLIST_FOREACH(p, &plugin_instance_list, next)
+    {
+        PluginObject *po = p->instance;
+
+        // Check if the callback is set
+        if (po->cb.on_invalidate_block) {
+            // Call the plugin callback
+            po->cb.on_invalidate_block(po, block);
+        }
     }
 
-    // Get the pointer to executing code in host memory.
-    void *code = qemu_map_ram_ptr_nofault(NULL, paddr + (~TARGET_PAGE_MASK & vaddr), NULL);
+    g_free(block->insns);
+    g_free(entry);
+}
+
+static void plugin_exec_block_release(gpointer data)
+{
+    PluginExecBlockEntry *entry = data;
+
+    // A vCPU may still be in the TB's code.
+    call_rcu(entry, plugin_exec_block_free, rcu);
+}
+
+int plugin_exec_block_mode(uint64_t begin, uint64_t end)
+{
+    int mode = 0;
+
+    // Only plugins whose filter takes part of the block ask for
+    // instrumentation.
+    PluginInstanceList *p = NULL;
+    QLIST_FOREACH(p, &plugin_instance_list, next)
+    {
+        PluginObject *po = p->instance;
+        if (!plugin_exec_in_range(po, begin, end)) {
+            continue;
+        }
+
+        if (po->cb.on_execute_instruction) {
+            mode |= PLUGIN_EXEC_INSN;
+        }
+        if (po->cb.on_execute_block) {
+            mode |= PLUGIN_EXEC_BLOCK;
+        }
+        if (po->cb.on_translate_block) {
+            mode |= PLUGIN_EXEC_COUNT;
+        }
+    }
+
+    return mode;
+}
+
+bool plugin_exec_insn_wanted(uint64_t vaddr)
+{
+    PluginInstanceList *p = NULL;
+    QLIST_FOREACH(p, &plugin_instance_list, next)
+    {
+        PluginObject *po = p->instance;
+        if (po->cb.on_execute_instruction &&
+            plugin_exec_in_range(po, vaddr, vaddr + 1)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void *plugin_exec_code_pointer(CPUState *cs, uint64_t vaddr)
+{
+    // The code was just fetched for translation, so this is a TLB hit.
+    // The block is looked up by this page again before it runs.
+    CPUArchState *env = cs->env_ptr;
+    tb_page_addr_t addr = get_page_addr_code(env, vaddr);
+    if (addr == -1) {
+        return NULL;
+    }
+
+    return qemu_map_ram_ptr_nofault(NULL, addr, NULL);
+}
+
+PluginExecBlock *plugin_exec_block_new(TranslationBlock *tb, uint64_t vaddr)
+{
+    PluginExecBlockEntry *entry = g_new0(PluginExecBlockEntry, 1);
+    entry->block.vaddr = vaddr;
+
+    // A TB abandoned during translation is allocated again at the same
+    // address, and its block is replaced.
+    qemu_mutex_lock(&exec_blocks_lock);
+    if (!exec_blocks) {
+        exec_blocks = g_hash_table_new_full(NULL, NULL, NULL,
+                                            plugin_exec_block_release);
+    }
+    g_hash_table_replace(exec_blocks, tb, entry);
+    qemu_mutex_unlock(&exec_blocks_lock);
+
+    return &entry->block;
+}
+
+void plugin_exec_block_add_insn(CPUState *cs, PluginExecBlock *block, uint64_t vaddr, uint32_t size)
+{
+    PluginExecInsn *insn;
+
+    block->insns = g_renew(PluginExecInsn, block->insns, block->num_insns + 1);
+    insn = &block->insns[block->num_insns++];
+    insn->vaddr = vaddr;
+    insn->size = size;
+    insn->addr = plugin_exec_code_pointer(cs, vaddr);
+}
+
+void plugin_exec_block_end(PluginExecBlock *block)
+{
+    uint64_t end = plugin_exec_block_extent(block);
+
+    PluginInstanceList *p = NULL;
+    QLIST_FOREACH(p, &plugin_instance_list, next)
+    {
+        PluginObject *po = p->instance;
+
+        // Check if the callback is set
+        if (po->cb.on_translate_block &&
+            plugin_exec_in_range(po, block->vaddr, end))
+        {
+            // Call the plugin callback
+            po->cb.on_translate_block(po, block);
+        }
+    }
+}
+
+void plugin_exec_block_invalidate(TranslationBlock *tb)
+{
+    PluginExecBlockEntry *entry = NULL;
+
+    qemu_mutex_lock(&exec_blocks_lock);
+    if (exec_blocks) {
+        entry = g_hash_table_lookup(exec_blocks, tb);
+        if (entry) {
+            g_hash_table_steal(exec_blocks, tb);
+        }
+    }
+    qemu_mutex_unlock(&exec_blocks_lock);
+
+    if (entry) {
+        plugin_exec_block_release(entry);
+    }
+}
+
+void plugin_exec_blocks_flush(void)
+{
+    GHashTable *blocks;
+
+    qemu_mutex_lock(&exec_blocks_lock);
+    blocks = exec_blocks;
+    exec_blocks = NULL;
+    qemu_mutex_unlock(&exec_blocks_lock);
+
+    if (blocks) {
+        g_hash_table_destroy(blocks);
+    }
+}
+
+void plugin_exec_filter_changed(void)
+{
+    // Existing blocks were instrumented for the old filter.
+    if (first_cpu) {
+        tb_flush(first_cpu);
+    }
+}
+
+void notify_exec_block(CPUState *cs, PluginExecBlock *block)
+{
+    uint64_t end = plugin_exec_block_extent(block);
+
+    PluginInstanceList *p = NULL;
+    QLIST_FOREACH(p, &plugin_instance_list, next)
+    {
+        PluginObject *po = p->instance;
+
+        // Check if the callback is set
+        if (po->cb.on_execute_block &&
+            plugin_exec_in_range(po, block->vaddr, end) &&
+            plugin_exec_in_process(po, cs))
+        {
+            // Call the plugin callback
+            po->cb.on_execute_block(po, block);
+        }
+    }
+}
+
+void notify_exec_instruction(CPUState *cs, uint64_t vaddr, void *code)
+{
+    // The pointer is normally resolved when the code is translated.
     if (!code) {
-        printf("notify_exec_instruction: No host memory for code address %lX!\n", paddr);
-        return;
+        // Perform the translation from vaddr to paddr.
+        hwaddr paddr = cpu_get_phys_page_debug(cs, vaddr);
+        if (paddr == -1) {
+            printf("notify_exec_instruction: No virtual translation for code address %lX!\n", vaddr);
+            return;
+        }
+
+        // Get the pointer to executing code in host memory.
+        code = qemu_map_ram_ptr_nofault(NULL, paddr + (~TARGET_PAGE_MASK & vaddr), NULL);
+        if (!code) {
+            printf("notify_exec_instruction: No host memory for code address %lX!\n", paddr);
+            return;
+        }
     }
 
     PluginInstanceList *p = NULL;
     QLIST_FOREACH(p, &plugin_instance_list, next)
     {
+        PluginObject *po = p->instance;
+
         // Check if the callback is set
-        if(p->instance->cb.on_execute_instruction)
+        if (po->cb.on_execute_instruction &&
+            plugin_exec_in_range(po, vaddr, vaddr + 1) &&
+            plugin_exec_in_process(po, cs))
         {
             // Call the plugin callback
-            p->instance->cb.on_execute_instruction(p->instance, vaddr, code);
+            po->cb.on_execute_instruction(po, vaddr, code);
         }
     }
 }
@@ -144,8 +392,8 @@ void notify_read_memory(CPUState *cs, uint64_t paddr, uint8_t *value, int size)
     PluginInstanceList *p = NULL;
     QLIST_FOREACH(p, &plugin_instance_list, next)
     {
-        // Check if the callback is set
-        if (p->instance->cb.on_memory_read)
+        // Check if the callback is set, watching plugins get their batches
+        if (p->instance->cb.on_memory_read && !p->instance->num_mem_watches)
         {
             // Call the plugin callback
             p->instance->cb.on_memory_read(p->instance, paddr, value, ram_ptr, size);
@@ -161,8 +409,8 @@ void notify_write_memory(CPUState *cs, uint64_t paddr, const uint8_t *value, int
    PluginInstanceList *p = NULL;
    QLIST_FOREACH(p, &plugin_instance_list, next)
    {
-        // Check if the callback is set
-        if (p->instance->cb.on_memory_write)
+        // Check if the callback is set, watching plugins get their batches
+        if (p->instance->cb.on_memory_write && !p->instance->num_mem_watches)
         {
             // Call the plugin callback
             p->instance->cb.on_memory_write(p->instance, paddr, value, ram_ptr, size);
@@ -170,6 +418,240 @@ void notify_write_memory(CPUState *cs, uint64_t paddr, const uint8_t *value, int
    }
 }
 
+// Memory watches. The table is swapped as a whole when a watch is added or
+// removed, so vCPUs filling their TLBs only ever read it under RCU.
+#define PLUGIN_MEM_RING_SIZE (256)
+
+typedef struct PluginMemWatch {
+    PluginObject *plugin;
+    // [begin, end) in the address space the flags say
+    uint64_t begin;
+    uint64_t end;
+    uint32_t flags;
+} PluginMemWatch;
+
+typedef struct PluginMemWatchTable {
+    struct rcu_head rcu;
+    size_t num_watches;
+    PluginMemWatch watches[];
+} PluginMemWatchTable;
+
+static PluginMemWatchTable *mem_watches = NULL;
+static QemuMutex mem_watch_lock;
+
+// Accesses waiting to be handed out, per vCPU thread. The ring is
+// emptied whenever the vCPU leaves a block, so with round robin TCG
+// it never holds accesses from more than one vCPU.
+static __thread PluginMemAccess *mem_ring = NULL;
+static __thread PluginMemAccess *mem_batch = NULL;
+static __thread uint32_t mem_ring_count = 0;
+
+static void __attribute__((constructor)) plugin_mem_watch_init(void)
+{
+    qemu_mutex_init(&mem_watch_lock);
+}
+
+static bool plugin_mem_watch_match(const PluginMemWatch *w, uint64_t vaddr,
+                                   uint64_t paddr, uint64_t size)
+{
+    uint64_t addr = (w->flags & PLUGIN_WATCH_VIRTUAL) ? vaddr : paddr;
+    return addr < w->end && addr + size > w->begin;
+}
+
+static void plugin_mem_watch_table_free(PluginMemWatchTable *table)
+{
+    g_free(table);
+}
+
+// Called with mem_watch_lock held
+static void plugin_mem_watch_update(PluginMemWatchTable *table)
+{
+    PluginMemWatchTable *old = mem_watches;
+    CPUState *cpu;
+
+    atomic_rcu_set(&mem_watches, table);
+    if (old) {
+        call_rcu(old, plugin_mem_watch_table_free, rcu);
+    }
+
+    // Existing TLB entries do not have the new watches set, and the
+    // generated code may still instrument every access.
+    plugin_update_memory_instrumentation();
+    CPU_FOREACH(cpu) {
+        tlb_flush(cpu);
+    }
+    if (first_cpu) {
+        tb_flush(first_cpu);
+    }
+}
+
+bool plugin_mem_watch_add(PluginObject *po, uint64_t begin, uint64_t end, uint32_t flags)
+{
+    PluginMemWatchTable *table;
+    size_t num_watches;
+
+    if (begin >= end || !(flags & (PLUGIN_WATCH_READ | PLUGIN_WATCH_WRITE))) {
+        return false;
+    }
+
+    qemu_mutex_lock(&mem_watch_lock);
+    num_watches = mem_watches ? mem_watches->num_watches : 0;
+    table = g_malloc(sizeof(PluginMemWatchTable) +
+                     (num_watches + 1) * sizeof(PluginMemWatch));
+    if (num_watches) {
+        memcpy(table->watches, mem_watches->watches,
+               num_watches * sizeof(PluginMemWatch));
+    }
+    table->watches[num_watches].plugin = po;
+    table->watches[num_watches].begin = begin;
+    table->watches[num_watches].end = end;
+    table->watches[num_watches].flags = flags;
+    table->num_watches = num_watches + 1;
+    po->num_mem_watches++;
+
+    plugin_mem_watch_update(table);
+    qemu_mutex_unlock(&mem_watch_lock);
+    return true;
+}
+
+void plugin_mem_watch_remove(PluginObject *po)
+{
+    PluginMemWatchTable *table = NULL;
+    size_t num_watches = 0;
+
+    qemu_mutex_lock(&mem_watch_lock);
+    if (!po->num_mem_watches) {
+        qemu_mutex_unlock(&mem_watch_lock);
+        return;
+    }
+
+    if (mem_watches->num_watches > po->num_mem_watches) {
+        table = g_malloc(sizeof(PluginMemWatchTable) +
+                         (mem_watches->num_watches - po->num_mem_watches) *
+                         sizeof(PluginMemWatch));
+        for (size_t i = 0; i < mem_watches->num_watches; i++) {
+            if (mem_watches->watches[i].plugin != po) {
+                table->watches[num_watches++] = mem_watches->watches[i];
+            }
+        }
+        table->num_watches = num_watches;
+    }
+    po->num_mem_watches = 0;
+
+    plugin_mem_watch_update(table);
+    qemu_mutex_unlock(&mem_watch_lock);
+}
+
+int plugin_mem_watch_page(uint64_t vaddr, uint64_t paddr)
+{
+    PluginMemWatchTable *table;
+    int flags = 0;
+
+    rcu_read_lock();
+    table = atomic_rcu_read(&mem_watches);
+    if (table) {
+        for (size_t i = 0; i < table->num_watches; i++) {
+            const PluginMemWatch *w = &table->watches[i];
+            if (plugin_mem_watch_match(w, vaddr, paddr, TARGET_PAGE_SIZE)) {
+                flags |= w->flags;
+            }
+        }
+    }
+    rcu_read_unlock();
+
+    return flags & (PLUGIN_WATCH_READ | PLUGIN_WATCH_WRITE);
+}
+
+void plugin_mem_watch_record(CPUState *cs, uint64_t vaddr, uint64_t paddr,
+                             uint64_t value, void *addr, int size, bool is_write)
+{
+    PluginMemAccess *access;
+
+    if (!mem_ring) {
+        mem_ring = g_new(PluginMemAccess, PLUGIN_MEM_RING_SIZE);
+        mem_batch = g_new(PluginMemAccess, PLUGIN_MEM_RING_SIZE);
+    }
+
+    access = &mem_ring[mem_ring_count++];
+    access->vaddr = vaddr;
+    access->paddr = paddr;
+    access->value = value;
+    access->addr = addr;
+    access->cpu_id = cs->cpu_index;
+    access->size = size;
+    access->is_write = is_write;
+
+    if (mem_ring_count == PLUGIN_MEM_RING_SIZE) {
+        plugin_mem_watch_flush();
+    }
+}
+
+static void plugin_mem_watch_deliver(PluginObject *po, PluginMemAccess *accesses, uint32_t count)
+{
+    if (po->cb.on_memory_access) {
+        po->cb.on_memory_access(po, accesses, count);
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        PluginMemAccess *a = &accesses[i];
+        uint8_t *value = (uint8_t *) &a->value;
+#ifdef HOST_WORDS_BIGENDIAN
+        value += sizeof(a->value) - a->size;
+#endif
+        if (a->is_write && po->cb.on_memory_write) {
+            po->cb.on_memory_write(po, a->paddr, value, a->addr, a->size);
+        } else if (!a->is_write && po->cb.on_memory_read) {
+            po->cb.on_memory_read(po, a->paddr, value, a->addr, a->size);
+        }
+    }
+}
+
+void plugin_mem_watch_flush(void)
+{
+    PluginMemWatchTable *table;
+    uint32_t count = mem_ring_count;
+
+    if (!count) {
+        return;
+    }
+    mem_ring_count = 0;
+
+    rcu_read_lock();
+    table = atomic_rcu_read(&mem_watches);
+
+    PluginInstanceList *p = NULL;
+    QLIST_FOREACH(p, &plugin_instance_list, next)
+    {
+        PluginObject *po = p->instance;
+        uint32_t num_batch = 0;
+
+        if (!table || !po->num_mem_watches) {
+            continue;
+        }
+
+        // Hand each plugin only the accesses in its own ranges
+        for (uint32_t i = 0; i < count; i++) {
+            const PluginMemAccess *a = &mem_ring[i];
+            int kind = a->is_write ? PLUGIN_WATCH_WRITE : PLUGIN_WATCH_READ;
+
+            for (size_t j = 0; j < table->num_watches; j++) {
+                const PluginMemWatch *w = &table->watches[j];
+                if (w->plugin == po && (w->flags & kind) &&
+                    plugin_mem_watch_match(w, a->vaddr, a->paddr, a->size)) {
+                    mem_batch[num_batch++] = *a;
+                    break;
+                }
+            }
+        }
+
+        if (num_batch) {
+            plugin_mem_watch_deliver(po, mem_batch, num_batch);
+        }
+    }
+    rcu_read_unlock();
+}
+
 void notify_breakpoint_hit(CPUState *cs, OSBreakpoint* bp)
 {
     CPUClass *cpu_class = CPU_GET_CLASS(cs);
@@ -21,6 +21,23 @@
 #include "target-types.h"
 #include "qemu-memory.h"
 #include "cpu.h"
+#include "exec/memory.h"
+#include "qemu/rcu.h"
+#include "sysemu/hw_accel.h"
+#include "plugin/cpu_cb.h"
+
+typedef struct QemuMemoryPage {
+    uint64_t vpage;
+    hwaddr paddr;
+    AddressSpace *as;
+    // Only set for pages backed by RAM
+    uint8_t *host;
+} QemuMemoryPage;
+
+struct QemuMemorySession {
+    CPUState *cpu;
+    GHashTable *pages;
+};
 
 bool qemu_get_virtual_memory(int cpu_id, uint64_t address, uint8_t size, uint8_t **data)
 {
@@ -132,3 +149,133 @@ bool qemu_store_u8(int cpu_id, uint64_t address, uint8_t data)
 {
     return qemu_set_virtual_memory(cpu_id, address, sizeof(data), (uint8_t *)&data);
 }
+
+QemuMemorySession *qemu_memory_session_begin(int cpu_id)
+{
+    CPUState *cpu = qemu_get_cpu(cpu_id);
+    QemuMemorySession *session;
+
+    if (!cpu) {
+        return NULL;
+    }
+
+    // Once for the session rather than once per read.
+    cpu_synchronize_state(cpu);
+
+    // Keeps the host pointers of the cached pages valid.
+    rcu_read_lock();
+
+    session = g_new0(QemuMemorySession, 1);
+    session->cpu = cpu;
+    session->pages = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+    return session;
+}
+
+void qemu_memory_session_end(QemuMemorySession *session)
+{
+    if (session) {
+        g_hash_table_destroy(session->pages);
+        g_free(session);
+        rcu_read_unlock();
+    }
+}
+
+static QemuMemoryPage *session_translate(QemuMemorySession *session, uint64_t address)
+{
+    uint64_t vpage = address & TARGET_PAGE_MASK;
+    QemuMemoryPage *page = g_hash_table_lookup(session->pages, &vpage);
+    MemTxAttrs attrs = MEMTXATTRS_UNSPECIFIED;
+    MemoryRegion *mr;
+    hwaddr xlat, len = TARGET_PAGE_SIZE;
+
+    if (page) {
+        return page;
+    }
+
+    // Unmapped pages are remembered too.
+    page = g_new0(QemuMemoryPage, 1);
+    page->vpage = vpage;
+    page->paddr = cpu_get_phys_page_attrs_debug(session->cpu, vpage, &attrs);
+    if (page->paddr != -1) {
+        page->as = session->cpu->cpu_ases[cpu_asidx_from_attrs(session->cpu, attrs)].as;
+        mr = address_space_translate(page->as, page->paddr, &xlat, &len, false, attrs);
+        if (len >= TARGET_PAGE_SIZE &&
+            memory_region_is_ram(mr) && !memory_region_is_ram_device(mr)) {
+            page->host = qemu_map_ram_ptr(mr->ram_block, xlat);
+        }
+    }
+
+    g_hash_table_insert(session->pages, &page->vpage, page);
+    return page;
+}
+
+bool qemu_memory_session_read(QemuMemorySession *session, uint64_t address, void *data, size_t size)
+{
+    CPUClass *cc = CPU_GET_CLASS(session->cpu);
+    uint8_t *buf = data;
+
+    // Targets with their own debug accessor keep using it.
+    if (cc->memory_rw_debug) {
+        return cc->memory_rw_debug(session->cpu, address, buf, size, 0) == 0;
+    }
+
+    while (size > 0) {
+        QemuMemoryPage *page = session_translate(session, address);
+        size_t offset = address & ~TARGET_PAGE_MASK;
+        size_t l = MIN(size, TARGET_PAGE_SIZE - offset);
+
+        if (page->paddr == -1) {
+            return false;
+        }
+
+        if (page->host) {
+            memcpy(buf, page->host + offset, l);
+        } else {
+            address_space_rw(page->as, page->paddr + offset,
+                             MEMTXATTRS_UNSPECIFIED, buf, l, false);
+        }
+
+        size -= l;
+        buf += l;
+        address += l;
+    }
+
+    return true;
+}
+
+bool qemu_memory_session_readv(QemuMemorySession *session, QemuMemoryRead *reads, size_t count)
+{
+    bool ok = true;
+
+    for (size_t i = 0; i < count; i++) {
+        if (!qemu_memory_session_read(session, reads[i].address, reads[i].data, reads[i].size)) {
+            memset(reads[i].data, 0, reads[i].size);
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+const void *qemu_memory_session_ptr(QemuMemorySession *session, uint64_t address, size_t size)
+{
+    size_t offset = address & ~TARGET_PAGE_MASK;
+    QemuMemoryPage *page;
+
+    if (!size || offset + size > TARGET_PAGE_SIZE) {
+        return NULL;
+    }
+
+    page = session_translate(session, address);
+    return page->host ? page->host + offset : NULL;
+}
+
+bool qemu_watch_memory_range(void *opaque, uint64_t begin, uint64_t end, uint32_t flags)
+{
+    return plugin_mem_watch_add(PLUGIN_OBJECT(opaque), begin, end, flags);
+}
+
+void qemu_unwatch_memory(void *opaque)
+{
+    plugin_mem_watch_remove(PLUGIN_OBJECT(opaque));
+}
@@ -20,6 +20,7 @@
 #define __QEMU_MEMORY_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C"{
@@ -40,6 +41,33 @@ bool qemu_store_u32(int cpu_id, uint64_t address, uint32_t data);
 bool qemu_store_u16(int cpu_id, uint64_t address, uint16_t data);
 bool qemu_store_u8(int cpu_id, uint64_t address, uint8_t data);
 
+// An introspection session reads guest virtual memory through the CPU's
+// page tables as they were when it began. Each page is walked once and
+// pages backed by RAM are read straight from host memory. The guest must
+// not run while a session is open.
+typedef struct QemuMemorySession QemuMemorySession;
+
+typedef struct QemuMemoryRead {
+    uint64_t address;
+    uint32_t size;
+    void *data;
+} QemuMemoryRead;
+
+QemuMemorySession *qemu_memory_session_begin(int cpu_id);
+void qemu_memory_session_end(QemuMemorySession *session);
+bool qemu_memory_session_read(QemuMemorySession *session, uint64_t address, void *data, size_t size);
+// Reads every entry, failed ones are zero filled. Returns true if all succeeded.
+bool qemu_memory_session_readv(QemuMemorySession *session, QemuMemoryRead *reads, size_t count);
+// Host pointer to [address, address + size) if it lies in one RAM page,
+// valid until the session ends. NULL otherwise.
+const void *qemu_memory_session_ptr(QemuMemorySession *session, uint64_t address, size_t size);
+
+// Watches [begin, end) for the plugin. flags are PLUGIN_WATCH_READ and/or
+// PLUGIN_WATCH_WRITE, plus PLUGIN_WATCH_VIRTUAL if the range is virtual.
+// Physical ranges use the addresses the memory callbacks report.
+bool qemu_watch_memory_range(void *opaque, uint64_t begin, uint64_t end, uint32_t flags);
+void qemu_unwatch_memory(void *opaque);
+
 #ifdef __cplusplus
 }
 #endif
@@ -19,6 +19,8 @@
 #include "qemu-processes.h"
 #include "target-types.h"
 #include "exec/gdbstub.h"
+#include "plugin/plugin-object.h"
+#include "plugin/cpu_cb.h"
 
 int qemu_set_anonymous_breakpoint(uint64_t addr)
 {
@@ -58,4 +60,27 @@ int qemu_set_anonymous_breakpoint_on_cpu(CPUState* cpu, uint64_t addr, uint64_t
     }
 
     return set_target_breakpoint(cpu, addr, length, bp_flags);
-}
\ No newline at end of file
+}
+
+void qemu_set_exec_filter_range(void *opaque, uint64_t begin, uint64_t end)
+{
+    PluginObject *p = PLUGIN_OBJECT(opaque);
+    if (p->exec_filter.range_begin == begin && p->exec_filter.range_end == end) {
+        return;
+    }
+
+    p->exec_filter.range_begin = begin;
+    p->exec_filter.range_end = end;
+    plugin_exec_filter_changed();
+}
+
+void qemu_set_exec_filter_process(void *opaque, OSPid pid)
+{
+    PluginObject *p = PLUGIN_OBJECT(opaque);
+    if (p->exec_filter.process == pid) {
+        return;
+    }
+
+    p->exec_filter.process = pid;
+    plugin_exec_filter_changed();
+}
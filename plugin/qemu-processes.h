@@ -31,6 +31,19 @@ extern "C"{
 int qemu_set_anonymous_breakpoint(uint64_t addr);
 int qemu_set_anonymous_breakpoint_on_cpu(CPUState* cpu , uint64_t addr, uint64_t length, OSBreakpointType bp_type);
 
+/**
+ * Limits the plugin's execution callbacks to code in [begin, end).
+ * Changing the filter flushes the translated code, so it is best set
+ * once, before the guest runs the code in question.
+ */
+void qemu_set_exec_filter_range(void *opaque, uint64_t begin, uint64_t end);
+
+/**
+ * Limits the plugin's execution callbacks to the given process.
+ * Use NULL_PID for any process. Changing it flushes the translated code.
+ */
+void qemu_set_exec_filter_process(void *opaque, OSPid pid);
+
 #ifdef __cplusplus
 }
 #endif
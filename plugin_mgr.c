@@ -39,6 +39,7 @@
 bool is_memread_instrumentation_enabled(void);
 bool is_memwrite_instrumentation_enabled(void);
 bool is_exec_instrumentation_enabled(void);
+bool is_block_instrumentation_enabled(void);
 bool is_syscall_instrumentation_enabled(void);
 bool is_interrupt_instrumentation_enabled(void);
 bool is_recvpacket_instrumentation_enabled(void);
@@ -49,6 +50,7 @@ bool is_ra_stop_instrumentation_enabled(void);
 static bool memread_instrumentation_enabled = false;
 static bool memwrite_instrumentation_enabled = false;
 static bool exec_instrumentation_enabled = false;
+static bool block_instrumentation_enabled = false;
 static bool syscall_instrumentation_enabled = false;
 static bool interrupt_instrumentation_enabled = false;
 static bool packetrecv_instrumentation_enabled = false;
@@ -216,9 +218,9 @@ void plugin_init_plugins(void)
         {
             // Check if certains callbacks are set. This allows us to speedup
             // execution and abstract the class callbacks away from QEMU code.
-            memread_instrumentation_enabled |= cb->on_memory_read != NULL;
-            memwrite_instrumentation_enabled |= cb->on_memory_write != NULL;
             exec_instrumentation_enabled |= cb->on_execute_instruction != NULL;
+            block_instrumentation_enabled |= cb->on_execute_block != NULL ||
+                                             cb->on_translate_block != NULL;
             syscall_instrumentation_enabled |= cb->on_syscall != NULL;
             interrupt_instrumentation_enabled |= cb->on_interrupt != NULL;
             packetrecv_instrumentation_enabled |= cb->on_packet_recv != NULL;
@@ -237,6 +239,30 @@ void plugin_init_plugins(void)
             // cpu_tb_jmp_cache_clear(cpu);
         }
     }
+
+    plugin_update_memory_instrumentation();
+}
+
+void plugin_update_memory_instrumentation(void)
+{
+    bool memread = false;
+    bool memwrite = false;
+
+    // Plugins watching memory only get told about what they watch, which
+    // does not need every access to be instrumented.
+    PluginInstanceList *p = NULL;
+    QLIST_FOREACH(p, &plugin_instance_list, next)
+    {
+        PluginObject *pi = p->instance;
+        if (!pi->num_mem_watches)
+        {
+            memread |= pi->cb.on_memory_read != NULL;
+            memwrite |= pi->cb.on_memory_write != NULL;
+        }
+    }
+
+    memread_instrumentation_enabled = memread;
+    memwrite_instrumentation_enabled = memwrite;
 }
 
 bool plugin_create_plugin(const char *optstr)
@@ -288,6 +314,11 @@ bool is_exec_instrumentation_enabled(void)
     return exec_instrumentation_enabled;
 }
 
+bool is_block_instrumentation_enabled(void)
+{
+    return block_instrumentation_enabled;
+}
+
 
 bool is_syscall_instrumentation_enabled(void)
 {
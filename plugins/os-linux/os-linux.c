@@ -89,6 +89,9 @@ typedef struct Linux
     uint64_t current_process;
 
     CPUState *cpu;
+
+    // Open while the task list is walked
+    QemuMemorySession *mem;
 } Linux;
 
 typedef struct LinuxClass
@@ -1249,7 +1252,7 @@ static void parse_task_child_ptrs(Linux* ctxt, Process* task, CPUState* cpu, uin
    // This will also not add the last child.
    for (current_child = next_child;
         current_child && current_child != previous_child;
-       qemu_load_u64(ctxt->cpu->cpu_index, current_child, &current_child))
+       qemu_memory_session_read(ctxt->mem, current_child, &current_child, sizeof(current_child)))
    {
           // Transform the kernel LL pointer to a task pointer by jumping to the
          // top of the task struct
@@ -1322,13 +1325,17 @@ static void parse_vm_area_struct(Linux* ctxt, TaskMemoryInfo* mem_info, CPUState
 
       vm_info = g_new0(VmAreaInfo, 1);
 
-      if(!qemu_load_u64(ctxt->cpu->cpu_index, ptr + VM_AREA_VM_NEXT_OFS, &next) ||
-         !qemu_load_u64(ctxt->cpu->cpu_index, ptr + VM_AREA_VM_PREV_OFS, &prev) ||
-         !qemu_load_u64(ctxt->cpu->cpu_index, ptr + VM_AREA_VM_START_OFS, &vm_info->vm_start) ||
-         !qemu_load_u64(ctxt->cpu->cpu_index, ptr + VM_AREA_VM_END_OFS,&vm_info->vm_end) ||
-         !qemu_load_u64(ctxt->cpu->cpu_index, ptr + VM_AREA_VM_PAGE_PROT_OFS, &vm_info->page_prot) ||
-         !qemu_load_u64(ctxt->cpu->cpu_index, ptr + VM_AREA_VM_FLAGS_OFS, &vm_info->flags) ||
-         !qemu_load_u64(ctxt->cpu->cpu_index, ptr + VM_AREA_VM_FILE_OFS, &vm_info->file_ptr)){
+      QemuMemoryRead fields[] = {
+         { ptr + VM_AREA_VM_NEXT_OFS, sizeof(next), &next },
+         { ptr + VM_AREA_VM_PREV_OFS, sizeof(prev), &prev },
+         { ptr + VM_AREA_VM_START_OFS, sizeof(vm_info->vm_start), &vm_info->vm_start },
+         { ptr + VM_AREA_VM_END_OFS, sizeof(vm_info->vm_end), &vm_info->vm_end },
+         { ptr + VM_AREA_VM_PAGE_PROT_OFS, sizeof(vm_info->page_prot), &vm_info->page_prot },
+         { ptr + VM_AREA_VM_FLAGS_OFS, sizeof(vm_info->flags), &vm_info->flags },
+         { ptr + VM_AREA_VM_FILE_OFS, sizeof(vm_info->file_ptr), &vm_info->file_ptr },
+      };
+
+      if(!qemu_memory_session_readv(ctxt->mem, fields, ARRAY_SIZE(fields))){
          // Fail to read vm info. Bail.
          g_free(vm_info);
          break;
@@ -1377,7 +1384,7 @@ static bool parse_mm_struct(Linux* ctxt, Process* task, CPUState* cpu)
 
    // EOUTPUT("mm_ptr = %#"PRIx64"\n", mm_ptr);
 
-   if(!qemu_load_u64(ctxt->cpu->cpu_index, mm_ptr + MM_STRUCT_VM_AREA_OFS, &vm_area_head_ptr)){
+   if(!qemu_memory_session_read(ctxt->mem, mm_ptr + MM_STRUCT_VM_AREA_OFS, &vm_area_head_ptr, sizeof(vm_area_head_ptr))){
       return false;
    }
 
@@ -1389,10 +1396,14 @@ static bool parse_mm_struct(Linux* ctxt, Process* task, CPUState* cpu)
 
    info->vm_areas = NULL;
 
-   if(!qemu_load_u64(ctxt->cpu->cpu_index, mm_ptr + MM_STRUCT_MMAP_BASE_OFS, &info->mmap_base) ||
-      !qemu_load_u64(ctxt->cpu->cpu_index, mm_ptr + MM_STRUCT_MMAP_LEGACY_BASE_OFS, &info->mmap_legacy_base) ||
-      !qemu_load_u64(ctxt->cpu->cpu_index, mm_ptr + MM_STRUCT_TASK_SIZE, &info->task_size) ||
-      !qemu_load_u64(ctxt->cpu->cpu_index, mm_ptr + MM_STRUCT_HIGHEST_VM_END_OFS, &info->highest_vm_end)){
+   QemuMemoryRead fields[] = {
+      { mm_ptr + MM_STRUCT_MMAP_BASE_OFS, sizeof(info->mmap_base), &info->mmap_base },
+      { mm_ptr + MM_STRUCT_MMAP_LEGACY_BASE_OFS, sizeof(info->mmap_legacy_base), &info->mmap_legacy_base },
+      { mm_ptr + MM_STRUCT_TASK_SIZE, sizeof(info->task_size), &info->task_size },
+      { mm_ptr + MM_STRUCT_HIGHEST_VM_END_OFS, sizeof(info->highest_vm_end), &info->highest_vm_end },
+   };
+
+   if(!qemu_memory_session_readv(ctxt->mem, fields, ARRAY_SIZE(fields))){
       return false;
    }
 
@@ -1403,7 +1414,7 @@ static bool parse_mm_struct(Linux* ctxt, Process* task, CPUState* cpu)
 
    parse_vm_area_struct(ctxt, info, cpu);
 
-   if(!qemu_load_u64(ctxt->cpu->cpu_index, mm_ptr + MM_STRUCT_PGD_OFS, &pgd_ptr)){
+   if(!qemu_memory_session_read(ctxt->mem, mm_ptr + MM_STRUCT_PGD_OFS, &pgd_ptr, sizeof(pgd_ptr))){
       return false;
    }
 
@@ -1472,88 +1483,52 @@ static bool parse_task_struct(Linux* ctxt, CPUState* cpu, uint64_t ptask, Proces
 
    // EOUTPUT("base_task_ptr = %#"PRIx64"\n", new_task->procaddr);
 
-   if(!qemu_get_virtual_memory(ctxt->cpu->cpu_index, ptask + TASK_LIST_COMM_OFS, LINUX_COMM_NAME_SIZE, (uint8_t**)&comm_name)){
-      return false;
-   }
-
-   if(!comm_name){
-      return false;
-   }
-   
-   // EOUTPUT("comm_name = %s\n", new_task->comm_name);
-
-   if(!qemu_load_u64(ctxt->cpu->cpu_index, ptask + TASK_LIST_FS_STRUCT_OFS, &new_task->u.lnx.fs_struct_ptr)){
-      return false;
-   }
-   
-   // EOUTPUT("fs ptr = %#"PRIx64"\n", new_task->fs_struct_ptr);
-
-   if(!qemu_load_u64(ctxt->cpu->cpu_index, ptask + TASK_LIST_FILES_STRUCT_OFS, &new_task->u.lnx.open_files_ptr)){
-      return false;
-   }
-
-   // EOUTPUT("files_struct ptr = %#"PRIx64"\n", new_task->open_files_ptr);
-
-   if(!qemu_load_u64(ctxt->cpu->cpu_index, ptask + TASK_LIST_REAL_PARENT_OFS, &new_task->u.lnx.real_parent_ptr)){
-      return false;
-   }
-
-   // EOUTPUT("real_parent_ptr = %#"PRIx64"\n", new_task->real_parent_ptr);
+   // The name is not always terminated in the guest.
+   comm_name = g_malloc0(LINUX_COMM_NAME_SIZE + 1);
 
-   if(!qemu_load_u32(ctxt->cpu->cpu_index, ptask + TASK_LIST_TGID_OFS, &new_task->u.lnx.tgid)){
-      return false;
-   }
-
-   // EOUTPUT("tgid = %d\n", new_task->tgid);
-
-   if(!qemu_load_u32(ctxt->cpu->cpu_index, ptask + TASK_LIST_PID_OFS, &new_task->info->pid)){
+   // For 32-bit change sizeof(uint64_t) to sizeof(uint32_t),
+   // this would preferably be done with a dynamically assigned pointer size per system
+   QemuMemoryRead fields[] = {
+      { ptask + TASK_LIST_COMM_OFS, LINUX_COMM_NAME_SIZE, comm_name },
+      { ptask + TASK_LIST_FS_STRUCT_OFS, sizeof(uint64_t), &new_task->u.lnx.fs_struct_ptr },
+      { ptask + TASK_LIST_FILES_STRUCT_OFS, sizeof(uint64_t), &new_task->u.lnx.open_files_ptr },
+      { ptask + TASK_LIST_REAL_PARENT_OFS, sizeof(uint64_t), &new_task->u.lnx.real_parent_ptr },
+      { ptask + TASK_LIST_TGID_OFS, sizeof(uint32_t), &new_task->u.lnx.tgid },
+      { ptask + TASK_LIST_PID_OFS, sizeof(uint32_t), &new_task->info->pid },
+      { ptask + TASK_LIST_STACK_CANARY_OFS, sizeof(uint64_t), &new_task->u.lnx.stack_canary },
+      { ptask + TASK_LIST_CHILD_LIST_HEAD_OFS, sizeof(uint64_t), &new_task->u.lnx.child_list_next },
+      { ptask + TASK_LIST_CHILD_LIST_HEAD_OFS + sizeof(uint64_t), sizeof(uint64_t), &new_task->u.lnx.child_list_prev },
+      { ptask + TASK_LIST_SIBLING_LIST_HEAD_OFS, sizeof(uint64_t), &new_task->u.lnx.sibling_list_next },
+      { ptask + TASK_LIST_SIBLING_LIST_HEAD_OFS + sizeof(uint64_t), sizeof(uint64_t), &new_task->u.lnx.sibling_list_prev },
+      { ptask + TASK_LIST_MM_OFS, sizeof(uint64_t), &new_task->u.lnx.mm_ptr },
+      { ptask + TASK_LIST_ACTIVE_MM_OFS, sizeof(uint64_t), &new_task->u.lnx.active_mm_ptr },
+   };
+
+   if(!qemu_memory_session_readv(ctxt->mem, fields, ARRAY_SIZE(fields))){
+      g_free(comm_name);
       return false;
    }
 
-   // EOUTPUT("pid = %d\n", new_task->pid);
-
-   if(!qemu_load_u64(ctxt->cpu->cpu_index, ptask + TASK_LIST_STACK_CANARY_OFS, &new_task->u.lnx.stack_canary)){
-      return false;
-   }
+   // EOUTPUT("comm_name = %s\n", comm_name);
+   // EOUTPUT("pid = %d\n", new_task->info->pid);
 
    if (new_task->info->pid == 0)
    {
       uint64_t offset = 0;
-      if(!qemu_load_u64(ctxt->cpu->cpu_index, ptask + TASK_LIST_PIDS_OFS, &offset)){
+      if(!qemu_memory_session_read(ctxt->mem, ptask + TASK_LIST_PIDS_OFS, &offset, sizeof(offset))){
+         g_free(comm_name);
          return false;
       }
       if (offset != 0)
       {
-         if(!qemu_load_u64(ctxt->cpu->cpu_index, offset + 0x10, &offset)){
-            return false;
-         }
-         if(!qemu_load_u32(ctxt->cpu->cpu_index, offset + 0x30, &new_task->info->pid)){
+         if(!qemu_memory_session_read(ctxt->mem, offset + 0x10, &offset, sizeof(offset)) ||
+            !qemu_memory_session_read(ctxt->mem, offset + 0x30, &new_task->info->pid, sizeof(uint32_t))){
+            g_free(comm_name);
             return false;
          }
       }
    }
 
-   // EOUTPUT("stack canary = %#"PRIx64"\n", new_task->stack_canary);
-
-   // for(uint32_t i = 0; i < 0x1000; i+=8)
-   // {
-   //    uint64_t tmp = 0;
-   //    uint8_t tmp_comm[16] = {0};
-      
-   //    EOUTPUT("ORIG OFS = %08X    comm = %s\n", i, tmp_comm);
-   // }
-
-   // For 32-bit change sizeof(uint64_t) to sizeof(uint32_t), 
-   // this would preferably be done with a dynamically assigned pointer size per system
-   if(!qemu_load_u64(ctxt->cpu->cpu_index, ptask + TASK_LIST_CHILD_LIST_HEAD_OFS, &new_task->u.lnx.child_list_next) ||
-      !qemu_load_u64(ctxt->cpu->cpu_index, ptask + TASK_LIST_CHILD_LIST_HEAD_OFS + sizeof(uint64_t), &new_task->u.lnx.child_list_prev) ||
-      !qemu_load_u64(ctxt->cpu->cpu_index, ptask + TASK_LIST_SIBLING_LIST_HEAD_OFS, &new_task->u.lnx.sibling_list_next) ||
-      !qemu_load_u64(ctxt->cpu->cpu_index, ptask + TASK_LIST_SIBLING_LIST_HEAD_OFS + sizeof(uint64_t), &new_task->u.lnx.sibling_list_prev) ||
-      !qemu_load_u64(ctxt->cpu->cpu_index, ptask + TASK_LIST_MM_OFS, &new_task->u.lnx.mm_ptr) ||
-      !qemu_load_u64(ctxt->cpu->cpu_index, ptask + TASK_LIST_ACTIVE_MM_OFS, &new_task->u.lnx.active_mm_ptr)){
-      return false;
-   }
-
    // EOUTPUT("active_mm_ptr = %#"PRIx64"\n", new_task->active_mm_ptr);
 
    parse_mm_struct(ctxt, new_task, cpu);
@@ -1645,7 +1620,7 @@ static uint64_t find_top_parent(Linux* ctxt, CPUState* cpu, uint64_t cur_ptr)
       // EOUTPUT("real_parent_ptr = %#"PRIx64"\n", new_parent);
 
       last_read = new_parent;
-      qemu_load_u64(ctxt->cpu->cpu_index, new_parent + TASK_LIST_REAL_PARENT_OFS, &new_parent);
+      qemu_memory_session_read(ctxt->mem, new_parent + TASK_LIST_REAL_PARENT_OFS, &new_parent, sizeof(new_parent));
 
       if(last_read == new_parent)
          break;
@@ -1662,8 +1637,14 @@ static ProcessList* linux_get_process_list(OSHandler* ctxt)
    ProcessList* proc_list = NULL;
    ProcessList* tail = NULL;
 
+   // Every read of the walk shares one set of page translations.
+   os->mem = qemu_memory_session_begin(os->cpu->cpu_index);
+   if(!os->mem){
+      return NULL;
+   }
+
    // Read the location of the current task pointer from guest memory
-   qemu_load_u64(os->cpu->cpu_index, os->current_task, &cur_task);
+   qemu_memory_session_read(os->mem, os->current_task, &cur_task, sizeof(cur_task));
   
    // Traverse the task list to the first task (root node)
    cur_task = find_top_parent(os, os->cpu, cur_task);
@@ -1671,6 +1652,9 @@ static ProcessList* linux_get_process_list(OSHandler* ctxt)
    // Work from the first task down
    parse_task_and_subs(os, os->cpu, &proc_list, &tail, cur_task);
 
+   qemu_memory_session_end(os->mem);
+   os->mem = NULL;
+
    return proc_list;
 }
 
@@ -1889,25 +1873,20 @@ static bool fix_offsets_for_kaslr(Linux* ctxt)
    return true;
 }
 
-static Process* linux_get_process_detail(OSHandler* ctxt, ProcessInfo *pi)
+static bool linux_match_pid(const Process *task, const void *data)
 {
-    ProcessList *procs = linux_get_process_list(ctxt);
-   if(procs){
-      for (ProcessList* cur_proc = procs; cur_proc; cur_proc = cur_proc->next)
-      {
-         Process *task = cur_proc->value;
-         if( pi->pid == task->info->pid ){
-            // Remove this process from the list.
-            Process *p = cur_proc->value;
-            cur_proc->value = NULL;
-                qapi_free_ProcessList(procs);
-            return p;
-         }
-      }
-      qapi_free_ProcessList(procs);
-   }
+   return task->info->pid == *(const uint64_t *) data;
+}
 
-   return NULL;
+static bool linux_match_name(const Process *task, const void *data)
+{
+   return !strncmp(task->name, data, LINUX_COMM_NAME_SIZE);
+}
+
+static Process* linux_get_process_detail(OSHandler* ctxt, ProcessInfo *pi)
+{
+   uint64_t pid = pi->pid;
+   return oshandler_cached_process(ctxt, linux_match_pid, &pid);
 }
 
 static void linux_get_process_string(OSHandler* ctxt, ProcessInfo *pi, QString **pqstr)
@@ -1975,73 +1954,56 @@ static OSHandler *linux_scan_for_context(OSHandler* ctxt, OSArch *arch)
    return os;
 }
 
-static bool linux_is_active_by_processinfo(OSHandler* ctxt, CPUState* cpu, ProcessInfo *pi)
+static uint64_t linux_active_process_key(OSHandler* ctxt, CPUState* cpu)
 {
-   uint64_t precr3 = OSARCH_GET_CLASS(ctxt->arch)->get_active_pagetable(ctxt->arch, cpu);
-   precr3 &= PDPT_ENTRY_INVMASK;
-   precr3 &= KVM_ENTRY_INVMASK;
-   return (pi->cr3 & KVM_ENTRY_INVMASK) == precr3;
+   // Need to mask out bits 31-30 and 12 for linux so we can identify the process.
+   uint64_t pagedir = OSARCH_GET_CLASS(ctxt->arch)->get_active_pagetable(ctxt->arch, cpu);
+   pagedir &= PDPT_ENTRY_INVMASK;
+   pagedir &= KVM_ENTRY_INVMASK;
+   return pagedir;
 }
 
-static ProcessInfo *linux_get_processinfo_by_pid(OSHandler* os, uint64_t pid)
+static uint64_t linux_process_key(OSHandler* ctxt, const ProcessInfo *pi)
 {
-    ProcessList *procs = linux_get_process_list(os);
-   if(procs){
-      for (ProcessList* cur_proc = procs; cur_proc; cur_proc = cur_proc->next)
-      {
-         const Process *task = cur_proc->value;
-         if( task->info->pid == pid ){
-            ProcessInfo *pi = g_memdup(task->info, sizeof(ProcessInfo));
-                qapi_free_ProcessList(procs);
-            return pi;
-         }
-      }
-      qapi_free_ProcessList(procs);
+   return pi->cr3 & KVM_ENTRY_INVMASK;
+}
+
+static bool linux_process_exists(OSHandler* os, const Process *task)
+{
+   Linux* ctxt = LINUX(os);
+   uint64_t ptask = task->info->procaddr;
+   uint64_t mm_ptr = 0;
+   uint32_t tgid = 0;
+
+   // An exited task has let go of its mm, and a freed task_struct that
+   // was reused belongs to another thread group.
+   if(!qemu_load_u64(ctxt->cpu->cpu_index, ptask + TASK_LIST_MM_OFS, &mm_ptr) ||
+      !qemu_load_u32(ctxt->cpu->cpu_index, ptask + TASK_LIST_TGID_OFS, &tgid)){
+      return false;
    }
 
-   return NULL;
+   return mm_ptr == task->u.lnx.mm_ptr && tgid == task->u.lnx.tgid;
 }
 
-static ProcessInfo *linux_get_processinfo_by_active(OSHandler* os, CPUState* cpu)
+static bool linux_is_active_by_processinfo(OSHandler* ctxt, CPUState* cpu, ProcessInfo *pi)
 {
-    // Need to mask out bits 31-30 and 12 for linux so we can identify the process.
-   uint64_t pagedir = OSARCH_GET_CLASS(os->arch)->get_active_pagetable(os->arch, cpu);
-   pagedir &= PDPT_ENTRY_INVMASK;
-   pagedir &= KVM_ENTRY_INVMASK;
-    ProcessList *procs = linux_get_process_list(os);
-   if(procs){
-      for (ProcessList* cur_proc = procs; cur_proc; cur_proc = cur_proc->next)
-      {
-         const Process *task = cur_proc->value;
-         if( (task->info->cr3 & KVM_ENTRY_INVMASK) == pagedir ){
-            ProcessInfo *pi = g_memdup(task->info, sizeof(ProcessInfo));
-                qapi_free_ProcessList(procs);
-            return pi;
-         }
-      }
-      qapi_free_ProcessList(procs);
-   }
+   // The active key is only read again after a page table switch.
+   return oshandler_get_active_key(ctxt, cpu) == linux_process_key(ctxt, pi);
+}
 
-   return NULL;
+static ProcessInfo *linux_get_processinfo_by_pid(OSHandler* os, uint64_t pid)
+{
+   return oshandler_cached_processinfo(os, linux_match_pid, &pid);
 }
 
-static ProcessInfo *linux_get_processinfo_by_name(OSHandler* os, const char *name)
+static ProcessInfo *linux_get_processinfo_by_active(OSHandler* os, CPUState* cpu)
 {
-    ProcessList *procs = linux_get_process_list(os);
-    if(procs){
-        for (ProcessList* cur_proc = procs; cur_proc; cur_proc = cur_proc->next)
-        {
-            const Process* task = cur_proc->value;
-            if( !strncmp(task->name, name, LINUX_COMM_NAME_SIZE) ){
-            ProcessInfo *pi = g_memdup(task->info, sizeof(ProcessInfo));
-                qapi_free_ProcessList(procs);
-            return pi;
-            }
-        }
-        qapi_free_ProcessList(procs);
-    }
+   return oshandler_cached_processinfo_by_key(os, oshandler_get_active_key(os, cpu));
+}
 
-   return NULL;
+static ProcessInfo *linux_get_processinfo_by_name(OSHandler* os, const char *name)
+{
+   return oshandler_cached_processinfo(os, linux_match_name, name);
 }
 
 // Object setup: constructor
@@ -2083,6 +2045,9 @@ static void linux_class_init(ObjectClass *klass,
     os_klass->get_processinfo_by_name = linux_get_processinfo_by_name;
     os_klass->get_processinfo_by_active = linux_get_processinfo_by_active;
     os_klass->is_active_by_processinfo = linux_is_active_by_processinfo;
+    os_klass->active_process_key = linux_active_process_key;
+    os_klass->process_key = linux_process_key;
+    os_klass->process_exists = linux_process_exists;
 }
 
 // Object setup: Object info
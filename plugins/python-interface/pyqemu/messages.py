@@ -31,8 +31,8 @@ JOB_FLAG_TYPES = [
     "continue",
     "force_save",
     "no_execute",
-    "reserved1",
-    "reserved2",
+    "template",
+    "merge",
     "reserved3",
     "reserved4",
     "reserved5"
@@ -45,11 +45,37 @@ COMMS_MESSAGE_TYPES = {
     14: "MSG_REQUEST_JOB_PURGE",
     15: "MSG_REQUEST_JOB_REPORT",
     16: "MSG_REQUEST_QUIT",
+    17: "MSG_REQUEST_JOB_BATCH",
+    18: "MSG_REQUEST_JOB_TEMPLATE",
+    19: "MSG_REQUEST_RST_STATE",
     20: "MSG_RESPONSE_CONFIG",
     21: "MSG_RESPONSE_REPORT",
-    22: "MSG_RESPONSE_RST"
+    22: "MSG_RESPONSE_RST",
+    23: "MSG_RESPONSE_RST_STATE"
 }
 
+RST_FLAG_TYPES = [
+    "no_states",
+    "reserved1",
+    "reserved2",
+    "reserved3",
+    "reserved4",
+    "reserved5",
+    "reserved6",
+    "reserved7"
+]
+
+JOB_RESULT_TYPES = [
+    "merged",
+    "reserved1",
+    "reserved2",
+    "reserved3",
+    "reserved4",
+    "reserved5",
+    "reserved6",
+    "reserved7"
+]
+
 JOB_REPORT_ITEMS = [
     "report_processor",
     "report_register",
@@ -58,7 +84,10 @@ JOB_REPORT_ITEMS = [
     "report_all_physical_memory",
     "report_all_virtual_memory",
     "report_error",
-    "report_exception"
+    "report_exception",
+    "report_coverage",
+    "report_encoded_memory",
+    "report_stats"
 ]
 
 JOB_REPORT_TYPES = {
@@ -69,7 +98,10 @@ JOB_REPORT_TYPES = {
     16: JOB_REPORT_ITEMS[4],
     32: JOB_REPORT_ITEMS[5],
     64: JOB_REPORT_ITEMS[6],
-    128: JOB_REPORT_ITEMS[7]
+    128: JOB_REPORT_ITEMS[7],
+    256: JOB_REPORT_ITEMS[8],
+    512: JOB_REPORT_ITEMS[9],
+    1024: JOB_REPORT_ITEMS[10]
 }
 
 JOB_REPORT_IDS = {v: k for k, v in JOB_REPORT_TYPES.items()}
@@ -103,7 +135,8 @@ JOB_ADD_TYPES = {
     34: "job_add_exit_insn_range",
     35: "job_add_exit_exception",
     36: "job_add_timeout",
-    37: "job_add_stream"
+    37: "job_add_stream",
+    38: "job_add_report_mask"
 }
 
 MEMORY_TYPES = {
@@ -111,6 +144,12 @@ MEMORY_TYPES = {
     2: "memory_physical"
 }
 
+MEMORY_ENCODINGS = {
+    0: "memory_encoding_raw",
+    1: "memory_encoding_fill",
+    2: "memory_encoding_xbzrle"
+}
+
 class FieldStorage(object):
     __metaclass__ = abc.ABCMeta
 
@@ -1348,8 +1387,14 @@ class CommsMessage(Packet):
             self.msg_id = CommsRequestConfigMsg.TYPE_ID
         elif isinstance(self.payload, CommsRequestRapidSaveTreeMsg):
             self.msg_id = CommsRequestRapidSaveTreeMsg.TYPE_ID
+        elif isinstance(self.payload, CommsRequestRapidSaveTreeStateMsg):
+            self.msg_id = CommsRequestRapidSaveTreeStateMsg.TYPE_ID
+        elif isinstance(self.payload, CommsRequestJobTemplateMsg):
+            self.msg_id = CommsRequestJobTemplateMsg.TYPE_ID
         elif isinstance(self.payload, CommsRequestJobAddMsg):
             self.msg_id = CommsRequestJobAddMsg.TYPE_ID
+        elif isinstance(self.payload, CommsRequestJobBatchMsg):
+            self.msg_id = CommsRequestJobBatchMsg.TYPE_ID
         elif isinstance(self.payload, CommsRequestJobPurgeMsg):
             self.msg_id = CommsRequestJobPurgeMsg.TYPE_ID
         elif isinstance(self.payload, CommsRequestJobReportMsg):
@@ -1362,6 +1407,8 @@ class CommsMessage(Packet):
             self.msg_id = CommsResponseJobReportMsg.TYPE_ID
         elif isinstance(self.payload, CommsResponseRapidSaveTreeMsg):
             self.msg_id = CommsResponseRapidSaveTreeMsg.TYPE_ID
+        elif isinstance(self.payload, CommsResponseRapidSaveTreeStateMsg):
+            self.msg_id = CommsResponseRapidSaveTreeStateMsg.TYPE_ID
 
         total_len = CommsMessage.sizeof_comms_message()
         if self.payload is not None:
@@ -1374,8 +1421,14 @@ class CommsMessage(Packet):
             return CommsRequestConfigMsg
         elif myid == CommsRequestRapidSaveTreeMsg.TYPE_ID:
             return CommsRequestRapidSaveTreeMsg
+        elif myid == CommsRequestRapidSaveTreeStateMsg.TYPE_ID:
+            return CommsRequestRapidSaveTreeStateMsg
         elif myid == CommsRequestJobAddMsg.TYPE_ID:
             return CommsRequestJobAddMsg
+        elif myid == CommsRequestJobBatchMsg.TYPE_ID:
+            return CommsRequestJobBatchMsg
+        elif myid == CommsRequestJobTemplateMsg.TYPE_ID:
+            return CommsRequestJobTemplateMsg
         elif myid == CommsRequestJobPurgeMsg.TYPE_ID:
             return CommsRequestJobPurgeMsg
         elif myid == CommsRequestJobReportMsg.TYPE_ID:
@@ -1388,6 +1441,8 @@ class CommsMessage(Packet):
             return CommsResponseJobReportMsg
         elif myid == CommsResponseRapidSaveTreeMsg.TYPE_ID:
             return CommsResponseRapidSaveTreeMsg
+        elif myid == CommsResponseRapidSaveTreeStateMsg.TYPE_ID:
+            return CommsResponseRapidSaveTreeStateMsg
 
         return Raw
 
@@ -1399,8 +1454,8 @@ class CommsRequestConfigMsg(Packet):
             _klass = self.__class__,
             _fields = [
                 OctetField("queue", 1),
-                FlagsField("report_mask", None, 8, JOB_REPORT_ITEMS),
-                ShortField("reserved1", None),
+                OctetField("reserved1", None),
+                FlagsField("report_mask", None, 16, JOB_REPORT_ITEMS),
                 IntField("reserved2", None),
                 FlagsField("valid_settings", None, 8, CONFIG_VALID_ITEMS),
                 LongField("timeout", None)
@@ -1415,8 +1470,8 @@ class CommsRequestJobReportMsg(Packet):
             _klass = self.__class__,
             _fields = [
                 OctetField("queue", 1),
-                FlagsField("report_mask", None, 8, JOB_REPORT_ITEMS),
-                ShortField("reserved1", None),
+                OctetField("reserved1", None),
+                FlagsField("report_mask", None, 16, JOB_REPORT_ITEMS),
                 SignedIntField("job_id", None),
                 SHA1Field("job_hash", None)
             ],
@@ -1431,13 +1486,29 @@ class CommsRequestRapidSaveTreeMsg(Packet):
             _klass = self.__class__,
             _fields = [
                 OctetField("queue", 1),
-                OctetField("reserved1", None),
+                FlagsField("flags", 0, 8, RST_FLAG_TYPES),
                 ShortField("reserved2", None),
                 SignedIntField("job_id", None)
             ],
             **kwargs)
 
 
+class CommsRequestRapidSaveTreeStateMsg(Packet):
+    TYPE_ID = 19
+    def __init__(self, _pkt=b"", **kwargs):
+        super(CommsRequestRapidSaveTreeStateMsg, self).__init__(
+            _pkt = _pkt,
+            _klass = self.__class__,
+            _fields = [
+                OctetField("queue", 1),
+                OctetField("reserved1", None),
+                ShortField("reserved2", None),
+                IntField("reserved3", None),
+                SHA1Field("hash", None)
+            ],
+            **kwargs)
+
+
 class CommsRequestJobPurgeMsg(Packet):
     TYPE_ID = 14
     def __init__(self, _pkt=b"", **kwargs):
@@ -1470,8 +1541,8 @@ class CommsResponseConfigMsg(Packet):
             _klass = self.__class__,
             _fields = [
                 OctetField("queue", 1),
-                FlagsField("report_mask", None, 8, JOB_REPORT_ITEMS),
-                ShortField("reserved1", None),
+                OctetField("reserved1", None),
+                FlagsField("report_mask", None, 16, JOB_REPORT_ITEMS),
                 IntField("reserved2", None),
                 LongField("timeout", None)
             ],
@@ -1486,7 +1557,7 @@ class CommsRequestJobAddMsg(Packet):
             _fields = [
                 OctetField("queue", 1),
                 FlagsField("flags", 0, 8, JOB_FLAG_TYPES),
-                ShortField("reserved1", None),
+                ShortField("template_id", None),
                 SignedIntField("job_id", None),
                 SHA1Field("base_hash", None),
                 FieldListField("entries", [], JobAddEntry)
@@ -1516,6 +1587,43 @@ class CommsRequestJobAddMsg(Packet):
         if job_entry_fields:
             self.entries = job_entry_fields
 
+class CommsRequestJobTemplateMsg(CommsRequestJobAddMsg):
+    TYPE_ID = 18
+    def __init__(self, _pkt=b"", **kwargs):
+        Packet.__init__(self,
+            _pkt = _pkt,
+            _klass = self.__class__,
+            _fields = [
+                OctetField("queue", 1),
+                OctetField("reserved1", None),
+                ShortField("template_id", None),
+                IntField("reserved2", None),
+                SHA1Field("base_hash", None),
+                FieldListField("entries", [], JobAddEntry)
+            ],
+            **kwargs)
+
+class CommsRequestJobBatchMsg(Packet):
+    TYPE_ID = 17
+    def __init__(self, _pkt=b"", **kwargs):
+        super(CommsRequestJobBatchMsg, self).__init__(
+            _pkt = _pkt,
+            _klass = self.__class__,
+            _fields = [
+                OctetField("queue", 1),
+                OctetField("reserved1", None),
+                ShortField("reserved2", None),
+                IntField("num_jobs", 0),
+                StrField("jobs", None)
+            ],
+            **kwargs)
+
+    def add_job(self, message):
+        """Appends a complete job add or job template CommsMessage."""
+        jobs = bytes(self.jobs) if self.num_jobs else b""
+        self.jobs = jobs + bytes(message)
+        self.num_jobs = int(self.num_jobs) + 1
+
 class JobAddEntry(FieldStructField):
     def __init__(self, name, job_fields=[], **kwargs):
         super(JobAddEntry, self).__init__(
@@ -1540,6 +1648,8 @@ class JobAddEntry(FieldStructField):
             return CommsRequestJobAddMemorySetup()
         elif etype == CommsRequestJobAddExitInsnRangeConstraint.TYPE_ID:
             return CommsRequestJobAddExitInsnRangeConstraint()
+        elif etype == CommsRequestJobAddReportMaskSetup.TYPE_ID:
+            return CommsRequestJobAddReportMaskSetup()
         return None
 
 class CommsRequestJobAddExitInsnCountConstraint(JobAddEntry):
@@ -1570,6 +1680,19 @@ class CommsRequestJobAddTimeoutSetup(JobAddEntry):
             ],
             **kwargs)
 
+class CommsRequestJobAddReportMaskSetup(JobAddEntry):
+    TYPE_ID = 38
+    def __init__(self, **kwargs):
+        super(CommsRequestJobAddReportMaskSetup, self).__init__(
+            name = CommsRequestJobAddReportMaskSetup.__name__,
+            entry_type = CommsRequestJobAddReportMaskSetup.TYPE_ID,
+            job_fields = [
+                OctetField("reserved1", None),
+                FlagsField("report_mask", 0, 16, JOB_REPORT_ITEMS),
+                IntField("reserved2", None)
+            ],
+            **kwargs)
+
 class CommsRequestJobAddRegisterSetup(JobAddEntry):
     TYPE_ID = 31
     def __init__(self, **kwargs):
@@ -1674,7 +1797,7 @@ class CommsResponseJobReportMsg(Packet):
             _klass = self.__class__,
             _fields = [
                 OctetField("queue", 1),
-                OctetField("reserved1", 0),
+                FlagsField("flags", 0, 8, JOB_RESULT_TYPES),
                 ShortField("reserved2", None),
                 SignedIntField("job_id", None),
                 IntField("num_insns", None),
@@ -1715,12 +1838,15 @@ class JobReportEntry(FieldStructField):
         "report_all_physical_memory": "PhysMemory> ",
         "report_all_virtual_memory": "VirtMemory> ",
         "report_error": "Error> ",
-        "report_exception": "Exception> "
+        "report_exception": "Exception> ",
+        "report_coverage": "Coverage> ",
+        "report_encoded_memory": "EncMemory> ",
+        "report_stats": "Stats> "
     }
     def __init__(self, name, report_fields=[], **kwargs):
         super(JobReportEntry, self).__init__(
             name = name,
-            fields = [OctetEnumField("entry_type", None, JOB_REPORT_TYPES)] +
+            fields = [ShortEnumField("entry_type", None, JOB_REPORT_TYPES)] +
                    report_fields,
                    **kwargs)
 
@@ -1760,6 +1886,10 @@ class JobReportEntry(FieldStructField):
             return CommsResponseJobReportExceptionEntry()
         elif etype == CommsResponseJobReportErrorEntry.TYPE_ID:
             return CommsResponseJobReportErrorEntry()
+        elif etype == CommsResponseJobReportCoverageEntry.TYPE_ID:
+            return CommsResponseJobReportCoverageEntry()
+        elif etype == CommsResponseJobReportStatsEntry.TYPE_ID:
+            return CommsResponseJobReportStatsEntry()
         return None
 
 class CommsResponseJobReportRegisterEntry(JobReportEntry):
@@ -1772,7 +1902,6 @@ class CommsResponseJobReportRegisterEntry(JobReportEntry):
             report_fields = [
                 OctetField("id", None),
                 FieldLenField("size", None, fmt="B", size_of=register_value),
-                OctetField("reserved1", None),
                 IntField("reserved2", None),
                 StrFixedLenField("name", None, NAME_LENGTH),
                 register_value
@@ -1786,7 +1915,6 @@ class CommsResponseJobReportProcessorEntry(JobReportEntry):
             name = CommsResponseJobReportProcessorEntry.__name__,
             entry_type = CommsResponseJobReportProcessorEntry.TYPE_ID,
             report_fields = [
-                OctetField("reserved1", None),
                 ShortField("reserved2", None),
                 IntField("reserved3", None),
                 IntField("reserved4", None),
@@ -1800,13 +1928,12 @@ class CommsResponseJobReportMemoryEntry(JobReportEntry):
         memory_value = XStrField("value", None)
         super(CommsResponseJobReportMemoryEntry, self).__init__(
             report_fields = [
-                OctetField("reserved1", None),
                 ShortField("reserved2", None),
                 FieldLenField("size", None, fmt="I", size_of=memory_value),
                 LongField("offset", None),
-                IntField("reserved3", None),
+                IntField("length", None),
                 ShortField("reserved4", None),
-                OctetField("reserved5", None),
+                OctetEnumField("encoding", None, MEMORY_ENCODINGS),
                 memory_value,
             ],
             **kwargs)
@@ -1850,7 +1977,6 @@ class CommsResponseJobReportExceptionEntry(JobReportEntry):
             name = CommsResponseJobReportExceptionEntry.__name__,
             entry_type = CommsResponseJobReportExceptionEntry.TYPE_ID,
             report_fields = [
-                OctetField("reserved1", None),
                 ShortField("reserved2", None),
                 IntField("reserved3", None),
                 XLongField("exception_mask", None),
@@ -1864,7 +1990,6 @@ class CommsResponseJobReportErrorEntry(JobReportEntry):
             name = CommsResponseJobReportErrorEntry.__name__,
             entry_type = CommsResponseJobReportErrorEntry.TYPE_ID,
             report_fields = [
-                OctetField("reserved1", None),
                 ShortField("reserved2", None),
                 IntField("error_id", None),
                 StrFixedLenField("error_text", None, ERROR_TEXT_LENGTH),
@@ -1872,6 +1997,42 @@ class CommsResponseJobReportErrorEntry(JobReportEntry):
             ],
             **kwargs)
 
+class CommsResponseJobReportCoverageEntry(JobReportEntry):
+    TYPE_ID = 256
+    def __init__(self, **kwargs):
+        # Each edge that was hit is (index << 8) | hit count
+        edges_value = XStrField("edges", None)
+        super(CommsResponseJobReportCoverageEntry, self).__init__(
+            name = CommsResponseJobReportCoverageEntry.__name__,
+            entry_type = CommsResponseJobReportCoverageEntry.TYPE_ID,
+            report_fields = [
+                OctetField("map_bits", None),
+                OctetField("reserved1", None),
+                FieldLenField("num_edges", None, fmt="I", size_of=edges_value,
+                              adjust=lambda pkt, x: x // 4,
+                              deadjust=lambda pkt, x: x * 4),
+                edges_value
+            ],
+            **kwargs)
+
+class CommsResponseJobReportStatsEntry(JobReportEntry):
+    TYPE_ID = 1024
+    def __init__(self, **kwargs):
+        # A sample count and total nanoseconds for each phase, then the counters
+        stats_values = XStrField("values", None)
+        super(CommsResponseJobReportStatsEntry, self).__init__(
+            name = CommsResponseJobReportStatsEntry.__name__,
+            entry_type = CommsResponseJobReportStatsEntry.TYPE_ID,
+            report_fields = [
+                OctetField("num_phases", None),
+                OctetField("num_counters", None),
+                FieldLenField("num_values", None, fmt="I", size_of=stats_values,
+                              adjust=lambda pkt, x: x // 8,
+                              deadjust=lambda pkt, x: x * 8),
+                stats_values
+            ],
+            **kwargs)
+
 class CommsResponseRapidSaveTreeMsg(Packet):
     TYPE_ID = 22
     def __init__(self, _pkt=b"", **kwargs):
@@ -1889,6 +2050,26 @@ class CommsResponseRapidSaveTreeMsg(Packet):
             ],
             **kwargs)
 
+class CommsResponseRapidSaveTreeStateMsg(Packet):
+    TYPE_ID = 23
+    def __init__(self, _pkt=b"", **kwargs):
+        state_value = XStrField("state", None)
+        super(CommsResponseRapidSaveTreeStateMsg, self).__init__(
+            _pkt = _pkt,
+            _klass = self.__class__,
+            _fields = [
+                OctetField("queue", 1),
+                OctetField("reserved1", 0),
+                ShortField("reserved2", None),
+                SignedIntField("job_id", None),
+                SHA1Field("hash", None),
+                FieldLenField("size", None, fmt="I", size_of=state_value),
+                LongField("state_size", None),
+                LongField("offset", None),
+                state_value
+            ],
+            **kwargs)
+
 class RSTInstructionEntry(FieldStructField):
     def __init__(self, **kwargs):
         tree_nodes = FieldListField("tree_nodes", [], RSTNodeEntry)
@@ -1914,8 +2095,10 @@ class RSTNodeEntry(FieldStructField):
                 SignedLongField("timestamp", None),
                 LongField("instruction_number", None),
                 LongField("cpu_exception_index", None),
-                tree_indices,
-                RSTNodeStateEntry()
+                SHA1Field("hash", None),
+                IntField("reserved1", None),
+                LongField("state_size", None),
+                tree_indices
             ],
             **kwargs)
 
@@ -121,6 +121,11 @@ class VirtualMemory(MemoryBase):
     def __iter__(self):
         return iter(get_virtual_memory(self.cpu, self.address, self.size))
 
+    @staticmethod
+    def readList(cpu, ranges):
+        # ranges is a list of (address, size), unreadable ones come back as None
+        return get_virtual_memory_list(cpu, ranges)
+
     def __call__(self, arg):
         if len(arg) <= self.size:
             set_virtual_memory(self.cpu, self.address, arg)
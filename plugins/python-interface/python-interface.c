@@ -164,7 +164,7 @@ static JOB_REPORT_TYPE python_get_ra_report_type(void *opaque)
     Py_DECREF(report_mask);
 
     // return
-    return (uint8_t) data;
+    return (JOB_REPORT_TYPE) data;
 }
 
 static void python_on_ra_start(void *opaque, CommsWorkItem *work)
@@ -603,7 +603,13 @@ static PyObject *python_get_virtual_memory(PyObject *self, PyObject *args)
         python_error_check(pydata);
 
         uint8_t *data = (uint8_t *)PyByteArray_AsString(pydata);
-        qemu_get_virtual_memory(cpu_id, address, size, &data);
+        QemuMemorySession *session = qemu_memory_session_begin(cpu_id);
+        if (session)
+        {
+            QemuMemoryRead read = { address, size, data };
+            qemu_memory_session_readv(session, &read, 1);
+            qemu_memory_session_end(session);
+        }
     }
     else
     {
@@ -616,6 +622,62 @@ static PyObject *python_get_virtual_memory(PyObject *self, PyObject *args)
     return pydata;
 }
 
+static PyObject *python_get_virtual_memory_list(PyObject *self, PyObject *args)
+{
+    int cpu_id;
+    PyObject *ranges = NULL;
+    PyObject *result = NULL;
+    QemuMemorySession *session;
+
+    if (!PyArg_ParseTuple(args, "iO", &cpu_id, &ranges) || !PySequence_Check(ranges))
+    {
+        char message[500];
+        snprintf(message, sizeof(message), "python_get_virtual_memory_list requires cpu id (int) and a list of (address, size) tuples.");
+        PyErr_SetString(PyExc_TypeError, message);
+        return NULL;
+    }
+
+    Py_ssize_t count = PySequence_Size(ranges);
+    result = PyList_New(count);
+    python_error_check(result);
+
+    // All of the reads share the page translations of one session.
+    session = qemu_memory_session_begin(cpu_id);
+    for (Py_ssize_t i = 0; i < count; i++)
+    {
+        unsigned long long address;
+        Py_ssize_t size;
+        PyObject *range = PySequence_GetItem(ranges, i);
+        PyObject *item = Py_None;
+
+        if (range && PyArg_ParseTuple(range, "Ln", &address, &size))
+        {
+            PyObject *pydata = PyByteArray_FromStringAndSize((char*)NULL, size);
+            if (pydata && session &&
+                qemu_memory_session_read(session, address, PyByteArray_AsString(pydata), size))
+            {
+                item = pydata;
+            }
+            else
+            {
+                Py_XDECREF(pydata);
+            }
+        }
+        PyErr_Clear();
+        Py_XDECREF(range);
+
+        // Unreadable ranges come back as None.
+        if (item == Py_None)
+        {
+            Py_INCREF(Py_None);
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+    qemu_memory_session_end(session);
+
+    return result;
+}
+
 static PyObject *python_set_virtual_memory(PyObject *self, PyObject *args)
 {
     unsigned long long address;
@@ -1400,6 +1462,8 @@ static int myextension_clear(PyObject *m) {
 static PyMethodDef pyToQemu[] = {
     {"get_virtual_memory", python_get_virtual_memory, METH_VARARGS,
      "Access the requested virtual memory."},
+    {"get_virtual_memory_list", python_get_virtual_memory_list, METH_VARARGS,
+     "Access several ranges of virtual memory at once."},
     {"set_virtual_memory", python_set_virtual_memory, METH_VARARGS,
      "Set the requested virtual memory with the given data."},
     {"get_physical_memory", python_get_physical_memory, METH_VARARGS,
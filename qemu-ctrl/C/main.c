@@ -83,15 +83,19 @@ void print_comms_tree_message(char *in_buffer, size_t size)
             printf("\t\tTimestamp: %ld\n", nh->timestamp);
             printf("\t\tInstruction Number: %lu\n", nh->instruction_number);
             printf("\t\tException Index: %ld\n", nh->cpu_exception_index);
+            printf("\t\tState Size: %lu\n", nh->state_size);
 
-            CommsResponseRapidSaveTreeNodeState *ns = (CommsResponseRapidSaveTreeNodeState*)(in_buffer + nh->state_offset);
-            printf("\t\tState Size: %du\n", ns->size);
+            // States come in their own messages, older trees had them inline.
+            CommsResponseRapidSaveTreeNodeState *ns = NULL;
+            if(nh->state_offset){
+                ns = (CommsResponseRapidSaveTreeNodeState*)(in_buffer + nh->state_offset);
+            }
 
             CommsResponseRapidSaveTreeNodeIndex *ni = (CommsResponseRapidSaveTreeNodeIndex*)(in_buffer + nh->index_offset);
             for(int k=0; k<nh->num_indices; k++)
             {
                 printf("\t\t\tState Index Name: %s\n", ni->label);
-                if(!memcmp(ni->label, "cpu", 3) && ni->label[3] != '_'){
+                if(ns && !memcmp(ni->label, "cpu", 3) && ni->label[3] != '_'){
                     // We'll be using this to validate our python VMSD parser.
                     printf("\t\t\t\tRAX is %lX\n", byte_swap_64(*((uint64_t*)&ns->state[ni->offset+17])));
                     printf("\t\t\t\tRCX is %lX\n", byte_swap_64(*((uint64_t*)&ns->state[ni->offset+17+8])));
@@ -176,11 +180,26 @@ void print_comms_tree_message(char *in_buffer, size_t size)
                 ni++;
             }
 
-            in_buffer += (nh->state_offset + ns->size + sizeof(CommsResponseRapidSaveTreeNodeState) - 1);
+            if(ns){
+                in_buffer += (nh->state_offset + ns->size + sizeof(CommsResponseRapidSaveTreeNodeState) - 1);
+            }else{
+                in_buffer += nh->index_offset + nh->num_indices * sizeof(CommsResponseRapidSaveTreeNodeIndex);
+            }
         }
     }
 }
 
+void print_comms_tree_state_message(char *in_buffer, size_t size)
+{
+    CommsResponseRapidSaveTreeStateMsg *msg = (CommsResponseRapidSaveTreeStateMsg*) in_buffer;
+
+    printf("\nComms Tree State Message:\n");
+    printf("\tQueue Number: %d\n", msg->queue);
+    printf("\tJob ID: %d\n", msg->job_id);
+    printf("\tState Size: %lu\n", msg->state_size);
+    printf("\tBytes %lu to %lu\n", msg->offset, msg->offset + msg->size);
+}
+
 void print_comms_report_message(char *in_buffer, size_t size)
 {
     int count = 1;
@@ -193,7 +212,8 @@ void print_comms_report_message(char *in_buffer, size_t size)
     CommsResponseJobReportMsg *crjrin = (CommsResponseJobReportMsg*) buffer;
     printf("\tQueue Number: %d, ", crjrin->queue);
     printf("Instructions: %d, ", crjrin->num_insns);
-    printf("Job ID: %d\n", crjrin->job_id);
+    printf("Job ID: %d", crjrin->job_id);
+    printf("%s\n", (crjrin->flags & JOB_RESULT_MERGED) ? ", Merged" : "");
 
     buffer += sizeof(CommsResponseJobReportMsg);    
 
@@ -243,7 +263,18 @@ void print_comms_report_message(char *in_buffer, size_t size)
                     CommsResponseJobReportMemoryEntry *mem = (CommsResponseJobReportMemoryEntry *)buffer;
                     buffer += (sizeof(CommsResponseJobReportMemoryEntry) + mem->size - 1);
 
-                    printf("\t%lx (%xh B): %lx...\n", mem->offset, mem->size, *((uint64_t *)mem->value));
+                    switch(mem->encoding)
+                    {
+                        case MEMORY_ENCODING_FILL:
+                            printf("\t%lx (%xh B): filled with %02x\n", mem->offset, mem->length, mem->value[0]);
+                            break;
+                        case MEMORY_ENCODING_XBZRLE:
+                            printf("\t%lx (%xh B): xbzrle diff of %xh B\n", mem->offset, mem->length, mem->size);
+                            break;
+                        default:
+                            printf("\t%lx (%xh B): %lx...\n", mem->offset, mem->size, *((uint64_t *)mem->value));
+                            break;
+                    }
                 }
                 break;
             case JOB_REPORT_ERROR:
@@ -262,6 +293,29 @@ void print_comms_report_message(char *in_buffer, size_t size)
                     printf("\tException Mask: %lx\n", ee->exception_mask);
                 }
                 break;
+            case JOB_REPORT_COVERAGE:
+                {
+                    CommsResponseJobReportCoverageEntry *cov = (CommsResponseJobReportCoverageEntry *)buffer;
+                    buffer += (sizeof(CommsResponseJobReportCoverageEntry) - sizeof(uint32_t) + cov->num_edges * sizeof(uint32_t));
+
+                    printf("\tCoverage: %d of %d edges hit\n", cov->num_edges, 1 << cov->map_bits);
+                }
+                break;
+            case JOB_REPORT_STATS:
+                {
+                    CommsResponseJobReportStatsEntry *stats = (CommsResponseJobReportStatsEntry *)buffer;
+                    buffer += (sizeof(CommsResponseJobReportStatsEntry) - sizeof(uint64_t) + stats->num_values * sizeof(uint64_t));
+
+                    printf("\tStats:");
+                    for (int i = 0; i < stats->num_phases; i++) {
+                        printf(" %lu/%luns", stats->values[i * 2], stats->values[i * 2 + 1]);
+                    }
+                    for (int i = 0; i < stats->num_counters; i++) {
+                        printf(" %lu", stats->values[stats->num_phases * 2 + i]);
+                    }
+                    printf("\n");
+                }
+                break;
             default:
                 printf("\n\tUnknown Report Type: %d\n", report_type);
                 printf("\tEnding Report Here.\n");
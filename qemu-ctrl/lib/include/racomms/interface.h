@@ -39,30 +39,44 @@ CommsMessage *racomms_msg_job_add_put_RegisterSetup(CommsMessage *msg, uint8_t i
 CommsMessage *racomms_msg_job_add_put_MemorySetup(CommsMessage *msg, uint64_t offset, uint32_t size, const uint8_t *value, MEMORY_FLAGS flags);
 CommsMessage *racomms_msg_job_add_put_StreamSetup(CommsMessage *msg, uint32_t fileno, uint32_t size, uint8_t *value);
 CommsMessage *racomms_msg_job_add_put_TimeoutSetup(CommsMessage *msg, uint64_t timeout);
+CommsMessage *racomms_msg_job_add_put_ReportMaskSetup(CommsMessage *msg, JOB_REPORT_TYPE report_mask);
+void          racomms_msg_job_add_put_Template(CommsMessage *msg, uint16_t template_id);
+
+CommsMessage *racomms_create_job_template_msg(uint8_t queue, uint16_t template_id, SHA1_HASH_TYPE base_hash);
+CommsMessage *racomms_create_job_batch_msg(uint8_t queue);
+CommsMessage *racomms_msg_job_batch_put_Job(CommsMessage *msg, const CommsMessage *job);
 
 CommsMessage *racomms_create_job_status_msg(uint8_t queue, int32_t job_id);
 
 CommsMessage *racomms_create_job_report_request_msg(uint8_t queue, int32_t job_id, SHA1_HASH_TYPE hash, JOB_REPORT_TYPE req_flags);
 CommsMessage *racomms_create_job_report_response_msg(uint8_t queue, int32_t job_id, SHA1_HASH_TYPE job_hash);
 void          racomms_msg_job_report_put_InstructionCount(CommsMessage *msg, uint64_t icount);
+void          racomms_msg_job_report_put_Flags(CommsMessage *msg, JOB_RESULT_TYPE flags);
 CommsMessage *racomms_msg_job_report_put_ProcessorEntry(CommsMessage *msg, uint8_t cpu_id, NAME_TYPE cpu_name);
 CommsMessage *racomms_msg_job_report_put_RegisterEntry(CommsMessage *msg, uint8_t id, NAME_TYPE name, uint8_t size, uint8_t *value);
 CommsMessage *racomms_msg_job_report_put_MemoryEntry(CommsMessage *msg, uint64_t offset, uint32_t size, uint8_t *value, JOB_REPORT_TYPE mem_type);
 CommsMessage *racomms_msg_job_report_put_Exception(CommsMessage *msg, uint64_t exception_mask);
 CommsMessage *racomms_msg_job_report_put_Error(CommsMessage *msg, uint32_t error_id, uint64_t error_loc, const char *error_text);
+CommsMessage *racomms_msg_job_report_put_CoverageEntry(CommsMessage *msg, const uint8_t *map, uint8_t map_bits);
+CommsMessage *racomms_msg_job_report_put_StatsEntry(CommsMessage *msg, const uint64_t *values, uint8_t num_phases, uint8_t num_counters);
 
 CommsMessage *racomms_create_purge_queue_msg(uint8_t queue, PURGE_ACTION_TYPE action);
 
 CommsMessage *racomms_create_quit_msg(QUIT_ACTION_TYPE how);
 
 CommsMessage *racomms_create_rapid_save_tree_request_msg(uint8_t queue, int32_t job_id);
+void          racomms_msg_rapid_save_tree_request_put_Flags(CommsMessage *msg, RST_FLAG_TYPE flags);
+CommsMessage *racomms_create_rapid_save_tree_state_request_msg(uint8_t queue, SHA1_HASH_TYPE hash);
 CommsMessage *racomms_create_rapid_save_tree_response_msg(uint8_t queue, int32_t job_id);
 CommsMessage *racomms_msg_rapid_save_tree_put_InstructionEntry(CommsMessage *msg, const char *insn_label);
 CommsMessage *racomms_msg_rapid_save_tree_put_NodeHeader(CommsMessage *msg, int64_t timestamp,
-    uint64_t instruction_number, uint64_t cpu_exception_index, int32_t job_id);
+    uint64_t instruction_number, uint64_t cpu_exception_index, int32_t job_id,
+    SHA1_HASH_TYPE hash, uint64_t state_size);
 CommsMessage *racomms_msg_rapid_save_tree_put_NodeIndex(CommsMessage *msg, const char *index_label,
     uint32_t instance_id, uint32_t section_id, uint64_t offset);
 CommsMessage *racomms_msg_rapid_save_tree_put_NodeState(CommsMessage *msg, uint32_t size);
+CommsMessage *racomms_create_rapid_save_tree_state_response_msg(uint8_t queue, int32_t job_id, SHA1_HASH_TYPE hash,
+    uint64_t state_size, uint64_t offset, uint32_t size);
 
 /**
  * 
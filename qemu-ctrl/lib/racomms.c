@@ -29,7 +29,7 @@
 #include "racomms/messages.h"
 
 #define READ_INTERVAL       (250)
-#define CURRENT_VERSION     (1)
+#define CURRENT_VERSION     (2)
 #define INITIAL_BUFFER_SIZE (256)
 
 
@@ -197,6 +197,60 @@ CommsMessage *racomms_msg_job_add_put_TimeoutSetup(CommsMessage *msg, uint64_t t
     return msg;
 }
 
+CommsMessage *racomms_msg_job_add_put_ReportMaskSetup(CommsMessage *msg, JOB_REPORT_TYPE report_mask)
+{
+    CommsRequestJobAddReportMaskSetup *rmsg = add_msg_entry(&msg, sizeof(CommsRequestJobAddReportMaskSetup));
+    if( !rmsg ) {
+        return NULL;
+    }
+    rmsg->entry_type = JOB_ADD_REPORT_MASK;
+    rmsg->report_mask = report_mask;
+    return msg;
+}
+
+void racomms_msg_job_add_put_Template(CommsMessage *msg, uint16_t template_id)
+{
+    CommsRequestJobAddMsg *rmsg = (CommsRequestJobAddMsg*)(msg + 1);
+    rmsg->flags |= JOB_FLAG_TEMPLATE;
+    rmsg->template_id = template_id;
+}
+
+CommsMessage *racomms_create_job_template_msg(uint8_t queue, uint16_t template_id, SHA1_HASH_TYPE base_hash)
+{
+    CommsMessage *msg = racomms_create_msg(MSG_REQUEST_JOB_TEMPLATE, sizeof(CommsMessage) + sizeof(CommsRequestJobTemplateMsg));
+    if( !msg ) {
+        return NULL;
+    }
+    CommsRequestJobTemplateMsg *rmsg = (CommsRequestJobTemplateMsg*)(msg + 1);
+    rmsg->queue = queue;
+    rmsg->template_id = template_id;
+    memcpy(rmsg->base_hash, base_hash, sizeof(SHA1_HASH_TYPE));
+    return msg;
+}
+
+CommsMessage *racomms_create_job_batch_msg(uint8_t queue)
+{
+    CommsMessage *msg = racomms_create_msg(MSG_REQUEST_JOB_BATCH, sizeof(CommsMessage) + sizeof(CommsRequestJobBatchMsg));
+    if( !msg ) {
+        return NULL;
+    }
+    CommsRequestJobBatchMsg *rmsg = (CommsRequestJobBatchMsg*)(msg + 1);
+    rmsg->queue = queue;
+    rmsg->num_jobs = 0;
+    return msg;
+}
+
+CommsMessage *racomms_msg_job_batch_put_Job(CommsMessage *msg, const CommsMessage *job)
+{
+    void *rmsg = add_msg_entry(&msg, job->size);
+    if( !rmsg ) {
+        return NULL;
+    }
+    memcpy(rmsg, job, job->size);
+    ((CommsRequestJobBatchMsg*)(msg + 1))->num_jobs++;
+    return msg;
+}
+
 CommsMessage *racomms_create_job_report_request_msg(uint8_t queue, int32_t job_id, SHA1_HASH_TYPE hash, JOB_REPORT_TYPE req_flags)
 {
     CommsMessage *msg = racomms_create_msg(MSG_REQUEST_JOB_REPORT, sizeof(CommsMessage) + sizeof(CommsRequestJobReportMsg));
@@ -231,6 +285,12 @@ void racomms_msg_job_report_put_InstructionCount(CommsMessage *msg, uint64_t ico
     rmsg->num_insns = icount;
 }
 
+void racomms_msg_job_report_put_Flags(CommsMessage *msg, JOB_RESULT_TYPE flags)
+{
+    CommsResponseJobReportMsg *rmsg = (CommsResponseJobReportMsg*)(msg + 1);
+    rmsg->flags = flags;
+}
+
 CommsMessage *racomms_msg_job_report_put_ProcessorEntry(CommsMessage *msg, uint8_t cpu_id, NAME_TYPE cpu_name)
 {
     CommsResponseJobReportProcessorEntry *rmsg = add_msg_entry(&msg, sizeof(CommsResponseJobReportProcessorEntry));
@@ -272,6 +332,8 @@ CommsMessage *racomms_msg_job_report_put_MemoryEntry(CommsMessage *msg, uint64_t
     rmsg->entry_type = mem_type;
     rmsg->offset = offset;
     rmsg->size = size;
+    rmsg->length = size;
+    rmsg->encoding = MEMORY_ENCODING_RAW;
     memcpy(rmsg->value, value, size);
     return msg;
 }
@@ -301,6 +363,46 @@ CommsMessage *racomms_msg_job_report_put_Error(CommsMessage *msg, uint32_t error
     return msg;
 }
 
+CommsMessage *racomms_msg_job_report_put_CoverageEntry(CommsMessage *msg, const uint8_t *map, uint8_t map_bits)
+{
+    uint32_t num_edges = 0;
+    uint32_t map_size = 1u << map_bits;
+
+    for (uint32_t i = 0; i < map_size; i++) {
+        num_edges += map[i] != 0;
+    }
+
+    CommsResponseJobReportCoverageEntry *rmsg = add_msg_entry(&msg, sizeof(CommsResponseJobReportCoverageEntry) - sizeof(uint32_t) + num_edges * sizeof(uint32_t));
+    if ( !rmsg ) {
+        return NULL;
+    }
+    rmsg->entry_type = JOB_REPORT_COVERAGE;
+    rmsg->map_bits = map_bits;
+    rmsg->num_edges = num_edges;
+    for (uint32_t i = 0, edge = 0; i < map_size; i++) {
+        if (map[i]) {
+            rmsg->edges[edge++] = (i << 8) | map[i];
+        }
+    }
+    return msg;
+}
+
+CommsMessage *racomms_msg_job_report_put_StatsEntry(CommsMessage *msg, const uint64_t *values, uint8_t num_phases, uint8_t num_counters)
+{
+    uint32_t num_values = num_phases * 2 + num_counters;
+
+    CommsResponseJobReportStatsEntry *rmsg = add_msg_entry(&msg, sizeof(CommsResponseJobReportStatsEntry) - sizeof(uint64_t) + num_values * sizeof(uint64_t));
+    if ( !rmsg ) {
+        return NULL;
+    }
+    rmsg->entry_type = JOB_REPORT_STATS;
+    rmsg->num_phases = num_phases;
+    rmsg->num_counters = num_counters;
+    rmsg->num_values = num_values;
+    memcpy(rmsg->values, values, num_values * sizeof(uint64_t));
+    return msg;
+}
+
 CommsMessage *racomms_create_purge_queue_msg(uint8_t queue, PURGE_ACTION_TYPE action)
 {
     CommsMessage *msg = racomms_create_msg(MSG_REQUEST_JOB_PURGE, sizeof(CommsMessage) + sizeof(CommsRequestJobPurgeMsg));
@@ -336,6 +438,24 @@ CommsMessage *racomms_create_rapid_save_tree_request_msg(uint8_t queue, int32_t
     return msg;
 }
 
+void racomms_msg_rapid_save_tree_request_put_Flags(CommsMessage *msg, RST_FLAG_TYPE flags)
+{
+    CommsRequestRapidSaveTreeMsg *rmsg = (CommsRequestRapidSaveTreeMsg*)(msg + 1);
+    rmsg->flags = flags;
+}
+
+CommsMessage *racomms_create_rapid_save_tree_state_request_msg(uint8_t queue, SHA1_HASH_TYPE hash)
+{
+    CommsMessage *msg = racomms_create_msg(MSG_REQUEST_RST_STATE, sizeof(CommsMessage) + sizeof(CommsRequestRapidSaveTreeStateMsg));
+    if( !msg ) {
+        return NULL;
+    }
+    CommsRequestRapidSaveTreeStateMsg *rmsg = (CommsRequestRapidSaveTreeStateMsg*)(msg + 1);
+    rmsg->queue = queue;
+    memcpy(rmsg->hash, hash, sizeof(SHA1_HASH_TYPE));
+    return msg;
+}
+
 CommsMessage *racomms_create_rapid_save_tree_response_msg(uint8_t queue, int32_t job_id)
 {
     CommsMessage *msg = racomms_create_msg(MSG_RESPONSE_RST, sizeof(CommsMessage) + sizeof(CommsResponseRapidSaveTreeMsg));
@@ -360,7 +480,8 @@ CommsMessage *racomms_msg_rapid_save_tree_put_InstructionEntry(CommsMessage *msg
 }
 
 CommsMessage *racomms_msg_rapid_save_tree_put_NodeHeader(CommsMessage *msg, int64_t timestamp,
-    uint64_t instruction_number, uint64_t cpu_exception_index, int32_t job_id)
+    uint64_t instruction_number, uint64_t cpu_exception_index, int32_t job_id,
+    SHA1_HASH_TYPE hash, uint64_t state_size)
 {
     CommsResponseRapidSaveTreeNodeHeader *rmsg = add_msg_entry(&msg, sizeof(CommsResponseRapidSaveTreeNodeHeader));
     if( !rmsg ) {
@@ -373,6 +494,8 @@ CommsMessage *racomms_msg_rapid_save_tree_put_NodeHeader(CommsMessage *msg, int6
     rmsg->instruction_number = instruction_number;
     rmsg->cpu_exception_index = cpu_exception_index;
     rmsg->job_id = job_id;
+    rmsg->state_size = state_size;
+    memcpy(rmsg->hash, hash, sizeof(SHA1_HASH_TYPE));
     return msg;
 }
 
@@ -400,6 +523,23 @@ CommsMessage *racomms_msg_rapid_save_tree_put_NodeState(CommsMessage *msg, uint3
     return msg;
 }
 
+CommsMessage *racomms_create_rapid_save_tree_state_response_msg(uint8_t queue, int32_t job_id, SHA1_HASH_TYPE hash,
+    uint64_t state_size, uint64_t offset, uint32_t size)
+{
+    CommsMessage *msg = racomms_create_msg(MSG_RESPONSE_RST_STATE, sizeof(CommsMessage) + sizeof(CommsResponseRapidSaveTreeStateMsg) + size);
+    if( !msg ) {
+        return NULL;
+    }
+    CommsResponseRapidSaveTreeStateMsg *rmsg = (CommsResponseRapidSaveTreeStateMsg*)(msg + 1);
+    rmsg->queue = queue;
+    rmsg->job_id = job_id;
+    rmsg->size = size;
+    rmsg->state_size = state_size;
+    rmsg->offset = offset;
+    memcpy(rmsg->hash, hash, sizeof(SHA1_HASH_TYPE));
+    return msg;
+}
+
 void string_to_hash(const char *str, SHA1_HASH_TYPE hash)
 {
     uint8_t len = 0, pos = 0;
@@ -548,6 +688,23 @@ int parse_job_report(CommsResponseJobReportMsg *crjrm, size_t size, int (analyze
                 continue_parsing = analyze_entry(report_type, (void *) ee, &record, &ret_val);
             }
             break;
+            case JOB_REPORT_COVERAGE:
+            {
+                CommsResponseJobReportCoverageEntry *cov = (CommsResponseJobReportCoverageEntry *)buffer;
+                /**
+                 * Only the edges that were hit are sent.
+                 */
+                buffer += (sizeof(CommsResponseJobReportCoverageEntry) - sizeof(uint32_t) + cov->num_edges * sizeof(uint32_t));
+                continue_parsing = analyze_entry(report_type, (void *) cov, &record, &ret_val);
+            }
+            break;
+            case JOB_REPORT_STATS:
+            {
+                CommsResponseJobReportStatsEntry *stats = (CommsResponseJobReportStatsEntry *)buffer;
+                buffer += (sizeof(CommsResponseJobReportStatsEntry) - sizeof(uint64_t) + stats->num_values * sizeof(uint64_t));
+                continue_parsing = analyze_entry(report_type, (void *) stats, &record, &ret_val);
+            }
+            break;
             default:
             {
                 /**
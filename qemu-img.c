@@ -2592,6 +2592,10 @@ static ImageInfoList *collect_image_info_list(bool image_opts,
         if(!strcmp(fmt, "vmstate")){
             // We will open a new VM State file and read from it.
             VMStateFile *vmstate_file = vmstate_file_new(filename);
+            if (!vmstate_file) {
+                error_report("Could not open '%s'", filename);
+                goto err;
+            }
             VMStateFileClass *vmstate_file_class = VMSTATE_FILE_GET_CLASS(vmstate_file);
             vmstate_file_class->query_image_info(vmstate_file, last);
             object_unref(OBJECT(vmstate_file));
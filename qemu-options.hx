@@ -3569,7 +3569,47 @@ Do no automatically save final states back to the vmstate file.
 
 @item noblocks=@var{noblocks}
 
-Skips dumping disk data to the blocks file
+Skips dumping disk data to the blocks file. When disk data is dumped, only
+the clusters written since the job's state was loaded are stored, the others
+refer back to the dump that was loaded. Identical clusters are stored once.
+
+@item mode=@var{mode}
+
+Use a preset mode. Any mode other than @option{user} turns off interrupts,
+block dumps, state saving, the tree and the trace. @option{forkserver} also
+keeps a copy of the base state's RAM in memory. A job that starts from the
+loaded base then only copies its dirty pages back from that copy and reloads
+the device state. This costs one copy of guest RAM.
+
+@item queues=@var{queues}
+
+Opens @var{queues} connections to the controller given with @option{connect},
+numbered as queues 1 to @var{queues}. Jobs are taken from the queues in turn
+and each result is sent back on the queue its job came from.
+
+@item fastrestore=@var{fastrestore}
+
+When a job starts from the state that is already loaded, restore only the RAM
+pages dirtied by the previous job and reload the device state instead of
+resetting the machine and loading the full state.
+
+@item hashalg=@var{hashalg}
+
+Selects how new states are hashed. @option{sha1} is the default. @option{fast}
+uses a non-cryptographic 160 bit hash that is much cheaper on large states.
+Hashes from the two engines never match, so use one engine per vmstate file.
+
+@item mapstates=@var{mapstates}
+
+Map states loaded from the vmstate file read-only instead of copying them into
+the memory channel pool. Loaded states are then served from the host page cache,
+which is shared with any other instance using the same vmstate file.
+
+@item asyncwrites=@var{asyncwrites}
+
+Append saved states to the vmstate file from a writer thread instead of the
+vCPU thread. States saved close together are written, indexed and synced to
+disk as one batch. Loading a state that is still queued waits for it.
 
 @item process=@var{process}
 
@@ -3587,6 +3627,40 @@ Initial size of global memory pool for memory channel.
 
 Size limit for the global memory channel pool. Use zero for no limit.
 
+@item state_cache=@var{state_cache}
+
+Size limit for the saved and loaded states the vmstate file keeps in memory.
+States are dropped one at a time, least recently used first, when either this
+limit or @option{chnl_limit} is exceeded. States that are asked for more than
+once, like the base states jobs start from, are dropped last. Zero, the
+default, leaves it to @option{chnl_limit}.
+
+@item chnl_compress=@var{chnl_compress}
+
+Compress saved states once they are hashed and store each device's section
+only once across states. States are expanded back into the pool when they are
+read. The vmstate file is still written uncompressed.
+
+@item merge=@var{merge}
+
+End a job as soon as a state it traces is already in the trace or the vmstate
+file, instead of running on from a state that has been explored before. The
+job report carries the hash of that state and is flagged as merged, and the
+state is not saved a second time. Only traced states are compared, so this
+needs tracing enabled. Jobs can also ask for this on their own with the merge
+job flag.
+
+@item coverage=@var{coverage}
+
+Collect an AFL style edge coverage map while each job runs and send it with
+the job report when the coverage report is requested. When the job limits
+analysis to a segment or a process, only blocks inside of it are counted.
+
+@item coverage_shm=@var{coverage_shm}
+
+Keep the coverage map in the named POSIX shared memory object so that an
+external fuzzer can read it directly. Implies @option{coverage}.
+
 @item msg_limit=@var{msg_limit}
 
 Puts an upper bound on the size of an outgoing message.
@@ -3599,6 +3673,13 @@ Enable or disable interrupts. Disables some CPU/OS functions such as IO and task
 
 Size of global memory pool for the reference cache.
 
+@item ref_shm=@var{ref_shm}
+
+Keep the reference cache in the named POSIX shared memory object instead of
+private memory. Instances loading the same states with the same
+@option{ref_pool} can share one object, so pages one of them has restored are
+found by the others. The object is left in place on exit.
+
 @item timeout=@var{timeout}
 
 Sets a timeout to interrupt an RA job that has gone on for too long.
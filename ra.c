@@ -25,15 +25,17 @@
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
 #include "qemu/sockets.h"
+#include "qemu/main-loop.h"
 #include "monitor/qdev.h"
 #include "migration/snapshot.h"
 #include "rsave-tree.h"
 #include "migration/ram_rapid.h"
+#include "migration/rsave-hash.h"
+#include "migration/ra-stats.h"
 #include "hw/boards.h"
 #include "racomms/interface.h"
 #include "migration/misc.h"
-#include "qapi/qmp/qlist.h"
-#include "qapi/qmp/qpointer.h"
+#include "qapi/qapi-commands-migration.h"
 #include "oshandler/oshandler.h"
 #include "sysemu/sysemu.h"
 #include "ra.h"
@@ -46,6 +48,7 @@
 #define RAPID_ANALYSIS_ISTEP_INIT  (0)
 #define RAPID_ANALYSIS_OPTS        ("rapidanalysis")
 #define RAPID_ANALYSIS_TIMEOUT     (0)
+#define RAPID_ANALYSIS_MAX_QUEUES  (255)
 
 static RSaveTree *global_rst = NULL;
 
@@ -71,6 +74,10 @@ QemuOptsList qemu_rapidanalysis_opts = {
             .name = "file",
             .type = QEMU_OPT_STRING,
             .help = "Sets the rapid analysis image to be loaded",
+        }, {
+            .name = "queues",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of controller connections (queues 1 to N) to serve jobs from\n",
         }, {
             .name = "mode",
             .type = QEMU_OPT_STRING,
@@ -101,10 +108,26 @@ QemuOptsList qemu_rapidanalysis_opts = {
             .name = "noblocks",
             .type = QEMU_OPT_BOOL,
             .help = "Skips dumping disk data to the blocks file\n",        
+        }, {
+            .name = "fastrestore",
+            .type = QEMU_OPT_BOOL,
+            .help = "Restore only dirty pages and device state when a job reuses the loaded base state\n",
+        }, {
+            .name = "mapstates",
+            .type = QEMU_OPT_BOOL,
+            .help = "Map saved states from the vmstate file instead of copying them into memory\n",
+        }, {
+            .name = "asyncwrites",
+            .type = QEMU_OPT_BOOL,
+            .help = "Append saved states to the vmstate file from a writer thread\n",
         }, {
             .name = "hash",
             .type = QEMU_OPT_STRING,
             .help = "Hash of state to use for initialization\n",
+        }, {
+            .name = "hashalg",
+            .type = QEMU_OPT_STRING,
+            .help = "Hash engine for new states (sha1 or fast)\n",
         }, {
             .name = "chnl_pool",
             .type = QEMU_OPT_SIZE,
@@ -113,6 +136,26 @@ QemuOptsList qemu_rapidanalysis_opts = {
             .name = "chnl_limit",
             .type = QEMU_OPT_SIZE,
             .help = "Size limit for the global memory channel pool (use zero for no limit)\n",
+        }, {
+            .name = "state_cache",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size limit for saved states kept in memory (use zero to only follow chnl_limit)\n",
+        }, {
+            .name = "chnl_compress",
+            .type = QEMU_OPT_BOOL,
+            .help = "Compress and deduplicate saved states held in the memory channel pool\n",
+        }, {
+            .name = "merge",
+            .type = QEMU_OPT_BOOL,
+            .help = "End jobs early when they reach a state that is already known\n",
+        }, {
+            .name = "coverage",
+            .type = QEMU_OPT_BOOL,
+            .help = "Collect an edge coverage map for each job\n",
+        }, {
+            .name = "coverage_shm",
+            .type = QEMU_OPT_STRING,
+            .help = "Name of the shared memory object holding the coverage map\n",
         }, {
             .name = "os",
             .type = QEMU_OPT_STRING,
@@ -133,6 +176,10 @@ QemuOptsList qemu_rapidanalysis_opts = {
             .name = "ref_pool",
             .type = QEMU_OPT_SIZE,
             .help = "Size of global memory pool for the reference cache\n",
+        }, {
+            .name = "ref_shm",
+            .type = QEMU_OPT_STRING,
+            .help = "Name of the shared memory object holding a reference cache shared between instances\n",
         },
         { /* end of list */ }
     },
@@ -165,6 +212,44 @@ bool rapid_analysis_awaiting_work(CPUState *cpu)
     return (global_rst != NULL) && !global_rst->has_work;
 }
 
+RapidAnalysisCacheInfo *qmp_query_rapid_analysis_cache(Error **errp)
+{
+    VMStateFileClass *vcc;
+
+    if(!global_rst || !global_rst->vm_state_file){
+        error_setg(errp, "Rapid analysis is not active");
+        return NULL;
+    }
+
+    vcc = VMSTATE_FILE_GET_CLASS(global_rst->vm_state_file);
+    return vcc->query_cache(global_rst->vm_state_file);
+}
+
+RapidAnalysisStats *qmp_query_rapid_analysis_stats(bool has_reset, bool reset, Error **errp)
+{
+    RapidAnalysisStats *stats;
+
+    if(!global_rst){
+        error_setg(errp, "Rapid analysis is not active");
+        return NULL;
+    }
+
+    stats = ra_stats_query();
+
+    if(global_rst->vm_state_file){
+        VMStateFileClass *vcc = VMSTATE_FILE_GET_CLASS(global_rst->vm_state_file);
+
+        stats->has_node_cache = true;
+        stats->node_cache = vcc->query_cache(global_rst->vm_state_file);
+    }
+
+    if(has_reset && reset){
+        ra_stats_reset();
+    }
+
+    return stats;
+}
+
 bool rapid_analysis_load_work(CPUState *cpu)
 {
     RSaveTree *rst = rapid_analysis_get_instance(cpu);
@@ -230,128 +315,324 @@ void rapid_analysis_set_configuration(CommsRequestConfigMsg *req, CommsQueue *q)
     config_out->report_mask = global_rst->report_mask;
     config_out->timeout = global_rst->config_timeout;
 
-    CommsResultsItem *work_results = g_new(CommsResultsItem, 1);
-    work_results->msg = out;
+    CommsResultsItem *work_results = racomms_create_results(out);
     queue_push_results(q, work_results);
 }
 
-void rapid_analysis_send_tree(CommsRequestRapidSaveTreeMsg *req, CommsQueue *q)
+// A tree export goes out a message at a time as the controller takes
+// them. Tree messages are split at the message limit, or at this size
+// without one, and states are sent in pieces of at most this size.
+#define RAPID_ANALYSIS_EXPORT_CHUNK ((uint64_t) 1 * MiB)
+
+typedef struct RapidAnalysisExportNode {
+    INSN_LABEL label;
+    SHA1_HASH_TYPE hash;
+    // Referenced, NULL until looked up when only the hash was known.
+    RSaveTreeNode *node;
+    // States of nodes found in the vmstate file are read from there.
+    bool in_file;
+    bool send;
+    uint64_t state_offset;
+    uint64_t state_size;
+} RapidAnalysisExportNode;
+
+typedef struct RapidAnalysisExport {
+    uint8_t queue;
+    int32_t job_id;
+    bool send_states;
+    uint64_t chunk_size;
+    GArray *nodes;
+    bool tree_sent;
+    guint tree_pos;
+    guint state_pos;
+    uint64_t state_offset;
+} RapidAnalysisExport;
+
+static RapidAnalysisExport *rapid_analysis_export_new(uint8_t queue, int32_t job_id, bool send_states)
+{
+    RapidAnalysisExport *ex = g_new0(RapidAnalysisExport, 1);
+
+    ex->queue = queue;
+    ex->job_id = job_id;
+    ex->send_states = send_states;
+    ex->chunk_size = RAPID_ANALYSIS_EXPORT_CHUNK;
+    if (global_rst->msgsz_limit) {
+        ex->chunk_size = MIN(global_rst->msgsz_limit, RAPID_ANALYSIS_EXPORT_CHUNK);
+    }
+    ex->nodes = g_array_new(false, true, sizeof(RapidAnalysisExportNode));
+    return ex;
+}
+
+static void rapid_analysis_export_free(void *opaque)
+{
+    RapidAnalysisExport *ex = opaque;
+
+    for (guint i = 0; i < ex->nodes->len; i++) {
+        RapidAnalysisExportNode *en = &g_array_index(ex->nodes, RapidAnalysisExportNode, i);
+        if (en->node) {
+            object_unref(OBJECT(en->node));
+        }
+    }
+    g_array_free(ex->nodes, true);
+    g_free(ex);
+}
+
+// Fills in what the export needs to know about a node. Nodes the tree
+// no longer holds are read from the vmstate file, as long as they have
+// been written to it. The export never waits on the writer.
+static bool rapid_analysis_export_resolve(RapidAnalysisExportNode *en)
 {
-    const QDictEntry *entry;
-    QList *insn_state;
-    const char *insn_label;
-    QListEntry *e;
-    uint64_t insn_offset;
-    uint64_t node_hdr_offset;
-    uint64_t node_state_offset;
+    if (!en->node) {
+        VMStateFileClass *vcc = VMSTATE_FILE_GET_CLASS(global_rst->vm_state_file);
+        en->in_file = vcc->locate_state(global_rst->vm_state_file, &en->node, en->hash,
+                                        &en->state_offset, &en->state_size);
+        return en->in_file;
+    }
+
+    if (!en->in_file && en->node->vm_state) {
+        MemoryChannelClass *mcc = MEMORY_CHANNEL_GET_CLASS(en->node->vm_state);
+        en->state_size = mcc->get_size(en->node->vm_state);
+    }
+    return true;
+}
+
+static guint rapid_analysis_export_next_state(RapidAnalysisExport *ex, guint from)
+{
+    while (from < ex->nodes->len) {
+        RapidAnalysisExportNode *en = &g_array_index(ex->nodes, RapidAnalysisExportNode, from);
+        if (en->send && en->state_size) {
+            break;
+        }
+        from++;
+    }
+    return from;
+}
+
+// Puts the headers and indices of nodes in one message, until it
+// reaches the chunk size. An instruction whose nodes don't fit is split,
+// the next message picks up at the node it stopped at under another
+// entry for the same instruction.
+static CommsMessage *rapid_analysis_export_tree(RapidAnalysisExport *ex)
+{
+    CommsMessage *msg = racomms_create_rapid_save_tree_response_msg(ex->queue, ex->job_id);
     VMStateIndexEntry *se;
 
+    while (ex->tree_pos < ex->nodes->len && msg->size < ex->chunk_size)
+    {
+        RapidAnalysisExportNode *first = &g_array_index(ex->nodes, RapidAnalysisExportNode, ex->tree_pos);
+        uint64_t insn_offset = msg->size;
+        uint64_t num_nodes = 0;
+
+        msg = racomms_msg_rapid_save_tree_put_InstructionEntry(msg, first->label);
+
+        // At least one node goes in, so the export always moves on.
+        for (; ex->tree_pos < ex->nodes->len && (!num_nodes || msg->size < ex->chunk_size); ex->tree_pos++)
+        {
+            RapidAnalysisExportNode *en = &g_array_index(ex->nodes, RapidAnalysisExportNode, ex->tree_pos);
+            uint64_t node_hdr_offset;
+
+            if (strncmp(en->label, first->label, sizeof(INSN_LABEL))) {
+                break;
+            }
+            if (!rapid_analysis_export_resolve(en) ||
+                (ex->job_id != INVALID_JOB && en->node->job_id != ex->job_id)) {
+                continue;
+            }
+
+            node_hdr_offset = msg->size;
+            msg = racomms_msg_rapid_save_tree_put_NodeHeader(msg,
+                    en->node->timestamp,
+                    en->node->instruction_number,
+                    en->node->cpu_exception_index,
+                    en->node->job_id,
+                    en->hash,
+                    en->state_size);
+
+            CommsResponseRapidSaveTreeNodeHeader *node_hdr = MSG_OFFSET(msg, node_hdr_offset);
+            node_hdr->index_offset = msg->size - node_hdr_offset;
+
+            QLIST_FOREACH(se, &en->node->device_list, next) {
+                msg = racomms_msg_rapid_save_tree_put_NodeIndex(msg,
+                        se->idstr,
+                        se->instance_id,
+                        se->section_id,
+                        se->offset);
+                // Update our node header entry pointer in case of a realloc adjustment
+                node_hdr = MSG_OFFSET(msg, node_hdr_offset);
+                node_hdr->num_indices++;
+            }
+
+            en->send = ex->send_states;
+            num_nodes++;
+        }
+
+        if (num_nodes) {
+            CommsResponseRapidSaveTreeInstructionEntry *insn_entry = MSG_OFFSET(msg, insn_offset);
+            CommsResponseRapidSaveTreeMsg *rst_msg = (CommsResponseRapidSaveTreeMsg*)(msg + 1);
+            insn_entry->num_nodes = num_nodes;
+            rst_msg->num_insns++;
+        } else {
+            // None of its nodes belong to the job.
+            msg->size = insn_offset;
+        }
+    }
+
+    return msg;
+}
+
+// Sends the next piece of a node state.
+static CommsMessage *rapid_analysis_export_state(RapidAnalysisExport *ex)
+{
+    RapidAnalysisExportNode *en = &g_array_index(ex->nodes, RapidAnalysisExportNode, ex->state_pos);
+    uint32_t size = MIN(en->state_size - ex->state_offset, ex->chunk_size);
+    uint64_t total = 0;
+
+    CommsMessage *msg = racomms_create_rapid_save_tree_state_response_msg(ex->queue, en->node->job_id,
+        en->hash, en->state_size, ex->state_offset, size);
+    CommsResponseRapidSaveTreeStateMsg *state_msg = (CommsResponseRapidSaveTreeStateMsg*)(msg + 1);
+    uint8_t *state = (uint8_t*)(state_msg + 1);
+
+    while (size > total) {
+        ssize_t r;
+        if (en->in_file) {
+            VMStateFileClass *vcc = VMSTATE_FILE_GET_CLASS(global_rst->vm_state_file);
+            r = vcc->read_state(global_rst->vm_state_file, &state[total],
+                                en->state_offset + ex->state_offset + total, size - total);
+        } else {
+            // The vCPU may be loading this state at the same time.
+            MemoryChannelClass *mcc = MEMORY_CHANNEL_GET_CLASS(en->node->vm_state);
+            r = mcc->read_state(en->node->vm_state, &state[total], ex->state_offset + total, size - total);
+        }
+        if (r <= 0) {
+            // Cut the state short, the controller sees it from the offsets.
+            error_report("Error attempting to get node vm state");
+            en->state_size = ex->state_offset + total;
+            state_msg->size = total;
+            msg->size -= size - total;
+            break;
+        }
+        total += r;
+    }
+
+    ex->state_offset += total;
+    if (ex->state_offset >= en->state_size) {
+        ex->state_offset = 0;
+        ex->state_pos = rapid_analysis_export_next_state(ex, ex->state_pos + 1);
+    }
+    return msg;
+}
+
+static CommsResultsItem *rapid_analysis_export_next(void *opaque)
+{
+    RapidAnalysisExport *ex = opaque;
+    CommsMessage *msg;
+
+    // The tree goes first, even when it is empty, then the states.
+    if (!ex->tree_sent) {
+        msg = rapid_analysis_export_tree(ex);
+        if (ex->tree_pos >= ex->nodes->len) {
+            ex->tree_sent = true;
+            ex->state_pos = rapid_analysis_export_next_state(ex, 0);
+        }
+    } else if (ex->state_pos < ex->nodes->len) {
+        msg = rapid_analysis_export_state(ex);
+    } else {
+        return NULL;
+    }
+
+    // Every message but the last says there is more to come.
+    msg->has_next_message = !ex->tree_sent || ex->state_pos < ex->nodes->len;
+    return racomms_create_results(msg);
+}
+
+static bool rapid_analysis_export_add_link(const RSaveTreeStoreKey *key, RSaveTreeStoreLink *link, void *opaque)
+{
+    RapidAnalysisExport *ex = opaque;
+    RapidAnalysisExportNode en;
+
+    memset(&en, 0, sizeof(en));
+    // A node is only detached with the store locked, so it can be looked
+    // at even when it is on its way out.
+    if (link->node && ex->job_id != INVALID_JOB && link->node->job_id != ex->job_id) {
+        return true;
+    }
+    en.node = rsave_tree_store_ref_node(link);
+    snprintf(en.label, sizeof(INSN_LABEL), "%" PRIx64, key->pc);
+    memcpy(en.hash, link->hash, sizeof(SHA1_HASH_TYPE));
+    g_array_append_val(ex->nodes, en);
+    return true;
+}
+
+void rapid_analysis_send_tree(CommsRequestRapidSaveTreeMsg *req, CommsQueue *q)
+{
     if(!global_rst){
         error_report("Error attempting to get tree from rapid analysis");
         return;
     }
 
-    RSaveTreeClass *rcc = RSAVE_TREE_GET_CLASS(global_rst);
+    RapidAnalysisExport *ex = rapid_analysis_export_new(req->queue, req->job_id,
+                                                        !(req->flags & RST_FLAG_NO_STATES));
 
-    rcc->lock_tree(global_rst);
+    // Only the list of nodes is taken, under the store lock rather than
+    // the tree lock so the BQL is kept. The nodes are referenced so they
+    // stay around while they are sent.
+    rsave_tree_store_foreach(&global_rst->trace, rapid_analysis_export_add_link, ex);
 
-    CommsMessage *msg = racomms_create_rapid_save_tree_response_msg(req->queue, req->job_id);
+    queue_push_results_source(q, rapid_analysis_export_next, ex, rapid_analysis_export_free);
+}
 
-    for (entry = qdict_first(global_rst->node_reference); entry;
-         entry = qdict_next(global_rst->node_reference, entry))
-    {
-        CommsResponseRapidSaveTreeMsg *rst_msg = (CommsResponseRapidSaveTreeMsg*)(msg + 1);
-        rst_msg->num_insns++;
-
-        insn_label = qdict_entry_key(entry);
-        insn_state = qobject_to(QList, qdict_entry_value(entry));
-        insn_offset = msg->size;
-        msg = racomms_msg_rapid_save_tree_put_InstructionEntry(msg, insn_label);
-
-        QLIST_FOREACH_ENTRY(insn_state, e) {
-            QPointer *node_ptr = qobject_to(QPointer, qlist_entry_obj(e));
-            RSaveTreeNode *node = qpointer_get_pointer(node_ptr);
-
-            if(req->job_id == INVALID_JOB || node->job_id == req->job_id)
-            {
-                // Get our initial instruction entry pointer
-                CommsResponseRapidSaveTreeInstructionEntry *insn_entry = MSG_OFFSET(msg, insn_offset);
-                insn_entry->num_nodes++;
-
-                node_hdr_offset = msg->size;
-                msg = racomms_msg_rapid_save_tree_put_NodeHeader(msg,
-                        node->timestamp,
-                        node->instruction_number,
-                        node->cpu_exception_index,
-                        node->job_id);
-
-                // Get our initial node header entry pointer
-                CommsResponseRapidSaveTreeNodeHeader *node_hdr = MSG_OFFSET(msg, node_hdr_offset);
-                // Set the index offset from the node header
-                node_hdr->index_offset = msg->size - node_hdr_offset;
-
-                QLIST_FOREACH(se, &node->device_list, next) {
-                    node_hdr->num_indices++;
-                    msg = racomms_msg_rapid_save_tree_put_NodeIndex(msg,
-                            se->idstr,
-                            se->instance_id,
-                            se->section_id,
-                            se->offset);
-                    // Update our node header entry pointer in case of a realloc adjustment
-                    node_hdr = MSG_OFFSET(msg, node_hdr_offset);
-                }
+static bool rapid_analysis_find_link(const RSaveTreeStoreKey *key, RSaveTreeStoreLink *link, void *opaque)
+{
+    RapidAnalysisExportNode *en = opaque;
 
-                // Set the state offset from the node header
-                node_hdr->state_offset = msg->size - node_hdr_offset;
-
-                // Collect the size of the memory channel
-                MemoryChannelClass *mcc = MEMORY_CHANNEL_GET_CLASS(node->vm_state);
-                size_t state_size = mcc->get_size(node->vm_state);
-
-                // Pre-allocate a node state big enough to hold the memory channel
-                node_state_offset = msg->size;
-                msg = racomms_msg_rapid_save_tree_put_NodeState(msg, state_size);
-                CommsResponseRapidSaveTreeNodeState *node_state = MSG_OFFSET(msg, node_state_offset);
-
-                // Proceed to copy the memory channel to the node state
-                size_t total = 0;
-                while(state_size > total){
-                    ssize_t r = mcc->get_buffer(node->vm_state, &node_state->state[total], total, state_size - total);
-                    if( r < 0 ){
-                        // some error
-                        error_report("Error attempting to get node vm state");
-                        break;
-                    }
-                    total += r;
-                }
-            }
-        }
+    if (!memcmp(link->hash, en->hash, sizeof(SHA1_HASH_TYPE))) {
+        en->node = rsave_tree_store_ref_node(link);
+        return !en->node;
+    }
+    return true;
+}
 
-        // There is a potential issue here, we may be writing the
-        // last item in the list while exceeding the limit of a message size.
-        // We may actually send the complete message while indicating that there
-        // is more data coming. Try checking if this is the last item in the loop.
-        if (global_rst->msgsz_limit && msg->size > global_rst->msgsz_limit && qdict_next(global_rst->node_reference, entry))
-        {
-            // Set the incomplete message flag then 
-            // send the message.
-            msg->has_next_message = 1;
-            
-            CommsResultsItem *work_results = g_new(CommsResultsItem, 1);
-            work_results->msg = msg;
-            queue_push_results(q, work_results);
-
-            // If we reset our pointers, then
-            // we should be able to continue on our loop
-            msg = racomms_create_rapid_save_tree_response_msg(req->queue, req->job_id);
+void rapid_analysis_send_state(CommsRequestRapidSaveTreeStateMsg *req, CommsQueue *q)
+{
+    RapidAnalysisExportNode en;
+
+    if(!global_rst){
+        error_report("Error attempting to get a state from rapid analysis");
+        return;
+    }
+
+    RapidAnalysisExport *ex = rapid_analysis_export_new(req->queue, INVALID_JOB, true);
+
+    memset(&en, 0, sizeof(en));
+    memcpy(en.hash, req->hash, sizeof(SHA1_HASH_TYPE));
+
+    // Saved states are read from the file, anything else has to still
+    // be in the tree.
+    if (!rapid_analysis_export_resolve(&en)) {
+        rsave_tree_store_foreach(&global_rst->trace, rapid_analysis_find_link, &en);
+
+        if (en.node) {
+            rapid_analysis_export_resolve(&en);
         }
     }
 
-    CommsResultsItem *work_results = g_new(CommsResultsItem, 1);
-    work_results->msg = msg;
-    queue_push_results(q, work_results);
-    
-    rcc->unlock_tree(global_rst);
+    // The node is the export's to release from here on.
+    g_array_append_val(ex->nodes, en);
+
+    if (!en.state_size) {
+        // An empty state tells the controller there is no such state.
+        CommsMessage *msg = racomms_create_rapid_save_tree_state_response_msg(req->queue, INVALID_JOB, req->hash, 0, 0, 0);
+        queue_push_results(q, racomms_create_results(msg));
+        rapid_analysis_export_free(ex);
+        return;
+    }
+
+    // Only the state goes out, there is no tree in front of it.
+    g_array_index(ex->nodes, RapidAnalysisExportNode, 0).send = true;
+    ex->tree_sent = true;
+    ex->state_pos = 0;
+
+    queue_push_results_source(q, rapid_analysis_export_next, ex, rapid_analysis_export_free);
 }
 
 void rapid_analysis_drive_init(QemuOpts *ra_opts, MachineState *machine)
@@ -406,18 +687,25 @@ void rapid_analysis_init(QemuOpts *ra_opts, MachineState *machine)
 {
     CPUState *cpu;
     uint64_t num_steps, step_limit, channel_pool_size, message_size_limit, reference_pool_size, channel_pool_limit, timeout;
-    bool skip_tree, skip_trace, skip_save, interrupts, skip_blocks;
+    uint64_t state_cache_limit;
+    bool skip_tree, skip_trace, skip_save, interrupts, skip_blocks, fast_restore, map_states, async_writes, compress_states, merge_states;
     const char *filename;
     const char *ctrl;
     const char *osname;
     const char *process;
     const char *hashstring;
+    const char *hashalg;
+    const char *coverage_shm;
+    const char *ref_shm;
+    RSaveHashEngine hash_engine;
     const char *execmode;
     SHA1_HASH_TYPE *hash = NULL;
     Error *err = NULL;
     RSaveTreeClass *rcc = NULL;
     int ctrl_fd = 0;
     bool use_connect = false;
+    uint64_t num_queues;
+    SocketAddress *saddr = NULL;
 
     if(global_rst){
         error_report("Error attempting to reinitialize rapid analysis");
@@ -444,35 +732,55 @@ void rapid_analysis_init(QemuOpts *ra_opts, MachineState *machine)
         }
     }
 
+    num_queues = qemu_opt_get_number(ra_opts, "queues", 1);
+    if( num_queues < 1 || num_queues > RAPID_ANALYSIS_MAX_QUEUES ){
+        error_report("Invalid number of queues");
+        error_printf("Use between 1 and %d queues\n", RAPID_ANALYSIS_MAX_QUEUES);
+        exit(1);
+    }
+    if( num_queues > 1 && ctrl && !use_connect ){
+        error_report("Multiple queues need a controller to connect to");
+        error_printf("Use connect=ip:port (X.X.X.X:1234) with queues\n");
+        exit(1);
+    }
+
     if( ctrl ) {
-        SocketAddress *saddr = socket_parse(ctrl, &err);
+        saddr = socket_parse(ctrl, &err);
         if (err) {
             error_propagate(&err, err);
             error_report("Could not parse supplied controller address");
             error_printf("Use listen=ip:port or connect=ip:port (X.X.X.X:1234) to specify a controller server\n");
             exit(1);
         }
-        if (use_connect) {
-            ctrl_fd = socket_connect(saddr, &err);
-        }else{
-            ctrl_fd = socket_listen(saddr, &err);
-        }
-        if (err) {
-            error_report("Failed to communicate with controller");
-            error_printf("Use listen=ip:port or connect=ip:port (X.X.X.X:1234) to specify a controller server\n");
-            exit(1);
-        }
         global_rst->send_to_queue = true;
     }else{
         global_rst->send_to_queue = false;
     }
 
-    racomms_queue_start(1, ctrl_fd, &err);
-    if (err) {
-        error_propagate(&err, err);
-        error_report("Could not start rapid analysis queue");
-        exit(1);
+    // Each queue gets its own connection to the controller and is
+    // numbered from 1, the controller tells them apart by the queue id.
+    for( uint64_t queue_id = 1; queue_id <= num_queues; queue_id++ ) {
+        if( saddr ) {
+            if (use_connect) {
+                ctrl_fd = socket_connect(saddr, &err);
+            }else{
+                ctrl_fd = socket_listen(saddr, &err);
+            }
+            if (err) {
+                error_report("Failed to communicate with controller");
+                error_printf("Use listen=ip:port or connect=ip:port (X.X.X.X:1234) to specify a controller server\n");
+                exit(1);
+            }
+        }
+
+        racomms_queue_start(queue_id, ctrl_fd, &err);
+        if (err) {
+            error_propagate(&err, err);
+            error_report("Could not start rapid analysis queue");
+            exit(1);
+        }
     }
+    qapi_free_SocketAddress(saddr);
 
     num_steps = qemu_opt_get_number(ra_opts, "istep", RAPID_ANALYSIS_ISTEP_INIT);
     message_size_limit = qemu_opt_get_size(ra_opts, "msg_limit", RAPID_ANALYSIS_MSGSZ_LIMIT_INIT);
@@ -480,11 +788,17 @@ void rapid_analysis_init(QemuOpts *ra_opts, MachineState *machine)
     channel_pool_size = qemu_opt_get_size(ra_opts, "chnl_pool", RAPID_ANALYSIS_CHANNEL_POOL_INIT);
     channel_pool_limit = qemu_opt_get_size(ra_opts, "chnl_limit", channel_pool_size);
     reference_pool_size = qemu_opt_get_size(ra_opts, "ref_pool", RAPID_ANALYSIS_REFERENCE_POOL_INIT);
+    state_cache_limit = qemu_opt_get_size(ra_opts, "state_cache", 0);
     skip_trace = qemu_opt_get_bool(ra_opts, "notrace", false);
     skip_tree = qemu_opt_get_bool(ra_opts, "notree", false);
     skip_save = qemu_opt_get_bool(ra_opts, "nosave", false);
     interrupts = qemu_opt_get_bool(ra_opts, "ints", true);
     skip_blocks = qemu_opt_get_bool(ra_opts, "noblocks", false);
+    fast_restore = qemu_opt_get_bool(ra_opts, "fastrestore", false);
+    map_states = qemu_opt_get_bool(ra_opts, "mapstates", false);
+    async_writes = qemu_opt_get_bool(ra_opts, "asyncwrites", false);
+    compress_states = qemu_opt_get_bool(ra_opts, "chnl_compress", false);
+    merge_states = qemu_opt_get_bool(ra_opts, "merge", false);
     timeout =  qemu_opt_get_number(ra_opts, "timeout", RAPID_ANALYSIS_TIMEOUT);
     execmode = qemu_opt_get(ra_opts, "mode");
 
@@ -497,10 +811,16 @@ void rapid_analysis_init(QemuOpts *ra_opts, MachineState *machine)
     global_rst->istep = num_steps;
     global_rst->ilimit = step_limit;
     global_rst->msgsz_limit = message_size_limit;
+    global_rst->state_cache_limit = state_cache_limit;
     global_rst->skip_save = skip_save;
     global_rst->skip_tree = skip_tree;
     global_rst->skip_trace = skip_trace;
     global_rst->skip_blocks = skip_blocks;
+    global_rst->fast_restore = fast_restore;
+    global_rst->map_states = map_states;
+    global_rst->async_writes = async_writes;
+    global_rst->compress_states = compress_states;
+    global_rst->merge_states = merge_states;
     global_rst->enable_interrupts = interrupts;
     global_rst->config_timeout = timeout;
     global_rst->job_timeout = timeout;
@@ -513,14 +833,44 @@ void rapid_analysis_init(QemuOpts *ra_opts, MachineState *machine)
         global_rst->skip_trace = true;
     }
 
-    rcc->init_ram_cache(global_rst, reference_pool_size, &err);
+    // Keeps the loaded base in memory and rolls each job back to it.
+    if(execmode && !strcmp(execmode, "forkserver")){
+        global_rst->forkserver = true;
+    }
+
+    ref_shm = qemu_opt_get(ra_opts, "ref_shm");
+    if(ref_shm) {
+        rcc->init_shared_ram_cache(global_rst, ref_shm, reference_pool_size, &err);
+    } else {
+        rcc->init_ram_cache(global_rst, reference_pool_size, &err);
+    }
     if (err) {
         error_propagate(&err, err);
         error_report("Cannot setup RAM cache");
         exit(1);
     }
+
+    coverage_shm = qemu_opt_get(ra_opts, "coverage_shm");
+    if(qemu_opt_get_bool(ra_opts, "coverage", coverage_shm != NULL)) {
+        rcc->init_coverage(global_rst, coverage_shm, &err);
+        if (err) {
+            error_report_err(err);
+            exit(1);
+        }
+    }
+
     memory_channel_alloc_pool(channel_pool_size, channel_pool_limit);
 
+    hashalg = qemu_opt_get(ra_opts, "hashalg");
+    if(hashalg) {
+        if(!rsave_hash_engine_from_name(hashalg, &hash_engine)) {
+            error_report("Unknown hash engine %s", hashalg);
+            error_printf("Use hashalg=sha1 or hashalg=fast\n");
+            exit(1);
+        }
+        rsave_hash_set_engine(hash_engine);
+    }
+
     hashstring = qemu_opt_get(ra_opts, "hash");
     if(hashstring) {
         hash = g_new0(SHA1_HASH_TYPE,1);
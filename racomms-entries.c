@@ -0,0 +1,100 @@
+/*
+ * Rapid Analysis QEMU System Emulator
+ *
+ * Copyright (c) 2020 Cromulence LLC
+ *
+ * Distribution Statement A
+ *
+ * Approved for Public Release, Distribution Unlimited
+ *
+ * Authors:
+ *  Joseph Walker
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The creation of this code was funded by the US Government.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "racomms/interface.h"
+#include "racomms/messages.h"
+
+// Size of a variable length entry, whose struct ends in the first byte
+// of its value. Zero if the entry doesn't fit in avail bytes.
+#define JOB_ENTRY_SIZE(entry, avail) \
+    ((avail) < sizeof(*(entry)) || (entry)->size < 1 || \
+     (entry)->size - 1 > (avail) - sizeof(*(entry)) ? \
+     0 : sizeof(*(entry)) + (entry)->size - 1)
+
+bool racomms_parse_job_entries(CommsMessage *msg, const char *buffer,
+                               CommsWorkItem *work_item, Error **errp)
+{
+    const char *start = (char*)msg;
+    const char *end = start + msg->size;
+
+    while(buffer < end) {
+        const size_t avail = end - buffer;
+        const JOB_ADD_TYPE e = *((JOB_ADD_TYPE *)buffer);
+        size_t entry_size = 0;
+
+        switch(e)
+        {
+            case JOB_ADD_EXIT_INSN_COUNT:
+                entry_size = sizeof(CommsRequestJobAddExitInsnCountConstraint);
+                break;
+            case JOB_ADD_EXIT_INSN_RANGE:
+                entry_size = sizeof(CommsRequestJobAddExitInsnRangeConstraint);
+                break;
+            case JOB_ADD_EXIT_EXCEPTION:
+                entry_size = sizeof(CommsRequestJobAddExitExceptionConstraint);
+                break;
+            case JOB_ADD_REGISTER:
+            {
+                CommsRequestJobAddRegisterSetup *entry = (CommsRequestJobAddRegisterSetup *)buffer;
+                entry_size = JOB_ENTRY_SIZE(entry, avail);
+            }
+                break;
+            case JOB_ADD_MEMORY:
+            {
+                CommsRequestJobAddMemorySetup *entry = (CommsRequestJobAddMemorySetup *)buffer;
+                entry_size = JOB_ENTRY_SIZE(entry, avail);
+            }
+                break;
+            case JOB_ADD_STREAM:
+            {
+                CommsRequestJobAddStreamSetup *entry = (CommsRequestJobAddStreamSetup *)buffer;
+                entry_size = JOB_ENTRY_SIZE(entry, avail);
+            }
+                break;
+            case JOB_ADD_TIMEOUT:
+                entry_size = sizeof(CommsRequestJobAddTimeoutSetup);
+                break;
+            case JOB_ADD_REPORT_MASK:
+                entry_size = sizeof(CommsRequestJobAddReportMaskSetup);
+                break;
+            default:
+                error_setg(errp, "unknown job item type %d at offset %zu", e, (size_t)(buffer - start));
+                return false;
+        }
+
+        // Nothing is read past the end of the message
+        if( !entry_size || entry_size > avail ) {
+            error_setg(errp, "job item type %d at offset %zu overruns the message", e, (size_t)(buffer - start));
+            return false;
+        }
+
+        if( work_item ) {
+            WorkEntryItem *work_entry = g_new(WorkEntryItem, 1);
+            work_entry->offset = (buffer - start);
+            work_entry->entry_type = e;
+            QLIST_INSERT_HEAD(&work_item->entry_list, work_entry, next);
+        }
+
+        buffer += entry_size;
+    }
+
+    return true;
+}
@@ -24,6 +24,8 @@
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
 #include "qemu/sockets.h"
+#include "qemu/iov.h"
+#include "qemu/atomic.h"
 #include "monitor/qdev.h"
 #include "migration/snapshot.h"
 #include "rsave-tree.h"
@@ -33,11 +35,18 @@
 #include "racomms/messages.h"
 #include "sysemu/sysemu.h"
 #include "ra.h"
+#include "migration/ra-stats.h"
 
-#define CURRENT_VERSION       (1)
+#define CURRENT_VERSION       (2)
 #define INITIAL_BUFFER_SIZE   (256)
-#define RACOMMS_MAX_SEND_SIZE (65536)
-#define RACOMMS_MIN_SEND_SIZE (4096)
+#define RACOMMS_MAX_QUEUES    (256)
+
+typedef struct CommsResultsSourceItem {
+    CommsResultsSource produce;
+    void *opaque;
+    GDestroyNotify destroy;
+    QSIMPLEQ_ENTRY(CommsResultsSourceItem) next;
+} CommsResultsSourceItem;
 
 struct CommsQueue {
     uint8_t id;
@@ -53,24 +62,79 @@ struct CommsQueue {
 
     QemuMutex results_list_mutex;
     QTAILQ_HEAD(,CommsResultsItem) results_list;
+
+    // Job templates by id, only touched from the main loop.
+    GHashTable *templates;
+
+    // Asked for more results whenever results_list runs dry, only
+    // touched from the main loop.
+    QSIMPLEQ_HEAD(, CommsResultsSourceItem) sources;
+
+    // The result at the head of results_list while it is written out.
+    // send_pos and send_niov track what is left of send_iov.
+    struct iovec *send_iov;
+    struct iovec *send_pos;
+    unsigned int send_niov;
 };
 
 static bool racomms_active = false;
-static CommsQueue *queue = NULL;
+
+// Queues are indexed by their id. The first queue started is the
+// default for callers that don't know which queue they want.
+static CommsQueue *queues[RACOMMS_MAX_QUEUES];
+static CommsQueue *default_queue = NULL;
+
+// Work arriving on any queue wakes up racomms_pop_any_work().
+static QemuEvent any_work_arrived_event;
+static unsigned int next_work_queue = 0;
+
+// Results that send guest memory in place keep it pinned until they
+// have been written, racomms_wait_results_sent() waits them out.
+static unsigned int pinned_results = 0;
+static QemuEvent results_sent_event;
 
 static void racomms_read_message(void *opaque);
 static void racomms_write_message(void *opaque);
 
 CommsQueue *get_comms_queue(uint8_t queue_num)
 {
-    return queue;
+    if( queues[queue_num] ) {
+        return queues[queue_num];
+    }
+    return default_queue;
+}
+
+uint8_t queue_get_id(CommsQueue *q)
+{
+    return q->id;
 }
 
 void queue_push_work(CommsQueue *q, CommsWorkItem *work)
 {
+    work->queued = ra_stats_begin();
+
     qemu_mutex_lock(&q->work_list_mutex);
     QTAILQ_INSERT_TAIL(&q->work_list, work, next);
-    qemu_event_set(&queue->work_arrived_event);
+    qemu_event_set(&q->work_arrived_event);
+    qemu_event_set(&any_work_arrived_event);
+    qemu_mutex_unlock(&q->work_list_mutex);
+}
+
+static void queue_push_work_batch(CommsQueue *q, CommsWorkItem **work, unsigned int num_work)
+{
+    int64_t queued = ra_stats_begin();
+
+    if( !num_work ) {
+        return;
+    }
+
+    qemu_mutex_lock(&q->work_list_mutex);
+    for( unsigned int i = 0; i < num_work; i++ ) {
+        work[i]->queued = queued;
+        QTAILQ_INSERT_TAIL(&q->work_list, work[i], next);
+    }
+    qemu_event_set(&q->work_arrived_event);
+    qemu_event_set(&any_work_arrived_event);
     qemu_mutex_unlock(&q->work_list_mutex);
 }
 
@@ -102,6 +166,56 @@ bool queue_has_work(CommsQueue *q)
     return work != NULL;
 }
 
+static CommsWorkItem *queue_try_pop_work(CommsQueue *q)
+{
+    CommsWorkItem *work;
+    qemu_mutex_lock(&q->work_list_mutex);
+    work = QTAILQ_FIRST(&q->work_list);
+    if( work ) {
+        QTAILQ_REMOVE(&q->work_list, work, next);
+    }
+    qemu_mutex_unlock(&q->work_list_mutex);
+    return work;
+}
+
+bool racomms_has_any_work(void)
+{
+    for( unsigned int i = 0; i < RACOMMS_MAX_QUEUES; i++ ) {
+        if( queues[i] && queue_has_work(queues[i]) ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+CommsWorkItem *racomms_pop_any_work(CommsQueue **from)
+{
+    CommsWorkItem *work = NULL;
+
+    while( !work )
+    {
+        // Reset before looking so work pushed during the scan isn't missed.
+        qemu_event_reset(&any_work_arrived_event);
+
+        // Round robin over the queues starting after the last one served,
+        // so a busy controller can't starve the others.
+        for( unsigned int i = 0; i < RACOMMS_MAX_QUEUES && !work; i++ ) {
+            unsigned int queue_num = (next_work_queue + i) % RACOMMS_MAX_QUEUES;
+            CommsQueue *q = queues[queue_num];
+            if( q && (work = queue_try_pop_work(q)) ) {
+                next_work_queue = queue_num + 1;
+                *from = q;
+            }
+        }
+
+        if( !work ) {
+            qemu_event_wait(&any_work_arrived_event);
+        }
+    }
+
+    return work;
+}
+
 
 static void queue_purge_work(CommsQueue *q)
 {
@@ -121,11 +235,84 @@ static void queue_purge_work(CommsQueue *q)
 
 void queue_push_results(CommsQueue *q, CommsResultsItem *results)
 {
+    // The referenced memory goes out with the message from here on.
+    if( results->refs ) {
+        results->msg->size += results->ref_size;
+        results->pinned = true;
+        atomic_inc(&pinned_results);
+    }
+    results->pushed = ra_stats_begin();
+
     qemu_mutex_lock(&q->results_list_mutex);
+    if( q->fd <= 0 && results->refs ) {
+        // Same as queue_release_results(), nothing is going to send it.
+        qemu_mutex_unlock(&q->results_list_mutex);
+        racomms_free_results(results);
+        return;
+    }
+    // Only poll the socket for room while there is something to send.
+    if( QTAILQ_EMPTY(&q->results_list) && q->fd > 0 ) {
+        qemu_set_fd_handler(q->fd, racomms_read_message, racomms_write_message, q);
+    }
     QTAILQ_INSERT_TAIL(&q->results_list, results, next);
     qemu_mutex_unlock(&q->results_list_mutex);
 }
 
+static void queue_free_source(CommsResultsSourceItem *source)
+{
+    if( source->destroy ) {
+        source->destroy(source->opaque);
+    }
+    g_free(source);
+}
+
+void queue_push_results_source(CommsQueue *q, CommsResultsSource produce, void *opaque, GDestroyNotify destroy)
+{
+    CommsResultsSourceItem *source = g_new0(CommsResultsSourceItem, 1);
+    source->produce = produce;
+    source->opaque = opaque;
+    source->destroy = destroy;
+
+    if( q->fd <= 0 ) {
+        queue_free_source(source);
+        return;
+    }
+    QSIMPLEQ_INSERT_TAIL(&q->sources, source, next);
+
+    // The writer asks the source for its first result once the socket
+    // has room.
+    qemu_mutex_lock(&q->results_list_mutex);
+    qemu_set_fd_handler(q->fd, racomms_read_message, racomms_write_message, q);
+    qemu_mutex_unlock(&q->results_list_mutex);
+}
+
+// Queues the next result of the first source that has one left.
+static bool queue_pull_source(CommsQueue *q)
+{
+    CommsResultsSourceItem *source;
+
+    while( (source = QSIMPLEQ_FIRST(&q->sources)) != NULL ) {
+        CommsResultsItem *results = source->produce(source->opaque);
+        if( results ) {
+            queue_push_results(q, results);
+            return true;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&q->sources, next);
+        queue_free_source(source);
+    }
+    return false;
+}
+
+static void queue_release_sources(CommsQueue *q)
+{
+    CommsResultsSourceItem *source;
+
+    while( (source = QSIMPLEQ_FIRST(&q->sources)) != NULL ) {
+        QSIMPLEQ_REMOVE_HEAD(&q->sources, next);
+        queue_free_source(source);
+    }
+}
+
 CommsResultsItem *queue_pop_results(CommsQueue *q)
 {
     CommsResultsItem *result;
@@ -138,26 +325,54 @@ CommsResultsItem *queue_pop_results(CommsQueue *q)
 
 static void queue_purge_results(CommsQueue *q)
 {
-    CommsResultsItem *result;
+    CommsResultsItem *result, *next;
     qemu_mutex_lock(&q->results_list_mutex);
-    result = QTAILQ_FIRST(&q->results_list);
 
     rapid_analysis_end_work(NULL, false);
 
-    while(result)
+    QTAILQ_FOREACH_SAFE(result, &q->results_list, next, next)
     {
-        g_free(result->msg);
+        // A result that is partly written has to be finished or the
+        // controller loses track of the message boundaries.
+        if( result == QTAILQ_FIRST(&q->results_list) && q->send_iov ) {
+            continue;
+        }
         QTAILQ_REMOVE(&q->results_list, result, next);
-        g_free(result);
-        result = QTAILQ_FIRST(&q->results_list);
+        racomms_free_results(result);
     }
 
     qemu_mutex_unlock(&q->results_list_mutex);
+
+    // Whatever the sources had left to send goes with them.
+    queue_release_sources(q);
+}
+
+static void queue_release_results(CommsQueue *q)
+{
+    CommsResultsItem *result, *next;
+    qemu_mutex_lock(&q->results_list_mutex);
+
+    // Without a connection these can never be sent, so they can't keep
+    // guest memory pinned either.
+    QTAILQ_FOREACH_SAFE(result, &q->results_list, next, next)
+    {
+        if( result->refs ) {
+            QTAILQ_REMOVE(&q->results_list, result, next);
+            racomms_free_results(result);
+        }
+    }
+    g_free(q->send_iov);
+    q->send_iov = NULL;
+    q->send_pos = NULL;
+    q->send_niov = 0;
+
+    qemu_mutex_unlock(&q->results_list_mutex);
 }
 
 static void *queue_dup_buffer(CommsQueue *q)
 {
-    return g_memdup(q->buffer, q->buffsize);
+    // Only the message read since the last reset, not the whole buffer.
+    return g_memdup(q->buffer, q->buffloc);
 }
 
 static void queue_reset(CommsQueue *q)
@@ -168,8 +383,25 @@ static void queue_reset(CommsQueue *q)
 
 static void queue_cleanup(CommsQueue *q)
 {
-    qemu_set_fd_handler(q->fd, NULL, NULL, NULL);
-    closesocket(q->fd);
+    // The queue stays registered so that queued work and results can
+    // still be drained, only the connection is dropped.
+    if( q->fd > 0 ) {
+        qemu_set_fd_handler(q->fd, NULL, NULL, NULL);
+        closesocket(q->fd);
+        q->fd = 0;
+    }
+    queue_release_sources(q);
+    queue_release_results(q);
+}
+
+static void queue_destroy(CommsQueue *q)
+{
+    queue_cleanup(q);
+    queue_purge_work(q);
+    qemu_event_destroy(&q->work_arrived_event);
+    qemu_mutex_destroy(&q->work_list_mutex);
+    qemu_mutex_destroy(&q->results_list_mutex);
+    g_hash_table_destroy(q->templates);
     g_free(q->buffer);
     g_free(q);
 }
@@ -187,23 +419,41 @@ static void queue_error(CommsQueue *q, const char *msg, ...)
 
 void racomms_queue_start(uint8_t id, int ctrlfd, Error **errp)
 {
+    CommsQueue *q;
+
     if( !racomms_active ) {
         racomms_active = true;
-        queue = g_new0(CommsQueue, 1);
-        queue->id = id;
-        queue->buffsize = INITIAL_BUFFER_SIZE;
-        queue->buffer = g_malloc0(INITIAL_BUFFER_SIZE);
-        QTAILQ_INIT(&queue->work_list);
-        QTAILQ_INIT(&queue->results_list);
-        qemu_event_init(&queue->work_arrived_event, false);
-        qemu_mutex_init(&queue->work_list_mutex);
-        qemu_mutex_init(&queue->results_list_mutex);
-        queue_reset(queue);
-        if( ctrlfd > 0 ) {
-            queue->fd = ctrlfd;
-            qemu_set_nonblock(queue->fd);
-            qemu_set_fd_handler(queue->fd, racomms_read_message, racomms_write_message, queue);
-        }
+        qemu_event_init(&any_work_arrived_event, false);
+        qemu_event_init(&results_sent_event, true);
+        next_work_queue = 0;
+    }
+
+    if( queues[id] ) {
+        error_setg(errp, "Queue %d has already been started", id);
+        return;
+    }
+
+    q = g_new0(CommsQueue, 1);
+    q->id = id;
+    q->buffsize = INITIAL_BUFFER_SIZE;
+    q->buffer = g_malloc0(INITIAL_BUFFER_SIZE);
+    QTAILQ_INIT(&q->work_list);
+    QTAILQ_INIT(&q->results_list);
+    qemu_event_init(&q->work_arrived_event, false);
+    qemu_mutex_init(&q->work_list_mutex);
+    qemu_mutex_init(&q->results_list_mutex);
+    q->templates = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    QSIMPLEQ_INIT(&q->sources);
+    queue_reset(q);
+    if( ctrlfd > 0 ) {
+        q->fd = ctrlfd;
+        qemu_set_nonblock(q->fd);
+        qemu_set_fd_handler(q->fd, racomms_read_message, NULL, q);
+    }
+
+    queues[id] = q;
+    if( !default_queue ) {
+        default_queue = q;
     }
 }
 
@@ -211,10 +461,15 @@ void racomms_queue_stop(void)
 {
     if( racomms_active ) {
         racomms_active = false;
-        queue_cleanup(queue);
-        qemu_event_destroy(&queue->work_arrived_event);
-        qemu_mutex_destroy(&queue->work_list_mutex);
-        qemu_mutex_destroy(&queue->results_list_mutex);
+        for( unsigned int i = 0; i < RACOMMS_MAX_QUEUES; i++ ) {
+            if( queues[i] ) {
+                queue_destroy(queues[i]);
+                queues[i] = NULL;
+            }
+        }
+        default_queue = NULL;
+        qemu_event_destroy(&any_work_arrived_event);
+        qemu_event_destroy(&results_sent_event);
     }
 }
 
@@ -382,6 +637,60 @@ CommsMessage *racomms_msg_job_add_put_TimeoutSetup(CommsMessage *msg, uint64_t t
     return msg;
 }
 
+CommsMessage *racomms_msg_job_add_put_ReportMaskSetup(CommsMessage *msg, JOB_REPORT_TYPE report_mask)
+{
+    CommsRequestJobAddReportMaskSetup *rmsg = add_msg_entry(&msg, sizeof(CommsRequestJobAddReportMaskSetup));
+    if( !rmsg ) {
+        return NULL;
+    }
+    rmsg->entry_type = JOB_ADD_REPORT_MASK;
+    rmsg->report_mask = report_mask;
+    return msg;
+}
+
+void racomms_msg_job_add_put_Template(CommsMessage *msg, uint16_t template_id)
+{
+    CommsRequestJobAddMsg *rmsg = (CommsRequestJobAddMsg*)(msg + 1);
+    rmsg->flags |= JOB_FLAG_TEMPLATE;
+    rmsg->template_id = template_id;
+}
+
+CommsMessage *racomms_create_job_template_msg(uint8_t queue, uint16_t template_id, SHA1_HASH_TYPE base_hash)
+{
+    CommsMessage *msg = racomms_create_msg(MSG_REQUEST_JOB_TEMPLATE, sizeof(CommsMessage) + sizeof(CommsRequestJobTemplateMsg));
+    if( !msg ) {
+        return NULL;
+    }
+    CommsRequestJobTemplateMsg *rmsg = (CommsRequestJobTemplateMsg*)(msg + 1);
+    rmsg->queue = queue;
+    rmsg->template_id = template_id;
+    memcpy(rmsg->base_hash, base_hash, sizeof(SHA1_HASH_TYPE));
+    return msg;
+}
+
+CommsMessage *racomms_create_job_batch_msg(uint8_t queue)
+{
+    CommsMessage *msg = racomms_create_msg(MSG_REQUEST_JOB_BATCH, sizeof(CommsMessage) + sizeof(CommsRequestJobBatchMsg));
+    if( !msg ) {
+        return NULL;
+    }
+    CommsRequestJobBatchMsg *rmsg = (CommsRequestJobBatchMsg*)(msg + 1);
+    rmsg->queue = queue;
+    rmsg->num_jobs = 0;
+    return msg;
+}
+
+CommsMessage *racomms_msg_job_batch_put_Job(CommsMessage *msg, const CommsMessage *job)
+{
+    void *rmsg = add_msg_entry(&msg, job->size);
+    if( !rmsg ) {
+        return NULL;
+    }
+    memcpy(rmsg, job, job->size);
+    ((CommsRequestJobBatchMsg*)(msg + 1))->num_jobs++;
+    return msg;
+}
+
 CommsMessage *racomms_create_job_report_request_msg(uint8_t queue, int32_t job_id, SHA1_HASH_TYPE hash, JOB_REPORT_TYPE req_flags)
 {
     CommsMessage *msg = racomms_create_msg(MSG_REQUEST_JOB_REPORT, sizeof(CommsMessage) + sizeof(CommsRequestJobReportMsg));
@@ -416,6 +725,12 @@ void racomms_msg_job_report_put_InstructionCount(CommsMessage *msg, uint64_t ico
     rmsg->num_insns = icount;
 }
 
+void racomms_msg_job_report_put_Flags(CommsMessage *msg, JOB_RESULT_TYPE flags)
+{
+    CommsResponseJobReportMsg *rmsg = (CommsResponseJobReportMsg*)(msg + 1);
+    rmsg->flags = flags;
+}
+
 CommsMessage *racomms_msg_job_report_put_ProcessorEntry(CommsMessage *msg, uint8_t cpu_id, NAME_TYPE cpu_name)
 {
     CommsResponseJobReportProcessorEntry *rmsg = add_msg_entry(&msg, sizeof(CommsResponseJobReportProcessorEntry));
@@ -457,10 +772,53 @@ CommsMessage *racomms_msg_job_report_put_MemoryEntry(CommsMessage *msg, uint64_t
     rmsg->entry_type = mem_type;
     rmsg->offset = offset;
     rmsg->size = size;
+    rmsg->length = size;
+    rmsg->encoding = MEMORY_ENCODING_RAW;
     memcpy(rmsg->value, value, size);
     return msg;
 }
 
+CommsMessage *racomms_msg_job_report_put_EncodedMemoryEntry(CommsMessage *msg, uint64_t offset, uint32_t length, MEMORY_ENCODING_TYPE encoding, uint32_t size, uint8_t *value, JOB_REPORT_TYPE mem_type)
+{
+    msg = racomms_msg_job_report_put_MemoryEntry(msg, offset, size, value, mem_type);
+    if( !msg ) {
+        return NULL;
+    }
+
+    // The entry we just put is the last one in the message.
+    CommsResponseJobReportMemoryEntry *rmsg = MSG_OFFSET(msg, msg->size - (sizeof(CommsResponseJobReportMemoryEntry) + size - 1));
+    rmsg->length = length;
+    rmsg->encoding = encoding;
+    return msg;
+}
+
+bool racomms_results_put_MemoryEntryRef(CommsResultsItem *results, uint64_t offset, uint32_t size, const uint8_t *value, JOB_REPORT_TYPE mem_type)
+{
+    CommsResultsRef ref;
+
+    if( mem_type != JOB_REPORT_VIRTUAL_MEMORY &&
+        mem_type != JOB_REPORT_PHYSICAL_MEMORY ){
+        return false;
+    }
+
+    if( !results->refs ) {
+        results->refs = g_array_new(false, false, sizeof(CommsResultsRef));
+    }
+
+    memset(&ref, 0, sizeof(ref));
+    ref.at = results->msg->size;
+    ref.entry.entry_type = mem_type;
+    ref.entry.offset = offset;
+    ref.entry.size = size;
+    ref.entry.length = size;
+    ref.entry.encoding = MEMORY_ENCODING_RAW;
+    ref.value = value;
+    g_array_append_val(results->refs, ref);
+
+    results->ref_size += offsetof(CommsResponseJobReportMemoryEntry, value) + size;
+    return true;
+}
+
 CommsMessage *racomms_msg_job_report_put_Exception(CommsMessage *msg, uint64_t exception_mask)
 {
     CommsResponseJobReportExceptionEntry *rmsg = add_msg_entry(&msg, sizeof(CommsResponseJobReportExceptionEntry));
@@ -486,6 +844,46 @@ CommsMessage *racomms_msg_job_report_put_Error(CommsMessage *msg, uint32_t error
     return msg;
 }
 
+CommsMessage *racomms_msg_job_report_put_CoverageEntry(CommsMessage *msg, const uint8_t *map, uint8_t map_bits)
+{
+    uint32_t num_edges = 0;
+    uint32_t map_size = 1u << map_bits;
+
+    for (uint32_t i = 0; i < map_size; i++) {
+        num_edges += map[i] != 0;
+    }
+
+    CommsResponseJobReportCoverageEntry *rmsg = add_msg_entry(&msg, sizeof(CommsResponseJobReportCoverageEntry) - sizeof(uint32_t) + num_edges * sizeof(uint32_t));
+    if ( !rmsg ) {
+        return NULL;
+    }
+    rmsg->entry_type = JOB_REPORT_COVERAGE;
+    rmsg->map_bits = map_bits;
+    rmsg->num_edges = num_edges;
+    for (uint32_t i = 0, edge = 0; i < map_size; i++) {
+        if (map[i]) {
+            rmsg->edges[edge++] = (i << 8) | map[i];
+        }
+    }
+    return msg;
+}
+
+CommsMessage *racomms_msg_job_report_put_StatsEntry(CommsMessage *msg, const uint64_t *values, uint8_t num_phases, uint8_t num_counters)
+{
+    uint32_t num_values = num_phases * 2 + num_counters;
+
+    CommsResponseJobReportStatsEntry *rmsg = add_msg_entry(&msg, sizeof(CommsResponseJobReportStatsEntry) - sizeof(uint64_t) + num_values * sizeof(uint64_t));
+    if ( !rmsg ) {
+        return NULL;
+    }
+    rmsg->entry_type = JOB_REPORT_STATS;
+    rmsg->num_phases = num_phases;
+    rmsg->num_counters = num_counters;
+    rmsg->num_values = num_values;
+    memcpy(rmsg->values, values, num_values * sizeof(uint64_t));
+    return msg;
+}
+
 CommsMessage *racomms_create_purge_queue_msg(uint8_t queue, PURGE_ACTION_TYPE action)
 {
     CommsMessage *msg = racomms_create_msg(MSG_REQUEST_JOB_PURGE, sizeof(CommsMessage) + sizeof(CommsRequestJobPurgeMsg));
@@ -521,6 +919,24 @@ CommsMessage *racomms_create_rapid_save_tree_request_msg(uint8_t queue, int32_t
     return msg;
 }
 
+void racomms_msg_rapid_save_tree_request_put_Flags(CommsMessage *msg, RST_FLAG_TYPE flags)
+{
+    CommsRequestRapidSaveTreeMsg *rmsg = (CommsRequestRapidSaveTreeMsg*)(msg + 1);
+    rmsg->flags = flags;
+}
+
+CommsMessage *racomms_create_rapid_save_tree_state_request_msg(uint8_t queue, SHA1_HASH_TYPE hash)
+{
+    CommsMessage *msg = racomms_create_msg(MSG_REQUEST_RST_STATE, sizeof(CommsMessage) + sizeof(CommsRequestRapidSaveTreeStateMsg));
+    if( !msg ) {
+        return NULL;
+    }
+    CommsRequestRapidSaveTreeStateMsg *rmsg = (CommsRequestRapidSaveTreeStateMsg*)(msg + 1);
+    rmsg->queue = queue;
+    memcpy(rmsg->hash, hash, sizeof(SHA1_HASH_TYPE));
+    return msg;
+}
+
 CommsMessage *racomms_create_rapid_save_tree_response_msg(uint8_t queue, int32_t job_id)
 {
     CommsMessage *msg = racomms_create_msg(MSG_RESPONSE_RST, sizeof(CommsMessage) + sizeof(CommsResponseRapidSaveTreeMsg));
@@ -545,7 +961,8 @@ CommsMessage *racomms_msg_rapid_save_tree_put_InstructionEntry(CommsMessage *msg
 }
 
 CommsMessage *racomms_msg_rapid_save_tree_put_NodeHeader(CommsMessage *msg, int64_t timestamp,
-    uint64_t instruction_number, uint64_t cpu_exception_index, int32_t job_id)
+    uint64_t instruction_number, uint64_t cpu_exception_index, int32_t job_id,
+    SHA1_HASH_TYPE hash, uint64_t state_size)
 {
     CommsResponseRapidSaveTreeNodeHeader *rmsg = add_msg_entry(&msg, sizeof(CommsResponseRapidSaveTreeNodeHeader));
     if( !rmsg ) {
@@ -558,6 +975,8 @@ CommsMessage *racomms_msg_rapid_save_tree_put_NodeHeader(CommsMessage *msg, int6
     rmsg->instruction_number = instruction_number;
     rmsg->cpu_exception_index = cpu_exception_index;
     rmsg->job_id = job_id;
+    rmsg->state_size = state_size;
+    memcpy(rmsg->hash, hash, sizeof(SHA1_HASH_TYPE));
     return msg;
 }
 
@@ -585,137 +1004,307 @@ CommsMessage *racomms_msg_rapid_save_tree_put_NodeState(CommsMessage *msg, uint3
     return msg;
 }
 
-bool racomms_queue_add_job(CommsQueue *q, CommsMessage *msg)
+CommsMessage *racomms_create_rapid_save_tree_state_response_msg(uint8_t queue, int32_t job_id, SHA1_HASH_TYPE hash,
+    uint64_t state_size, uint64_t offset, uint32_t size)
+{
+    CommsMessage *msg = racomms_create_msg(MSG_RESPONSE_RST_STATE, sizeof(CommsMessage) + sizeof(CommsResponseRapidSaveTreeStateMsg) + size);
+    if( !msg ) {
+        return NULL;
+    }
+    CommsResponseRapidSaveTreeStateMsg *rmsg = (CommsResponseRapidSaveTreeStateMsg*)(msg + 1);
+    rmsg->queue = queue;
+    rmsg->job_id = job_id;
+    rmsg->size = size;
+    rmsg->state_size = state_size;
+    rmsg->offset = offset;
+    memcpy(rmsg->hash, hash, sizeof(SHA1_HASH_TYPE));
+    return msg;
+}
+
+// Walks the job add entries from buffer to the end of msg. The entries
+// are added to work_item when one is given, otherwise only checked.
+static bool queue_parse_job_entries(CommsQueue *q, CommsMessage *msg, const char *buffer, CommsWorkItem *work_item)
 {
-    const char *start = (char*)msg;
-    const char *end = start + msg->size;
+    Error *err = NULL;
 
-    if(msg->msg_id != MSG_REQUEST_JOB_ADD){
-        queue_error(q, "%s: wrong job msg received: %d (%s @ line %d)\n", msg->msg_id, __func__, strerror(errno), __LINE__);
+    if( !racomms_parse_job_entries(msg, buffer, work_item, &err) ){
+        queue_error(q, "%s: %s @ line %d\n", __func__, error_get_pretty(err), __LINE__);
+        error_free(err);
         return false;
     }
+    return true;
+}
 
-    char *buffer = (char*)(msg + 1);
-    CommsRequestJobAddMsg *job_msg = (CommsRequestJobAddMsg*)buffer;
-    if(job_msg->queue != queue->id){
-        queue_error(q, "%s: job add received for wrong queue: %d (%s @ line %d)\n", job_msg->queue, __func__, strerror(errno), __LINE__);
-        return false;
+// Builds a job from its template: the job's header and entries followed
+// by the template's entries. Entries are applied last to first, so the
+// job's own entries win over the template's. Templates still pending in
+// the job's batch come before the registered ones.
+static CommsMessage *queue_apply_template(CommsQueue *q, GHashTable *pending, CommsMessage *msg)
+{
+    CommsRequestJobAddMsg *job_msg = (CommsRequestJobAddMsg*)(msg + 1);
+    CommsMessage *tmpl = NULL;
+    if( pending ) {
+        tmpl = g_hash_table_lookup(pending, GUINT_TO_POINTER(job_msg->template_id));
+    }
+    if( !tmpl ) {
+        tmpl = g_hash_table_lookup(q->templates, GUINT_TO_POINTER(job_msg->template_id));
+    }
+    if( !tmpl ) {
+        queue_error(q, "%s: job %d uses unknown template %d @ line %d\n", __func__, job_msg->job_id, job_msg->template_id, __LINE__);
+        g_free(msg);
+        return NULL;
+    }
+
+    CommsRequestJobTemplateMsg *tmpl_msg = (CommsRequestJobTemplateMsg*)(tmpl + 1);
+    const size_t tmpl_entries = tmpl->size - sizeof(CommsMessage) - sizeof(CommsRequestJobTemplateMsg);
+
+    CommsMessage *r = g_realloc(msg, msg->size + tmpl_entries);
+    memcpy(MSG_OFFSET(r, r->size), tmpl_msg + 1, tmpl_entries);
+    r->size += tmpl_entries;
+
+    job_msg = (CommsRequestJobAddMsg*)(r + 1);
+    memcpy(job_msg->base_hash, tmpl_msg->base_hash, sizeof(SHA1_HASH_TYPE));
+    return r;
+}
+
+// Takes msg over, it is freed if the job can't be parsed.
+static CommsWorkItem *queue_parse_job(CommsQueue *q, GHashTable *pending, CommsMessage *msg)
+{
+    if(msg->msg_id != MSG_REQUEST_JOB_ADD){
+        queue_error(q, "%s: wrong job msg received: %d (%s @ line %d)\n", __func__, msg->msg_id, strerror(errno), __LINE__);
+        g_free(msg);
+        return NULL;
+    }
+
+    if( msg->size < sizeof(CommsMessage) + sizeof(CommsRequestJobAddMsg) ) {
+        queue_error(q, "%s: malformed job add @ line %d\n", __func__, __LINE__);
+        g_free(msg);
+        return NULL;
+    }
+
+    CommsRequestJobAddMsg *job_msg = (CommsRequestJobAddMsg*)(msg + 1);
+    if(job_msg->queue != q->id){
+        queue_error(q, "%s: job add received for wrong queue: %d (%s @ line %d)\n", __func__, job_msg->queue, strerror(errno), __LINE__);
+        g_free(msg);
+        return NULL;
+    }
+
+    if( job_msg->flags & JOB_FLAG_TEMPLATE ) {
+        msg = queue_apply_template(q, pending, msg);
+        if( !msg ) {
+            return NULL;
+        }
+        job_msg = (CommsRequestJobAddMsg*)(msg + 1);
     }
-    buffer = (char*)(job_msg + 1);
 
     CommsWorkItem *work_item = g_new(CommsWorkItem, 1);
     work_item->msg = msg;
     QLIST_INIT(&work_item->entry_list);
 
-    while(buffer < end) {
-        JOB_ADD_TYPE e = *((JOB_ADD_TYPE *)buffer);
+    if( !queue_parse_job_entries(q, msg, (char*)(job_msg + 1), work_item) ){
+        racomms_free_work(work_item);
+        return NULL;
+    }
+    return work_item;
+}
 
-        WorkEntryItem *work_entry = g_new(WorkEntryItem, 1);
-        work_entry->offset = (buffer - start);
-        work_entry->entry_type = e;
-        QLIST_INSERT_HEAD(&work_item->entry_list, work_entry, next);
+bool racomms_queue_add_job(CommsQueue *q, CommsMessage *msg)
+{
+    CommsWorkItem *work_item = queue_parse_job(q, NULL, msg);
+    if( !work_item ) {
+        return false;
+    }
 
-        switch(e)
-        {
-            case JOB_ADD_EXIT_INSN_COUNT:
-            {
-                buffer += sizeof(CommsRequestJobAddExitInsnCountConstraint);
-            }
-                break;
-            case JOB_ADD_EXIT_INSN_RANGE:
-            {
-                buffer += sizeof(CommsRequestJobAddExitInsnRangeConstraint);
-            }
-                break;
-            case JOB_ADD_EXIT_EXCEPTION:
-            {
-                buffer += sizeof(CommsRequestJobAddExitExceptionConstraint);
-            }
-                break;
-            case JOB_ADD_REGISTER:
-            {
-                CommsRequestJobAddRegisterSetup *entry = (CommsRequestJobAddRegisterSetup *)buffer;
-                buffer += sizeof(CommsRequestJobAddRegisterSetup) + entry->size - 1;
-            }
-                break;
-            case JOB_ADD_MEMORY:
-            {
-                CommsRequestJobAddMemorySetup *entry = (CommsRequestJobAddMemorySetup *)buffer;
-                buffer += sizeof(CommsRequestJobAddMemorySetup) + entry->size - 1;
-            }
-                break;
-            case JOB_ADD_STREAM:
-            {
-                CommsRequestJobAddStreamSetup *entry = (CommsRequestJobAddStreamSetup *)buffer;
-                buffer += sizeof(CommsRequestJobAddStreamSetup) + entry->size - 1;
+    queue_push_work(q, work_item);
+    return true;
+}
+
+// Takes msg over, it is freed if the template is malformed.
+static bool queue_check_template(CommsQueue *q, CommsMessage *msg)
+{
+    CommsRequestJobTemplateMsg *tmpl_msg = (CommsRequestJobTemplateMsg*)(msg + 1);
+
+    if( msg->size < sizeof(CommsMessage) + sizeof(CommsRequestJobTemplateMsg) ||
+        !queue_parse_job_entries(q, msg, (char*)(tmpl_msg + 1), NULL) ){
+        queue_error(q, "%s: malformed job template @ line %d\n", __func__, __LINE__);
+        g_free(msg);
+        return false;
+    }
+    return true;
+}
+
+// Takes msg over. A template replaces any earlier one with the same id.
+static bool queue_add_template(CommsQueue *q, CommsMessage *msg)
+{
+    CommsRequestJobTemplateMsg *tmpl_msg = (CommsRequestJobTemplateMsg*)(msg + 1);
+
+    if( !queue_check_template(q, msg) ) {
+        return false;
+    }
+
+    g_hash_table_insert(q->templates, GUINT_TO_POINTER(tmpl_msg->template_id), msg);
+    return true;
+}
+
+// The jobs in a batch are queued together once they have all been
+// parsed, so the worker is woken once for the batch. Its templates are
+// registered along with them, jobs later in the batch can already use
+// them, and a batch that fails leaves the templates as they were.
+static bool queue_add_batch(CommsQueue *q, CommsMessage *msg)
+{
+    CommsRequestJobBatchMsg *batch = (CommsRequestJobBatchMsg*)(msg + 1);
+    const uint8_t *buffer = (uint8_t*)(batch + 1);
+    const uint8_t *end = (uint8_t*)msg + msg->size;
+    GHashTable *templates;
+    GHashTableIter iter;
+    gpointer id, tmpl;
+    GPtrArray *jobs;
+    bool ok = true;
+
+    if( msg->size < sizeof(CommsMessage) + sizeof(CommsRequestJobBatchMsg) ) {
+        queue_error(q, "%s: malformed job batch @ line %d\n", __func__, __LINE__);
+        return false;
+    }
+
+    jobs = g_ptr_array_new();
+    templates = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    for( uint32_t i = 0; i < batch->num_jobs && ok; i++ ) {
+        const CommsMessage *job = (const CommsMessage*)buffer;
+        if( buffer + sizeof(CommsMessage) > end || job->size < sizeof(CommsMessage) ||
+            job->size > (uint64_t)(end - buffer) ){
+            queue_error(q, "%s: malformed job batch @ line %d\n", __func__, __LINE__);
+            ok = false;
+            break;
+        }
+
+        if( job->msg_id == MSG_REQUEST_JOB_TEMPLATE ) {
+            CommsMessage *tmpl_msg = g_memdup(job, job->size);
+            ok = queue_check_template(q, tmpl_msg);
+            if( ok ) {
+                CommsRequestJobTemplateMsg *tmpl_hdr = (CommsRequestJobTemplateMsg*)(tmpl_msg + 1);
+                g_hash_table_insert(templates, GUINT_TO_POINTER(tmpl_hdr->template_id), tmpl_msg);
             }
-                break;
-            case JOB_ADD_TIMEOUT:
-            {
-                buffer += sizeof(CommsRequestJobAddTimeoutSetup);
+        } else {
+            CommsWorkItem *work_item = queue_parse_job(q, templates, g_memdup(job, job->size));
+            if( work_item ) {
+                g_ptr_array_add(jobs, work_item);
             }
-                break;
-            default:
-                queue_error(q, "%s: unknown job item type: %d (%s @ line %d)\n", e, __func__, strerror(errno), __LINE__);
-                racomms_free_work(work_item);
-                return false;
+            ok = work_item != NULL;
         }
+        buffer += job->size;
     }
 
-    if( buffer > end ){
-        // Malformed job, we exceeded the size
-        racomms_free_work(work_item);
-        return false;
+    if( ok ) {
+        g_hash_table_iter_init(&iter, templates);
+        while( g_hash_table_iter_next(&iter, &id, &tmpl) ) {
+            g_hash_table_insert(q->templates, id, tmpl);
+            g_hash_table_iter_steal(&iter);
+        }
+        queue_push_work_batch(q, (CommsWorkItem**)jobs->pdata, jobs->len);
+    } else {
+        g_ptr_array_foreach(jobs, (GFunc)racomms_free_work, NULL);
     }
+    g_hash_table_destroy(templates);
+    g_ptr_array_free(jobs, true);
+    return ok;
+}
 
-    queue_push_work(q, work_item);
-    return true;
+static struct iovec *results_build_iov(CommsResultsItem *result, unsigned int *niov)
+{
+    const size_t entry_header = offsetof(CommsResponseJobReportMemoryEntry, value);
+    const guint nrefs = result->refs ? result->refs->len : 0;
+    const size_t msg_len = result->msg->size - result->ref_size;
+    uint8_t *raw_msg = (uint8_t*)result->msg;
+    struct iovec *iov = g_new(struct iovec, 1 + nrefs * 3);
+    size_t msg_sent = 0;
+    unsigned int n = 0;
+
+    // Interleave the message with the referenced entries at the offsets
+    // they were put at.
+    for( guint i = 0; i < nrefs; i++ ) {
+        CommsResultsRef *ref = &g_array_index(result->refs, CommsResultsRef, i);
+        if( ref->at > msg_sent ) {
+            iov[n].iov_base = &raw_msg[msg_sent];
+            iov[n++].iov_len = ref->at - msg_sent;
+            msg_sent = ref->at;
+        }
+        iov[n].iov_base = &ref->entry;
+        iov[n++].iov_len = entry_header;
+        iov[n].iov_base = (void *)ref->value;
+        iov[n++].iov_len = ref->entry.size;
+    }
+    if( msg_len > msg_sent ) {
+        iov[n].iov_base = &raw_msg[msg_sent];
+        iov[n++].iov_len = msg_len - msg_sent;
+    }
+
+    *niov = n;
+    return iov;
 }
 
 static void racomms_write_message(void *opaque)
 {
     CommsQueue *q = (CommsQueue*)opaque;
-    CommsResultsItem *result, *next;
-    size_t max_send_size = RACOMMS_MAX_SEND_SIZE;
+    CommsResultsItem *result;
 
     qemu_mutex_lock(&q->results_list_mutex);
-    
-    // Give the writers to the results list priority.
-    QTAILQ_FOREACH_SAFE(result, &q->results_list, next, next)
+
+    // The main loop calls us when the socket has room. Write as much as
+    // it takes and pick up where we left off next time.
+    while( (result = QTAILQ_FIRST(&q->results_list)) != NULL )
     {
-        size_t bytes_read = 0;
-        uint8_t *raw_msg = (uint8_t*)result->msg;
-        while( bytes_read < result->msg->size ) {
-            size_t bytes_to_send = MIN(result->msg->size - bytes_read, max_send_size);
-            ssize_t rc = write(q->fd, &raw_msg[bytes_read], bytes_to_send);
-            if (rc < 0) {
-                if( errno == EAGAIN ){
-                    // Throttle the send size...
-                    max_send_size = MAX(max_send_size/2, RACOMMS_MIN_SEND_SIZE);
-                }else{
+        if( !q->send_iov ) {
+            q->send_iov = results_build_iov(result, &q->send_niov);
+            q->send_pos = q->send_iov;
+        }
+
+        while( q->send_niov ) {
+            ssize_t rc = writev(q->fd, q->send_pos, MIN(q->send_niov, IOV_MAX));
+            if( rc < 0 ) {
+                if( errno == EINTR ) {
+                    continue;
+                }
+                qemu_mutex_unlock(&q->results_list_mutex);
+                if( errno != EAGAIN && errno != EWOULDBLOCK ) {
                     queue_error(q, "%s: failed to send msg %d @ line %d\n", __func__, result->msg->msg_id, __LINE__);
-                    return;
                 }
-            }else{
-                bytes_read += rc;
+                return;
             }
+            iov_discard_front(&q->send_pos, &q->send_niov, rc);
         }
-        g_free(result->msg);
+
+        g_free(q->send_iov);
+        q->send_iov = NULL;
+        q->send_pos = NULL;
+        ra_stats_end(RAPID_ANALYSIS_PHASE_SEND, result->pushed);
+        ra_stats_count(JOB_STATS_BYTES_SENT, result->msg->size);
         QTAILQ_REMOVE(&q->results_list, result, next);
-        g_free(result);
+        racomms_free_results(result);
+    }
+    qemu_mutex_unlock(&q->results_list_mutex);
 
-        qemu_mutex_unlock(&q->results_list_mutex);
-        // See if we have contention for the lock...
-        if( qemu_mutex_trylock(&q->results_list_mutex) ){
-            // We failed to grab the lock so bail for now...
-            return;
-        }
+    // A source refills the list one result at a time. It goes out the
+    // next time the socket has room, so a long stream can't hold up the
+    // main loop.
+    if( queue_pull_source(q) ) {
+        return;
+    }
+
+    // Nothing left to send, stop polling for room.
+    qemu_mutex_lock(&q->results_list_mutex);
+    if( QTAILQ_EMPTY(&q->results_list) ) {
+        qemu_set_fd_handler(q->fd, racomms_read_message, NULL, q);
     }
     qemu_mutex_unlock(&q->results_list_mutex);
 }
 
 static void *read_all(CommsQueue *q, size_t read_size)
 {
+    // The connection was dropped after an error.
+    if(q->fd <= 0) {
+        return NULL;
+    }
+
     if(q->buffsize < (q->buffloc + read_size)) {
         size_t new_size = q->buffloc + read_size;
         void *new_buffer = g_realloc(q->buffer, new_size);
@@ -752,13 +1341,20 @@ static void racomms_read_message(void *opaque)
     CommsMessage *header = NULL;
 
     // Reset for initial message
-    queue_reset( queue );
+    queue_reset( q );
 
     // Read all messages in the queue
     while((header = read_all(q, sizeof(CommsMessage))) != NULL ) {
         const MESSAGE_TYPE header_msg_id = header->msg_id;
         const uint64_t header_size = header->size;
 
+        // Sizes include the header, the bodies are read as header_size
+        // less the header.
+        if( header_size < sizeof(CommsMessage) ) {
+            queue_error(q, "%s: malformed message size %" PRIu64 " @ line %d\n", __func__, header_size, __LINE__);
+            return;
+        }
+
         // Do we need to realloc to hold the entire message?
         if( q->buffsize < header_size) {
             void *new_buffer = g_realloc(q->buffer, header_size);
@@ -791,6 +1387,17 @@ static void racomms_read_message(void *opaque)
                 rapid_analysis_send_tree(msg, q);
             }
                 break;
+            case MSG_REQUEST_RST_STATE:
+            {
+                CommsRequestRapidSaveTreeStateMsg *msg = read_all(q, sizeof(CommsRequestRapidSaveTreeStateMsg));
+                if( !msg ){
+                    queue_error(q, "%s: read: %s @ line %d\n", __func__, strerror(errno), __LINE__);
+                    return;
+                }
+
+                rapid_analysis_send_state(msg, q);
+            }
+                break;
             case MSG_REQUEST_JOB_ADD:
             {
                 const size_t job_size = header_size - sizeof(CommsMessage);
@@ -809,6 +1416,29 @@ static void racomms_read_message(void *opaque)
                 racomms_queue_add_job(q, dup_msg);
             }
                 break;
+            case MSG_REQUEST_JOB_TEMPLATE:
+            {
+                CommsRequestJobTemplateMsg *tmpl = read_all(q, header_size - sizeof(CommsMessage));
+                if( !tmpl ){
+                    queue_error(q, "%s: read: %s @ line %d\n", __func__, strerror(errno), __LINE__);
+                    return;
+                }
+
+                queue_add_template(q, queue_dup_buffer(q));
+            }
+                break;
+            case MSG_REQUEST_JOB_BATCH:
+            {
+                CommsRequestJobBatchMsg *batch = read_all(q, header_size - sizeof(CommsMessage));
+                if( !batch ){
+                    queue_error(q, "%s: read: %s @ line %d\n", __func__, strerror(errno), __LINE__);
+                    return;
+                }
+
+                // The jobs are copied out of the read buffer one by one.
+                queue_add_batch(q, (CommsMessage*)q->buffer);
+            }
+                break;
             case MSG_REQUEST_JOB_PURGE:
             {
                 CommsRequestJobPurgeMsg *msg = read_all(q, sizeof(CommsRequestJobPurgeMsg));
@@ -878,7 +1508,7 @@ static void racomms_read_message(void *opaque)
         }
 
         // Reset for next message
-        queue_reset( queue );
+        queue_reset( q );
     }
 }
 
@@ -895,3 +1525,34 @@ void racomms_free_work(CommsWorkItem *work)
 
     g_free(work);
 }
+
+CommsResultsItem *racomms_create_results(CommsMessage *msg)
+{
+    CommsResultsItem *results = g_new0(CommsResultsItem, 1);
+    results->msg = msg;
+    return results;
+}
+
+void racomms_free_results(CommsResultsItem *results)
+{
+    if( results->refs ) {
+        g_array_free(results->refs, true);
+    }
+    if( results->pinned && atomic_fetch_dec(&pinned_results) == 1 ) {
+        qemu_event_set(&results_sent_event);
+    }
+    g_free(results->msg);
+    g_free(results);
+}
+
+void racomms_wait_results_sent(void)
+{
+    while( atomic_read(&pinned_results) ) {
+        // Reset before checking again so a release in between isn't missed.
+        qemu_event_reset(&results_sent_event);
+        if( !atomic_read(&pinned_results) ) {
+            break;
+        }
+        qemu_event_wait(&results_sent_event);
+    }
+}
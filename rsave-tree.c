@@ -18,13 +18,17 @@
 
 #include "rsave-tree.h"
 #include "migration/rsave-tree-node.h"
-#include "qapi/qmp/qlist.h"
-#include "qapi/qmp/qpointer.h"
 #include "oshandler/oshandler.h"
 #include "tcg/tcg.h"
+#include "ra.h"
+#include "exec/exec-all.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+#include "migration/ra-stats.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 struct RAMRapidReferenceCache{
     ram_addr_t addr;
@@ -32,6 +36,40 @@ struct RAMRapidReferenceCache{
     uint8_t *pageptr;
 };
 
+// The shared reference cache is a set associative table of pages in a
+// named shared memory object, so every instance loading from the same
+// states fills and reads the same copies. It is a header, the entries
+// of each set, a replacement hint per set and then the pages.
+#define RAM_RAPID_SHARED_MAGIC (0x5345524650524152ull)
+#define RAM_RAPID_SHARED_WAYS  (8)
+
+typedef struct RAMRapidSharedHeader {
+    uint64_t magic;
+    uint64_t page_size;
+    uint64_t num_sets;
+    uint64_t ways;
+} RAMRapidSharedHeader;
+
+// Entries are guarded by a sequence number instead of a lock: it is odd
+// while a writer fills the entry in and zero until the entry is first
+// used. Readers copy the page and check the number did not move.
+typedef struct RAMRapidSharedEntry {
+    uint64_t seq;
+    uint64_t addr;
+    SHA1_HASH_TYPE hash;
+    uint32_t reserved;
+} RAMRapidSharedEntry;
+
+struct RAMRapidSharedCache {
+    void *base;
+    size_t size;
+    RAMRapidSharedHeader *header;
+    RAMRapidSharedEntry *entries;
+    uint32_t *hints;
+    uint8_t *pages;
+    uint64_t set_mask;
+};
+
 static void rsave_tree_prepare_tb(RSaveTree *rst, TranslationBlock *tb)
 {
     if( rst->istep != 0 ) {
@@ -74,7 +112,169 @@ static void rsave_tree_init_ram_cache(RSaveTree *rst, uint64_t size, Error **err
     rst->memend = rst->pagemem;
 }
 
-static bool rsave_tree_search_ram_cache(RSaveTree *rst,
+static void rsave_tree_init_shared_ram_cache(RSaveTree *rst, const char *shm_name, uint64_t size, Error **errp)
+{
+    RAMRapidSharedCache *cache;
+    uint64_t num_sets = pow2floor(MAX(size / TARGET_PAGE_SIZE / RAM_RAPID_SHARED_WAYS, 1));
+    uint64_t num_entries = num_sets * RAM_RAPID_SHARED_WAYS;
+    size_t entries_offset = QEMU_ALIGN_UP(sizeof(RAMRapidSharedHeader), 64);
+    size_t hints_offset = entries_offset + num_entries * sizeof(RAMRapidSharedEntry);
+    size_t pages_offset = QEMU_ALIGN_UP(hints_offset + num_sets * sizeof(uint32_t), TARGET_PAGE_SIZE);
+    size_t total = pages_offset + num_entries * TARGET_PAGE_SIZE;
+    RAMRapidSharedHeader *header;
+    struct stat st;
+    void *map;
+    int fd;
+
+    // Every instance works out the same layout from the same size, the
+    // first one to get here sizes the object.
+    fd = shm_open(shm_name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "Cannot open reference cache %s", shm_name);
+        return;
+    }
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "Cannot stat reference cache %s", shm_name);
+        close(fd);
+        return;
+    }
+    if (st.st_size && st.st_size != total) {
+        error_setg(errp, "Reference cache %s was created with another ref_pool size", shm_name);
+        close(fd);
+        return;
+    }
+    if (!st.st_size && ftruncate(fd, total) < 0) {
+        error_setg_errno(errp, errno, "Cannot size reference cache %s", shm_name);
+        close(fd);
+        return;
+    }
+
+    map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Cannot map reference cache %s", shm_name);
+        return;
+    }
+
+    // A new object is all zeroes, which is an empty table. Instances
+    // starting together write the same header.
+    header = map;
+    if (!atomic_read(&header->magic)) {
+        header->page_size = TARGET_PAGE_SIZE;
+        header->num_sets = num_sets;
+        header->ways = RAM_RAPID_SHARED_WAYS;
+        smp_wmb();
+        atomic_set(&header->magic, RAM_RAPID_SHARED_MAGIC);
+    }
+    smp_rmb();
+    if (header->magic != RAM_RAPID_SHARED_MAGIC ||
+        header->page_size != TARGET_PAGE_SIZE ||
+        header->num_sets != num_sets ||
+        header->ways != RAM_RAPID_SHARED_WAYS) {
+        error_setg(errp, "Reference cache %s has a different layout", shm_name);
+        munmap(map, total);
+        return;
+    }
+
+    cache = g_new0(RAMRapidSharedCache, 1);
+    cache->base = map;
+    cache->size = total;
+    cache->header = header;
+    cache->entries = (RAMRapidSharedEntry *)((uint8_t *)map + entries_offset);
+    cache->hints = (uint32_t *)((uint8_t *)map + hints_offset);
+    cache->pages = (uint8_t *)map + pages_offset;
+    cache->set_mask = num_sets - 1;
+    rst->shared_refs = cache;
+}
+
+static uint64_t rsave_tree_shared_set(RAMRapidSharedCache *cache, ram_addr_t offset, SHA1_HASH_TYPE ref_hash)
+{
+    // Spread both the page and the state over the sets.
+    uint64_t h = (offset >> TARGET_PAGE_BITS) ^ ((uint64_t) ref_hash[0] << 32 | ref_hash[1]);
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    return h & cache->set_mask;
+}
+
+static bool rsave_tree_search_shared_cache(RAMRapidSharedCache *cache,
+    ram_addr_t offset,
+    SHA1_HASH_TYPE ref_hash,
+    uint8_t *host_buf)
+{
+    uint64_t first = rsave_tree_shared_set(cache, offset, ref_hash) * RAM_RAPID_SHARED_WAYS;
+
+    for (uint64_t way = 0; way < RAM_RAPID_SHARED_WAYS; way++) {
+        RAMRapidSharedEntry *entry = &cache->entries[first + way];
+        uint64_t seq = atomic_read(&entry->seq);
+
+        if (!seq || (seq & 1)) {
+            continue;
+        }
+        smp_rmb();
+        if (entry->addr != offset || memcmp(entry->hash, ref_hash, sizeof(SHA1_HASH_TYPE))) {
+            continue;
+        }
+
+        memcpy(host_buf, &cache->pages[(first + way) * TARGET_PAGE_SIZE], TARGET_PAGE_SIZE);
+
+        // A writer took the entry over while we copied it.
+        smp_rmb();
+        return atomic_read(&entry->seq) == seq;
+    }
+
+    return false;
+}
+
+static void rsave_tree_update_shared_cache(RAMRapidSharedCache *cache,
+    ram_addr_t offset,
+    SHA1_HASH_TYPE ref_hash,
+    uint8_t *host_buf)
+{
+    uint64_t set = rsave_tree_shared_set(cache, offset, ref_hash);
+    uint64_t first = set * RAM_RAPID_SHARED_WAYS;
+    RAMRapidSharedEntry *entry = NULL;
+    uint64_t seq;
+
+    for (uint64_t way = 0; way < RAM_RAPID_SHARED_WAYS; way++) {
+        RAMRapidSharedEntry *e = &cache->entries[first + way];
+        seq = atomic_read(&e->seq);
+
+        // Another instance may have added the page already.
+        if (seq && !(seq & 1)) {
+            smp_rmb();
+            if (e->addr == offset && !memcmp(e->hash, ref_hash, sizeof(SHA1_HASH_TYPE))) {
+                return;
+            }
+        }
+        if (!seq && !entry) {
+            entry = e;
+        }
+    }
+
+    // A full set gives up its ways in turn.
+    if (!entry) {
+        entry = &cache->entries[first + atomic_fetch_inc(&cache->hints[set]) % RAM_RAPID_SHARED_WAYS];
+    }
+
+    // Claim the entry, unless another writer has it. A writer that dies
+    // here leaves its entry unusable, which only costs that one way.
+    seq = atomic_read(&entry->seq);
+    if ((seq & 1) || atomic_cmpxchg(&entry->seq, seq, seq + 1) != seq) {
+        return;
+    }
+    smp_wmb();
+
+    entry->addr = offset;
+    memcpy(entry->hash, ref_hash, sizeof(SHA1_HASH_TYPE));
+    memcpy(&cache->pages[(entry - cache->entries) * TARGET_PAGE_SIZE], host_buf, TARGET_PAGE_SIZE);
+
+    smp_wmb();
+    atomic_set(&entry->seq, seq + 2);
+}
+
+static bool rsave_tree_search_private_cache(RSaveTree *rst,
     ram_addr_t offset,
     SHA1_HASH_TYPE ref_hash,
     uint8_t *host_buf)
@@ -96,11 +296,33 @@ static bool rsave_tree_search_ram_cache(RSaveTree *rst,
     return false;
 }
 
+static bool rsave_tree_search_ram_cache(RSaveTree *rst,
+    ram_addr_t offset,
+    SHA1_HASH_TYPE ref_hash,
+    uint8_t *host_buf)
+{
+    bool found;
+
+    if( rst->shared_refs ){
+        found = rsave_tree_search_shared_cache(rst->shared_refs, offset, ref_hash, host_buf);
+    } else {
+        found = rsave_tree_search_private_cache(rst, offset, ref_hash, host_buf);
+    }
+
+    ra_stats_count(found ? JOB_STATS_REF_CACHE_HITS : JOB_STATS_REF_CACHE_MISSES, 1);
+    return found;
+}
+
 static void rsave_tree_update_ram_cache(RSaveTree *rst,
     ram_addr_t offset,
     SHA1_HASH_TYPE ref_hash,
     uint8_t *host_buf)
 {
+    if( rst->shared_refs ){
+        rsave_tree_update_shared_cache(rst->shared_refs, offset, ref_hash, host_buf);
+        return;
+    }
+
     if( !rst->pagemem || !rst->reftable ){
         return;
     }
@@ -120,13 +342,11 @@ static void rsave_tree_update_ram_cache(RSaveTree *rst,
     memcpy(refcache->pageptr, host_buf, TARGET_PAGE_SIZE);
 }
 
-static bool rsave_tree_validate_state(RSaveTree *rst, CPUState *cpu)
+static bool rsave_tree_in_segment(RSaveTree *rst, CPUState *cpu)
 {
-    bool is_valid = false;
+    bool is_valid = true;
     CPUClass *cpu_class = CPU_GET_CLASS(cpu); 
 
-    is_valid = true;
-
     // Check the executing address
     if( cpu_class->get_pc )
     {
@@ -148,6 +368,14 @@ static bool rsave_tree_validate_state(RSaveTree *rst, CPUState *cpu)
         }
     }
 
+    return is_valid;
+}
+
+static bool rsave_tree_validate_state(RSaveTree *rst, CPUState *cpu)
+{
+    // Check the executing address
+    bool is_valid = rsave_tree_in_segment(rst, cpu);
+
     // If os handlers are initialized, check for valid user process space as well.
     if( is_valid && is_oshandler_active() )
     {
@@ -171,7 +399,7 @@ static bool rsave_tree_validate_state(RSaveTree *rst, CPUState *cpu)
 
 static bool rsave_tree_validate_iteration(RSaveTree *rst)
 {
-    return !rst->job_ilimit || rst->icount < rst->job_ilimit;
+    return !rst->job_ilimit || atomic_read(&rst->icount) < rst->job_ilimit;
 }
 
 static bool rsave_tree_validate_exception(RSaveTree *rst)
@@ -181,23 +409,43 @@ static bool rsave_tree_validate_exception(RSaveTree *rst)
 
 static bool rsave_tree_final_iteration(RSaveTree *rst)
 {
-    return rst->icount == rst->job_ilimit;
+    return atomic_read(&rst->icount) == rst->job_ilimit;
 }
 
 static void rsave_tree_increment_iteration(RSaveTree *rst, TranslationBlock *tb) 
 {
-    rst->icount += tcg_tb_get_icount(tb);
+    // This runs without the tree lock, vCPUs share the count.
+    atomic_add(&rst->icount, tcg_tb_get_icount(tb));
+}
+
+static bool rsave_tree_update_due(RSaveTree *rst, CPUState *cpu)
+{
+    RSaveTreeClass *rst_class = RSAVE_TREE_GET_CLASS(rst);
+
+    // Anything that ends the job needs the full update.
+    if (rapid_analysis_has_error() ||
+        !rst_class->validate_iteration(rst) ||
+        !rst_class->validate_exception(rst)) {
+        return true;
+    }
+
+    // Otherwise only a state that may go into the trace does. The
+    // process check is left to validate_state under the locks.
+    return !rst->skip_trace && rsave_tree_in_segment(rst, cpu);
 }
 
 static void rsave_tree_write_node(RSaveTree *rst, RSaveTreeNode *node, uint64_t *out_index)
 {
     // Add the current node to the vm state file
     VMStateFileClass *vmstate_file_class = VMSTATE_FILE_GET_CLASS(rst->vm_state_file);
+    int64_t begin = ra_stats_begin();
+
     vmstate_file_class->save_data(
         rst->vm_state_file,
         node,
         out_index,
         rst->skip_save && !(rst->job_flags & JOB_FLAG_FORCE_SAVE));
+    ra_stats_end(RAPID_ANALYSIS_PHASE_WRITE, begin);
 }
 
 static QEMUFile *rsave_tree_load_from_node(RSaveTree *rst, RSaveTreeNode *node)
@@ -207,74 +455,62 @@ static QEMUFile *rsave_tree_load_from_node(RSaveTree *rst, RSaveTreeNode *node)
     return qemu_fopen_ops(node->vm_state, &memory_channel_input_ops);
 }
 
-static void free_node_link(void *obj)
-{
-    object_unref(OBJECT(obj));
-}
-
 /**
- * The RSaveTree consists of two lists, a linked list of states which serves
- * as a timeline; and, a dictionary that keys off of the id which lists 
- * states at different occourances of the id. 
- * 
+ * The RSaveTree consists of two structures, a chain of states which serves
+ * as a timeline; and, an index that keys off of the program counter
+ * which lists states at different occourances of it.
+ *
  * We will do the following things when adding a state node
- * 1 - Add the snapshot to the list of states
- * 2 - Add the snapshot to the dictionary of states, keyed off of the id
+ * 1 - Add the snapshot to the chain of states
+ * 2 - Add the snapshot to the index of states, keyed off of the pc
  */
-static void rsave_tree_insert_analysis_node(RSaveTree *rst, RSaveTreeNode *new_child, const char* key_id)
+static void rsave_tree_insert_analysis_node(RSaveTree *rst, RSaveTreeNode *new_child, uint64_t pc)
 {
-    RSaveTreeNodeLink *parent_link = rst->last_state_link;
-    RSaveTreeNodeLink *rstl = rsave_tree_node_link_new(parent_link, new_child);
+    uint32_t rstl = rsave_tree_store_append(&rst->trace, rst->last_state_link, new_child);
+    uint64_t context = 0;
 
-    // Check if the key exists in the dictionary
-    if(qdict_haskey(rst->node_reference, key_id))
-    {
-        // We've seen this instruction before
-        // Add the new node to the existing list
-        QList *occurrence_list = qdict_get_qlist(rst->node_reference, key_id);
-        QPointer *lptr = qpointer_from_pointer(rstl, free_node_link);
+    // Jobs tracing different processes keep their pcs apart.
+    if (rst->target_process != NULL_PID && is_oshandler_active()) {
+        context = (uint64_t)(uintptr_t) rst->target_process;
+    }
 
-        qlist_append(occurrence_list, lptr);
+    rsave_tree_store_index(&rst->trace, rstl, pc, context);
+
+    if (rstl != RSAVE_TREE_STORE_NONE) {
+        rst->last_state_link = rstl;
     }
-    else
-    {
-        // We haven't seen this instruction yet
-        // We will make a new list, add this node to it
-        // and add the list to the dictionary
-        QList *occurrence_list = qlist_new();
-        QPointer *lptr = qpointer_from_pointer(rstl, free_node_link);
+}
+
+/**
+ * Jobs that merge stop at the first state they reach which is already in
+ * the trace or the vmstate file, since from there on they would only
+ * repeat what was run before. This has to be asked before the node is
+ * inserted, or it finds itself.
+ */
+static bool rsave_tree_merge_due(RSaveTree *rst, RSaveTreeNode *new_child)
+{
+    VMStateFileClass *vmstate_file_class;
 
-        qlist_append(occurrence_list, lptr);
-        qdict_put(rst->node_reference, key_id, occurrence_list);
+    if (!new_child || !(rst->merge_states || rst->job_flags & JOB_FLAG_MERGE)) {
+        return false;
     }
 
-    if( rst->last_state_link ) {
-        object_unref(OBJECT(rst->last_state_link));
+    if (rsave_tree_store_find_hash(&rst->trace, new_child->hash) != RSAVE_TREE_STORE_NONE) {
+        return true;
     }
 
-    object_ref(OBJECT(rstl));
-    rst->last_state_link = rstl;
+    vmstate_file_class = VMSTATE_FILE_GET_CLASS(rst->vm_state_file);
+    return vmstate_file_class->has_state(rst->vm_state_file, new_child->hash);
 }
 
 static void rsave_tree_load_new_analysis(RSaveTree *rst, RSaveTreeNode *node)
 {
-    if(rst->last_state_link) {
-        object_unref(OBJECT(rst->last_state_link));
-        rst->last_state_link = NULL;
-    }
-
-    rst->last_state_link = rsave_tree_node_link_new(NULL, node);
+    rst->last_state_link = rsave_tree_store_append(&rst->trace, RSAVE_TREE_STORE_NONE, node);
 }
 
 static void rsave_tree_start_analysis(RSaveTree *rst)
 {
-    RSaveTreeNodeLink *rstl = rst->last_state_link;
-
-    QPointer *lptr = qpointer_from_pointer(rstl, free_node_link);
-    qlist_append(rst->root_list, lptr);
-
-    object_ref(OBJECT(rstl));
-    rst->last_state_link = rstl;
+    rsave_tree_store_add_root(&rst->trace, rst->last_state_link);
 }
 
 static void rsave_tree_set_stream_data(RSaveTree *rst, uint32_t fileno, uint8_t *data, uint32_t size)
@@ -292,6 +528,93 @@ static void rsave_tree_reset_job(RSaveTree *rst, uint8_t queue, int32_t job_id,
     rst->job_timeout = rst->config_timeout;
     rst->job_report_mask = rst->report_mask;
     rst->exceptions_occurred = 0;
+    rst->job_merged = false;
+}
+
+static void rsave_tree_init_coverage(RSaveTree *rst, const char *shm_name, Error **errp)
+{
+    size_t size = 1 << RSAVE_TREE_COVERAGE_BITS;
+    void *map;
+
+    // A named map can be read by other processes while jobs run.
+    if (shm_name) {
+        int fd = shm_open(shm_name, O_RDWR | O_CREAT, 0600);
+        if (fd < 0) {
+            error_setg_errno(errp, errno, "Cannot open coverage map %s", shm_name);
+            return;
+        }
+        if (ftruncate(fd, size) < 0) {
+            error_setg_errno(errp, errno, "Cannot size coverage map %s", shm_name);
+            close(fd);
+            return;
+        }
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    } else {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (map == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Cannot map coverage map");
+        return;
+    }
+
+    memset(map, 0, size);
+    rst->coverage_map = map;
+    rst->coverage_bits = RSAVE_TREE_COVERAGE_BITS;
+}
+
+static bool rsave_tree_coverage_wanted(RSaveTree *rst, vaddr pc)
+{
+    // Same test as rsave_tree_in_segment, made when the code is translated.
+    if (!rst->coverage_map) {
+        return false;
+    }
+    return !rst->coverage_begin || !rst->coverage_end ||
+           (pc >= rst->coverage_begin && pc <= rst->coverage_end);
+}
+
+static void rsave_tree_update_coverage(RSaveTree *rst, CPUState *cpu)
+{
+    OSHandler *os_handler = oshandler_get_instance();
+    OSHandlerClass *os_cc = OSHANDLER_GET_CLASS(os_handler);
+
+    cpu->coverage_active = os_cc->is_active_process(
+        os_handler,
+        cpu,
+        os_cc->get_processinfo_by_ospid(os_handler, rst->target_process));
+}
+
+static void rsave_tree_reset_coverage(RSaveTree *rst)
+{
+    bool process = rst->target_process != NULL_PID && is_oshandler_active();
+    CPUState *cpu;
+
+    if (!rst->coverage_map) {
+        return;
+    }
+
+    memset(rst->coverage_map, 0, 1 << rst->coverage_bits);
+    CPU_FOREACH(cpu) {
+        cpu->coverage_prev_loc = 0;
+        cpu->coverage_active = 1;
+        if (process) {
+            rsave_tree_update_coverage(rst, cpu);
+        }
+    }
+
+    // The filter is built into the generated code, so code generated
+    // for another filter has to go.
+    if (!rst->coverage_translated ||
+        rst->coverage_begin != rst->segment_begin ||
+        rst->coverage_end != rst->segment_end ||
+        rst->coverage_process != process) {
+        rst->coverage_begin = rst->segment_begin;
+        rst->coverage_end = rst->segment_end;
+        rst->coverage_process = process;
+        rst->coverage_translated = true;
+        tb_flush(first_cpu);
+    }
 }
 
 static void rsave_tree_reset(RSaveTree *rst)
@@ -316,16 +639,33 @@ static void rsave_tree_reset(RSaveTree *rst)
     rst->exception_mask = 0;
     rst->exceptions_occurred = 0;
     rst->has_work = false;
+    rst->job_started = 0;
+    rst->fast_restore = false;
+    rst->map_states = false;
+    rst->async_writes = false;
+    rst->compress_states = false;
+    rst->forkserver = false;
+    rst->merge_states = false;
+    rst->state_restorable = false;
     rst->job_flags = 0;
+    rst->job_merged = false;
+    rst->state_cache_limit = 0;
 
-    rst->last_state_link = NULL;
-    rst->node_reference = NULL;
+    rst->last_state_link = RSAVE_TREE_STORE_NONE;
     rst->vm_state_file = NULL;
 
     rst->ntables = 0;
     rst->pagemem = NULL;
     rst->reftable = NULL;
     rst->memend = NULL;
+    rst->shared_refs = NULL;
+
+    rst->coverage_map = NULL;
+    rst->coverage_bits = 0;
+    rst->coverage_begin = 0;
+    rst->coverage_end = 0;
+    rst->coverage_process = false;
+    rst->coverage_translated = false;
 }
 
 static void rsave_tree_initfn(Object *obj)
@@ -336,8 +676,7 @@ static void rsave_tree_initfn(Object *obj)
     rsave_tree_reset(rst);
 
     // Setup the tree data structures
-    rst->root_list = qlist_new();
-    rst->node_reference = qdict_new();
+    rsave_tree_store_init(&rst->trace);
     qemu_mutex_init(&rst->tree_mutex);
 }
 
@@ -348,16 +687,8 @@ static void rsave_tree_finalize(Object *obj)
     // Destroy the mutex
     qemu_mutex_destroy(&rst->tree_mutex);
 
-    // Free up tree structures
-    qobject_unref(rst->root_list);
-    rst->root_list = NULL;
-    qobject_unref(rst->node_reference);
-    rst->node_reference = NULL;
-
-    if(rst->last_state_link) {
-        object_unref(OBJECT(rst->last_state_link));
-        rst->last_state_link = NULL;
-    }
+    // Free up tree structures, the trace goes all at once
+    rsave_tree_store_destroy(&rst->trace);
 
     // Close out the VM State File
     if(rst->vm_state_file) {
@@ -373,6 +704,16 @@ static void rsave_tree_finalize(Object *obj)
         g_free(rst->pagemem);
     }
 
+    // The shared cache stays around for the other instances
+    if(rst->shared_refs) {
+        munmap(rst->shared_refs->base, rst->shared_refs->size);
+        g_free(rst->shared_refs);
+    }
+
+    if(rst->coverage_map) {
+        munmap(rst->coverage_map, 1 << rst->coverage_bits);
+    }
+
     // Zero out primatives
     rsave_tree_reset(rst);
 }
@@ -389,16 +730,23 @@ static void rsave_tree_class_init(ObjectClass *klass, void *class_data)
     rst_class->validate_exception = rsave_tree_validate_exception;
     rst_class->final_iteration = rsave_tree_final_iteration;
     rst_class->increment_iteration = rsave_tree_increment_iteration;
+    rst_class->update_due = rsave_tree_update_due;
     rst_class->write_node_state = rsave_tree_write_node;
     rst_class->load_new_analysis = rsave_tree_load_new_analysis;
     rst_class->start_analysis = rsave_tree_start_analysis;
     rst_class->insert_analysis = rsave_tree_insert_analysis_node;
+    rst_class->merge_due = rsave_tree_merge_due;
     rst_class->load_from_node = rsave_tree_load_from_node;
     rst_class->init_ram_cache = rsave_tree_init_ram_cache;
+    rst_class->init_shared_ram_cache = rsave_tree_init_shared_ram_cache;
     rst_class->search_ram_cache = rsave_tree_search_ram_cache;
     rst_class->update_ram_cache = rsave_tree_update_ram_cache;
     rst_class->set_stream_data = rsave_tree_set_stream_data;
     rst_class->reset_job = rsave_tree_reset_job;
+    rst_class->init_coverage = rsave_tree_init_coverage;
+    rst_class->coverage_wanted = rsave_tree_coverage_wanted;
+    rst_class->reset_coverage = rsave_tree_reset_coverage;
+    rst_class->update_coverage = rsave_tree_update_coverage;
 }
 
 static const TypeInfo rsave_tree_info = {
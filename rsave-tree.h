@@ -25,6 +25,7 @@
 #include "qom/object.h"
 #include "migration/vmstate-file.h"
 #include "migration/qemu-memory-channel.h"
+#include "migration/rsave-tree-store.h"
 #include "qemu/thread.h"
 #include "qom/cpu.h"
 #include "exec/tb-context.h"
@@ -34,10 +35,12 @@
 
 
 #define SNAPSHOT_PATH_MAX (PATH_MAX+9)
+#define RSAVE_TREE_COVERAGE_BITS (16)
 
 typedef struct RSaveTree RSaveTree;
 typedef struct RSaveTreeClass RSaveTreeClass;
 typedef struct RAMRapidReferenceCache RAMRapidReferenceCache;
+typedef struct RAMRapidSharedCache RAMRapidSharedCache;
 
 #define TYPE_RSAVE_TREE "rsave-tree"
 #define RSAVE_TREE(obj)                                    \
@@ -50,10 +53,9 @@ typedef struct RAMRapidReferenceCache RAMRapidReferenceCache;
 struct RSaveTree {
     Object obj; 
     
-    // Tree state information
-    QList *root_list;
-    RSaveTreeNodeLink *last_state_link;
-    QDict *node_reference;
+    // Tree state information, the trace is indexed by pc
+    RSaveTreeStore trace;
+    uint32_t last_state_link;
     SHA1_HASH_TYPE active_hash;
 
     // Data Protection
@@ -72,12 +74,19 @@ struct RSaveTree {
     bool enable_interrupts;
     bool skip_blocks;
     bool send_to_queue;
+    bool fast_restore;
+    bool map_states;
+    bool async_writes;
+    bool compress_states;
+    bool forkserver;
+    bool merge_states;
 
     // Execution State Trackers
     uint64_t istep;
     uint64_t icount;
     uint64_t ilimit;
     uint64_t msgsz_limit;
+    uint64_t state_cache_limit;
     uint64_t config_timeout;
     JOB_REPORT_TYPE report_mask;
     vaddr segment_begin;
@@ -95,15 +104,33 @@ struct RSaveTree {
     SHA1_HASH_TYPE job_hash;
     JOB_FLAG_TYPE job_flags;
     uint64_t job_timeout;
+    // The job ended on a state that was already known
+    bool job_merged;
 
     // State Machine
     bool has_work;
+    // When the job's code started running, 0 once it stopped
+    int64_t job_started;
+    // Set when guest RAM matches active_hash apart from pages marked dirty
+    bool state_restorable;
+
+    // Edge coverage map updated by the generated code, and the filter
+    // that code was generated for
+    uint8_t *coverage_map;
+    uint8_t coverage_bits;
+    vaddr coverage_begin;
+    vaddr coverage_end;
+    bool coverage_process;
+    bool coverage_translated;
 
     // Bookkeeping and memory for the reference cache
     size_t ntables;
     RAMRapidReferenceCache *reftable;
     uint8_t *pagemem;
     uint8_t *memend;
+
+    // Reference cache in shared memory, used in place of the one above
+    RAMRapidSharedCache *shared_refs;
 };
 
 struct RSaveTreeClass {
@@ -117,16 +144,23 @@ struct RSaveTreeClass {
     bool (*validate_exception)(RSaveTree *rst);
     bool (*final_iteration)(RSaveTree *rst);
     void (*increment_iteration)(RSaveTree *rst, TranslationBlock *tb);
+    bool (*update_due)(RSaveTree *rst, CPUState *cpu);
     void (*write_node_state)(RSaveTree *rst, RSaveTreeNode *node, uint64_t *out_index);
     void (*load_new_analysis)(RSaveTree *rst, RSaveTreeNode *node);
     void (*start_analysis)(RSaveTree *rst);
-    void (*insert_analysis)(RSaveTree *rst, RSaveTreeNode *new_child, const char* key_id);
+    void (*insert_analysis)(RSaveTree *rst, RSaveTreeNode *new_child, uint64_t pc);
+    bool (*merge_due)(RSaveTree *rst, RSaveTreeNode *new_child);
     QEMUFile* (*load_from_node)(RSaveTree *rst, RSaveTreeNode *new_child);
     void (*init_ram_cache)(RSaveTree *rst, uint64_t size, Error **errp);
+    void (*init_shared_ram_cache)(RSaveTree *rst, const char *shm_name, uint64_t size, Error **errp);
     bool (*search_ram_cache)(RSaveTree *rst, ram_addr_t offset, SHA1_HASH_TYPE ref_hash, uint8_t *host_buf);
     void (*update_ram_cache)(RSaveTree *rst, ram_addr_t offset, SHA1_HASH_TYPE ref_hash, uint8_t *host_buf);
     void (*set_stream_data)(RSaveTree *rst, uint32_t fileno, uint8_t *data, uint32_t size);
     void (*reset_job)(RSaveTree *rst, uint8_t queue, int32_t job_id, JOB_FLAG_TYPE job_flags);
+    void (*init_coverage)(RSaveTree *rst, const char *shm_name, Error **errp);
+    bool (*coverage_wanted)(RSaveTree *rst, vaddr pc);
+    void (*reset_coverage)(RSaveTree *rst);
+    void (*update_coverage)(RSaveTree *rst, CPUState *cpu);
 };
 
 RSaveTree* rsave_tree_create(void);
@@ -0,0 +1,235 @@
+#!/usr/bin/env python3
+#/*
+# * Rapid Analysis QEMU System Emulator
+# *
+# * Copyright (c) 2020 Cromulence LLC
+# *
+# * Distribution Statement A
+# *
+# * Approved for Public Release, Distribution Unlimited
+# *
+# * Authors:
+# *  Joseph Walker
+# *
+# * This work is licensed under the terms of the GNU GPL, version 2 or later.
+# * See the COPYING file in the top-level directory.
+# *
+# * The creation of this code was funded by the US Government.
+# */
+
+# Runs several rapid analysis QEMU workers behind a single controller
+# connection. The supervisor connects to the controller the same way a
+# QEMU would, starts the workers against the same rsave base and hands
+# each job to the next worker in turn. Reports and trees for a job are
+# requested from the worker that ran it.
+#
+# The workers open the base vmstate read-only (nosave, noblocks) and map
+# their states (mapstates), so they share the host page cache for it.
+# With --shared-refs they also share one reference cache (ref_shm), which
+# is removed when the supervisor exits.
+#
+# usage: ra-supervisor.py --controller ip:port --workers K -- <qemu command line>
+#
+# The qemu command line must contain -rapidanalysis; the supervisor adds
+# its own connect= to it.
+
+import argparse
+import os
+import selectors
+import socket
+import struct
+import subprocess
+import sys
+
+# These match include/racomms/racomms-types.h and messages.h
+MSG_REQUEST_CONFIG       = 11
+MSG_REQUEST_RST          = 12
+MSG_REQUEST_JOB_ADD      = 13
+MSG_REQUEST_JOB_PURGE    = 14
+MSG_REQUEST_JOB_REPORT   = 15
+MSG_REQUEST_QUIT         = 16
+MSG_REQUEST_JOB_BATCH    = 17
+MSG_REQUEST_JOB_TEMPLATE = 18
+MSG_REQUEST_RST_STATE    = 19
+MSG_RESPONSE_CONFIG      = 20
+
+HEADER_FORMAT = '<BBBBIQ'
+HEADER_SIZE = struct.calcsize(HEADER_FORMAT)
+
+# The job id sits at the same place in job add, report and tree requests.
+JOB_ID_FORMAT = '<i'
+JOB_ID_OFFSET = HEADER_SIZE + 4
+
+# A batch is its queue, padding and job count followed by whole job messages.
+BATCH_FORMAT = '<BBHI'
+BATCH_SIZE = struct.calcsize(BATCH_FORMAT)
+
+WORKER_OPTIONS = ['nosave=on', 'noblocks=on', 'mapstates=on']
+
+
+class Peer(object):
+    def __init__(self, name, sock):
+        self.name = name
+        self.sock = sock
+        self.buffer = bytearray()
+
+    def send(self, message):
+        self.sock.sendall(message)
+
+    def read_messages(self):
+        data = self.sock.recv(65536)
+        if not data:
+            raise ConnectionError('%s disconnected' % self.name)
+        self.buffer += data
+
+        messages = []
+        while len(self.buffer) >= HEADER_SIZE:
+            size = struct.unpack_from(HEADER_FORMAT, self.buffer)[5]
+            if size < HEADER_SIZE:
+                raise ConnectionError('%s sent a malformed message' % self.name)
+            if len(self.buffer) < size:
+                break
+            messages.append(bytes(self.buffer[:size]))
+            del self.buffer[:size]
+        return messages
+
+
+def worker_command(command, port, ref_shm=None):
+    command = list(command)
+    options = WORKER_OPTIONS + (['ref_shm=' + ref_shm] if ref_shm else [])
+    for i, arg in enumerate(command[:-1]):
+        if arg in ('-rapidanalysis', '--rapidanalysis'):
+            # Later options win, so these override anything given for them.
+            command[i + 1] = ','.join([command[i + 1], 'connect=127.0.0.1:%d' % port] + options)
+            return command
+    raise ValueError('The qemu command line needs a -rapidanalysis option')
+
+
+class Supervisor(object):
+    def __init__(self, controller, workers):
+        self.controller = controller
+        self.workers = workers
+        self.next_worker = 0
+        self.job_owner = {}
+        self.selector = selectors.DefaultSelector()
+        for peer in [controller] + workers:
+            self.selector.register(peer.sock, selectors.EVENT_READ, peer)
+
+    def broadcast(self, message):
+        for worker in self.workers:
+            worker.send(message)
+
+    def add_job(self, message):
+        worker = self.workers[self.next_worker % len(self.workers)]
+        self.next_worker += 1
+        self.job_owner[struct.unpack_from(JOB_ID_FORMAT, message, JOB_ID_OFFSET)[0]] = worker
+        worker.send(message)
+
+    def add_batch(self, message):
+        # Batches are split up so their jobs still go round the workers.
+        num_jobs = struct.unpack_from(BATCH_FORMAT, message, HEADER_SIZE)[3]
+        offset = HEADER_SIZE + BATCH_SIZE
+        for _ in range(num_jobs):
+            if len(message) - offset < HEADER_SIZE:
+                break
+            size = struct.unpack_from(HEADER_FORMAT, message, offset)[5]
+            if size < HEADER_SIZE or len(message) - offset < size:
+                break
+            job = message[offset:offset + size]
+            if job[0] == MSG_REQUEST_JOB_TEMPLATE:
+                self.broadcast(job)
+            else:
+                self.add_job(job)
+            offset += size
+
+    def from_controller(self, message):
+        msg_id = message[0]
+
+        if msg_id == MSG_REQUEST_JOB_ADD:
+            self.add_job(message)
+        elif msg_id == MSG_REQUEST_JOB_BATCH:
+            self.add_batch(message)
+        elif msg_id in (MSG_REQUEST_JOB_REPORT, MSG_REQUEST_RST):
+            job_id = struct.unpack_from(JOB_ID_FORMAT, message, JOB_ID_OFFSET)[0]
+            self.job_owner.get(job_id, self.workers[0]).send(message)
+        else:
+            # Configuration, templates, purges and quits apply to every worker.
+            # State requests only carry a hash, so every worker is asked and
+            # the ones without the state answer with an empty one.
+            self.broadcast(message)
+
+    def from_worker(self, worker, message):
+        # Every worker answers a configuration request, the controller
+        # only expects one answer.
+        if message[0] == MSG_RESPONSE_CONFIG and worker is not self.workers[0]:
+            return
+        self.controller.send(message)
+
+    def run(self):
+        while self.workers:
+            for key, _ in self.selector.select():
+                peer = key.data
+                try:
+                    messages = peer.read_messages()
+                except ConnectionError as e:
+                    if peer is self.controller:
+                        print('Controller disconnected, stopping')
+                        return
+                    print(str(e))
+                    self.selector.unregister(peer.sock)
+                    self.workers.remove(peer)
+                    self.job_owner = dict((j, w) for j, w in self.job_owner.items() if w is not peer)
+                    continue
+
+                for message in messages:
+                    if peer is self.controller:
+                        self.from_controller(message)
+                    else:
+                        self.from_worker(peer, message)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Runs rapid analysis workers behind one controller connection.')
+    parser.add_argument('--controller', required=True, help='controller address as ip:port')
+    parser.add_argument('--workers', type=int, default=2, help='number of QEMU workers to start')
+    parser.add_argument('--port', type=int, default=0, help='local port the workers connect to')
+    parser.add_argument('--shared-refs', action='store_true', help='share one reference cache between the workers')
+    parser.add_argument('command', nargs=argparse.REMAINDER, help='qemu command line, after --')
+    args = parser.parse_args()
+
+    command = args.command[1:] if args.command[:1] == ['--'] else args.command
+    if not command or args.workers < 1:
+        parser.error('a qemu command line and at least one worker are required')
+
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(('127.0.0.1', args.port))
+    listener.listen(args.workers)
+    port = listener.getsockname()[1]
+
+    ref_shm = '/ra-supervisor-%d' % os.getpid() if args.shared_refs else None
+    processes = [subprocess.Popen(worker_command(command, port, ref_shm)) for _ in range(args.workers)]
+    try:
+        workers = [Peer('worker %d' % i, listener.accept()[0]) for i in range(args.workers)]
+        listener.close()
+
+        host, controller_port = args.controller.rsplit(':', 1)
+        controller = Peer('controller', socket.create_connection((host, int(controller_port))))
+
+        Supervisor(controller, workers).run()
+    finally:
+        for process in processes:
+            if process.poll() is None:
+                process.terminate()
+        for process in processes:
+            process.wait()
+        if ref_shm:
+            try:
+                os.unlink('/dev/shm' + ref_shm)
+            except OSError:
+                pass
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
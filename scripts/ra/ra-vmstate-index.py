@@ -0,0 +1,126 @@
+#/*
+# * Rapid Analysis QEMU System Emulator
+# *
+# * Copyright (c) 2020 Cromulence LLC
+# *
+# * Distribution Statement A
+# *
+# * Approved for Public Release, Distribution Unlimited
+# *
+# * Authors:
+# *  Joseph Walker
+# *
+# * This work is licensed under the terms of the GNU GPL, version 2 or later.
+# * See the COPYING file in the top-level directory.
+# *
+# * The creation of this code was funded by the US Government.
+# */
+
+# Rebuilds the <file>.idx lookup index that sits next to a vmstate file.
+# QEMU rebuilds a stale index on its own when the file is opened, this
+# is for doing it ahead of time on large files. The RAM page tables in
+# <file>.pages are only reachable through the index, so they start over.
+#
+# The hash engine the states were made with is kept from the old index,
+# or taken from --engine. Files that never had one used sha1.
+#
+# usage: ra-vmstate-index.py <vmstate file> [--engine sha1|fast] [--dump]
+
+import sys
+import struct
+import binascii
+
+SEGMENTS_PER_HEADER = 1000
+INDEX_SUFFIX = '.idx'
+PAGES_SUFFIX = '.pages'
+INDEX_MAGIC = 0x5844494d56534152
+INDEX_VERSION = 4
+
+# These match RSaveHashEngine in migration/rsave-hash.h
+HASH_ENGINES = {'sha1': 0, 'fast': 1}
+
+# These match the structures in migration/vmstate-file.h
+COUNT_FORMAT = '<Q'
+SEGMENT_FORMAT = '<20siQQ'
+# Magic, version, record count, then the vmstate file size and where
+# its last header is so QEMU can open it without walking the chain, and
+# the hash engine of the states.
+INDEX_HEADER_FORMAT = '<QQQQQQ'
+# The segment, its position, then the state and page table offsets and
+# the number of pages, which stay zero until QEMU builds a table.
+INDEX_RECORD_FORMAT = SEGMENT_FORMAT + 'QQQQ'
+
+COUNT_SIZE = struct.calcsize(COUNT_FORMAT)
+SEGMENT_SIZE = struct.calcsize(SEGMENT_FORMAT)
+INDEX_HEADER_SIZE = struct.calcsize(INDEX_HEADER_FORMAT)
+
+
+def read_segments(vmstate):
+    segments = []
+    header_pointer = 0
+    while True:
+        current_header = header_pointer
+        vmstate.seek(header_pointer)
+        num_segments = struct.unpack(COUNT_FORMAT, vmstate.read(COUNT_SIZE))[0]
+        for _ in range(num_segments):
+            segments.append(struct.unpack(SEGMENT_FORMAT, vmstate.read(SEGMENT_SIZE)))
+
+        vmstate.seek(header_pointer + COUNT_SIZE + SEGMENTS_PER_HEADER * SEGMENT_SIZE)
+        header_pointer = struct.unpack(COUNT_FORMAT, vmstate.read(COUNT_SIZE))[0]
+        if header_pointer == 0:
+            break
+
+    vmstate.seek(0, 2)
+    return segments, vmstate.tell(), current_header
+
+
+def read_engine(index_path):
+    try:
+        with open(index_path, 'rb') as index:
+            header = index.read(INDEX_HEADER_SIZE)
+    except IOError:
+        return HASH_ENGINES['sha1']
+    if len(header) == INDEX_HEADER_SIZE:
+        magic, version, _, _, _, engine = struct.unpack(INDEX_HEADER_FORMAT, header)
+        if magic == INDEX_MAGIC and version == INDEX_VERSION:
+            return engine
+    return HASH_ENGINES['sha1']
+
+
+def write_index(index_path, segments, file_size, current_header, engine):
+    with open(index_path, 'wb') as index:
+        index.write(struct.pack(INDEX_HEADER_FORMAT, INDEX_MAGIC, INDEX_VERSION, len(segments),
+                                file_size, current_header, engine))
+        for position, segment in enumerate(segments):
+            index.write(struct.pack(INDEX_RECORD_FORMAT, *(segment + (position, 0, 0, 0))))
+
+
+def main(argv):
+    if len(argv) < 2:
+        print('usage: %s <vmstate file> [--engine sha1|fast] [--dump]' % argv[0])
+        return 1
+
+    engine = read_engine(argv[1] + INDEX_SUFFIX)
+    if '--engine' in argv:
+        name = argv[argv.index('--engine') + 1] if argv.index('--engine') + 1 < len(argv) else None
+        if name not in HASH_ENGINES:
+            print('Unknown hash engine %s, use sha1 or fast' % name)
+            return 1
+        engine = HASH_ENGINES[name]
+
+    with open(argv[1], 'rb') as vmstate:
+        segments, file_size, current_header = read_segments(vmstate)
+
+    write_index(argv[1] + INDEX_SUFFIX, segments, file_size, current_header, engine)
+    open(argv[1] + PAGES_SUFFIX, 'wb').close()
+    print('Indexed %d segments into %s' % (len(segments), argv[1] + INDEX_SUFFIX))
+
+    if '--dump' in argv:
+        for position, (hash, job_id, pointer, size) in enumerate(segments):
+            print('%8d %s job %-8d offset 0x%x size %d' %
+                  (position, binascii.hexlify(hash).decode(), job_id, pointer, size))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
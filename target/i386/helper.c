@@ -27,6 +27,7 @@
 #include "sysemu/hw_accel.h"
 #include "monitor/monitor.h"
 #include "hw/i386/apic_internal.h"
+#include "oshandler/oshandler.h"
 #endif
 
 void cpu_sync_bndcs_hflags(CPUX86State *env)
@@ -671,8 +672,18 @@ void cpu_x86_update_cr0(CPUX86State *env, uint32_t new_cr0)
 void cpu_x86_update_cr3(CPUX86State *env, target_ulong new_cr3)
 {
     X86CPU *cpu = x86_env_get_cpu(env);
+#ifndef CONFIG_USER_ONLY
+    bool changed = env->cr[3] != new_cr3;
+#endif
 
     env->cr[3] = new_cr3;
+#ifndef CONFIG_USER_ONLY
+    /* A context switch, the OS handler's view of the active process
+       is out of date.  */
+    if (changed) {
+        oshandler_notify_pagetable_change(CPU(cpu));
+    }
+#endif
     if (env->cr[0] & CR0_PG_MASK) {
         qemu_log_mask(CPU_LOG_MMU,
                         "CR3 update: CR3=" TARGET_FMT_lx "\n", new_cr3);
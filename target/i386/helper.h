@@ -109,7 +109,8 @@ DEF_HELPER_1(clgi, void, env)
 DEF_HELPER_1(skinit, void, env)
 DEF_HELPER_2(invlpga, void, env, int)
 
-DEF_HELPER_2(call_instrumentation, void, env, tl)
+DEF_HELPER_3(call_instrumentation, void, env, tl, ptr)
+DEF_HELPER_2(call_block_instrumentation, void, env, ptr)
 
 /* x86 FPU */
 
@@ -645,8 +645,14 @@ void helper_wrpkru(CPUX86State *env, uint32_t ecx, uint64_t val)
     tlb_flush(cs);
 }
 
-void helper_call_instrumentation(CPUX86State *env, target_ulong ptr)
+void helper_call_instrumentation(CPUX86State *env, target_ulong ptr, void *code)
 {
     CPUState *cs = CPU(x86_env_get_cpu(env));
-    notify_exec_instruction(cs, ptr);
+    notify_exec_instruction(cs, ptr, code);
+}
+
+void helper_call_block_instrumentation(CPUX86State *env, void *block)
+{
+    CPUState *cs = CPU(x86_env_get_cpu(env));
+    notify_exec_block(cs, block);
 }
\ No newline at end of file
@@ -32,6 +32,7 @@
 #include "trace-tcg.h"
 #include "exec/log.h"
 #include "plugin/cpu_cb.h"
+#include "ra.h"
 
 #define PREFIX_REPZ   0x01
 #define PREFIX_REPNZ  0x02
@@ -136,6 +137,8 @@ typedef struct DisasContext {
     int cpuid_ext3_features;
     int cpuid_7_0_ebx_features;
     int cpuid_xsave_features;
+    int exec_mode; /* plugin instrumentation wanted for this block */
+    PluginExecBlock *exec_block;
     sigjmp_buf jmpbuf;
 } DisasContext;
 
@@ -4476,8 +4479,13 @@ static target_ulong disas_insn(DisasContext *s, CPUState *cpu)
     rex_w = -1;
     rex_r = 0;
 
-    if( is_exec_instrumentation_enabled() ) {
-        gen_helper_call_instrumentation(cpu_env, tcg_const_i64(pc_start));
+    if ((s->exec_mode & PLUGIN_EXEC_INSN) && plugin_exec_insn_wanted(pc_start)) {
+        /* The host pointer is resolved here instead of on every call.  */
+        TCGv exec_pc = tcg_const_tl(pc_start);
+        TCGv_ptr exec_code = tcg_const_ptr(plugin_exec_code_pointer(cpu, pc_start));
+        gen_helper_call_instrumentation(cpu_env, exec_pc, exec_code);
+        tcg_temp_free_ptr(exec_code);
+        tcg_temp_free(exec_pc);
     }
 
  next_byte:
@@ -8468,8 +8476,90 @@ static void i386_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cpu)
     cpu_cc_srcT = tcg_temp_local_new();
 }
 
+/* Counts executions of the block in the generated code, for plugins
+   that only want counts.  */
+static void gen_exec_block_count(PluginExecBlock *block)
+{
+    TCGv_ptr count_ptr = tcg_const_ptr(&block->exec_count);
+    TCGv_i64 count = tcg_temp_new_i64();
+
+    tcg_gen_ld_i64(count, count_ptr, 0);
+    tcg_gen_addi_i64(count, count, 1);
+    tcg_gen_st_i64(count, count_ptr, 0);
+    tcg_temp_free_i64(count);
+    tcg_temp_free_ptr(count_ptr);
+}
+
+/* Records the edge from the previous block into this one in the
+   rapid analysis coverage map, the same way AFL does.  When the map
+   only covers one process the update is skipped while the vCPU runs
+   any other.  */
+static void gen_coverage_edge(uint8_t *map, uint32_t cur_loc, bool gated)
+{
+    TCGLabel *skip = gen_new_label();
+    TCGv_i32 loc = tcg_temp_new_i32();
+    TCGv_ptr hit_ptr = tcg_temp_new_ptr();
+
+    if (gated) {
+        tcg_gen_ld8u_i32(loc, cpu_env,
+                         -ENV_OFFSET + offsetof(CPUState, coverage_active));
+        tcg_gen_brcondi_i32(TCG_COND_EQ, loc, 0, skip);
+    }
+
+    tcg_gen_ld_i32(loc, cpu_env,
+                   -ENV_OFFSET + offsetof(CPUState, coverage_prev_loc));
+    tcg_gen_xori_i32(loc, loc, cur_loc);
+    tcg_gen_ext_i32_ptr(hit_ptr, loc);
+    tcg_gen_addi_ptr(hit_ptr, hit_ptr, (intptr_t)map);
+    tcg_gen_ld8u_i32(loc, hit_ptr, 0);
+    tcg_gen_addi_i32(loc, loc, 1);
+    tcg_gen_st8_i32(loc, hit_ptr, 0);
+
+    tcg_gen_movi_i32(loc, cur_loc >> 1);
+    tcg_gen_st_i32(loc, cpu_env,
+                   -ENV_OFFSET + offsetof(CPUState, coverage_prev_loc));
+
+    gen_set_label(skip);
+    tcg_temp_free_ptr(hit_ptr);
+    tcg_temp_free_i32(loc);
+}
+
 static void i386_tr_tb_start(DisasContextBase *db, CPUState *cpu)
 {
+    DisasContext *dc = container_of(db, DisasContext, base);
+    RSaveTree *rst = rapid_analysis_get_instance(cpu);
+
+    if (rst && rst->coverage_map &&
+        RSAVE_TREE_GET_CLASS(rst)->coverage_wanted(rst, dc->base.pc_first)) {
+        target_ulong pc = dc->base.pc_first;
+        uint32_t cur_loc = ((pc >> 4) ^ (pc << 8)) &
+                           ((1 << rst->coverage_bits) - 1);
+        gen_coverage_edge(rst->coverage_map, cur_loc, rst->coverage_process);
+    }
+
+    /* Blocks outside every plugin's filter get no instrumentation.  The
+       block ends before it reaches a page past its start, see
+       i386_tr_translate_insn.  */
+    dc->exec_mode = 0;
+    dc->exec_block = NULL;
+    if (is_exec_instrumentation_enabled() || is_block_instrumentation_enabled()) {
+        dc->exec_mode = plugin_exec_block_mode(dc->base.pc_first,
+                                               dc->base.pc_first + TARGET_PAGE_SIZE);
+    }
+
+    if (dc->exec_mode & (PLUGIN_EXEC_BLOCK | PLUGIN_EXEC_COUNT)) {
+        dc->exec_block = plugin_exec_block_new(dc->base.tb, dc->base.pc_first);
+
+        if (dc->exec_mode & PLUGIN_EXEC_COUNT) {
+            gen_exec_block_count(dc->exec_block);
+        }
+
+        if (dc->exec_mode & PLUGIN_EXEC_BLOCK) {
+            TCGv_ptr block = tcg_const_ptr(dc->exec_block);
+            gen_helper_call_block_instrumentation(cpu_env, block);
+            tcg_temp_free_ptr(block);
+        }
+    }
 }
 
 static void i386_tr_insn_start(DisasContextBase *dcbase, CPUState *cpu)
@@ -8504,6 +8594,11 @@ static void i386_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
     DisasContext *dc = container_of(dcbase, DisasContext, base);
     target_ulong pc_next = disas_insn(dc, cpu);
 
+    if (dc->exec_block) {
+        plugin_exec_block_add_insn(cpu, dc->exec_block, dc->base.pc_next,
+                                   pc_next - dc->base.pc_next);
+    }
+
     if (dc->tf || (dc->base.tb->flags & HF_INHIBIT_IRQ_MASK)) {
         /* if single step mode, we generate only one instruction and
            generate an exception */
@@ -8538,6 +8633,10 @@ static void i386_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
         gen_jmp_im(dc->base.pc_next - dc->cs_base);
         gen_eob(dc);
     }
+
+    if (dc->exec_block) {
+        plugin_exec_block_end(dc->exec_block);
+    }
 }
 
 static void i386_tr_disas_log(const DisasContextBase *dcbase,
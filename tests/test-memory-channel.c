@@ -0,0 +1,230 @@
+/*
+ * Rapid Analysis QEMU System Emulator
+ *
+ * Copyright (c) 2020 Cromulence LLC
+ *
+ * Distribution Statement A
+ *
+ * Approved for Public Release, Distribution Unlimited
+ *
+ * Authors:
+ *  Joseph Walker
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The creation of this code was funded by the US Government.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/module.h"
+#include "migration/qemu-memory-channel.h"
+
+// Spans several blocks, with a short one at the end.
+#define STATE_SIZE (1024 * 1024 + 1000)
+
+static const MemoryChannelSection sections[] = {
+    { .name = "dev", .offset = 100 },
+    { .name = "ram", .offset = 5000 },
+};
+
+static uint8_t *make_state(uint32_t seed)
+{
+    uint8_t *state = g_malloc0(STATE_SIZE);
+
+    // Some text that compresses, some that doesn't, and zeros.
+    for (size_t i = 0; i < 5000; i++) {
+        state[i] = "device state "[i % 13];
+    }
+    for (size_t i = 5000; i < STATE_SIZE / 2; i++) {
+        seed = seed * 1103515245 + 12345;
+        state[i] = seed >> 16;
+    }
+
+    return state;
+}
+
+static MemoryChannel *make_channel(const uint8_t *state)
+{
+    MemoryChannel *mc = memory_channel_create();
+    MemoryChannelClass *mcc = MEMORY_CHANNEL_GET_CLASS(mc);
+    struct iovec iov;
+
+    // Written the way a QEMUFile hands it over, in pieces.
+    for (size_t pos = 0; pos < STATE_SIZE; pos += iov.iov_len) {
+        iov.iov_base = (void *)&state[pos];
+        iov.iov_len = MIN(STATE_SIZE - pos, 32768);
+        g_assert_cmpint(mcc->writev_buffer(mc, &iov, 1, pos), ==, iov.iov_len);
+    }
+    mcc->close(mc);
+
+    return mc;
+}
+
+static void check_get_buffer(MemoryChannel *mc, const uint8_t *state)
+{
+    MemoryChannelClass *mcc = MEMORY_CHANNEL_GET_CLASS(mc);
+    uint8_t *buf = g_malloc(STATE_SIZE);
+    size_t pos = 0;
+    ssize_t len;
+
+    while ((len = mcc->get_buffer(mc, &buf[pos], pos, STATE_SIZE - pos)) > 0) {
+        pos += len;
+    }
+    g_assert_cmpuint(pos, ==, STATE_SIZE);
+    g_assert(!memcmp(buf, state, STATE_SIZE));
+    mcc->close(mc);
+
+    g_free(buf);
+}
+
+static void check_read_state(MemoryChannel *mc, const uint8_t *state)
+{
+    MemoryChannelClass *mcc = MEMORY_CHANNEL_GET_CLASS(mc);
+    static const size_t reads[][2] = {
+        { 0, 16 }, { 90, 20 }, { 4090, 4096 }, { 262140, 8 },
+        { 300000, 500000 }, { STATE_SIZE - 10, 10 },
+    };
+    uint8_t *buf = g_malloc(500000);
+
+    for (size_t i = 0; i < ARRAY_SIZE(reads); i++) {
+        g_assert_cmpint(mcc->read_state(mc, buf, reads[i][0], reads[i][1]), ==, reads[i][1]);
+        g_assert(!memcmp(buf, &state[reads[i][0]], reads[i][1]));
+    }
+
+    // Reads stop at the end of the state.
+    g_assert_cmpint(mcc->read_state(mc, buf, STATE_SIZE - 4, 16), ==, 4);
+    g_assert_cmpint(mcc->read_state(mc, buf, STATE_SIZE, 16), ==, 0);
+
+    g_free(buf);
+}
+
+static void check_write_to_file(MemoryChannel *mc, const uint8_t *state)
+{
+    MemoryChannelClass *mcc = MEMORY_CHANNEL_GET_CLASS(mc);
+    uint8_t *buf = g_malloc(STATE_SIZE);
+    FILE *fp = tmpfile();
+
+    g_assert(fp);
+    mcc->write_to_file(mc, fp);
+    g_assert_cmpint(ftell(fp), ==, STATE_SIZE);
+    rewind(fp);
+    g_assert_cmpuint(fread(buf, 1, STATE_SIZE, fp), ==, STATE_SIZE);
+    g_assert(!memcmp(buf, state, STATE_SIZE));
+
+    fclose(fp);
+    g_free(buf);
+}
+
+static void test_round_trip(void)
+{
+    uint8_t *state = make_state(1);
+    MemoryChannel *mc = make_channel(state);
+    MemoryChannelClass *mcc = MEMORY_CHANNEL_GET_CLASS(mc);
+    size_t unpacked, packed;
+
+    // Before and after packing the channel reads back the same.
+    check_get_buffer(mc, state);
+    check_read_state(mc, state);
+    unpacked = mcc->get_footprint(mc);
+
+    mcc->pack(mc, sections, ARRAY_SIZE(sections));
+    g_assert_cmpuint(mcc->get_size(mc), ==, STATE_SIZE);
+    packed = mcc->get_footprint(mc);
+    g_assert_cmpuint(packed, <, unpacked);
+
+    check_get_buffer(mc, state);
+    check_read_state(mc, state);
+    check_write_to_file(mc, state);
+
+    // Reading doesn't leave a second copy behind.
+    mcc->close(mc);
+    g_assert_cmpuint(mcc->get_footprint(mc), ==, packed);
+
+    object_unref(OBJECT(mc));
+    g_free(state);
+
+    // Blocks and section dictionaries go with the last channel.
+    g_assert(!memory_channel_test_and_set_pool_limit());
+}
+
+static void test_stream(void)
+{
+    uint8_t *state = make_state(2);
+    MemoryChannel *mc = make_channel(state);
+    MemoryChannelClass *mcc = MEMORY_CHANNEL_GET_CLASS(mc);
+    uint8_t *buf = g_malloc(STATE_SIZE);
+    QEMUIOVector *qiov;
+    size_t niov, packed;
+
+    mcc->pack(mc, sections, ARRAY_SIZE(sections));
+    packed = mcc->get_footprint(mc);
+
+    // The whole stream unpacks it until the channel is closed.
+    niov = mcc->get_stream(mc, &qiov);
+    g_assert_cmpuint(iov_to_buf(qiov->iov, niov, 0, buf, STATE_SIZE), ==, STATE_SIZE);
+    g_assert(!memcmp(buf, state, STATE_SIZE));
+    g_assert_cmpuint(mcc->get_footprint(mc), >, packed);
+
+    mcc->close(mc);
+    g_assert_cmpuint(mcc->get_footprint(mc), ==, packed);
+    check_get_buffer(mc, state);
+
+    object_unref(OBJECT(mc));
+    g_free(buf);
+    g_free(state);
+
+    g_assert(!memory_channel_test_and_set_pool_limit());
+}
+
+static void test_shared(void)
+{
+    uint8_t *state = make_state(3);
+    uint8_t *other_state = make_state(3);
+    MemoryChannel *mc = make_channel(state);
+    MemoryChannel *other;
+    MemoryChannelClass *mcc = MEMORY_CHANNEL_GET_CLASS(mc);
+    size_t packed;
+
+    mcc->pack(mc, sections, ARRAY_SIZE(sections));
+    packed = mcc->get_footprint(mc);
+
+    // Identical states share their blocks, one changed byte doesn't
+    // change what either reads back.
+    other_state[STATE_SIZE - 1] ^= 0xff;
+    other = make_channel(other_state);
+    mcc->pack(other, sections, ARRAY_SIZE(sections));
+    g_assert_cmpuint(mcc->get_footprint(mc), <, packed);
+
+    check_get_buffer(mc, state);
+    check_get_buffer(other, other_state);
+    check_read_state(other, other_state);
+
+    object_unref(OBJECT(mc));
+    check_get_buffer(other, other_state);
+    object_unref(OBJECT(other));
+
+    g_free(other_state);
+    g_free(state);
+
+    g_assert(!memory_channel_test_and_set_pool_limit());
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    module_call_init(MODULE_INIT_QOM);
+
+    // Anything left in the pool or in packed blocks is over the limit.
+    memory_channel_alloc_pool(0, 1);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/memory-channel/round-trip", test_round_trip);
+    g_test_add_func("/memory-channel/stream", test_stream);
+    g_test_add_func("/memory-channel/shared", test_shared);
+    ret = g_test_run();
+
+    memory_channel_free_pool();
+    return ret;
+}
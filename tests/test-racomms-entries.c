@@ -0,0 +1,222 @@
+/*
+ * Rapid Analysis QEMU System Emulator
+ *
+ * Copyright (c) 2020 Cromulence LLC
+ *
+ * Distribution Statement A
+ *
+ * Approved for Public Release, Distribution Unlimited
+ *
+ * Authors:
+ *  Joseph Walker
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The creation of this code was funded by the US Government.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "racomms/interface.h"
+#include "racomms/messages.h"
+
+#define ENTRIES_OFFSET (sizeof(CommsMessage) + sizeof(CommsRequestJobAddMsg))
+
+// A job add message built up an entry at a time.
+typedef struct TestJob {
+    GByteArray *bytes;
+    GArray *offsets;
+} TestJob;
+
+static void job_init(TestJob *job)
+{
+    CommsMessage header = { .msg_id = MSG_REQUEST_JOB_ADD };
+    CommsRequestJobAddMsg job_msg = { .job_id = 1 };
+
+    job->bytes = g_byte_array_new();
+    job->offsets = g_array_new(false, false, sizeof(uint32_t));
+    g_byte_array_append(job->bytes, (guint8 *)&header, sizeof(header));
+    g_byte_array_append(job->bytes, (guint8 *)&job_msg, sizeof(job_msg));
+}
+
+static void job_add(TestJob *job, const void *entry, size_t size)
+{
+    uint32_t offset = job->bytes->len;
+
+    g_array_append_val(job->offsets, offset);
+    g_byte_array_append(job->bytes, entry, size);
+}
+
+static void job_add_register(TestJob *job, uint8_t size)
+{
+    size_t entry_size = sizeof(CommsRequestJobAddRegisterSetup) + size - 1;
+    CommsRequestJobAddRegisterSetup *entry = g_malloc0(entry_size);
+
+    entry->entry_type = JOB_ADD_REGISTER;
+    entry->size = size;
+    job_add(job, entry, entry_size);
+    g_free(entry);
+}
+
+static void job_add_memory(TestJob *job, uint32_t size)
+{
+    size_t entry_size = sizeof(CommsRequestJobAddMemorySetup) + size - 1;
+    CommsRequestJobAddMemorySetup *entry = g_malloc0(entry_size);
+
+    entry->entry_type = JOB_ADD_MEMORY;
+    entry->size = size;
+    job_add(job, entry, entry_size);
+    g_free(entry);
+}
+
+static void job_add_fixed(TestJob *job)
+{
+    CommsRequestJobAddExitInsnCountConstraint count = { .entry_type = JOB_ADD_EXIT_INSN_COUNT, .insn_limit = 10 };
+    CommsRequestJobAddTimeoutSetup timeout = { .entry_type = JOB_ADD_TIMEOUT, .timeout = 5 };
+    CommsRequestJobAddReportMaskSetup mask = { .entry_type = JOB_ADD_REPORT_MASK };
+
+    job_add(job, &count, sizeof(count));
+    job_add(job, &timeout, sizeof(timeout));
+    job_add(job, &mask, sizeof(mask));
+}
+
+// Parses the first size bytes of the job, the message claiming to be
+// that long.
+static bool job_parse(TestJob *job, size_t size, CommsWorkItem *work_item, Error **errp)
+{
+    CommsMessage *msg = g_memdup(job->bytes->data, size);
+    bool ok;
+
+    msg->size = size;
+    ok = racomms_parse_job_entries(msg, (char *)msg + ENTRIES_OFFSET, work_item, errp);
+    g_free(msg);
+    return ok;
+}
+
+static void job_free(TestJob *job)
+{
+    g_byte_array_free(job->bytes, true);
+    g_array_free(job->offsets, true);
+}
+
+static void test_valid(void)
+{
+    CommsWorkItem work_item = { 0 };
+    WorkEntryItem *entry, *next;
+    TestJob job;
+    guint i;
+
+    job_init(&job);
+    job_add_fixed(&job);
+    job_add_register(&job, 8);
+    job_add_memory(&job, 100);
+    job_add_register(&job, 1);
+
+    // Checked alone, and recorded for a work item.
+    g_assert(job_parse(&job, job.bytes->len, NULL, &error_abort));
+
+    QLIST_INIT(&work_item.entry_list);
+    g_assert(job_parse(&job, job.bytes->len, &work_item, &error_abort));
+
+    // The list is last entry first.
+    i = job.offsets->len;
+    QLIST_FOREACH_SAFE(entry, &work_item.entry_list, next, next) {
+        g_assert_cmpuint(i, >, 0);
+        i--;
+        g_assert_cmpuint(entry->offset, ==, g_array_index(job.offsets, uint32_t, i));
+        g_assert_cmpuint(entry->entry_type, ==, job.bytes->data[entry->offset]);
+        g_free(entry);
+    }
+    g_assert_cmpuint(i, ==, 0);
+
+    job_free(&job);
+}
+
+static void test_empty(void)
+{
+    TestJob job;
+
+    job_init(&job);
+    g_assert(job_parse(&job, job.bytes->len, NULL, &error_abort));
+    job_free(&job);
+}
+
+static void test_unknown_type(void)
+{
+    uint8_t entry[16] = { JOB_ADD_RESERVED };
+    Error *err = NULL;
+    TestJob job;
+
+    job_init(&job);
+    job_add_fixed(&job);
+    job_add(&job, entry, sizeof(entry));
+
+    g_assert(!job_parse(&job, job.bytes->len, NULL, &err));
+    g_assert(err);
+    error_free(err);
+    job_free(&job);
+}
+
+static void test_truncated(void)
+{
+    Error *err = NULL;
+    TestJob job;
+
+    job_init(&job);
+    job_add_fixed(&job);
+    job_add_memory(&job, 64);
+
+    // Cut anywhere inside the last entry, its header included.
+    for (size_t size = g_array_index(job.offsets, uint32_t, job.offsets->len - 1) + 1;
+         size < job.bytes->len; size++) {
+        g_assert(!job_parse(&job, size, NULL, &err));
+        g_assert(err);
+        error_free(err);
+        err = NULL;
+    }
+
+    // And inside a fixed size one.
+    g_assert(!job_parse(&job, ENTRIES_OFFSET + 4, NULL, &err));
+    error_free(err);
+
+    job_free(&job);
+}
+
+static void test_bad_size(void)
+{
+    CommsRequestJobAddMemorySetup *entry;
+    Error *err = NULL;
+    TestJob job;
+
+    // A value bigger than the message is left.
+    job_init(&job);
+    job_add_memory(&job, 16);
+    entry = (CommsRequestJobAddMemorySetup *)(job.bytes->data + ENTRIES_OFFSET);
+    entry->size = UINT32_MAX;
+    g_assert(!job_parse(&job, job.bytes->len, NULL, &err));
+    error_free(err);
+    err = NULL;
+
+    entry->size = 17;
+    g_assert(!job_parse(&job, job.bytes->len, NULL, &err));
+    error_free(err);
+    err = NULL;
+
+    // No value at all.
+    entry->size = 0;
+    g_assert(!job_parse(&job, job.bytes->len, NULL, &err));
+    error_free(err);
+    job_free(&job);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/racomms/entries/valid", test_valid);
+    g_test_add_func("/racomms/entries/empty", test_empty);
+    g_test_add_func("/racomms/entries/unknown-type", test_unknown_type);
+    g_test_add_func("/racomms/entries/truncated", test_truncated);
+    g_test_add_func("/racomms/entries/bad-size", test_bad_size);
+    return g_test_run();
+}
@@ -0,0 +1,199 @@
+/*
+ * Rapid Analysis QEMU System Emulator
+ *
+ * Copyright (c) 2020 Cromulence LLC
+ *
+ * Distribution Statement A
+ *
+ * Approved for Public Release, Distribution Unlimited
+ *
+ * Authors:
+ *  Joseph Walker
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The creation of this code was funded by the US Government.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/module.h"
+#include "migration/rsave-tree-node.h"
+#include "migration/rsave-tree-store.h"
+
+// More pcs than the initial index has slots for.
+#define NUM_PCS 3000
+
+static RSaveTreeNode *make_node(uint32_t id)
+{
+    RSaveTreeNode *node = rsave_tree_node_new();
+
+    memset(node->hash, 0, sizeof(SHA1_HASH_TYPE));
+    memcpy(node->hash, &id, sizeof(id));
+    node->job_id = id;
+    return node;
+}
+
+typedef struct Visit {
+    GArray *pcs;
+    GArray *links;
+    RSaveTreeStore *store;
+} Visit;
+
+static bool record_link(const RSaveTreeStoreKey *key, RSaveTreeStoreLink *link, void *opaque)
+{
+    Visit *v = opaque;
+    uint32_t l = link - rsave_tree_store_get_link(v->store, 0);
+
+    // Links are only contiguous within a chunk, the test stays in one.
+    g_assert_cmpuint(l, <, RSAVE_TREE_STORE_CHUNK_SIZE);
+    g_array_append_val(v->pcs, key->pc);
+    g_array_append_val(v->links, l);
+    return true;
+}
+
+static void test_index(void)
+{
+    RSaveTreeStore store;
+    RSaveTreeNode *nodes[NUM_PCS];
+    uint32_t links[NUM_PCS];
+    uint32_t parent = RSAVE_TREE_STORE_NONE;
+    Visit v = { .store = &store };
+
+    rsave_tree_store_init(&store);
+    for (uint32_t i = 0; i < NUM_PCS; i++) {
+        nodes[i] = make_node(i);
+        links[i] = rsave_tree_store_append(&store, parent, nodes[i]);
+        g_assert_cmpuint(links[i], ==, i);
+        parent = links[i];
+    }
+
+    // Every other state goes to pc 0, the rest to a pc each. The same pc
+    // in another context is another key, the first state reached again
+    // there.
+    for (uint32_t i = 0; i < NUM_PCS; i++) {
+        rsave_tree_store_index(&store, links[i], (i % 2) ? 0x1000 + i : 0, 0);
+    }
+    g_assert_cmpuint(store.num_keys, ==, NUM_PCS / 2 + 1);
+    parent = rsave_tree_store_append(&store, parent, nodes[0]);
+    rsave_tree_store_index(&store, parent, 0, 7);
+    g_assert_cmpuint(store.num_keys, ==, NUM_PCS / 2 + 2);
+
+    // Keys in the order they were first seen, links in the order added.
+    v.pcs = g_array_new(false, false, sizeof(uint64_t));
+    v.links = g_array_new(false, false, sizeof(uint32_t));
+    rsave_tree_store_foreach(&store, record_link, &v);
+    g_assert_cmpuint(v.links->len, ==, NUM_PCS + 1);
+    for (uint32_t i = 0; i < NUM_PCS / 2; i++) {
+        g_assert_cmpuint(g_array_index(v.pcs, uint64_t, i), ==, 0);
+        g_assert_cmpuint(g_array_index(v.links, uint32_t, i), ==, i * 2);
+    }
+    g_assert_cmpuint(g_array_index(v.pcs, uint64_t, NUM_PCS / 2), ==, 0x1001);
+    g_assert_cmpuint(g_array_index(v.links, uint32_t, NUM_PCS / 2), ==, 1);
+    g_assert_cmpuint(g_array_index(v.pcs, uint64_t, NUM_PCS), ==, 0);
+    g_assert_cmpuint(g_array_index(v.links, uint32_t, NUM_PCS), ==, NUM_PCS);
+
+    // The chain runs from parent to child.
+    g_assert_cmpuint(rsave_tree_store_get_link(&store, 5)->parent, ==, 4);
+    g_assert_cmpuint(rsave_tree_store_get_link(&store, 4)->child, ==, 5);
+
+    for (uint32_t i = 0; i < NUM_PCS; i++) {
+        g_assert_cmpuint(rsave_tree_store_find_hash(&store, nodes[i]->hash), ==, i);
+        object_unref(OBJECT(nodes[i]));
+    }
+
+    g_array_free(v.pcs, true);
+    g_array_free(v.links, true);
+    rsave_tree_store_destroy(&store);
+}
+
+static bool ref_all(const RSaveTreeStoreKey *key, RSaveTreeStoreLink *link, void *opaque)
+{
+    GPtrArray *refs = opaque;
+    RSaveTreeNode *node = rsave_tree_store_ref_node(link);
+
+    if (node) {
+        g_ptr_array_add(refs, node);
+    }
+    return true;
+}
+
+static void test_detach(void)
+{
+    RSaveTreeStore store;
+    RSaveTreeNode *kept = make_node(1);
+    RSaveTreeNode *dropped = make_node(2);
+    GPtrArray *refs = g_ptr_array_new();
+    SHA1_HASH_TYPE hash;
+    uint32_t l[3];
+
+    rsave_tree_store_init(&store);
+    l[0] = rsave_tree_store_append(&store, RSAVE_TREE_STORE_NONE, kept);
+    l[1] = rsave_tree_store_append(&store, l[0], dropped);
+    // The same state reached again.
+    l[2] = rsave_tree_store_append(&store, l[1], dropped);
+    for (int i = 0; i < 3; i++) {
+        rsave_tree_store_index(&store, l[i], 0x400000, 0);
+    }
+    memcpy(hash, dropped->hash, sizeof(hash));
+
+    // The store doesn't hold nodes, the last reference detaches every
+    // link to the node.
+    object_unref(OBJECT(dropped));
+    g_assert(rsave_tree_store_get_link(&store, l[0])->node == kept);
+    g_assert(!rsave_tree_store_get_link(&store, l[1])->node);
+    g_assert(!rsave_tree_store_get_link(&store, l[2])->node);
+
+    // The hash is still known.
+    g_assert_cmpmem(rsave_tree_store_get_link(&store, l[2])->hash, sizeof(hash), hash, sizeof(hash));
+    g_assert_cmpuint(rsave_tree_store_find_hash(&store, hash), ==, l[1]);
+
+    // Only nodes that are still around are handed out.
+    rsave_tree_store_foreach(&store, ref_all, refs);
+    g_assert_cmpuint(refs->len, ==, 1);
+    g_assert(refs->pdata[0] == kept);
+    g_assert_cmpuint(OBJECT(kept)->ref, ==, 2);
+    object_unref(OBJECT(kept));
+
+    // A node outliving the store lets go of it.
+    rsave_tree_store_destroy(&store);
+    g_assert(!kept->link_store);
+    object_unref(OBJECT(kept));
+
+    g_ptr_array_free(refs, true);
+}
+
+static void test_roots(void)
+{
+    RSaveTreeStore store;
+    RSaveTreeNode *node = make_node(1);
+    uint32_t l[2];
+
+    rsave_tree_store_init(&store);
+    l[0] = rsave_tree_store_append(&store, RSAVE_TREE_STORE_NONE, node);
+    l[1] = rsave_tree_store_append(&store, RSAVE_TREE_STORE_NONE, node);
+
+    // Jobs from the same start state add its root once.
+    rsave_tree_store_add_root(&store, l[0]);
+    rsave_tree_store_add_root(&store, l[0]);
+    rsave_tree_store_add_root(&store, l[1]);
+    rsave_tree_store_add_root(&store, l[0]);
+    g_assert_cmpuint(store.first_root, ==, l[0]);
+    g_assert_cmpuint(store.last_root, ==, l[1]);
+    g_assert_cmpuint(rsave_tree_store_get_link(&store, l[0])->next_root, ==, l[1]);
+    g_assert_cmpuint(rsave_tree_store_get_link(&store, l[1])->next_root, ==, RSAVE_TREE_STORE_NONE);
+
+    object_unref(OBJECT(node));
+    rsave_tree_store_destroy(&store);
+}
+
+int main(int argc, char **argv)
+{
+    module_call_init(MODULE_INIT_QOM);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/rsave-tree-store/index", test_index);
+    g_test_add_func("/rsave-tree-store/detach", test_detach);
+    g_test_add_func("/rsave-tree-store/roots", test_roots);
+    return g_test_run();
+}
@@ -0,0 +1,262 @@
+/*
+ * Rapid Analysis QEMU System Emulator
+ *
+ * Copyright (c) 2020 Cromulence LLC
+ *
+ * Distribution Statement A
+ *
+ * Approved for Public Release, Distribution Unlimited
+ *
+ * Authors:
+ *  Joseph Walker
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The creation of this code was funded by the US Government.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/module.h"
+#include "qapi/error.h"
+#include "migration/vmstate-file.h"
+#include "migration/rsave-tree-node.h"
+#include "migration/qemu-memory-channel.h"
+#include "migration/rsave-hash.h"
+
+#define STATE_SIZE 64
+
+static char *test_dir;
+
+static char *vmstate_path(const char *name)
+{
+    return g_strdup_printf("%s/%s", test_dir, name);
+}
+
+static RSaveTreeNode *make_node(int32_t job_id)
+{
+    RSaveTreeNode *node = rsave_tree_node_new();
+    RSaveTreeNodeClass *node_class = RSAVE_TREE_NODE_GET_CLASS(node);
+    MemoryChannelClass *mc_class;
+    uint8_t buf[STATE_SIZE];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+
+    node->job_id = job_id;
+    node->instruction_number = job_id;
+    node->vm_state = memory_channel_create();
+    mc_class = MEMORY_CHANNEL_GET_CLASS(node->vm_state);
+
+    // Each state has different contents, so a different hash.
+    memset(buf, job_id & 0xff, sizeof(buf));
+    memcpy(buf, &job_id, sizeof(job_id));
+    mc_class->writev_buffer(node->vm_state, &iov, 1, 0);
+    mc_class->close(node->vm_state);
+
+    node_class->calculate_hash(node);
+    return node;
+}
+
+static void save_nodes(VMStateFile *file, GArray *hashes, int32_t first, int32_t count)
+{
+    VMStateFileClass *file_class = VMSTATE_FILE_GET_CLASS(file);
+
+    for (int32_t i = first; i < first + count; i++) {
+        RSaveTreeNode *node = make_node(i);
+        uint64_t index;
+
+        file_class->save_data(file, node, &index, false);
+        g_assert_cmpuint(index, ==, i);
+        g_array_append_val(hashes, node->hash);
+        object_unref(OBJECT(node));
+    }
+}
+
+static void check_nodes(VMStateFile *file, GArray *hashes)
+{
+    VMStateFileClass *file_class = VMSTATE_FILE_GET_CLASS(file);
+
+    for (int32_t i = 0; i < hashes->len; i++) {
+        SHA1_HASH_TYPE *hash = &g_array_index(hashes, SHA1_HASH_TYPE, i);
+        RSaveTreeNode *node;
+
+        g_assert(file_class->has_state(file, *hash));
+        g_assert(file_class->load_from_index(file, &node, i));
+        g_assert_cmpint(node->job_id, ==, i);
+        g_assert_cmpuint(node->instruction_number, ==, i);
+        g_assert_cmpmem(node->hash, sizeof(SHA1_HASH_TYPE), *hash, sizeof(SHA1_HASH_TYPE));
+        object_unref(OBJECT(node));
+    }
+}
+
+static void test_reopen(void)
+{
+    char *path = vmstate_path("reopen");
+    GArray *hashes = g_array_new(false, false, sizeof(SHA1_HASH_TYPE));
+    VMStateFile *file;
+
+    // Enough states to need a second header.
+    file = vmstate_file_new(path);
+    g_assert(file);
+    save_nodes(file, hashes, 0, SEGMENTS_PER_HEADER + 5);
+    object_unref(OBJECT(file));
+
+    // The index places the next state after the last one.
+    file = vmstate_file_new(path);
+    g_assert(file);
+    check_nodes(file, hashes);
+    save_nodes(file, hashes, hashes->len, 3);
+    object_unref(OBJECT(file));
+
+    file = vmstate_file_new(path);
+    g_assert(file);
+    check_nodes(file, hashes);
+    object_unref(OBJECT(file));
+
+    g_array_free(hashes, true);
+    g_free(path);
+}
+
+static void test_missing_index(void)
+{
+    char *path = vmstate_path("missing");
+    char *index_path = g_strconcat(path, VMSTATE_INDEX_SUFFIX, NULL);
+    GArray *hashes = g_array_new(false, false, sizeof(SHA1_HASH_TYPE));
+    VMStateFile *file;
+
+    file = vmstate_file_new(path);
+    save_nodes(file, hashes, 0, 10);
+    object_unref(OBJECT(file));
+
+    // Without an index the chain is walked.
+    g_assert_cmpint(unlink(index_path), ==, 0);
+    file = vmstate_file_new(path);
+    check_nodes(file, hashes);
+    save_nodes(file, hashes, hashes->len, 2);
+    object_unref(OBJECT(file));
+
+    file = vmstate_file_new(path);
+    check_nodes(file, hashes);
+    object_unref(OBJECT(file));
+
+    g_array_free(hashes, true);
+    g_free(index_path);
+    g_free(path);
+}
+
+static void test_stale_index(void)
+{
+    char *path = vmstate_path("stale");
+    char *index_path = g_strconcat(path, VMSTATE_INDEX_SUFFIX, NULL);
+    GArray *hashes = g_array_new(false, false, sizeof(SHA1_HASH_TYPE));
+    VMStateFile *file;
+    gchar *old_index;
+    gsize old_size;
+
+    file = vmstate_file_new(path);
+    save_nodes(file, hashes, 0, 5);
+    object_unref(OBJECT(file));
+    g_assert(g_file_get_contents(index_path, &old_index, &old_size, NULL));
+
+    file = vmstate_file_new(path);
+    save_nodes(file, hashes, hashes->len, 4);
+    object_unref(OBJECT(file));
+
+    // An index from before the last states went in isn't trusted.
+    g_assert(g_file_set_contents(index_path, old_index, old_size, NULL));
+    file = vmstate_file_new(path);
+    check_nodes(file, hashes);
+    save_nodes(file, hashes, hashes->len, 1);
+    object_unref(OBJECT(file));
+
+    file = vmstate_file_new(path);
+    check_nodes(file, hashes);
+    object_unref(OBJECT(file));
+
+    g_free(old_index);
+    g_array_free(hashes, true);
+    g_free(index_path);
+    g_free(path);
+}
+
+static void test_hash_engine(void)
+{
+    char *path = vmstate_path("engine");
+    char *index_path = g_strconcat(path, VMSTATE_INDEX_SUFFIX, NULL);
+    GArray *hashes = g_array_new(false, false, sizeof(SHA1_HASH_TYPE));
+    VMStateFile *file;
+    VMStateFileClass *file_class;
+    Error *err = NULL;
+
+    // A new file takes the engine in use.
+    rsave_hash_set_engine(RSAVE_HASH_ENGINE_FAST);
+    file = vmstate_file_new(path);
+    file_class = VMSTATE_FILE_GET_CLASS(file);
+    g_assert(file_class->check_hash_engine(file, &error_abort));
+    save_nodes(file, hashes, 0, 3);
+    object_unref(OBJECT(file));
+
+    // It is refused under another engine.
+    rsave_hash_set_engine(RSAVE_HASH_ENGINE_SHA1);
+    file = vmstate_file_new(path);
+    g_assert_cmpint(file_class->get_hash_engine(file), ==, RSAVE_HASH_ENGINE_FAST);
+    g_assert(!file_class->check_hash_engine(file, &err));
+    g_assert(err);
+    error_free(err);
+    object_unref(OBJECT(file));
+
+    // A rebuilt index keeps the engine.
+    rsave_hash_set_engine(RSAVE_HASH_ENGINE_FAST);
+    file = vmstate_file_new(path);
+    file_class->rebuild_index(file);
+    object_unref(OBJECT(file));
+    file = vmstate_file_new(path);
+    g_assert(file_class->check_hash_engine(file, &error_abort));
+    check_nodes(file, hashes);
+    object_unref(OBJECT(file));
+
+    // Without an index there is nothing to say it wasn't SHA1.
+    g_assert_cmpint(unlink(index_path), ==, 0);
+    file = vmstate_file_new(path);
+    g_assert_cmpint(file_class->get_hash_engine(file), ==, RSAVE_HASH_ENGINE_SHA1);
+    object_unref(OBJECT(file));
+
+    rsave_hash_set_engine(RSAVE_HASH_ENGINE_SHA1);
+    g_array_free(hashes, true);
+    g_free(index_path);
+    g_free(path);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    module_call_init(MODULE_INIT_QOM);
+    memory_channel_alloc_pool(0, 0);
+
+    test_dir = g_dir_make_tmp("test-vmstate-file-XXXXXX", NULL);
+    g_assert(test_dir);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/vmstate-file/reopen", test_reopen);
+    g_test_add_func("/vmstate-file/missing-index", test_missing_index);
+    g_test_add_func("/vmstate-file/stale-index", test_stale_index);
+    g_test_add_func("/vmstate-file/hash-engine", test_hash_engine);
+    ret = g_test_run();
+
+    // Each file leaves its index and page tables behind.
+    GDir *dir = g_dir_open(test_dir, 0, NULL);
+    const char *name;
+    while (dir && (name = g_dir_read_name(dir))) {
+        char *file_path = vmstate_path(name);
+        unlink(file_path);
+        g_free(file_path);
+    }
+    if (dir) {
+        g_dir_close(dir);
+    }
+    rmdir(test_dir);
+    g_free(test_dir);
+
+    memory_channel_free_pool();
+    return ret;
+}
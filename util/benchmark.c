@@ -33,8 +33,8 @@ static double get_elapsed_millis(Benchmarker *this)
 
     gettimeofday(&finish, NULL);
 
-    ret_val = (finish.tv_sec - this->start_time.tv_sec) * 1000;
-    ret_val += (finish.tv_usec - this->start_time.tv_usec) / 1000;
+    ret_val = (finish.tv_sec - this->start_time.tv_sec) * 1000.0;
+    ret_val += (finish.tv_usec - this->start_time.tv_usec) / 1000.0;
 
     return ret_val;
 }
@@ -47,7 +47,7 @@ static double get_elapsed_seconds(Benchmarker *this)
     gettimeofday(&finish, NULL);
 
     ret_val = (finish.tv_sec - this->start_time.tv_sec);
-    ret_val += (finish.tv_usec - this->start_time.tv_usec) / 100000;
+    ret_val += (finish.tv_usec - this->start_time.tv_usec) / 1000000.0;
 
     return ret_val;
 }